@@ -11,11 +11,14 @@
  * instructions.
  */
 
-#define LONG_LOCAL_OFFSET_SIZE 4  // in bytes
-#define LONG_UPVAL_OFFSET_SIZE 2  // in bytes
+#define LONG_LOCAL_OFFSET_SIZE 4   // in bytes
+#define LONG_UPVAL_OFFSET_SIZE 2   // in bytes
+#define LONG_GLOBAL_OFFSET_SIZE 4  // in bytes
 
 #define LONG_CONST_OFFSET_SIZE 4  // in bytes
+#define CACHE_OFFSET_SIZE 2       // in bytes
 #define CHUNK_CONST_POOL_MAX UINT32_MAX
+#define CHUNK_CACHE_MAX UINT16_MAX
 #define CHUNK_CONST_POOL_EFULL UINT32_MAX
 
 _Static_assert(
@@ -78,8 +81,127 @@ typedef enum {
   OP_GET_SUPER_LONG,
   OP_SUPER_INVOKE,
   OP_SUPER_INVOKE_LONG,
+  // <count>: replace the @count values on top of the stack by their sum, as
+  // count - 1 OP_ADDs would, but concatenating strings at once. The compiler
+  // emits it for chains of + (see binary() in compiler.c).
+  OP_CONCAT_N,
+
+  /* Superinstructions. The compiler never emits these directly, they are
+   * produced by the peephole pass (see peephole.h) from the sequences noted
+   * beside them. */
+  OP_ADD_LOCAL_CONST,     // OP_GET_LOCAL <slot>, OP_CONST <offset>, OP_ADD
+  OP_SET_LOCAL_POP,       // OP_SET_LOCAL <slot>, OP_POP
+  OP_GET_THIS_PROPERTY,   // OP_GET_LOCAL 0, OP_GET_PROPERTY <offset>
+  OP_JMP_IF_NOT_LESS,     // OP_LESS, OP_JMP_IF_FALSE, OP_POP
+  OP_JMP_IF_NOT_GREATER,  // OP_GREATER, OP_JMP_IF_FALSE, OP_POP
+  OP_JMP_IF_LESS,         // OP_LESS, OP_NOT, OP_JMP_IF_FALSE, OP_POP
+  OP_JMP_IF_GREATER,      // OP_GREATER, OP_NOT, OP_JMP_IF_FALSE, OP_POP
+
+  /* Quickened instructions. The compiler never emits these either: run()
+   * rewrites a generic instruction in place into the variant for the types
+   * of operands it has just seen, which only checks these types, and back to
+   * the generic instruction when the check fails. */
+  OP_ADD_NUM,       // OP_ADD of two numbers
+  OP_ADD_STR,       // OP_ADD of two strings
+  OP_SUBTRACT_NUM,  // OP_SUBTRACT
+  OP_MUL_NUM,       // OP_MUL
+  OP_DIV_NUM,       // OP_DIV
+  OP_LESS_NUM,      // OP_LESS
+  OP_GREATER_NUM,   // OP_GREATER
+
+  /* Instructions of the register engine (see run_register() in vm.c). Their
+   * operands are encoded in the instruction: A, B and C are registers, i.e,
+   * slots of the frame, one byte each. K is a 2-byte offset in the constant
+   * pool, G a 2-byte global slot, U a 1-byte upvalue index, N an argument
+   * count and <cache> a 2-byte inline cache offset. The engine shares OP_JMP
+   * and OP_LOOP with the stack engine. */
+  OP_R_MOVE,                 // A B: R[A] = R[B]
+  OP_R_LOADK,                // A K: R[A] = K
+  OP_R_LOADNIL,              // A
+  OP_R_LOADTRUE,             // A
+  OP_R_LOADFALSE,            // A
+  OP_R_DEFINE_GLOBAL,        // A G: define global G as R[A]
+  OP_R_GET_GLOBAL,           // A G: R[A] = global G
+  OP_R_SET_GLOBAL,           // A G: global G = R[A]
+  OP_R_GET_UPVAL,            // A U: R[A] = upvalue U
+  OP_R_SET_UPVAL,            // A U: upvalue U = R[A]
+  OP_R_ADD,                  // A B C: R[A] = R[B] + R[C]
+  OP_R_SUBTRACT,             // A B C
+  OP_R_ADDK,                 // A B K: R[A] = R[B] + K
+  OP_R_SUBTRACTK,            // A B K: R[A] = R[B] - K
+  OP_R_MUL,                  // A B C
+  OP_R_DIV,                  // A B C
+  OP_R_LESS,                 // A B C
+  OP_R_GREATER,              // A B C
+  OP_R_EQUAL,                // A B C
+  OP_R_NOT,                  // A B: R[A] = !R[B]
+  OP_R_NEGATE,               // A B: R[A] = -R[B]
+  OP_R_PRINT,                // A
+  OP_R_JMP_IF_FALSE,         // A <2-byte distance>
+  OP_R_JMP_IF_TRUE,          // A <2-byte distance>
+  OP_R_JMP_IF_NOT_LESS,      // B C <2-byte distance>: jump unless R[B] < R[C]
+  OP_R_JMP_IF_NOT_GREATER,   // B C <2-byte distance>
+  OP_R_JMP_IF_LESS,          // B C <2-byte distance>
+  OP_R_JMP_IF_GREATER,       // B C <2-byte distance>
+  // the same four jumps comparing R[B] with a constant, in the same order
+  OP_R_JMP_IF_NOT_LESSK,     // B K <2-byte distance>: jump unless R[B] < K
+  OP_R_JMP_IF_NOT_GREATERK,  // B K <2-byte distance>
+  OP_R_JMP_IF_LESSK,         // B K <2-byte distance>
+  OP_R_JMP_IF_GREATERK,      // B K <2-byte distance>
+  OP_R_CALL,                 // A N: R[A] = R[A](R[A+1], ..., R[A+N])
+  OP_R_RETURN,               // A: return R[A]
+  OP_R_CLOSURE,              // A K <upvalues>: R[A] = closure K
+  OP_R_CLOSE_UPVAL,          // A: close the upvalues of R[A] and above
+  OP_R_CLASS,                // A K: R[A] = new class named K
+  OP_R_METHOD,               // A B K: add R[B] to class R[A] as method K
+  OP_R_INHERIT,              // A B: class R[A] inherits from R[B]
+  OP_R_GET_PROPERTY,         // A B K <cache>: R[A] = R[B].K
+  OP_R_SET_PROPERTY,         // A K B <cache>: R[A].K = R[B]
+  OP_R_INVOKE,               // A K N <cache>: R[A] = R[A].K(R[A+1], ...)
+  OP_R_GET_SUPER,            // A B C K: R[A] = method K of R[C] bound to R[B]
+  OP_R_SUPER_INVOKE,         // A K N B: OP_R_INVOKE of method K of class R[B]
 } Opcode;
 
+struct Shape;
+struct ClosureObj;
+
+#define IC_POLY_MAX 4
+#define IC_MEGAMORPHIC UINT8_MAX
+
+/** InlineCacheEntry: a property resolved for receivers of layout @shape
+ * (see Shape in object.h).
+ *
+ * @method: the resolved method, or NULL if the property is a field.
+ * @slot: if the property is a field, its slot in the receiver's fields.
+ * @transition: for OP_SET_PROPERTY, the shape of the receiver once the field
+ * is added, or NULL if the receiver already has the field.
+ * */
+typedef struct InlineCacheEntry {
+  struct Shape* shape;
+  struct Shape* transition;
+  struct ClosureObj* method;
+  uint32_t slot;
+} InlineCacheEntry;
+
+/** InlineCache: the cache of one OP_GET_PROPERTY, OP_SET_PROPERTY or
+ * OP_INVOKE site, referred to by the instruction's cache operand.
+ *
+ * The cache starts monomorphic and records up to IC_POLY_MAX receiver
+ * shapes. Past that, @count becomes IC_MEGAMORPHIC and the site always does
+ * the full look-up.
+ * */
+typedef struct InlineCache {
+  InlineCacheEntry entries[IC_POLY_MAX];
+  uint8_t count;
+#ifdef DBG_IC_STATS
+  Opcode opcode;         // the instruction owning the cache
+  uint32_t name_offset;  // offset of the property's name in the constant pool
+  uint16_t line;
+  uint64_t hits;
+  uint64_t misses;
+#endif
+} InlineCache;
+
 /** Used to keep track of line numbers of bytecodes.
  * */
 typedef struct BytecodeLine {
@@ -96,6 +218,9 @@ typedef struct {
   ValueArr constants;     // constant values
   uint16_t current_line;  // current line number
   BytecodeLine* line_tracker;
+  InlineCache* caches;  // inline caches of property accesses
+  uint32_t cache_count;
+  uint32_t cache_capacity;
 } Chunk;
 
 void chunk_init(Chunk* chunk);
@@ -126,4 +251,16 @@ void chunk_write_load_const(Chunk* chunk, Value value, uint16_t line);
 uint16_t chunk_get_line(Chunk* chunk, uint32_t index);
 
 bool chunk_const_pool_is_full(Chunk* chunk);
+
+/* chunk_truncate: remove the bytecodes from @size onward, along with their
+ * line information, and the constants from @const_count onward. */
+void chunk_truncate(Chunk* chunk, uint32_t size, uint32_t const_count);
+
+/* Add a new, empty inline cache to chunk->caches and return its offset.
+ * Return CHUNK_CACHE_MAX if there are too many caches. */
+uint32_t chunk_add_cache(Chunk* chunk);
+
+/* opcode_generic: the generic instruction of the quickened @opcode, or
+ * @opcode itself. */
+Opcode opcode_generic(Opcode opcode);
 #endif
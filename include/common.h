@@ -10,7 +10,24 @@
 // #define DBG_DISASSEMBLE
 // #define DBG_STRESS_GC
 // #define DBG_LOG_GC
+// #define DBG_GC_STATS
+// #define DISABLE_GENERATIONS
+// #define INCREMENTAL_GC
+// #define CONCURRENT_GC
+// #define LAZY_SWEEP
+// #define BACKGROUND_FREE
+// #define COMPACT_GC
+// #define DISABLE_POOL
+// #define DBG_ALLOC_STATS
 // #define DBG_VM
 // #define NAN_BOXING
+// #define FORCE_SWITCH_DISPATCH
+// #define DISABLE_PEEPHOLE
+// #define DBG_COUNT_DISPATCH
+// #define DBG_IC_STATS
+// #define DISABLE_JIT
+// #define DBG_DUMP_TRACES
+// #define LINEAR_PROBE_TABLE
+// #define INCREMENTAL_REHASH
 
 #endif
@@ -22,5 +22,8 @@ typedef enum {
 
 ClosureObj* compile(const char* source);
 bool mark_compiler_roots();
+/* compiler_reset: forget the functions being compiled, once an error ended
+ * the compilation without returning from compile(). */
+void compiler_reset();
 
 #endif
@@ -7,4 +7,14 @@
 
 void disassemble_chunk(Chunk* chunk, const char* name);
 
+/* disassemble_inst: print the instruction at @offset of @chunk, and return
+ * the offset of the next one. */
+int disassemble_inst(Chunk* chunk, size_t offset);
+
+#ifdef DBG_IC_STATS
+/* print_inline_caches: print the state and the hit/miss counters of every
+ * inline cache of @chunk to stderr. */
+void print_inline_caches(Chunk* chunk, const char* name);
+#endif
+
 #endif
@@ -0,0 +1,116 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "object.h"
+#include "vm.h"
+
+/** A baseline template JIT for the stack engine.
+ *
+ * Once a function has been called or has looped JIT_THRESHOLD times in total,
+ * jit_compile() translates its chunk into x86-64 machine code: each
+ * instruction is lowered
+ * to a fixed template that works on the value stack directly, with calls into
+ * the runtime entry points below for the slow paths. Functions using
+ * instructions without a template (classes, properties and super calls) are
+ * left to run().
+ *
+ * Compiled code runs a frame until it returns, leaving the return value in
+ * place of the callee as OP_RETURN does. It is entered either at the start of
+ * a frame just pushed by a call, or at the head of a loop of a frame run()
+ * was executing: compiled code keeps no state other than the frame and the
+ * value stack, so it can take over at any instruction. The program counter
+ * of the frame is stored before every call into the runtime, so that errors
+ * report the right lines.
+ * */
+
+#if defined(__x86_64__) && defined(__linux__) && !defined(DISABLE_JIT)
+#define JIT_AVAILABLE
+#endif
+
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 1000
+#endif
+
+/* JitEntry: run @frame from @start, the code of one of its instructions. */
+typedef InterpretResult (*JitEntry)(CallFrame* frame, uint8_t* start);
+
+/* JitCode: the machine code of a function, in @size bytes of executable
+ * memory starting at @entry.
+ * @positions: the position in the code of each instruction, indexed by
+ * bytecode offset. */
+typedef struct JitCode {
+  JitEntry entry;
+  size_t size;
+  uint32_t* positions;
+} JitCode;
+
+/* jit_compile: compile @function, setting function->jit_code.
+ * return false if the function uses an instruction without a template, or
+ * if memory runs out. */
+bool jit_compile(FunctionObj* function);
+
+/* jit_free: release the machine code of @function, if any. */
+void jit_free(FunctionObj* function);
+
+/* jit_hot_code: count a call to @function or an iteration of one of its
+ * loops, and return its machine code, which is compiled when the count
+ * reaches JIT_THRESHOLD. NULL if it is not compiled.
+ * */
+static inline JitCode* jit_hot_code(FunctionObj* function) {
+  if (function->jit_code == NULL && function->hotness < JIT_THRESHOLD &&
+      ++function->hotness == JIT_THRESHOLD)
+    jit_compile(function);
+  return function->jit_code;
+}
+
+/* jit_run: run @frame natively from its instruction at frame->pc, which is
+ * either the start of the function or the target of an OP_LOOP. */
+static inline InterpretResult jit_run(JitCode* code, CallFrame* frame) {
+  uint32_t offset = frame->pc - frame->closure->function->chunk.bytecodes;
+  return code->entry(frame, (uint8_t*)code->entry + code->positions[offset]);
+}
+
+/** Runtime entry points of the compiled code, defined in vm.c.
+ *
+ * They take the running @frame, the top of its stack @sp and the address of
+ * the next instruction @pc, then an operand of the instruction. They return
+ * the new top of the stack, or NULL after reporting a runtime error.
+ * */
+typedef Value* (*JitHelper)(CallFrame* frame,
+                            Value* sp,
+                            uint8_t* pc,
+                            uint32_t operand);
+
+// @operand: the opcode of the instruction whose operands have the wrong type.
+Value* jit_type_error(CallFrame* frame,
+                      Value* sp,
+                      uint8_t* pc,
+                      uint32_t operand);
+// @operand: the slot of the global variable.
+Value* jit_undefined_global(CallFrame* frame,
+                            Value* sp,
+                            uint8_t* pc,
+                            uint32_t operand);
+Value* jit_add(CallFrame* frame, Value* sp, uint8_t* pc, uint32_t operand);
+// @operand: the number of operands of OP_CONCAT_N.
+Value* jit_concat(CallFrame* frame, Value* sp, uint8_t* pc, uint32_t operand);
+Value* jit_equal(CallFrame* frame, Value* sp, uint8_t* pc, uint32_t operand);
+Value* jit_not(CallFrame* frame, Value* sp, uint8_t* pc, uint32_t operand);
+Value* jit_print(CallFrame* frame, Value* sp, uint8_t* pc, uint32_t operand);
+// @operand: the number of arguments.
+Value* jit_call(CallFrame* frame, Value* sp, uint8_t* pc, uint32_t operand);
+// @operand: the offset of the closure in the constant pool.
+Value* jit_closure(CallFrame* frame, Value* sp, uint8_t* pc, uint32_t operand);
+// @operand: the index of the upvalue, the value is stored through a write
+// barrier.
+Value* jit_set_upvalue(CallFrame* frame,
+                       Value* sp,
+                       uint8_t* pc,
+                       uint32_t operand);
+Value* jit_close_upvalue(CallFrame* frame,
+                         Value* sp,
+                         uint8_t* pc,
+                         uint32_t operand);
+Value* jit_return(CallFrame* frame, Value* sp, uint8_t* pc, uint32_t operand);
+
+#endif
@@ -1,11 +1,155 @@
 #ifndef MEMORY_H
 #define MEMORY_H
 
+#include <stdint.h>
 #include <stdlib.h>
 
 #include "value.h"
 
+/** GCConfig: when the collector runs, see the collector in vm.h. Each field
+ * is set by the command line option --gc-<option>=<value> or else the
+ * environment variable CLOX_GC_<OPTION>, see gc_configure().
+ *
+ * @initial (initial): the threshold of the first full collection, in bytes.
+ * @grow_factor (grow): the threshold of the next full collection, relative to
+ * the bytes left by the last one.
+ * @min_threshold (min), @max_threshold (max): the bounds of the threshold.
+ * @heap_limit (limit): the bytes the heap can't outgrow. An allocation past
+ * it fails with an "Out of memory." runtime error, if collecting all of the
+ * garbage doesn't make room for it.
+ * @target (target): if not 0, the share of the run time to spend
+ * collecting. Each full collection adjusts @grow_factor to get closer to it:
+ * a larger heap makes collections rarer.
+ *
+ * The sizes take a K, M or G suffix. */
+#ifndef GC_INITIAL_HEAP
+#define GC_INITIAL_HEAP (1024 * 1024)
+#endif
+#ifndef GC_GROW_FACTOR
 #define GC_GROW_FACTOR 2
+#endif
+#ifndef GC_MIN_THRESHOLD
+#define GC_MIN_THRESHOLD (1024 * 1024)
+#endif
+// the bounds of the grow factor set by the target
+#define GC_GROW_MIN 1.25
+#define GC_GROW_MAX 8
+
+typedef struct {
+  size_t initial;
+  double grow_factor;
+  size_t min_threshold;
+  size_t max_threshold;
+  size_t heap_limit;
+  double target;
+} GCConfig;
+
+// the bytes allocated between two minor collections
+#ifndef GC_NURSERY_SIZE
+#define GC_NURSERY_SIZE (256 * 1024)
+#endif
+
+// With INCREMENTAL_GC, a slice of a full collection unmarks or traverses
+// GC_SLICE_WORK objects, or runs for GC_SLICE_US microseconds if defined,
+// every GC_SLICE_BYTES bytes allocated. With CONCURRENT_GC, the program checks
+// every GC_SLICE_BYTES bytes whether the marking thread is done.
+#ifndef GC_SLICE_WORK
+#define GC_SLICE_WORK 4096
+#endif
+#ifndef GC_SLICE_BYTES
+#define GC_SLICE_BYTES (64 * 1024)
+#endif
+
+#if defined(CONCURRENT_GC) && defined(INCREMENTAL_GC)
+#error "CONCURRENT_GC and INCREMENTAL_GC are exclusive"
+#endif
+
+// The blocks of up to POOL_MAX_SIZE bytes are served by the pool allocator,
+// rounded up to a multiple of POOL_GRANULE bytes and carved out of pages of
+// POOL_PAGE_SIZE bytes, a power of two. DISABLE_POOL leaves the arrays to
+// malloc(), the objects are always allocated in pages (see Page below).
+#ifndef POOL_MAX_SIZE
+#define POOL_MAX_SIZE 256
+#endif
+#define POOL_GRANULE 16
+#ifndef POOL_PAGE_SIZE
+#define POOL_PAGE_SIZE (64 * 1024)
+#endif
+
+// With LAZY_SWEEP, the pages swept on each allocation
+#ifndef GC_SWEEP_WORK
+#define GC_SWEEP_WORK 1
+#endif
+
+// With COMPACT_GC, a compaction (see gc_compact()) is requested once a full
+// collection leaves GC_COMPACT_THRESHOLD percent of the pages of small
+// objects or more that packing the objects would empty.
+#ifndef GC_COMPACT_THRESHOLD
+#define GC_COMPACT_THRESHOLD 25
+#endif
+
+// the threads traversing the heap in the full collections that stop the
+// program, splitting the roots and stealing each other's gray objects
+#ifndef GC_MARK_THREADS
+#define GC_MARK_THREADS 1
+#endif
+#if GC_MARK_THREADS > 1 && (defined(CONCURRENT_GC) || defined(INCREMENTAL_GC))
+#error "GC_MARK_THREADS is for the collections that stop the program"
+#endif
+#if defined(CONCURRENT_GC) && !defined(NAN_BOXING)
+#error "CONCURRENT_GC needs NAN_BOXING, to read values in one load"
+#endif
+
+/** Page: the header of a page of objects, aligned on POOL_PAGE_SIZE so that
+ * the page of an object is found by masking its address. The objects of up
+ * to POOL_MAX_SIZE bytes share the pages of their size class, a larger one
+ * has a page of its own, of as many bytes as needed.
+ *
+ * The bitmaps have a bit per POOL_GRANULE bytes of the page:
+ * @live: set for the blocks holding an object.
+ * @marks: the marks of the objects (see the collector in vm.h), kept out of
+ * the objects so that the collector never writes to them.
+ *
+ * @block_size: the size class of the objects, the size of the large object.
+ * @young: set once an object is allocated in the page, until the page is
+ * swept.
+ * @unswept: with LAZY_SWEEP, set while the page holds garbage left by the
+ * last full collection.
+ * @evacuated: set while gc_compact() moves the objects out of the page. */
+#define PAGE_BITMAP_WORDS (POOL_PAGE_SIZE / POOL_GRANULE / 64)
+
+typedef struct Page {
+  struct Page* next;
+  uint32_t block_size;
+  bool young;
+  bool unswept;
+  bool evacuated;
+  uint64_t live[PAGE_BITMAP_WORDS];
+  uint64_t marks[PAGE_BITMAP_WORDS];
+} Page;
+
+#define OBJ_PAGE(obj) \
+  ((Page*)((uintptr_t)(obj) & ~((uintptr_t)POOL_PAGE_SIZE - 1)))
+#define OBJ_BIT(obj) (((uintptr_t)(obj) & (POOL_PAGE_SIZE - 1)) / POOL_GRANULE)
+
+/* gc_is_marked: whether the object @obj is marked. */
+static inline bool gc_is_marked(Obj* obj) {
+  uint32_t bit = OBJ_BIT(obj);
+  return (OBJ_PAGE(obj)->marks[bit / 64] >> (bit % 64)) & 1;
+}
+
+/* With CONCURRENT_GC, the marking thread reads the objects while the program
+ * changes them. The size bounding an array it reads is stored with
+ * GC_PUBLISH() once the array holds that many elements, and read with
+ * GC_READ() before the array. */
+#ifdef CONCURRENT_GC
+#define GC_PUBLISH(size, value) \
+  __atomic_store_n(&(size), (value), __ATOMIC_RELEASE)
+#define GC_READ(size) __atomic_load_n(&(size), __ATOMIC_ACQUIRE)
+#else
+#define GC_PUBLISH(size, value) ((size) = (value))
+#define GC_READ(size) (size)
+#endif
 
 #define GROW_ARRAY(type, ptr, old_sz, new_sz) \
   (type*)reallocate(ptr, sizeof(type) * old_sz, sizeof(type) * new_sz)
@@ -21,9 +165,13 @@
 #define FREE(type, ptr) (type*)reallocate(ptr, sizeof(type), 0)
 
 /* reallocate: Allocate a new array and move data from the old array
- * to the new one.
+ * to the new one, or resize the old array in place when possible. The bytes
+ * added are zeroed.
  * return value: pointer to the new array
  *
+ * @old_sz must be the size the array was allocated with, which selects its
+ * size class in the pool allocator.
+ *
  * Special cases include:
  * old_sz = 0, new_sz = any (!= 0): allocate a new array
  * old_sz = any, new_sz = 0: free that array
@@ -34,8 +182,49 @@ void* append_array(void* ptr,
                    int arr_size,
                    int arr_capacity,
                    void* item);
+/* collect_garbage: free the unreachable young objects, or all of the
+ * unreachable objects once the old generation has grown past
+ * vm.gc.threshold (see the collector in vm.h). */
 void collect_garbage();
+/* gc_allocate: allocate a zeroed object of @size bytes in a page, counted as
+ * allocated by reallocate() would. The object is young, and unmarked. */
+Obj* gc_allocate(size_t size);
+/* gc_hold, gc_unhold: no garbage is collected between them, so that the
+ * objects worked on needn't be reachable. The bytes allocated meanwhile are
+ * still counted: the first allocation after gc_unhold() collects if it is
+ * time to. */
+void gc_hold();
+void gc_unhold();
+/* gc_compact: move the objects of the sparsest pages of small objects to the
+ * free blocks of the others, update every reference to them and return the
+ * pages left empty to the system. Nothing is done while a collection cycle
+ * is in progress: vm.gc.compact stays set, to try again later.
+ *
+ * No object may be referred to from the C stack: the engines only call it at
+ * the loop back-edges they run outside of any call from the runtime, once
+ * vm.gc.compact is set by the native function compact() or, with COMPACT_GC,
+ * by the collector. */
+void gc_compact();
+/* gc_visit_objects: call @visit on every object of the heap. */
+void gc_visit_objects(void (*visit)(Obj*));
 void free_objects();
+
+/* gc_config_init: set @config from the environment variables, or to the
+ * defaults. */
+void gc_config_init(GCConfig* config);
+/* gc_configure: set the field of @config named @option to @value.
+ * return false if there is no such option, or the value is invalid. */
+bool gc_configure(GCConfig* config, const char* option, const char* value);
 bool mark_object(Obj* obj);
 
+#ifdef DBG_GC_STATS
+/* gc_print_stats: print the collections run so far and their pauses. */
+void gc_print_stats();
+#endif
+#ifdef DBG_ALLOC_STATS
+/* alloc_print_stats: print the blocks allocated so far, and the memory left
+ * free in the pages of the pool allocator. */
+void alloc_print_stats();
+#endif
+
 #endif
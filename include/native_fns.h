@@ -1,3 +1,6 @@
 #include "value.h"
 
 Value native_fn_has_attribute(int param_count, Value* params);
+/* native_fn_compact: request a compaction of the heap, run at the next loop
+ * back-edge (see gc_compact()). */
+Value native_fn_compact(int param_count, Value* params);
@@ -28,25 +28,52 @@ typedef enum {
 
 struct Obj {
   ObjType type;
-  Obj* next;
-
-  // Used by garbage collector to indicate whether the object is marked
-  bool gc_marked;
+  // The mark of the object is in the bitmap of its page (see Page in
+  // memory.h). Between collections, the marked objects are the old ones.
+  bool gc_remembered;  // in vm.gc.remembered
 };
 
+/** StringObj: a string of @length characters.
+ *
+ * The strings are interned: vm.strings holds a single string of given
+ * characters, stored in @chars and hashed in @hashcode, so that the equal
+ * strings in it are the same object.
+ *
+ * The result of a long concatenation is a rope instead, not interned yet: its
+ * characters are those of @left followed by those of @right, and its @chars
+ * is NULL. Appending to a rope doesn't copy it. A rope is flattened once its
+ * characters are needed (see StringObj_intern()): it becomes an interned
+ * string itself, or else it keeps the interned string equal to it in @left,
+ * and shares its @chars.
+ * */
 typedef struct StringObj {
   Obj obj;
   uint32_t length;
-  char* chars;
   uint32_t hashcode;
+  char* chars;
+  struct StringObj* left;
+  struct StringObj* right;
 } StringObj;
 
+/* The concatenations shorter than this are copied, and interned right away.
+ */
+#ifndef ROPE_MIN_LENGTH
+#define ROPE_MIN_LENGTH 32
+#endif
+
 typedef struct FunctionObj {
   Obj obj;
   int arity;
   int upval_count;
+  int reg_count;  // registers of a frame, for the register engine
   Chunk chunk;
   StringObj* name;
+
+  // the machine code compiled by the JIT (see jit.h) once @hotness, the
+  // number of calls and loop iterations, reaches JIT_THRESHOLD.
+  struct JitCode* jit_code;
+  uint32_t hotness;
+  struct Trace* traces;  // the loops of the tracing JIT, see trace.h
 } FunctionObj;
 
 typedef struct UpvalueObj {
@@ -58,7 +85,7 @@ typedef struct UpvalueObj {
   struct UpvalueObj* next;
 } UpvalueObj;
 
-typedef struct {
+typedef struct ClosureObj {
   Obj obj;
   FunctionObj* function;
   UpvalueObj** upvalues;
@@ -79,18 +106,53 @@ typedef struct {
   ClosureObj* method;
 } BoundMethodObj;
 
-typedef struct {
+/** Shape: the layout of an instance's fields, shared by all instances of a
+ * class whose fields were added in the same order.
+ *
+ * The shapes of a class form a transition tree rooted at the shape of an
+ * instance without fields. Adding the field @name to an instance moves it
+ * from the shape @parent to its child (the transition) keyed by @name. The
+ * instance stores the value of the field at slot @field_count - 1.
+ *
+ * Shapes are owned by their class and are freed along with it.
+ * */
+typedef struct Shape {
+  struct ClassObj* klass;
+  struct Shape* parent;
+  StringObj* name;  // the last field added, NULL for the root shape
+  uint32_t field_count;
+
+  struct Shape** transitions;
+  uint32_t transition_count;
+  uint32_t transition_capacity;
+} Shape;
+
+/* The number of field slots allocated inside a new instance is the largest
+ * field count reached by the instances of its class, up to this limit. */
+#define INSTANCE_INLINE_FIELDS_MAX 16
+
+typedef struct ClassObj {
   Obj obj;
   StringObj* name;
 
   // this tables contain mappings from names to bound method objects.
   Table methods;
+
+  Shape* shape;  // the root of the class's transition tree
+  uint32_t inline_fields;
 } ClassObj;
 
 typedef struct {
   Obj obj;
   ClassObj* klass;
-  Table fields;
+  Shape* shape;
+
+  // Values of the fields indexed by slot. @fields points to @inline_fields
+  // until the instance outgrows them.
+  Value* fields;
+  uint32_t field_capacity;
+  uint32_t inline_capacity;
+  Value inline_fields[];
 } InstanceObj;
 
 #define IS_STRING_OBJ(value) (is_obj_type(value, OBJ_STRING))
@@ -103,7 +165,7 @@ typedef struct {
 #define IS_BOUND_METHOD_OBJ(value) (is_obj_type(value, OBJ_BOUND_METHOD))
 
 #define AS_STRING(value) ((StringObj*)AS_OBJ(value))
-#define AS_CSTRING(value) (AS_STRING(value)->chars)
+#define AS_CSTRING(value) (StringObj_intern(AS_STRING(value))->chars)
 #define AS_FUNCTION(value) ((FunctionObj*)AS_OBJ(value))
 #define AS_CLOSURE(value) ((ClosureObj*)AS_OBJ(value))
 #define AS_UPVALUE(value) ((UpvalueObj*)AS_OBJ(value))
@@ -119,6 +181,23 @@ static inline bool is_obj_type(Value value, ObjType type) {
 /* StringObj_construct: Allocate a container object in heap memory
  * that contains a clone of the string pointed by @chars */
 StringObj* StringObj_construct(const char* chars, size_t length);
+
+/* StringObj_concat: the string object containing @left followed by @right,
+ * a rope if it is at least ROPE_MIN_LENGTH characters long.
+ * Both strings must be reachable by the garbage collector. */
+StringObj* StringObj_concat(StringObj* left, StringObj* right);
+
+/* StringObj_concat_n: the string object containing the @count strings of
+ * @strings one after the other. The short strings in a row are copied at
+ * once, the result is a rope of the longer pieces (see StringObj_concat()).
+ * The strings must be reachable by the garbage collector. */
+StringObj* StringObj_concat_n(StringObj** strings, uint32_t count);
+
+/* StringObj_intern: the interned string equal to @string, which is flattened
+ * first if it is a rope. The strings compared, printed or used as the key
+ * of a table go through it. It doesn't collect garbage, so that @string
+ * needn't be reachable. */
+StringObj* StringObj_intern(StringObj* string);
 FunctionObj* FunctionObj_construct();
 ClosureObj* ClosureObj_construct(FunctionObj*);
 UpvalueObj* UpvalueObj_construct(Value*);
@@ -132,7 +211,29 @@ void print_object(Obj*);
 uint32_t hash_string(const char*, int);
 void* allocate_object(size_t size, ObjType type);
 /** Object's specific supporting functions. */
-Value InstanceObj_get_property(InstanceObj* instance, StringObj* property_name);
+
+/* Shape_lookup: the slot of the field @name in the layout @shape, or -1 if
+ * there is no such field. */
+int Shape_lookup(Shape* shape, StringObj* name);
+
+/* Shape_transition: the shape reached by adding the field @name to @shape.
+ * The shape is created if it does not exist yet. */
+Shape* Shape_transition(Shape* shape, StringObj* name);
+
+/* Free @shape and all shapes reachable from its transitions. */
+void Shape_free(Shape* shape);
+
+/* InstanceObj_get_field: store the value of the field @name in @dest.
+ * return true if the instance has the field. */
+bool InstanceObj_get_field(InstanceObj* instance, StringObj* name, Value* dest);
+
+/* InstanceObj_set_field: set the field @name, adding it to the instance if
+ * needed. Return whether the field already existed. */
+bool InstanceObj_set_field(InstanceObj* instance, StringObj* name, Value value);
+
+/* InstanceObj_reserve_fields: ensure the instance can store @count fields. */
+void InstanceObj_reserve_fields(InstanceObj* instance, uint32_t count);
+
 bool object_equal(Obj* obj1, Obj* obj2);
 
 #endif
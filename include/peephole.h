@@ -0,0 +1,15 @@
+#ifndef PEEPHOLE_H
+#define PEEPHOLE_H
+
+#include "chunk.h"
+
+/* peephole_optimize: rewrite common instruction sequences of @chunk into
+ * superinstructions (see the fused opcodes in chunk.h).
+ *
+ * The bytecode array is compacted in place: jump distances and the line
+ * tracker are remapped to the new instruction positions. Must be called once
+ * the chunk is complete, i.e, every jump has been patched.
+ * */
+void peephole_optimize(Chunk* chunk);
+
+#endif
@@ -5,8 +5,19 @@
 
 #define MAX_LOAD 0.75
 
+// With INCREMENTAL_REHASH, a Table or a StringSet that grows keeps its former
+// slots next to the new ones, and each insertion moves REHASH_STEP of them
+// to the new ones, so that no insertion rehashes the whole of a large table.
+// The tables of LINEAR_PROBE_TABLE still rehash at once.
+#ifndef REHASH_STEP
+#define REHASH_STEP 64
+#endif
+
 typedef struct StringObj StringObj;
 
+#ifdef LINEAR_PROBE_TABLE
+/* The former layout of Table, an array of entries probed one after the
+ * other, kept to be compared with (see test/bench/table.sh). */
 typedef struct Entry {
   StringObj* key;
   bool tombstone;
@@ -18,6 +29,52 @@ typedef struct Table {
   uint32_t capacity;
   Entry* entries;
 } Table;
+#else
+/** Table: a hash table mapping interned strings to values, in the manner of
+ * SwissTable.
+ *
+ * The @capacity slots, a power of two, are split into groups of TABLE_GROUP
+ * slots. Each slot has a control byte in @control: TABLE_EMPTY, TABLE_DELETED
+ * or the 7 low bits of the hash of its key. A key is looked up in the groups
+ * of its probe sequence, starting at the group picked by the other bits of its
+ * hash: the control bytes of a group are compared with its 7 bits at once
+ * (with SSE2), so that only the keys of the matching slots are read, and a
+ * group with an empty slot ends the sequence.
+ *
+ * The keys and the values are kept in the separate arrays @keys and @values,
+ * allocated in one block after @control. The key of a slot that isn't full is
+ * NULL, so that the garbage collector reads these arrays alone.
+ *
+ * @count: the number of keys.
+ * @tombstones: the number of TABLE_DELETED slots, which count towards the
+ * load of the table until it is rehashed.
+ *
+ * With INCREMENTAL_REHASH, @old_capacity slots are left to be moved from
+ * @old_control, @old_keys and @old_values while the table grows, from the
+ * slot @moved on. The keys still there are counted in @count, and found
+ * there once they aren't found in the new slots. A slot moved becomes
+ * TABLE_DELETED, so that the probe sequences of the others stay intact.
+ * */
+#define TABLE_GROUP 16
+#define TABLE_EMPTY 0x80
+#define TABLE_DELETED 0xfe
+
+typedef struct Table {
+  uint32_t count;
+  uint32_t tombstones;
+  uint32_t capacity;
+  uint8_t* control;
+  StringObj** keys;
+  Value* values;
+#ifdef INCREMENTAL_REHASH
+  uint32_t old_capacity;
+  uint32_t moved;
+  uint8_t* old_control;
+  StringObj** old_keys;
+  Value* old_values;
+#endif
+} Table;
+#endif
 
 void table_init(Table* table);
 void table_free(Table* table);
@@ -41,6 +98,55 @@ bool table_delete(Table* table, StringObj* key, Value* dest);
 /* table_add_all: Add all key-value pairs from src to dest. */
 void table_add_all(Table* dest, Table* src);
 
-void table_remove_unmarked_object(Table* table);
+/** StringSet: the set of the interned strings (see StringObj in object.h),
+ * looked up by their characters.
+ *
+ * It is an open-addressing hash table with linear probing over a power of
+ * two @capacity of entries. Each entry caches the hash and the length of its
+ * string, so that a probe only reads the characters of a string whose hash
+ * and length both match. A removal shifts the following entries of its
+ * cluster back, so that there are no tombstones.
+ *
+ * With INCREMENTAL_REHASH, the @old_capacity entries @old_entries are left
+ * to be moved while the set grows, from the entry @moved on. They are kept
+ * as they are until the last one is moved, and looked up once a string isn't
+ * found in the new entries. A collection moves the rest of them before
+ * removing the strings that aren't marked.
+ * */
+typedef struct SetEntry {
+  StringObj* string;  // NULL if the entry is empty
+  uint32_t hashcode;
+  uint32_t length;
+} SetEntry;
+
+typedef struct StringSet {
+  uint32_t count;
+  uint32_t capacity;
+  SetEntry* entries;
+#ifdef INCREMENTAL_REHASH
+  uint32_t old_capacity;
+  uint32_t moved;
+  SetEntry* old_entries;
+#endif
+} StringSet;
+
+void string_set_init(StringSet* set);
+void string_set_free(StringSet* set);
+
+/* string_set_find: the string of the @length characters @chars, whose hash
+ * is @hashcode, or NULL if the set has no such string. */
+StringObj* string_set_find(StringSet* set,
+                           const char* chars,
+                           uint32_t length,
+                           uint32_t hashcode);
+
+/* string_set_add: add @string, whose characters are in none of the strings
+ * of the set. It must be reachable by the garbage collector: the set may
+ * grow. */
+void string_set_add(StringSet* set, StringObj* string);
+
+/* string_set_remove_unmarked: remove the strings that aren't marked, at the
+ * end of a collection. Nothing is allocated. */
+void string_set_remove_unmarked(StringSet* set);
 
 #endif
@@ -0,0 +1,91 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "jit.h"
+#include "object.h"
+#include "vm.h"
+
+/** A tracing JIT for the hot loops of the stack engine.
+ *
+ * run() counts the iterations of each loop at its OP_LOOP back-edges. Once a
+ * loop has iterated TRACE_HOT_LOOP times, the recorder executes one iteration
+ * itself, from the head of the loop back to it, writing down the path taken
+ * and the types of the values it sees. The recording becomes a linear IR in
+ * which:
+ * - the types of the locals of the frame read by the loop, numbers or
+ * booleans, are checked once, when the trace is entered, and the locals are
+ * unboxed;
+ * - arithmetic and comparisons work on unboxed numbers and booleans, without
+ * any type check;
+ * - each branch is a guard of the direction recorded, leaving the trace for
+ * run() when it doesn't hold (a side exit);
+ * - constants are folded, dead instructions dropped, and the loads, the
+ * arithmetic and the guards that don't depend on the iteration hoisted out
+ * of the loop;
+ * - values live in machine registers, the locals carried from one iteration
+ * to the next included.
+ *
+ * The machine code of the trace iterates until a guard fails. The exit then
+ * boxes the temporaries of the value stack and leaves the frame at the
+ * instruction where run() resumes. Stores to locals and globals are written
+ * through, so an exit has nothing else to restore.
+ *
+ * Only the instructions of numeric loops are recorded: constants, locals,
+ * globals holding numbers, arithmetic, comparisons and jumps. A recording
+ * meeting anything else (a call, a property, a string...) is aborted, and
+ * loops aborted TRACE_MAX_ABORTS times are left to run(). Define
+ * DBG_DUMP_TRACES to print every trace and aborted recording.
+ * */
+
+#ifndef TRACE_HOT_LOOP
+#define TRACE_HOT_LOOP 50
+#endif
+
+#define TRACE_MAX_ABORTS 4
+
+// the longest recording, in instructions
+#define TRACE_MAX_LENGTH 256
+
+/* TraceEntry: run the trace from the head of its loop in @frame, and return
+ * the number of the exit taken. */
+typedef uint32_t (*TraceEntry)(CallFrame* frame);
+
+/* Trace: the trace of the loop whose head is at the bytecode offset @start
+ * of the function owning it.
+ * @misses: the entries in a row that exited before the first iteration.
+ * @aborts: the recordings aborted.
+ * @entry: the machine code of the trace, in @size bytes. NULL until the loop
+ * has been recorded. */
+typedef struct Trace {
+  uint32_t start;
+  uint32_t misses;
+  uint8_t aborts;
+  TraceEntry entry;
+  size_t size;
+  struct Trace* next;
+} Trace;
+
+/* trace_loop: called by run() at a hot OP_LOOP jumping back to frame->pc,
+ * with the frame stored. Run the trace of the loop, recording it first if
+ * needed. Either way, run() resumes at frame->pc with the stack ending at
+ * vm.stack_top.
+ * */
+void trace_loop(CallFrame* frame);
+
+/* The iterations of the loops are counted in trace_counters, indexed by
+ * the address of their head. Loops sharing a counter add up, which only
+ * makes them hot sooner. */
+#define TRACE_COUNTERS 64
+extern int16_t trace_counters[TRACE_COUNTERS];
+
+/* trace_hot: count an iteration of the loop whose head is at @pc, and
+ * return true if run() should call trace_loop(): the loop is hot, or has a
+ * trace to enter. */
+static inline bool trace_hot(uint8_t* pc) {
+  return ++trace_counters[(uintptr_t)pc % TRACE_COUNTERS] >= TRACE_HOT_LOOP;
+}
+
+/* trace_free: release the traces of @function. */
+void trace_free(FunctionObj* function);
+
+#endif
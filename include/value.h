@@ -9,6 +9,7 @@ typedef enum {
   VAL_NIL,
   VAL_NUMBER,
   VAL_OBJ,
+  VAL_UNDEFINED,  // only held by global variables that are not defined yet
 } ValueType;
 
 typedef struct Obj Obj;
@@ -54,6 +55,7 @@ typedef struct Obj Obj;
 
 /* Use the second bit to distinguish boolean and nil */
 #define TAG_NIL 0x01
+#define TAG_UNDEFINED 0x02
 #define TAG_BOOL 0x10
 #define TAG_OBJ IEEE754_SIGN_BIT
 
@@ -81,6 +83,7 @@ static inline double val_to_num(Value val) {
 
 /* Value initializers */
 #define NIL_VAL() ((Value)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL() ((Value)(QNAN | TAG_UNDEFINED))
 #define BOOL_VAL(b) (QNAN | TAG_BOOL | (b ? true : false))
 #define NUMBER_VAL(num) num_to_val(num)
 #define OBJ_VAL(object) (Value)((TAG_OBJ | QNAN | (uintptr_t) & object))
@@ -89,6 +92,7 @@ static inline double val_to_num(Value val) {
 // not a quiet NaN -> value should be treated as a normal double.
 #define IS_NUMBER(value) (!BITMASK_EQ(value, QNAN))
 #define IS_NIL(value) (value == NIL_VAL())
+#define IS_UNDEFINED(value) (value == UNDEFINED_VAL())
 #define IS_BOOL(value) \
   ((!BITMASK_EQ(value, TAG_OBJ)) && BITMASK_EQ(value, TAG_BOOL | QNAN))
 #define IS_OBJ(value) BITMASK_EQ(value, TAG_OBJ | QNAN)
@@ -117,6 +121,12 @@ typedef struct {
       .number = 0 \
     }             \
   }
+#define UNDEFINED_VAL() \
+  (Value) {             \
+    VAL_UNDEFINED, {    \
+      .number = 0       \
+    }                   \
+  }
 #define NUMBER_VAL(value) \
   (Value) {               \
     VAL_NUMBER, {         \
@@ -138,6 +148,7 @@ typedef struct {
 /* type checkers */
 #define IS_NUMBER(value) (((Value)(value)).type == VAL_NUMBER)
 #define IS_NIL(value) (((Value)(value)).type == VAL_NIL)
+#define IS_UNDEFINED(value) (((Value)(value)).type == VAL_UNDEFINED)
 #define IS_BOOL(value) (((Value)(value)).type == VAL_BOOL)
 #define IS_OBJ(value) (((Value)(value)).type == VAL_OBJ)
 
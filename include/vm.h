@@ -2,13 +2,45 @@
 #define VM_H
 
 #include "chunk.h"
+#include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-#define STACK_MAX 256
 #define CALL_FRAME_MAX 64
-#define GC_THRESHOLD 1024;
+// A frame of the register engine spans up to 256 registers, starting at its
+// callee's register in the frame of the caller.
+#define STACK_MAX (CALL_FRAME_MAX * 256)
+
+/** Engine: the instruction set the compiler emits and the VM runs.
+ *
+ * ENGINE_STACK: operands are passed on the value stack (see run()).
+ * ENGINE_REGISTER: locals and temporaries live in frame registers named by
+ * the operands of the instructions (see run_register()).
+ * */
+typedef enum {
+  ENGINE_STACK,
+  ENGINE_REGISTER,
+} Engine;
+
+/** JitMode: what the stack engine compiles to machine code.
+ *
+ * JIT_NONE: nothing, everything is interpreted.
+ * JIT_METHOD: hot functions, as a whole (see jit.h).
+ * JIT_TRACE: the paths taken through hot loops (see trace.h).
+ * */
+typedef enum {
+  JIT_NONE,
+  JIT_METHOD,
+  JIT_TRACE,
+} JitMode;
+
+// the phases of an incremental full collection, see @gc in VM
+typedef enum {
+  GC_IDLE,
+  GC_UNMARKING,
+  GC_MARKING,
+} GCPhase;
 
 typedef struct {
   ClosureObj* closure;
@@ -24,8 +56,6 @@ typedef struct {
  * @stack: contains values that are being used during the execution
  * @stack_top: points to the top of the stack, i.e, this pointer will point to
  * the next slot where the new value will be placed in the stack
- * @objects: Contains all dynamically allocated objects, later used by the
- * garbage collector
  * @open_upvalues: used to manage upvalues (values that are used by functions
  * to which the values does not belong)
  */
@@ -36,7 +66,6 @@ typedef struct {
   uint8_t* pc;  // program counter
   Value stack[STACK_MAX];
   Value* stack_top;
-  Obj* objects;
 
   /** Upvalues all scoped variables refered by closures.
    *
@@ -84,32 +113,94 @@ typedef struct {
    * */
   UpvalueObj* open_upvalues;
 
-  Table strings;  // used for string-interning technique
-  Table globals;  // global variables
+  StringSet strings;  // used for string-interning technique
+
+  /** Global variables are resolved to slots when they are compiled (see
+   * vm_global_slot()), so the instructions accessing them index @globals
+   * directly. A slot holds UNDEFINED_VAL() until its variable is defined.
+   *
+   * @global_slots: maps the name of each global variable to its slot.
+   * @global_names: the name of the variable in each slot.
+   * */
+  ValueArr globals;
+  Table global_slots;
+  ValueArr global_names;
   bool repl;
+  Engine engine;
+  JitMode jit;
 
   /** @gc stores the data used by the garbage collection algorithm.
    * The garbage collector is implemented using mark-sweep algorithm.
    *
    * The idea is to use a graph traversal algorithm (in this case,
    * Breadth-first traversal) to mark all reachable objects. After the graph
-   * traversal completes, we remove all unreachable objects from @vm.objects.
+   * traversal completes, we remove all unreachable objects.
+   *
+   * The objects are allocated in pages, whose bitmaps record the blocks
+   * holding an object and the marks (see Page in memory.h). Sweeping a page
+   * frees its unmarked objects by scanning the bitmaps.
+   *
+   * The collector is generational. The objects surviving a collection keep
+   * their mark: between collections, an object is old if and only if it is
+   * marked. A minor collection only frees young objects. Its traversal stops
+   * at the old objects, which are already marked, and starts from the roots
+   * and from the old objects remembered by gc_write_barrier() for referring
+   * to young ones. It only sweeps the pages where objects were allocated
+   * since the last collection. A full collection clears the marks first,
+   * then traverses and sweeps every page.
+   *
+   * With INCREMENTAL_GC, the unmarking and the traversal of a full collection
+   * are done in slices between which the program runs (see mark_slice() in
+   * memory.c), in the phase @gc.phase. Marked objects are gray while in
+   * @gc.objects, black once traversed. gc_write_barrier() keeps the black
+   * objects given a reference to a white one in @gc.remembered, to traverse
+   * them again. The final pause marks the roots again, finishes the
+   * traversal and sweeps.
+   *
+   * With CONCURRENT_GC, the traversal of a full collection is done by another
+   * thread instead, during the GC_MARKING phase (see start_marking() in
+   * memory.c).
+   *
+   * The objects never move, except in a compaction (see gc_compact() in
+   * memory.c): @gc.compact requests one, at the next loop back-edge. With
+   * COMPACT_GC, full collections request one once the pages are fragmented.
    *
    * @gc.objects: A dynamic array used to keep tracks of objects that are
    * reachable and are not marked.
    * @gc.count: Number of objects in @gc.objects
    * @gc.capacity: Maximum capacity of @gc.objects
+   * @gc.remembered: The old objects that may refer to young objects, i.e, the
+   * remembered set, of @gc.remembered_count objects.
+   * @gc.cursor: The next page to unmark, in the GC_UNMARKING phase.
+   * @gc.sweep: With LAZY_SWEEP, the link to the next page left to sweep by
+   * the last full collection, NULL once all are swept. The unmarked objects
+   * of the unswept pages are garbage, freed a page at a time as the program
+   * allocates (see sweep_some() in memory.c).
    *
-   * Two fields @gc.allocated and @gc.threshold are used to determine when
-   * to collect garbages. If @gc.allocated > @gc.threshold, the garbage
-   * collection operation is performed.
+   * The fields @gc.allocated, @gc.young_limit, @gc.old_allocated and
+   * @gc.threshold are used to determine when to collect garbages. Once
+   * @gc.allocated reaches @gc.young_limit, GC_NURSERY_SIZE bytes after the
+   * end of the last collection, the garbage collection operation is
+   * performed. It is a full one if @gc.old_allocated, the bytes left by the
+   * last collection, reached @gc.threshold. @gc.config sets the thresholds
+   * and the heap limit (see GCConfig in memory.h).
    * */
   struct {
     Obj** objects;
     uint32_t count;
     uint32_t capacity;
+    Obj** remembered;
+    uint32_t remembered_count;
+    uint32_t remembered_capacity;
+    GCPhase phase;
+    Page* cursor;
+    Page** sweep;
     size_t allocated;
+    size_t young_limit;
+    size_t old_allocated;
     size_t threshold;
+    GCConfig config;
+    bool compact;
   } gc;
 
   // The method name of class initializers. In this case, it's
@@ -125,13 +216,26 @@ typedef enum {
 
 extern VM vm;
 
-void vm_init(bool is_repl);
+void vm_init(bool is_repl,
+             Engine engine,
+             JitMode jit,
+             const GCConfig* gc_config);
 void vm_free();
 
 void vm_stack_push(Value value);
 Value vm_stack_pop();
 int vm_stack_size();
 
+/* vm_out_of_memory: fail with an "Out of memory." runtime error, once the
+ * heap can't grow. Doesn't return: the program being interpreted ends. */
+_Noreturn void vm_out_of_memory();
+
+/** vm_global_slot: get the slot of the global variable named @name in
+ * vm.globals, creating an undefined one if there is no such variable. Slots
+ * persist across compilations, so that the REPL can refer to (and redefine)
+ * the variables of previous lines. */
+uint32_t vm_global_slot(StringObj* name);
+
 /** gc_empty: check if the BFS array used by gc is empty.  */
 bool gc_empty();
 
@@ -141,4 +245,37 @@ Obj* gc_pop();
 /** gc_push: Add a new object to the BFS array. */
 void gc_push(Obj*);
 
+/** gc_remember: Add an old object to the remembered set. */
+void gc_remember(Obj*);
+
+/** gc_write_barrier: to be called when a reference to @value is stored in
+ * the object @owner. The old objects referring to young ones are remembered,
+ * so that minor collections find the young objects through them. */
+static inline void gc_write_barrier(Obj* owner, Value value) {
+#ifdef CONCURRENT_GC
+  // the marks belong to the marking thread while it runs: every object given
+  // a reference is remembered, for the final pause to traverse it again.
+  if (vm.gc.phase == GC_MARKING) {
+    if (IS_OBJ(value))
+      gc_remember(owner);
+    return;
+  }
+#endif
+  if (gc_is_marked(owner) && IS_OBJ(value) && !gc_is_marked(AS_OBJ(value)))
+    gc_remember(owner);
+}
+
+/** gc_write_barrier_any: gc_write_barrier() for stores of any values in the
+ * object @owner. */
+static inline void gc_write_barrier_any(Obj* owner) {
+#ifdef CONCURRENT_GC
+  if (vm.gc.phase == GC_MARKING) {
+    gc_remember(owner);
+    return;
+  }
+#endif
+  if (gc_is_marked(owner))
+    gc_remember(owner);
+}
+
 #endif
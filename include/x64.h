@@ -0,0 +1,199 @@
+#ifndef X64_H
+#define X64_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "value.h"
+
+/** An assembler of x86-64 machine code, shared by the JITs (see jit.h and
+ * trace.h).
+ *
+ * Code is emitted in a growing buffer, then copied to executable memory by
+ * x64_install(). Jumps either go to a label, an index the user of the
+ * assembler gives a meaning to and binds to a position of the code, or
+ * forward to a position set later with x64_patch_here().
+ *
+ * The templates of values assume that, with NAN_BOXING, @r14 holds QNAN.
+ * */
+
+enum {
+  RAX,
+  RCX,
+  RDX,
+  RBX,
+  RSP,
+  RBP,
+  RSI,
+  RDI,
+  R8,
+  R9,
+  R10,
+  R11,
+  R12,
+  R13,
+  R14,
+  R15,
+};
+
+#define XMM0 0
+#define XMM1 1
+
+// condition codes of jcc and setcc
+enum {
+  CC_E = 0x4,
+  CC_NE = 0x5,
+  CC_BE = 0x6,
+  CC_A = 0x7,
+  CC_P = 0xa,
+  CC_NP = 0xb,
+};
+
+#define VALUE_SIZE ((int32_t)sizeof(Value))
+#ifdef NAN_BOXING
+#define NUMBER_OFFSET 0
+#else
+#define NUMBER_OFFSET ((int32_t)offsetof(Value, as.number))
+#define TYPE_OFFSET ((int32_t)offsetof(Value, type))
+#endif
+
+#define LABEL_UNBOUND UINT32_MAX
+
+/* X64Jump: a rel32 operand at @pos of the code to patch with the position of
+ * @label once all of the code is emitted. */
+typedef struct {
+  size_t pos;
+  uint32_t label;
+} X64Jump;
+
+typedef struct {
+  uint8_t* code;
+  size_t size;
+  size_t capacity;
+
+  X64Jump* jumps;
+  uint32_t jump_count;
+  uint32_t jump_capacity;
+
+  // the position in @code of each label, LABEL_UNBOUND until bound.
+  uint32_t* labels;
+  uint32_t label_count;
+
+  // set once a buffer couldn't grow: the rest of the code is dropped, and
+  // x64_link() fails so that the compilation is abandoned.
+  bool failed;
+} Assembler;
+
+/* x64_init: start an empty assembler with @label_count unbound labels. */
+void x64_init(Assembler* as, uint32_t label_count);
+void x64_free(Assembler* as);
+
+/* x64_bind: make @label refer to the current position of the code. */
+void x64_bind(Assembler* as, uint32_t label);
+
+/* x64_link: set the jumps to labels, once all of the code is emitted.
+ * return false if a jump goes to an unbound label, or if the assembler ran
+ * out of memory. */
+bool x64_link(Assembler* as);
+
+/* x64_install: copy the code to new executable memory of as->size bytes.
+ * return NULL on failure. */
+void* x64_install(Assembler* as);
+void x64_uninstall(void* code, size_t size);
+
+/** Instructions. */
+
+void x64_byte(Assembler* as, uint8_t byte);
+void x64_u32(Assembler* as, uint32_t value);
+void x64_u64(Assembler* as, uint64_t value);
+
+/* x64_op_mem: the instruction @opcode (of one or two bytes, after @prefix
+ * if it isn't 0) on the register @reg and the memory operand
+ * [@base + @disp]. */
+void x64_op_mem(Assembler* as,
+                uint8_t prefix,
+                bool wide,
+                uint16_t opcode,
+                int reg,
+                int base,
+                int32_t disp);
+
+/* x64_op_regs: the instruction @opcode, as in x64_op_mem(), on the
+ * registers @reg (in ModRM.reg) and @rm. */
+void x64_op_regs(Assembler* as,
+                 uint8_t prefix,
+                 bool wide,
+                 uint16_t opcode,
+                 int reg,
+                 int rm);
+
+/* x64_op_reg: the 64-bit instruction @opcode on the registers @reg (in
+ * ModRM.reg) and @rm. */
+void x64_op_reg(Assembler* as, uint8_t opcode, int reg, int rm);
+
+void x64_load(Assembler* as, int reg, int base, int32_t disp);
+void x64_store(Assembler* as, int base, int32_t disp, int reg);
+void x64_lea(Assembler* as, int reg, int base, int32_t disp);
+void x64_mov(Assembler* as, int dst, int src);
+void x64_mov_imm64(Assembler* as, int reg, uint64_t imm);
+// zero-extended to 64 bits
+void x64_mov_imm32(Assembler* as, int reg, uint32_t imm);
+void x64_cmp(Assembler* as, int left, int right);
+void x64_test(Assembler* as, int reg);
+void x64_call(Assembler* as, void* function);
+
+/* x64_setcc: set @al to 1 if the condition @cc holds, 0 otherwise. */
+void x64_setcc(Assembler* as, uint8_t cc);
+
+void x64_jmp(Assembler* as, uint32_t label);
+void x64_jcc(Assembler* as, uint8_t cc, uint32_t label);
+
+/* x64_jcc_forward: a jump to some later position of the code, to be set
+ * with x64_patch_here(). Return the position of the operand. */
+size_t x64_jcc_forward(Assembler* as, uint8_t cc);
+size_t x64_jmp_forward(Assembler* as);
+void x64_patch_here(Assembler* as, size_t pos);
+
+/* x64_push_frame: save the callee-saved registers, then reserve @size bytes
+ * of the machine stack, which keeps it aligned on 16 bytes if @size is 8
+ * modulo 16. x64_pop_frame() undoes it and returns. */
+void x64_push_frame(Assembler* as, int32_t size);
+void x64_pop_frame(Assembler* as, int32_t size);
+
+/** Templates of values.
+ *
+ * A Value is copied in 8-byte words through @rdx, which is never used to
+ * address memory by the templates.
+ * */
+
+void x64_copy_value(Assembler* as,
+                    int dst_base,
+                    int32_t dst_disp,
+                    int src_base,
+                    int32_t src_disp);
+void x64_store_value(Assembler* as, int base, int32_t disp, Value value);
+
+/* x64_check_number: jump forward if the value at [@base + @disp] isn't a
+ * number. Return the position of the jump's operand. */
+size_t x64_check_number(Assembler* as, int base, int32_t disp);
+
+/* x64_guard_number: jump to @label if the value at [@base + @disp] isn't a
+ * number. */
+void x64_guard_number(Assembler* as, int base, int32_t disp, uint32_t label);
+
+/* x64_store_bool: store the boolean in @al at [@base + @disp]. */
+void x64_store_bool(Assembler* as, int base, int32_t disp);
+
+/* x64_store_number: store the number in @xmm at [@base + @disp]. */
+void x64_store_number(Assembler* as, int base, int32_t disp, int xmm);
+
+// the number of the Value at [@base + @disp]
+void x64_movsd_load(Assembler* as, int xmm, int base, int32_t disp);
+void x64_movsd_store(Assembler* as, int base, int32_t disp, int xmm);
+
+/* x64_ucomisd: compare the number in @xmm with the one of the Value at
+ * [@base + @disp]. */
+void x64_ucomisd(Assembler* as, int xmm, int base, int32_t disp);
+
+#endif
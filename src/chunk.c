@@ -30,6 +30,9 @@ void chunk_init(Chunk* chunk) {
   chunk->bytecodes = NULL;
   chunk->current_line = 0;
   chunk->line_tracker = NULL;
+  chunk->caches = NULL;
+  chunk->cache_count = 0;
+  chunk->cache_capacity = 0;
   value_arr_init(&(chunk->constants));
 }
 
@@ -39,6 +42,7 @@ void chunk_free(Chunk* chunk) {
   }
 
   value_arr_free(&(chunk->constants));
+  FREE_ARRAY(InlineCache, chunk->caches, chunk->cache_capacity);
   chunk_init(chunk);
 
   while (chunk->line_tracker != NULL) {
@@ -131,3 +135,53 @@ void chunk_write_load_const(Chunk* chunk, Value value, uint16_t line) {
 bool chunk_const_pool_is_full(Chunk* chunk) {
   return (chunk->constants.size >= CHUNK_CONST_POOL_MAX);
 }
+
+void chunk_truncate(Chunk* chunk, uint32_t size, uint32_t const_count) {
+  assert(size <= chunk->size && const_count <= chunk->constants.size);
+  chunk->size = size;
+  chunk->constants.size = const_count;
+
+  // the line tracker is ordered from the last bytecode to the first one.
+  while (chunk->line_tracker != NULL && chunk->line_tracker->pos >= size) {
+    BytecodeLine* deleted = chunk->line_tracker;
+    chunk->line_tracker = chunk->line_tracker->next;
+    free(deleted);
+  }
+}
+
+uint32_t chunk_add_cache(Chunk* chunk) {
+  if (chunk->cache_count >= CHUNK_CACHE_MAX)
+    return CHUNK_CACHE_MAX;
+
+  if (chunk->cache_count == chunk->cache_capacity) {
+    uint32_t new_cap = GROW_CAPACITY(chunk->cache_capacity);
+    chunk->caches = GROW_ARRAY(InlineCache, chunk->caches,
+                               chunk->cache_capacity, new_cap);
+    chunk->cache_capacity = new_cap;
+  }
+
+  // reallocate() zeroes the new caches.
+  uint32_t index = chunk->cache_count;
+  GC_PUBLISH(chunk->cache_count, index + 1);
+  return index;
+}
+
+Opcode opcode_generic(Opcode opcode) {
+  switch (opcode) {
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+      return OP_ADD;
+    case OP_SUBTRACT_NUM:
+      return OP_SUBTRACT;
+    case OP_MUL_NUM:
+      return OP_MUL;
+    case OP_DIV_NUM:
+      return OP_DIV;
+    case OP_LESS_NUM:
+      return OP_LESS;
+    case OP_GREATER_NUM:
+      return OP_GREATER;
+    default:
+      return opcode;
+  }
+}
@@ -8,6 +8,7 @@
 #include "chunk.h"
 #include "memory.h"
 #include "object.h"
+#include "peephole.h"
 #include "scanner.h"
 #include "value.h"
 #include "vm.h"
@@ -82,6 +83,69 @@ typedef struct Upvalue {
   bool long_offset;
 } Upvalue;
 
+/* ConstLoad: an instruction loading a constant, e.g. OP_CONST or OP_TRUE.
+ *
+ * @start: position of the instruction in the chunk.
+ * @end: position of the next instruction, or NO_CONST_LOAD if there is no
+ * recorded instruction.
+ * @const_count: size of the constant pool before the instruction was emitted.
+ * @value: the loaded constant.
+ */
+typedef struct ConstLoad {
+  uint32_t start;
+  uint32_t end;
+  uint32_t const_count;
+  Value value;
+} ConstLoad;
+
+#define NO_CONST_LOAD UINT32_MAX
+
+/* RegExpr: where the register emitter left the value of the expression it
+ * compiled last.
+ *
+ * @reg: the register holding the value.
+ * @temp: whether @reg is a temporary, otherwise it's a local variable. A
+ * temporary is always the topmost register in use.
+ * @start: position of the instructions computing the value into @reg, or
+ * NO_REG_INST if they are not known.
+ * @dst_pos: position of the operand naming @reg in the last of these
+ * instructions, or NO_REG_INST. While @end is the end of the chunk, the
+ * value can be computed into another register by rewriting the operand (see
+ * reg_move()).
+ * @jump_op: if the value is a comparison of @left and @right, the
+ * compare-and-jump instruction jumping when it is false. OP_R_JMP_IF_FALSE
+ * otherwise.
+ * @right_load: position of the OP_R_LOADK loading @right right before the
+ * comparison, or NO_REG_INST. The jump then compares with the constant.
+ */
+typedef struct RegExpr {
+  uint8_t reg;
+  bool temp;
+  uint32_t start;
+  uint32_t dst_pos;
+  uint32_t end;
+  Opcode jump_op;
+  uint8_t left;
+  uint8_t right;
+  uint32_t right_load;
+} RegExpr;
+
+#define NO_REG_INST UINT32_MAX
+
+/* PendingRead: a read of the local in register @local that the register
+ * emitter postpones to the instruction consuming it, e.g. the left operand of
+ * a binary operation while the right one is compiled.
+ *
+ * Code compiled in between may write the local (assignments, and calls
+ * through upvalues). Before such code, the local is copied into the
+ * temporary @copy reserved for it and @copied is set, the consuming
+ * instruction then reads the copy. */
+typedef struct PendingRead {
+  uint8_t local;
+  uint8_t copy;
+  bool copied;
+} PendingRead;
+
 /* Compiler: stores states during the compilation process
  * of a function or the global script, which also can be
  * considered as a function. it mimicks the VM's behavior
@@ -97,6 +161,18 @@ typedef struct Compiler {
   Upvalue upvalues[MAX_UPVALUE];
   int upval_count;
   Loop* loops;
+
+  // the last constant load emitted, used to fold the expressions whose
+  // operands are all constants (see binary() and unary()).
+  ConstLoad last_const;
+
+  // state of the register emitter. Local variable i lives in register i and
+  // temporaries are allocated as a stack above the locals.
+  int free_reg;   // the first register holding neither a local nor a temporary
+  int reg_count;  // the number of registers a frame of the function needs
+  RegExpr expr;   // the expression compiled last
+  PendingRead pending[MAX_LOCALVAR];
+  int pending_count;
 } Compiler;
 
 /* ClassCompiler: track the information of the current class
@@ -158,10 +234,28 @@ static void super_();
 static void emit_get_variable(uint32_t name_offset);
 static bool emit_get_either_local_or_upval(Token name);
 static void emit_op_get_global(uint32_t iden_offset);
+static void emit_global_inst(Opcode opcode,
+                             Opcode long_opcode,
+                             uint32_t name_offset);
 static void emit_op_get_local(uint32_t stack_index);
 static void emit_op_get_upvalue(uint32_t upvalue_index);
 static void emit_implicit_ret();
 static void end_scope();
+static void reg_declaration();
+static void reg_stmt();
+static void reg_dot();
+static void reg_unary();
+static void reg_binary();
+static void reg_number();
+static void reg_literal();
+static void reg_string();
+static void reg_variable();
+static void reg_assignment();
+static void reg_and();
+static void reg_or();
+static void reg_call();
+static void reg_this();
+static void reg_super();
 
 /* parse_rules: a mapping from operators to appropiate parsing rules */
 ParseRule parse_rules[] = {
@@ -207,15 +301,68 @@ ParseRule parse_rules[] = {
     [TK_EOF] = {NULL, NULL, PREC_NONE},
 };
 
+/* reg_parse_rules: the rules of parse_rules emitting the register engine's
+ * instructions instead */
+ParseRule reg_parse_rules[] = {
+    [TK_TRUE] = {reg_literal, NULL, PREC_PRIMARY},
+    [TK_FALSE] = {reg_literal, NULL, PREC_PRIMARY},
+    [TK_NIL] = {reg_literal, NULL, PREC_PRIMARY},
+    [TK_LEFT_PAREN] = {grouping, reg_call, PREC_CALL},
+    [TK_RIGHT_PAREN] = {NULL, NULL, PREC_NONE},
+    [TK_LEFT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TK_RIGHT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TK_COMMA] = {NULL, NULL, PREC_NONE},
+    [TK_DOT] = {NULL, reg_dot, PREC_CALL},
+    [TK_MINUS] = {reg_unary, reg_binary, PREC_TERM},
+    [TK_PLUS] = {NULL, reg_binary, PREC_TERM},
+    [TK_SEMICOLON] = {NULL, NULL, PREC_NONE},
+    [TK_SLASH] = {NULL, reg_binary, PREC_FACTOR},
+    [TK_STAR] = {NULL, reg_binary, PREC_FACTOR},
+    [TK_BANG] = {reg_unary, NULL, PREC_UNARY},
+    [TK_BANG_EQUAL] = {NULL, reg_binary, PREC_EQUALITY},
+    [TK_EQUAL] = {NULL, reg_assignment, PREC_ASSIGNMENT},
+    [TK_EQUAL_EQUAL] = {NULL, reg_binary, PREC_EQUALITY},
+    [TK_GREATER] = {NULL, reg_binary, PREC_COMPARISON},
+    [TK_GREATER_EQUAL] = {NULL, reg_binary, PREC_COMPARISON},
+    [TK_LESS] = {NULL, reg_binary, PREC_COMPARISON},
+    [TK_LESS_EQUAL] = {NULL, reg_binary, PREC_COMPARISON},
+    [TK_IDENTIFIER] = {reg_variable, NULL, PREC_NONE},
+    [TK_STRING] = {reg_string, NULL, PREC_PRIMARY},
+    [TK_NUMBER] = {reg_number, NULL, PREC_PRIMARY},
+    [TK_AND] = {NULL, reg_and, PREC_AND},
+    [TK_CLASS] = {NULL, NULL, PREC_NONE},
+    [TK_ELSE] = {NULL, NULL, PREC_NONE},
+    [TK_FOR] = {NULL, NULL, PREC_NONE},
+    [TK_FUN] = {NULL, NULL, PREC_NONE},
+    [TK_IF] = {NULL, NULL, PREC_NONE},
+    [TK_OR] = {NULL, reg_or, PREC_OR},
+    [TK_PRINT] = {NULL, NULL, PREC_NONE},
+    [TK_RETURN] = {NULL, NULL, PREC_NONE},
+    [TK_SUPER] = {reg_super, NULL, PREC_NONE},
+    [TK_THIS] = {reg_this, NULL, PREC_NONE},
+    [TK_VAR] = {NULL, NULL, PREC_NONE},
+    [TK_WHILE] = {NULL, NULL, PREC_NONE},
+    [TK_ERROR] = {NULL, NULL, PREC_NONE},
+    [TK_EOF] = {NULL, NULL, PREC_NONE},
+};
+
 Parser parser;
 Chunk* compiling_chunk;
 Compiler* current = NULL;
 ClassCompiler* cur_cls = NULL;
 
+void compiler_reset() {
+  current = NULL;
+  cur_cls = NULL;
+}
+
 bool mark_compiler_roots() {
   Compiler* compiler_it = current;
   while (compiler_it != NULL) {
     mark_object((Obj*)compiler_it->function);
+    // the function is written without write barriers until it is compiled,
+    // then remembered by end_compiler() if it is old.
+    gc_remember((Obj*)compiler_it->function);
     compiler_it = compiler_it->enclosing;
   }
 
@@ -291,6 +438,8 @@ static void compiler_init(Compiler* compiler, FunctionType type) {
   }
   compiler->upval_count = 0;
   compiler->loops = NULL;
+  compiler->last_const.end = NO_CONST_LOAD;
+  compiler->pending_count = 0;
   current = compiler;
 
   // reserve the first slot for VM's internal use
@@ -299,6 +448,11 @@ static void compiler_init(Compiler* compiler, FunctionType type) {
   } else {
     add_local(SYNTHETIC_TK_PLACEHOLDER);
   }
+  compiler->free_reg = compiler->local_count;
+  compiler->reg_count = compiler->local_count;
+  compiler->expr = (RegExpr){.dst_pos = NO_REG_INST,
+                             .jump_op = OP_R_JMP_IF_FALSE,
+                             .right_load = NO_REG_INST};
 }
 
 void parser_init() {
@@ -329,6 +483,28 @@ static void emit_param_inst(Opcode opcode, uint32_t param, uint8_t param_sz) {
   emit_bytes(&param, param_sz);
 }
 
+/** @emit_cache_slot: allocate an inline cache for the property access
+ * @opcode being emitted and write its offset as the instruction's operand.
+ * */
+static void emit_cache_slot(Opcode opcode, uint32_t name_offset) {
+  uint32_t cache_offset = chunk_add_cache(current_chunk());
+  if (cache_offset == CHUNK_CACHE_MAX) {
+    error(&parser.prev, "Too many property accesses in one function.");
+    return;
+  }
+
+#ifdef DBG_IC_STATS
+  InlineCache* cache = &current_chunk()->caches[cache_offset];
+  cache->opcode = opcode;
+  cache->name_offset = name_offset;
+  cache->line = parser.prev.line;
+#else
+  (void)opcode;
+  (void)name_offset;
+#endif
+  emit_bytes(&cache_offset, CACHE_OFFSET_SIZE);
+}
+
 static uint32_t emit_jump(Opcode jmp_opcode) {
   emit_byte(jmp_opcode);
   // parameter's starting position
@@ -435,12 +611,21 @@ static ClosureObj* end_compiler() {
 
   FunctionObj* function = current->function;
   function->upval_count = current->upval_count;
+  function->reg_count = current->reg_count;
+#ifndef DISABLE_PEEPHOLE
+  // jumps may be left unpatched if there was a parse error.
+  if (!parser.error && vm.engine == ENGINE_STACK)
+    peephole_optimize(&function->chunk);
+#endif
 #ifdef DBG_DISASSEMBLE
   /* Print the instruction to be executed */
   disassemble_chunk(&function->chunk,
                     function->name == NULL ? "script" : function->name->chars);
 #endif
   ClosureObj* closure = ClosureObj_construct(function);
+  // the constants added since the last collection may be young, see
+  // mark_compiler_roots().
+  gc_write_barrier_any(&function->obj);
 
   // continue compiling the enclosing function
   // Calling ClosureObj_construct may trigger the garbage collector,
@@ -451,6 +636,8 @@ static ClosureObj* end_compiler() {
 }
 
 static ParseRule* get_rule(TokenType op) {
+  if (vm.engine == ENGINE_REGISTER)
+    return &(reg_parse_rules[op]);
   return &(parse_rules[op]);
 }
 
@@ -560,10 +747,8 @@ static void assignment() {
     emit_param_inst(OP_SET_UPVAL, upvalue_index, 1);
   else if (upvalue_index != -1)
     emit_param_inst(OP_SET_UPVAL_LONG, upvalue_index, LONG_UPVAL_OFFSET_SIZE);
-  else if (iden_offset <= UINT8_MAX)
-    emit_param_inst(OP_SET_GLOBAL, iden_offset, 1);
   else
-    emit_param_inst(OP_SET_GLOBAL_LONG, iden_offset, LONG_CONST_OFFSET_SIZE);
+    emit_global_inst(OP_SET_GLOBAL, OP_SET_GLOBAL_LONG, iden_offset);
 }
 
 static void emit_get_variable(uint32_t name_offset) {
@@ -608,6 +793,11 @@ static bool emit_get_either_local_or_upval(Token name) {
 }
 
 static void declaration() {
+  if (vm.engine == ENGINE_REGISTER) {
+    reg_declaration();
+    return;
+  }
+
   if (match(TK_VAR))
     var_declaration();
   else if (match(TK_FUN))
@@ -627,6 +817,11 @@ static uint16_t patch_jump(uint32_t jmp_param_pos) {
   uint32_t jump_pos = jmp_param_pos + 2;
   uint32_t dest = current_chunk()->size;
   uint32_t jump_dist = dest - jump_pos;
+
+  // the code before @dest may be entered from elsewhere, it can't be folded
+  // into a constant anymore.
+  current->last_const.end = NO_CONST_LOAD;
+
   if (jump_dist >= UINT16_MAX) {
     error(&parser.prev, "Too much bytecodes to jump.");
     return 0;
@@ -767,12 +962,20 @@ static void end_scope() {
   /** Remove all current scope's local variable representations
    *  from @current->locals.
    */
+  int first_captured = -1;
   for (Local* local_it = &current->locals[current->local_count - 1];
        local_it >= (struct Local*)&current->locals; local_it--) {
     if (local_it->depth != -1 && local_it->depth < current->scope_depth)
       break;
     current->local_count--;
 
+    // registers need no popping, only the captured ones are closed below.
+    if (vm.engine == ENGINE_REGISTER) {
+      if (local_it->captured)
+        first_captured = current->local_count;
+      continue;
+    }
+
     // Local variables are looked up in the virtual machine's stack
     // so we need to add a pop instruction corresponding to each local
     // variable
@@ -783,6 +986,11 @@ static void end_scope() {
     }
   }
 
+  if (first_captured != -1) {
+    emit_byte(OP_R_CLOSE_UPVAL);
+    emit_byte(first_captured);
+  }
+  current->free_reg = current->local_count;
   current->scope_depth--;
 }
 
@@ -956,10 +1164,7 @@ static void define_variable(uint32_t offset) {
     // value array of the current scope.
     return;
   }
-  if (offset <= UINT8_MAX)
-    emit_param_inst(OP_DEFINE_GLOBAL, offset, 1);
-  else
-    emit_param_inst(OP_DEFINE_GLOBAL_LONG, offset, LONG_CONST_OFFSET_SIZE);
+  emit_global_inst(OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, offset);
 }
 
 /* parse_identifier: parse the identifier. If the current token is
@@ -1147,6 +1352,11 @@ static void return_stmt() {
 
 // parse statements that are not declaration type
 static void stmt() {
+  if (vm.engine == ENGINE_REGISTER) {
+    reg_stmt();
+    return;
+  }
+
   if (match(TK_PRINT))
     print_stmt();
   else if (match(TK_LEFT_BRACE))
@@ -1167,32 +1377,137 @@ static void stmt() {
     expression_stmt();
 }
 
+/* emit_const_load: emit the instruction loading the constant @value and
+ * record it as the last constant load of the current function. */
+static void emit_const_load(Value value) {
+  ConstLoad load = {.start = current_chunk()->size,
+                    .const_count = current_chunk()->constants.size,
+                    .value = value};
+  if (IS_BOOL(value))
+    emit_byte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+  else if (IS_NIL(value))
+    emit_byte(OP_NIL);
+  else
+    emit_const_inst(value);
+
+  load.end = current_chunk()->size;
+  current->last_const = load;
+}
+
+/* fold_const: replace the constant loads emitted from @start onward, which
+ * were recorded when the constant pool had @const_count constants, by a
+ * single load of @value. */
+static void fold_const(uint32_t start, uint32_t const_count, Value value) {
+  // nothing is allocated before emit_const_inst() roots @value, which may be
+  // a new string that is not referenced anywhere yet.
+  chunk_truncate(current_chunk(), start, const_count);
+  emit_const_load(value);
+}
+
+/* fold_unary: evaluate the unary operation @op on the constant @operand.
+ *
+ * return value: false if the operation is left to the VM, e.g. because it
+ * fails at runtime. */
+static bool fold_unary(TokenType op, Value operand, Value* result) {
+  switch (op) {
+    case TK_MINUS:
+      if (!IS_NUMBER(operand))
+        return false;
+      *result = NUMBER_VAL(-AS_NUMBER(operand));
+      return true;
+    case TK_BANG: {
+      bool falsey = IS_NIL(operand) || (IS_BOOL(operand) && !AS_BOOL(operand));
+      *result = BOOL_VAL(falsey);
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+/* fold_binary: evaluate the binary operation @op on the constants @left and
+ * @right, exactly as the instructions emitted for @op would do at runtime.
+ *
+ * return value: false if the operation is left to the VM, e.g. because it
+ * fails at runtime. */
+static bool fold_binary(TokenType op, Value left, Value right, Value* result) {
+  if (op == TK_EQUAL_EQUAL || op == TK_BANG_EQUAL) {
+    bool equal = value_equal(left, right);
+    *result = BOOL_VAL(op == TK_EQUAL_EQUAL ? equal : !equal);
+    return true;
+  }
+
+  if (op == TK_PLUS && IS_STRING_OBJ(left) && IS_STRING_OBJ(right)) {
+    *result = OBJ_VAL(*StringObj_concat(AS_STRING(left), AS_STRING(right)));
+    return true;
+  }
+
+  if (!IS_NUMBER(left) || !IS_NUMBER(right))
+    return false;
+
+  double a = AS_NUMBER(left);
+  double b = AS_NUMBER(right);
+  bool cmp;
+  switch (op) {
+    case TK_PLUS:
+      *result = NUMBER_VAL(a + b);
+      return true;
+    case TK_MINUS:
+      *result = NUMBER_VAL(a - b);
+      return true;
+    case TK_STAR:
+      *result = NUMBER_VAL(a * b);
+      return true;
+    case TK_SLASH:
+      *result = NUMBER_VAL(a / b);
+      return true;
+    // <= and >= are compiled to the negation of > and <, which differs from
+    // the comparison itself if an operand is NaN.
+    case TK_LESS:
+      cmp = a < b;
+      break;
+    case TK_GREATER:
+      cmp = a > b;
+      break;
+    case TK_LESS_EQUAL:
+      cmp = !(a > b);
+      break;
+    case TK_GREATER_EQUAL:
+      cmp = !(a < b);
+      break;
+    default:
+      return false;
+  }
+  *result = BOOL_VAL(cmp);
+  return true;
+}
+
 /** number: take the consumed token (@parser.prev) and 'transform' it into
  * a constant-load instruction
  * */
 static void number() {
   double literal = strtod(parser.prev.start, NULL);
   Value num = NUMBER_VAL(literal);
-  emit_const_inst(num);
+  emit_const_load(num);
 }
 
 static void string() {
   /* Create a string object in heap memory */
   StringObj* str_obj =
       StringObj_construct(parser.prev.start, parser.prev.length);
-  emit_const_inst(OBJ_VAL(str_obj->obj));
+  emit_const_load(OBJ_VAL(str_obj->obj));
 }
 
 static void literal() {
   switch (parser.prev.type) {
     case TK_TRUE:
-      emit_byte(OP_TRUE);
+      emit_const_load(BOOL_VAL(true));
       break;
     case TK_FALSE:
-      emit_byte(OP_FALSE);
+      emit_const_load(BOOL_VAL(false));
       break;
     case TK_NIL:
-      emit_byte(OP_NIL);
+      emit_const_load(NIL_VAL());
       break;
     default:
       return;
@@ -1202,8 +1517,19 @@ static void literal() {
 /* unary(): parse the unary expression */
 static void unary() {
   Token op = parser.prev;
+  uint32_t operand_start = current_chunk()->size;
   parse_precedence(PREC_UNARY);
 
+  // fold the operation if the operand is a constant
+  ConstLoad operand = current->last_const;
+  Value folded;
+  if (operand.start == operand_start &&
+      operand.end == current_chunk()->size &&
+      fold_unary(op.type, operand.value, &folded)) {
+    fold_const(operand.start, operand.const_count, folded);
+    return;
+  }
+
   switch (op.type) {
     case TK_MINUS:
       emit_byte(OP_NEGATE);
@@ -1226,17 +1552,46 @@ static void grouping() {
 static void binary() {
   Token op = parser.prev;
 
+  // the left operand is a constant if it is the last thing emitted
+  ConstLoad left = current->last_const;
+  bool left_const = left.end == current_chunk()->size;
+
   // get the precedence of the consumed operator
   Precedence op_prec = get_rule(op.type)->prec;
   parse_precedence(op_prec + 1);  // parse the next term
 
+  // fold the operation if both operands are constants
+  ConstLoad right = current->last_const;
+  Value folded;
+  if (left_const && right.start == left.end &&
+      right.end == current_chunk()->size &&
+      fold_binary(op.type, left.value, right.value, &folded)) {
+    fold_const(left.start, left.const_count, folded);
+    parser.prev_prec = op_prec;
+    return;
+  }
+
   switch (op.type) {
     /* We use chunk_append here because there are some cases where the operator
      * and its operands do not lie on the same line. If an error occurs, we
      * have to report the exact line on which a token is. */
-    case TK_PLUS:
-      chunk_append(current_chunk(), OP_ADD, op.line);
+    case TK_PLUS: {
+      // the operands of a chain of + are added by a single OP_CONCAT_N, so
+      // that strings are concatenated at once. They are all evaluated
+      // before a type error is reported.
+      int count = 2;
+      while (count < UINT8_MAX && match(TK_PLUS)) {
+        parse_precedence(PREC_TERM + 1);
+        count++;
+      }
+      if (count == 2) {
+        chunk_append(current_chunk(), OP_ADD, op.line);
+      } else {
+        chunk_append(current_chunk(), OP_CONCAT_N, op.line);
+        chunk_append(current_chunk(), count, op.line);
+      }
       break;
+    }
     case TK_MINUS:
       chunk_append(current_chunk(), OP_SUBTRACT, op.line);
       break;
@@ -1290,64 +1645,1054 @@ static void dot() {
     uint32_t iden_offset_size =
         (iden_offset <= UINT8_MAX) ? 1 : LONG_CONST_OFFSET_SIZE;
     emit_param_inst(inst, iden_offset, iden_offset_size);
+    emit_cache_slot(inst, iden_offset);
   } else if (match(TK_LEFT_PAREN)) {
     int param_count = parameter_list();
     emit_byte(OP_INVOKE);
     emit_byte(iden_offset);
     emit_byte(param_count);
+    emit_cache_slot(OP_INVOKE, iden_offset);
   } else {
     Opcode inst =
         (iden_offset <= UINT8_MAX) ? OP_GET_PROPERTY : OP_GET_PROPERTY_LONG;
     uint32_t iden_offset_size =
         (iden_offset <= UINT8_MAX) ? 1 : LONG_CONST_OFFSET_SIZE;
     emit_param_inst(inst, iden_offset, iden_offset_size);
+    emit_cache_slot(inst, iden_offset);
   }
 }
 
-// compile: parse the source and emit bytecodes.
-// return value: Closure object that contains the top-level code
-ClosureObj* compile(const char* source) {
-  scanner_init(source);
-  parser_init();
-  Compiler compiler;
-  compiler_init(&compiler, TYPE_SCRIPT);
+/* ========================= Register engine =========================
+ *
+ * The functions below emit the instructions of the register engine (see
+ * run_register() in vm.c) and are used in place of the ones above when
+ * vm.engine is ENGINE_REGISTER. They share the parser, the scopes and the
+ * resolution of variables with the stack emitter.
+ *
+ * Local variable i lives in register i, so reading a local emits nothing.
+ * Every other value is computed into a temporary, allocated right above the
+ * locals and the temporaries in use, which are all released at the end of
+ * the statement. Each expression leaves its result in @current->expr (see
+ * RegExpr), from which the enclosing expression picks its operands.
+ * */
 
-  // tell the parser to look at the very first token, but not consume it yet
-  advance();
+/* reg_alloc: allocate a temporary on top of the registers in use. */
+static uint8_t reg_alloc() {
+  if (current->free_reg > UINT8_MAX) {
+    error(&parser.prev, "Too many registers in one function.");
+    return UINT8_MAX;
+  }
 
-  while (!match(TK_EOF))
-    declaration();
-  scanner_free();
-  parser_free();
-  ClosureObj* closure = end_compiler();
-  return parser.error ? NULL : closure;
+  uint8_t reg = current->free_reg++;
+  if (current->free_reg > current->reg_count)
+    current->reg_count = current->free_reg;
+  return reg;
 }
 
-static void emit_op_get_global(uint32_t offset) {
-  if (offset <= UINT8_MAX)
-    emit_param_inst(OP_GET_GLOBAL, offset, 1);
-  else
-    emit_param_inst(OP_GET_GLOBAL_LONG, offset, LONG_CONST_OFFSET_SIZE);
+/* reg_add_local: declare the local variable @name in the current scope.
+ * Its register is the one right above the previous locals, i.e, the first
+ * temporary of the statement, which holds the variable's initial value. */
+static uint8_t reg_add_local(Token name) {
+  declare_variable(name);
+  current->free_reg = current->local_count;
+  if (current->free_reg > current->reg_count)
+    current->reg_count = current->free_reg;
+  return current->local_count - 1;
 }
 
-static void emit_op_get_upvalue(uint32_t upvalue_index) {
-  if (upvalue_index <= UINT8_MAX)
-    emit_param_inst(OP_GET_UPVAL, (uint32_t)upvalue_index, 1);
-  else
-    emit_param_inst(OP_GET_UPVAL_LONG, (uint32_t)upvalue_index,
-                    LONG_UPVAL_OFFSET_SIZE);
+static void reg_set_local(uint8_t reg) {
+  current->expr = (RegExpr){.reg = reg,
+                            .temp = false,
+                            .start = NO_REG_INST,
+                            .dst_pos = NO_REG_INST,
+                            .jump_op = OP_R_JMP_IF_FALSE,
+                            .right_load = NO_REG_INST};
 }
 
-static void emit_op_get_local(uint32_t stack_index) {
-  if (stack_index <= UINT8_MAX)
-    emit_param_inst(OP_GET_LOCAL, (uint32_t)stack_index, 1);
-  else
-    emit_param_inst(OP_GET_LOCAL_LONG, (uint32_t)stack_index,
-                    LONG_LOCAL_OFFSET_SIZE);
+/* reg_free_temps: release the temporaries at the end of a statement. The
+ * last expression is reset too, as an expression that fails to parse leaves
+ * it untouched. */
+static void reg_free_temps() {
+  current->free_reg = current->local_count;
+  current->pending_count = 0;
+  reg_set_local(0);
 }
 
-// emit implicit return
-static void emit_implicit_ret() {
+/* reg_set_temp: record that the last expression was computed into the
+ * temporary @reg by the instructions from @start to the end of the chunk,
+ * the last one naming @reg at @dst_pos. */
+static void reg_set_temp(uint8_t reg, uint32_t start, uint32_t dst_pos) {
+  current->expr = (RegExpr){.reg = reg,
+                            .temp = true,
+                            .start = start,
+                            .dst_pos = dst_pos,
+                            .end = current_chunk()->size,
+                            .jump_op = OP_R_JMP_IF_FALSE,
+                            .right_load = NO_REG_INST};
+}
+
+static bool reg_relocatable(RegExpr expr) {
+  return expr.temp && expr.dst_pos != NO_REG_INST &&
+         expr.end == current_chunk()->size;
+}
+
+static void emit_short(uint32_t value) {
+  emit_bytes(&value, 2);
+}
+
+/* reg_check_short: check that the constant offset or global slot @operand
+ * fits in the 2-byte operands of the register engine. */
+static uint16_t reg_check_short(uint32_t operand, const char* msg) {
+  if (operand > UINT16_MAX) {
+    error(&parser.prev, msg);
+    return 0;
+  }
+  return operand;
+}
+
+static uint16_t reg_make_const(Value value) {
+  return reg_check_short(chunk_add_const(current_chunk(), value),
+                         "Too many constants in one function.");
+}
+
+/* reg_global_slot: the slot of the global variable named by the constant at
+ * @name_offset. */
+static uint16_t reg_global_slot(uint32_t name_offset) {
+  if (name_offset == CHUNK_CONST_POOL_EFULL)
+    return 0;  // already reported by identifier_constant()
+
+  Value name;
+  chunk_get_const(current_chunk(), name_offset, &name);
+  return reg_check_short(vm_global_slot(AS_STRING(name)),
+                         "Too many global variables.");
+}
+
+/* reg_move: compute the value of @expr into @dst, retargeting the
+ * instruction computing it if possible. */
+static void reg_move(RegExpr expr, uint8_t dst) {
+  if (expr.reg == dst)
+    return;
+
+  if (reg_relocatable(expr)) {
+    current_chunk()->bytecodes[expr.dst_pos] = dst;
+    return;
+  }
+  emit_byte(OP_R_MOVE);
+  emit_byte(dst);
+  emit_byte(expr.reg);
+}
+
+/* reg_push: make @expr the topmost temporary, copying it into a new one if
+ * it's a local. Return the temporary. */
+static uint8_t reg_push(RegExpr expr) {
+  if (expr.temp)
+    return expr.reg;
+
+  uint8_t reg = reg_alloc();
+  reg_move(expr, reg);
+  return reg;
+}
+
+/* reg_defer_read: postpone the read of the local in register @local (see
+ * PendingRead) until reg_resolve_read(). */
+static void reg_defer_read(uint8_t local) {
+  if (current->pending_count == MAX_LOCALVAR) {
+    error(&parser.prev, "Expression is too deeply nested.");
+    return;
+  }
+
+  PendingRead* read = &current->pending[current->pending_count++];
+  read->local = local;
+  read->copy = reg_alloc();
+  read->copied = false;
+}
+
+/* reg_resolve_read: end the last postponed read. Return the register to
+ * read. */
+static uint8_t reg_resolve_read() {
+  if (current->pending_count == 0)
+    return 0;  // reg_defer_read() failed
+
+  PendingRead read = current->pending[--current->pending_count];
+  return read.copied ? read.copy : read.local;
+}
+
+/* reg_flush_reads: copy the locals whose reads are postponed before code
+ * that may write them: the local in register @local, or any of them if
+ * @local is -1. */
+static void reg_flush_reads(int local) {
+  for (int i = 0; i < current->pending_count; i++) {
+    PendingRead* read = &current->pending[i];
+    if (read->copied || (local != -1 && read->local != local))
+      continue;
+
+    emit_byte(OP_R_MOVE);
+    emit_byte(read->copy);
+    emit_byte(read->local);
+    read->copied = true;
+  }
+}
+
+static uint32_t reg_emit_jump(Opcode jmp_opcode, uint8_t reg) {
+  emit_byte(jmp_opcode);
+  emit_byte(reg);
+  uint32_t jmp_param_pos = current_chunk()->size;
+  emit_byte(0xff);
+  emit_byte(0xff);
+  return jmp_param_pos;
+}
+
+/* reg_emit_cond_jump: emit the jump taken if the condition @cond is false,
+ * fusing it with the comparison computing @cond if there is one. */
+static uint32_t reg_emit_cond_jump(RegExpr cond) {
+  Chunk* chunk = current_chunk();
+  uint32_t jmp_param_pos;
+  if (cond.jump_op != OP_R_JMP_IF_FALSE && cond.end == chunk->size) {
+    // a type error is reported on the line of the comparison
+    uint16_t line = chunk_get_line(chunk, cond.start);
+    if (cond.right_load != NO_REG_INST) {
+      uint16_t k;
+      memcpy(&k, &chunk->bytecodes[cond.right_load + 2], 2);
+      chunk_truncate(chunk, cond.right_load, chunk->constants.size);
+      chunk_append(chunk,
+                   cond.jump_op + OP_R_JMP_IF_NOT_LESSK - OP_R_JMP_IF_NOT_LESS,
+                   line);
+      chunk_append(chunk, cond.left, line);
+      chunk_append(chunk, ((uint8_t*)&k)[0], line);
+      chunk_append(chunk, ((uint8_t*)&k)[1], line);
+    } else {
+      chunk_truncate(chunk, cond.start, chunk->constants.size);
+      chunk_append(chunk, cond.jump_op, line);
+      chunk_append(chunk, cond.left, line);
+      chunk_append(chunk, cond.right, line);
+    }
+    jmp_param_pos = chunk->size;
+    chunk_append(chunk, 0xff, line);
+    chunk_append(chunk, 0xff, line);
+  } else {
+    jmp_param_pos = reg_emit_jump(OP_R_JMP_IF_FALSE, cond.reg);
+  }
+
+  reg_free_temps();
+  return jmp_param_pos;
+}
+
+/* reg_argument_list: compile the arguments of a call into the registers
+ * following the callee's. */
+static int reg_argument_list() {
+  int param_count = 0;
+  if (!check(TK_RIGHT_PAREN)) {
+    do {
+      expression();
+      reg_push(current->expr);
+      param_count++;
+    } while (match(TK_COMMA));
+  }
+
+  consume(TK_RIGHT_PAREN, "Expect ')' after list of parameters.");
+  if (param_count >= MAX_CALLARGS) {
+    error(&parser.prev, "Exceed limit of number of parameters.");
+  }
+  return param_count;
+}
+
+/* reg_load_const: load @value into a new temporary */
+static void reg_load_const(Value value) {
+  uint8_t dst = reg_alloc();
+  uint32_t start = current_chunk()->size;
+  if (IS_BOOL(value)) {
+    emit_byte(AS_BOOL(value) ? OP_R_LOADTRUE : OP_R_LOADFALSE);
+    emit_byte(dst);
+  } else if (IS_NIL(value)) {
+    emit_byte(OP_R_LOADNIL);
+    emit_byte(dst);
+  } else {
+    uint16_t offset = reg_make_const(value);
+    emit_byte(OP_R_LOADK);
+    emit_byte(dst);
+    emit_short(offset);
+  }
+  reg_set_temp(dst, start, start + 1);
+}
+
+static void reg_number() {
+  reg_load_const(NUMBER_VAL(strtod(parser.prev.start, NULL)));
+}
+
+static void reg_string() {
+  StringObj* str_obj =
+      StringObj_construct(parser.prev.start, parser.prev.length);
+  reg_load_const(OBJ_VAL(str_obj->obj));
+}
+
+static void reg_literal() {
+  switch (parser.prev.type) {
+    case TK_TRUE:
+      reg_load_const(BOOL_VAL(true));
+      break;
+    case TK_FALSE:
+      reg_load_const(BOOL_VAL(false));
+      break;
+    case TK_NIL:
+      reg_load_const(NIL_VAL());
+      break;
+    default:
+      return;
+  }
+}
+
+/* reg_read_variable: make @name the last expression, loading it into a
+ * temporary unless it's a local of the current function. */
+static void reg_read_variable(Token name) {
+  int local = resolve_local(current, &name);
+  if (local != -1) {
+    reg_set_local(local);
+    return;
+  }
+
+  int upvalue = resolve_upvalue(current, &name);
+  uint16_t slot = 0;
+  if (upvalue == -1)
+    slot = reg_global_slot(identifier_constant(&name));
+
+  uint8_t dst = reg_alloc();
+  uint32_t start = current_chunk()->size;
+  if (upvalue != -1) {
+    emit_byte(OP_R_GET_UPVAL);
+    emit_byte(dst);
+    emit_byte(upvalue);
+  } else {
+    emit_byte(OP_R_GET_GLOBAL);
+    emit_byte(dst);
+    emit_short(slot);
+  }
+  reg_set_temp(dst, start, start + 1);
+}
+
+static void reg_variable() {
+  parser.consumed_identifier = parser.prev;
+
+  // if the next operation is assignment, reg_assignment() compiles the store
+  if (parser.current.type == TK_EQUAL) {
+    reg_set_local(0);
+    return;
+  }
+  reg_read_variable(parser.prev);
+}
+
+static void reg_assignment() {
+  if (parser.prev_prec >= PREC_ASSIGNMENT) {
+    error(&parser.prev, "Invalid assignment.");
+    return;
+  }
+
+  Token name = parser.consumed_identifier;
+  parse_precedence(PREC_ASSIGNMENT);
+  RegExpr value = current->expr;
+
+  int local = resolve_local(current, &name);
+  if (local != -1) {
+    reg_flush_reads(local);
+    reg_move(value, local);
+    if (value.temp)
+      current->free_reg = value.reg;
+    reg_set_local(local);
+    return;
+  }
+
+  int upvalue = resolve_upvalue(current, &name);
+  if (upvalue != -1) {
+    emit_byte(OP_R_SET_UPVAL);
+    emit_byte(value.reg);
+    emit_byte(upvalue);
+  } else {
+    uint16_t slot = reg_global_slot(identifier_constant(&name));
+    emit_byte(OP_R_SET_GLOBAL);
+    emit_byte(value.reg);
+    emit_short(slot);
+  }
+  current->expr.dst_pos = NO_REG_INST;
+  current->expr.jump_op = OP_R_JMP_IF_FALSE;
+}
+
+static void reg_unary() {
+  Token op = parser.prev;
+  parse_precedence(PREC_UNARY);
+  RegExpr operand = current->expr;
+
+  Opcode opcode;
+  switch (op.type) {
+    case TK_MINUS:
+      opcode = OP_R_NEGATE;
+      break;
+    case TK_BANG:
+      opcode = OP_R_NOT;
+      break;
+    default:
+      error(&op, "Invalid operation.");
+      return;
+  }
+
+  if (operand.temp)
+    current->free_reg = operand.reg;
+  uint8_t dst = reg_alloc();
+  uint32_t start = current_chunk()->size;
+  chunk_append(current_chunk(), opcode, op.line);
+  chunk_append(current_chunk(), dst, op.line);
+  chunk_append(current_chunk(), operand.reg, op.line);
+  reg_set_temp(dst, start, start + 1);
+}
+
+static void reg_binary() {
+  Token op = parser.prev;
+  RegExpr left = current->expr;
+  uint8_t base = left.temp ? left.reg : current->free_reg;
+
+  // a local left operand is only read by the operation itself
+  if (!left.temp)
+    reg_defer_read(left.reg);
+
+  Precedence op_prec = get_rule(op.type)->prec;
+  parse_precedence(op_prec + 1);
+  RegExpr right = current->expr;
+  uint8_t left_reg = left.temp ? left.reg : reg_resolve_read();
+
+  Opcode opcode;
+  Opcode jump_op = OP_R_JMP_IF_FALSE;
+  bool negate = false;
+  switch (op.type) {
+    case TK_PLUS:
+      opcode = OP_R_ADD;
+      break;
+    case TK_MINUS:
+      opcode = OP_R_SUBTRACT;
+      break;
+    case TK_STAR:
+      opcode = OP_R_MUL;
+      break;
+    case TK_SLASH:
+      opcode = OP_R_DIV;
+      break;
+    case TK_LESS:
+      opcode = OP_R_LESS;
+      jump_op = OP_R_JMP_IF_NOT_LESS;
+      break;
+    case TK_GREATER:
+      opcode = OP_R_GREATER;
+      jump_op = OP_R_JMP_IF_NOT_GREATER;
+      break;
+    case TK_EQUAL_EQUAL:
+      opcode = OP_R_EQUAL;
+      break;
+    // a <= b is !(a > b) and a >= b is !(a < b), as in binary()
+    case TK_LESS_EQUAL:
+      opcode = OP_R_GREATER;
+      jump_op = OP_R_JMP_IF_GREATER;
+      negate = true;
+      break;
+    case TK_GREATER_EQUAL:
+      opcode = OP_R_LESS;
+      jump_op = OP_R_JMP_IF_LESS;
+      negate = true;
+      break;
+    case TK_BANG_EQUAL:
+      opcode = OP_R_EQUAL;
+      negate = true;
+      break;
+    default:
+      return;
+  }
+
+  current->free_reg = base;
+  uint8_t dst = reg_alloc();
+  Chunk* chunk = current_chunk();
+
+  // a constant right operand of + and - is read from the constant pool
+  // instead of a register, it isn't loaded at all then.
+  bool right_const = reg_relocatable(right) &&
+                     chunk->bytecodes[right.start] == OP_R_LOADK;
+  bool fold_const = right_const &&
+                    (opcode == OP_R_ADD || opcode == OP_R_SUBTRACT);
+  uint8_t k[2];
+  if (fold_const) {
+    memcpy(k, &chunk->bytecodes[right.start + 2], 2);
+    chunk_truncate(chunk, right.start, chunk->constants.size);
+    opcode = (opcode == OP_R_ADD) ? OP_R_ADDK : OP_R_SUBTRACTK;
+  }
+
+  uint32_t start = chunk->size;
+  // the operands are on the operator's line too, see runtime_error()
+  chunk_append(chunk, opcode, op.line);
+  chunk_append(chunk, dst, op.line);
+  chunk_append(chunk, left_reg, op.line);
+  if (fold_const) {
+    chunk_append(chunk, k[0], op.line);
+    chunk_append(chunk, k[1], op.line);
+  } else {
+    chunk_append(chunk, right.reg, op.line);
+  }
+  uint32_t dst_pos = start + 1;
+  if (negate) {
+    dst_pos = chunk->size + 1;
+    chunk_append(chunk, OP_R_NOT, op.line);
+    chunk_append(chunk, dst, op.line);
+    chunk_append(chunk, dst, op.line);
+  }
+
+  reg_set_temp(dst, start, dst_pos);
+  current->expr.jump_op = jump_op;
+  current->expr.left = left_reg;
+  current->expr.right = right.reg;
+  if (right_const && jump_op != OP_R_JMP_IF_FALSE)
+    current->expr.right_load = right.start;
+  parser.prev_prec = op_prec;
+}
+
+/* reg_logical: compile the right operand of 'and' (if @jmp_opcode is
+ * OP_R_JMP_IF_FALSE) or 'or' into the register of the left one, which is
+ * kept if it decides the result. */
+static void reg_logical(Opcode jmp_opcode, Precedence prec) {
+  uint8_t dst = reg_push(current->expr);
+  uint32_t jmp_param_pos = reg_emit_jump(jmp_opcode, dst);
+  parse_precedence(prec);
+  reg_move(current->expr, dst);
+  current->free_reg = dst + 1;
+  patch_jump(jmp_param_pos);
+  reg_set_temp(dst, NO_REG_INST, NO_REG_INST);
+}
+
+static void reg_and() {
+  reg_logical(OP_R_JMP_IF_FALSE, PREC_AND);
+}
+
+static void reg_or() {
+  reg_logical(OP_R_JMP_IF_TRUE, PREC_OR);
+}
+
+static void reg_call() {
+  uint8_t base = reg_push(current->expr);
+  int param_count = reg_argument_list();
+
+  // the callee may write the locals through upvalues
+  reg_flush_reads(-1);
+  emit_byte(OP_R_CALL);
+  emit_byte(base);
+  emit_byte(param_count);
+  current->free_reg = base + 1;
+  reg_set_temp(base, NO_REG_INST, NO_REG_INST);
+}
+
+static void reg_this() {
+  if (cur_cls == NULL) {
+    error(&parser.prev, "Can't use 'this' outside of a class.");
+    return;
+  }
+
+  reg_variable();
+}
+
+static void reg_super() {
+  consume(TK_DOT, "Expect '.' after 'super'.");
+
+  if (cur_cls == NULL) {
+    error(&parser.prev, "Can't use 'super' outside of a class.");
+  } else if (!cur_cls->has_supercls) {
+    error(&parser.prev, "Can't use 'super' in a class with no superclass.");
+  }
+
+  uint16_t name = reg_check_short(
+      parse_identifier("Expect superclass method name."),
+      "Too many constants in one function.");
+  uint8_t base = current->free_reg;
+
+  if (match(TK_LEFT_PAREN)) {
+    reg_read_variable(SYNTHETIC_TK_THIS);
+    reg_push(current->expr);
+    int param_count = reg_argument_list();
+    reg_read_variable(SYNTHETIC_TK_SUPER);
+    uint8_t supercls = current->expr.reg;
+
+    reg_flush_reads(-1);
+    emit_byte(OP_R_SUPER_INVOKE);
+    emit_byte(base);
+    emit_short(name);
+    emit_byte(param_count);
+    emit_byte(supercls);
+    current->free_reg = base + 1;
+    reg_set_temp(base, NO_REG_INST, NO_REG_INST);
+  } else {
+    reg_read_variable(SYNTHETIC_TK_THIS);
+    uint8_t receiver = current->expr.reg;
+    reg_read_variable(SYNTHETIC_TK_SUPER);
+    uint8_t supercls = current->expr.reg;
+
+    current->free_reg = base;
+    uint8_t dst = reg_alloc();
+    uint32_t start = current_chunk()->size;
+    emit_byte(OP_R_GET_SUPER);
+    emit_byte(dst);
+    emit_byte(receiver);
+    emit_byte(supercls);
+    emit_short(name);
+    reg_set_temp(dst, start, start + 1);
+  }
+}
+
+static void reg_dot() {
+  RegExpr object = current->expr;
+  uint16_t name =
+      reg_check_short(parse_identifier("Expect an identifier after '.' "
+                                       "operator."),
+                      "Too many constants in one function.");
+
+  if (match(TK_EQUAL)) {
+    uint8_t base = object.temp ? object.reg : current->free_reg;
+    if (!object.temp)
+      reg_defer_read(object.reg);
+    expression();
+    RegExpr value = current->expr;
+    uint8_t object_reg = object.temp ? object.reg : reg_resolve_read();
+
+    emit_byte(OP_R_SET_PROPERTY);
+    emit_byte(object_reg);
+    emit_short(name);
+    emit_byte(value.reg);
+    emit_cache_slot(OP_R_SET_PROPERTY, name);
+
+    // the value of the expression is the assigned value
+    current->free_reg = base;
+    if (!value.temp) {
+      reg_set_local(value.reg);
+      return;
+    }
+    uint8_t dst = reg_alloc();
+    uint32_t start = current_chunk()->size;
+    emit_byte(OP_R_MOVE);
+    emit_byte(dst);
+    emit_byte(value.reg);
+    reg_set_temp(dst, start, start + 1);
+  } else if (match(TK_LEFT_PAREN)) {
+    uint8_t base = reg_push(object);
+    int param_count = reg_argument_list();
+
+    reg_flush_reads(-1);
+    emit_byte(OP_R_INVOKE);
+    emit_byte(base);
+    emit_short(name);
+    emit_byte(param_count);
+    emit_cache_slot(OP_R_INVOKE, name);
+    current->free_reg = base + 1;
+    reg_set_temp(base, NO_REG_INST, NO_REG_INST);
+  } else {
+    if (object.temp)
+      current->free_reg = object.reg;
+    uint8_t dst = reg_alloc();
+    uint32_t start = current_chunk()->size;
+    emit_byte(OP_R_GET_PROPERTY);
+    emit_byte(dst);
+    emit_byte(object.reg);
+    emit_short(name);
+    emit_cache_slot(OP_R_GET_PROPERTY, name);
+    reg_set_temp(dst, start, start + 1);
+  }
+}
+
+/* reg_function: compile a function's parameters and body, and emit the
+ * instruction creating its closure in register @dst. */
+static void reg_function(FunctionType type, uint8_t dst) {
+  Compiler compiler;
+  compiler_init(&compiler, type);
+
+  begin_scope();
+  consume(TK_LEFT_PAREN, "Expect '(' after function name.");
+  int param_count = 0;
+  if (!check(TK_RIGHT_PAREN)) {
+    do {
+      parse_identifier("Expect parameter's name.");
+      reg_add_local(parser.consumed_identifier);
+      param_count++;
+    } while (match(TK_COMMA));
+  }
+  consume(TK_RIGHT_PAREN, "Expect ')' after parameter list.");
+  consume(TK_LEFT_BRACE, "Expect '{' after ')'.");
+  block_stmt();
+  end_scope();
+
+  ClosureObj* closure = end_compiler();
+  closure->function->arity = param_count;
+  uint16_t offset = reg_make_const(OBJ_VAL(*closure));
+  emit_byte(OP_R_CLOSURE);
+  emit_byte(dst);
+  emit_short(offset);
+
+  for (int i = 0; i < compiler.upval_count; i++) {
+    Upvalue upvalue = compiler.upvalues[i];
+    emit_byte(upvalue.local | (upvalue.long_offset << 1));
+    emit_bytes(&(upvalue.index),
+               (upvalue.long_offset) ? LONG_UPVAL_OFFSET_SIZE : 1);
+  }
+}
+
+static void reg_var_declaration() {
+  do {
+    uint32_t offset = parse_identifier("Expect an identifier.");
+    Token name = parser.consumed_identifier;
+    if (match(TK_EQUAL))
+      expression();
+    else
+      reg_load_const(NIL_VAL());
+    uint8_t value = reg_push(current->expr);
+
+    if (current->scope_depth > 0) {
+      reg_add_local(name);
+    } else {
+      uint16_t slot = reg_global_slot(offset);
+      emit_byte(OP_R_DEFINE_GLOBAL);
+      emit_byte(value);
+      emit_short(slot);
+    }
+    reg_free_temps();
+  } while (match(TK_COMMA));
+
+  consume(TK_SEMICOLON, "Expect ';' after statement.");
+}
+
+static void reg_fun_declaration() {
+  uint32_t name = parse_identifier("Expect function name.");
+  bool global = current->scope_depth == 0;
+  // a local function is declared first so that it can refer to itself
+  uint8_t dst =
+      global ? reg_alloc() : reg_add_local(parser.consumed_identifier);
+  reg_function(TYPE_FUNCTION, dst);
+
+  if (global) {
+    uint16_t slot = reg_global_slot(name);
+    emit_byte(OP_R_DEFINE_GLOBAL);
+    emit_byte(dst);
+    emit_short(slot);
+  }
+}
+
+static void reg_method(uint8_t klass) {
+  uint16_t name =
+      reg_check_short(parse_identifier("Expect method name after 'fun'."),
+                      "Too many constants in one function.");
+  FunctionType ftype;
+  if (parser.prev.length == 4 && memcmp(parser.prev.start, "init", 4) == 0) {
+    ftype = TYPE_INITIALIZER;
+  } else {
+    ftype = TYPE_METHOD;
+  }
+
+  uint8_t method = reg_alloc();
+  reg_function(ftype, method);
+  emit_byte(OP_R_METHOD);
+  emit_byte(klass);
+  emit_byte(method);
+  emit_short(name);
+  current->free_reg = method;
+}
+
+static void reg_class_declaration() {
+  uint32_t name_offset =
+      parse_identifier("Expect an identifier after 'class'.");
+  uint16_t name =
+      reg_check_short(name_offset, "Too many constants in one function.");
+  bool global = current->scope_depth == 0;
+  uint8_t klass =
+      global ? reg_alloc() : reg_add_local(parser.consumed_identifier);
+  emit_byte(OP_R_CLASS);
+  emit_byte(klass);
+  emit_short(name);
+
+  ClassCompiler cls_cmpl;
+  cls_cmpl.enclosing = cur_cls;
+  cls_cmpl.has_supercls = false;
+  cur_cls = &cls_cmpl;
+
+  uint16_t slot = 0;
+  if (global) {
+    slot = reg_global_slot(name_offset);
+    emit_byte(OP_R_DEFINE_GLOBAL);
+    emit_byte(klass);
+    emit_short(slot);
+  }
+
+  if (match(TK_LESS)) {
+    consume(TK_IDENTIFIER, "Expect superclass name after '<'.");
+
+    // the superclass goes to the register of the local 'super', the first
+    // one above the locals. A global class is reloaded above it.
+    if (global)
+      current->free_reg = klass;
+    reg_read_variable(parser.prev);
+    reg_push(current->expr);
+    cur_cls->has_supercls = true;
+    begin_scope();
+    uint8_t supercls = reg_add_local(SYNTHETIC_TK_SUPER);
+
+    if (global) {
+      klass = reg_alloc();
+      emit_byte(OP_R_GET_GLOBAL);
+      emit_byte(klass);
+      emit_short(slot);
+    }
+    emit_byte(OP_R_INHERIT);
+    emit_byte(klass);
+    emit_byte(supercls);
+  }
+
+  consume(TK_LEFT_BRACE, "Expect '{' before class's body.");
+  while (!(check(TK_RIGHT_BRACE) || check(TK_EOF))) {
+    reg_method(klass);
+  }
+
+  if (cur_cls->has_supercls) {
+    end_scope();
+  }
+
+  cur_cls = cur_cls->enclosing;
+  consume(TK_RIGHT_BRACE, "Expect '}' after class's body.");
+}
+
+static void reg_print_stmt() {
+  expression();
+  consume(TK_SEMICOLON, "Expect a ';' after statement.");
+  emit_byte(OP_R_PRINT);
+  emit_byte(current->expr.reg);
+}
+
+static void reg_expression_stmt() {
+  expression();
+  consume(TK_SEMICOLON, "Expect a ';' after statement.");
+  RegExpr value = current->expr;
+  if (vm.repl) {
+    emit_byte(OP_R_PRINT);
+    emit_byte(value.reg);
+  } else if (reg_relocatable(value) &&
+             current_chunk()->bytecodes[value.start] == OP_R_MOVE) {
+    // drop the copy of the result of a set-property expression
+    chunk_truncate(current_chunk(), value.start,
+                   current_chunk()->constants.size);
+  }
+}
+
+static void reg_if_stmt() {
+  consume(TK_LEFT_PAREN, "Expect '(' after 'if'.");
+  expression();
+  consume(TK_RIGHT_PAREN, "Expect ')' after condition.");
+  uint32_t to_else = reg_emit_cond_jump(current->expr);
+
+  stmt();
+  if (match(TK_ELSE)) {
+    uint32_t then_to_exit = emit_jump(OP_JMP);
+    patch_jump(to_else);
+    stmt();
+    patch_jump(then_to_exit);
+  } else {
+    patch_jump(to_else);
+  }
+}
+
+static void reg_while_stmt() {
+  Loop loop;
+  compiler_enter_loop(&loop);
+
+  consume(TK_LEFT_PAREN, "Expect '(' after 'while'.");
+  uint32_t condition_pos = current_chunk()->size;
+  expression();
+  consume(TK_RIGHT_PAREN, "Expect ')' after expression.");
+  uint32_t out_of_loop_jmp = reg_emit_cond_jump(current->expr);
+
+  stmt();
+
+  patch_continue();
+  emit_loop(condition_pos);
+  patch_jump(out_of_loop_jmp);
+  patch_break();
+
+  compiler_exit_loop();
+}
+
+static void reg_for_stmt() {
+  Loop loop;
+  compiler_enter_loop(&loop);
+
+  begin_scope();
+  consume(TK_LEFT_PAREN, "Expect '(' after 'for'.");
+
+  if (match(TK_VAR))
+    reg_var_declaration();
+  else if (!match(TK_SEMICOLON))
+    reg_expression_stmt();
+  reg_free_temps();
+
+  uint32_t condition_start = current_chunk()->size;
+  uint32_t exit_loop = NO_REG_INST;
+  if (!match(TK_SEMICOLON)) {
+    expression();
+    consume(TK_SEMICOLON, "Expect ';' after expression.");
+    exit_loop = reg_emit_cond_jump(current->expr);
+  }
+
+  uint32_t enter_body = emit_jump(OP_JMP);
+  uint32_t increment_start = current_chunk()->size;
+  if (!check(TK_RIGHT_PAREN)) {
+    expression();
+    reg_free_temps();
+  }
+  consume(TK_RIGHT_PAREN, "Expect ')' after increment expression.");
+
+  emit_loop(condition_start);
+  patch_jump(enter_body);
+  if (!check(TK_SEMICOLON)) {
+    stmt();
+    patch_continue();
+  } else
+    consume(TK_SEMICOLON,
+            "Expect ';' after for-loop if there is no loop statement.");
+
+  emit_loop(increment_start);
+  if (exit_loop != NO_REG_INST)
+    patch_jump(exit_loop);
+  patch_break();
+  end_scope();
+
+  compiler_exit_loop();
+}
+
+static void reg_return_stmt() {
+  if (current->enclosing == NULL) {
+    error(&parser.prev, "'return' outside function.");
+  }
+
+  if (current->func_type == TYPE_INITIALIZER) {
+    error(&parser.prev, "Can't return a value from an initializer.");
+  }
+
+  if (!check(TK_SEMICOLON)) {
+    expression();
+    emit_byte(OP_R_RETURN);
+    emit_byte(current->expr.reg);
+  } else {
+    emit_implicit_ret();
+  }
+
+  consume(TK_SEMICOLON, "Expect ';' after statement.");
+}
+
+static void reg_stmt() {
+  if (match(TK_PRINT))
+    reg_print_stmt();
+  else if (match(TK_LEFT_BRACE))
+    block_stmt();
+  else if (match(TK_IF))
+    reg_if_stmt();
+  else if (match(TK_WHILE))
+    reg_while_stmt();
+  else if (match(TK_FOR))
+    reg_for_stmt();
+  else if (match(TK_BREAK))
+    break_stmt();
+  else if (match(TK_CONTINUE))
+    continue_stmt();
+  else if (match(TK_RETURN))
+    reg_return_stmt();
+  else
+    reg_expression_stmt();
+
+  reg_free_temps();
+}
+
+static void reg_declaration() {
+  if (match(TK_VAR))
+    reg_var_declaration();
+  else if (match(TK_FUN))
+    reg_fun_declaration();
+  else if (match(TK_CLASS))
+    reg_class_declaration();
+  else
+    reg_stmt();
+
+  reg_free_temps();
+  if (parser.panic)
+    synchronize();
+}
+
+// compile: parse the source and emit bytecodes.
+// return value: Closure object that contains the top-level code
+ClosureObj* compile(const char* source) {
+  scanner_init(source);
+  parser_init();
+  Compiler compiler;
+  compiler_init(&compiler, TYPE_SCRIPT);
+
+  // tell the parser to look at the very first token, but not consume it yet
+  advance();
+
+  while (!match(TK_EOF))
+    declaration();
+  scanner_free();
+  parser_free();
+  ClosureObj* closure = end_compiler();
+  return parser.error ? NULL : closure;
+}
+
+static void emit_op_get_global(uint32_t offset) {
+  emit_global_inst(OP_GET_GLOBAL, OP_GET_GLOBAL_LONG, offset);
+}
+
+/* emit_global_inst: emit @opcode (OP_DEFINE_GLOBAL, OP_GET_GLOBAL or
+ * OP_SET_GLOBAL), or @long_opcode if the operand doesn't fit in a byte, for
+ * the global variable named by the constant at @name_offset. The instruction
+ * refers to the variable by its slot in vm.globals, which is resolved here
+ * once and for all. */
+static void emit_global_inst(Opcode opcode,
+                             Opcode long_opcode,
+                             uint32_t name_offset) {
+  if (name_offset == CHUNK_CONST_POOL_EFULL)
+    return;  // already reported by identifier_constant()
+
+  Value name;
+  chunk_get_const(current_chunk(), name_offset, &name);
+  uint32_t slot = vm_global_slot(AS_STRING(name));
+  if (slot <= UINT8_MAX)
+    emit_param_inst(opcode, slot, 1);
+  else
+    emit_param_inst(long_opcode, slot, LONG_GLOBAL_OFFSET_SIZE);
+}
+
+static void emit_op_get_upvalue(uint32_t upvalue_index) {
+  if (upvalue_index <= UINT8_MAX)
+    emit_param_inst(OP_GET_UPVAL, (uint32_t)upvalue_index, 1);
+  else
+    emit_param_inst(OP_GET_UPVAL_LONG, (uint32_t)upvalue_index,
+                    LONG_UPVAL_OFFSET_SIZE);
+}
+
+static void emit_op_get_local(uint32_t stack_index) {
+  if (stack_index <= UINT8_MAX)
+    emit_param_inst(OP_GET_LOCAL, (uint32_t)stack_index, 1);
+  else
+    emit_param_inst(OP_GET_LOCAL_LONG, (uint32_t)stack_index,
+                    LONG_LOCAL_OFFSET_SIZE);
+}
+
+// emit implicit return
+static void emit_implicit_ret() {
+  if (vm.engine == ENGINE_REGISTER) {
+    // register 0 holds the class instance in initializers
+    uint8_t result = 0;
+    if (current->func_type != TYPE_INITIALIZER) {
+      result = reg_alloc();
+      emit_byte(OP_R_LOADNIL);
+      emit_byte(result);
+    }
+    emit_byte(OP_R_RETURN);
+    emit_byte(result);
+    return;
+  }
+
   switch (current->func_type) {
     case TYPE_INITIALIZER:
       // slot 0 is reserved for the class instance
@@ -1376,11 +2721,12 @@ static void compiler_enter_loop(Loop* loop) {
 static void compiler_exit_loop() {
   Loop* curloop = current->loops;
 
-  FREE_ARRAY(Loop, curloop->break_jmps.positions, curloop->break_jmps.capacity);
+  FREE_ARRAY(uint32_t, curloop->break_jmps.positions,
+             curloop->break_jmps.capacity);
   curloop->break_jmps.capacity = 0;
   curloop->break_jmps.count = 0;
 
-  FREE_ARRAY(Loop, curloop->ctn_jmps.positions, curloop->ctn_jmps.capacity);
+  FREE_ARRAY(uint32_t, curloop->ctn_jmps.positions, curloop->ctn_jmps.capacity);
   curloop->ctn_jmps.capacity = 0;
   curloop->ctn_jmps.count = 0;
 
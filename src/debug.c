@@ -1,15 +1,15 @@
 #include "debug.h"
+#include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
 #include "chunk.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 size_t current_line;
 bool line_change;
 
-int disassemble_inst(Chunk* chunk, size_t offset);
-
 void disassemble_chunk(Chunk* chunk, const char* name) {
   // Initialize bytecode logger's state
   current_line = 0;
@@ -40,6 +40,20 @@ int const_instruction(const char* name, Chunk* chunk, int offset) {
   return offset + 2;
 }
 
+// global_instruction: print an instruction accessing a global variable along
+// with the name of the variable's slot.
+int global_instruction(const char* name,
+                       Chunk* chunk,
+                       int offset,
+                       size_t param_size) {
+  uint32_t slot = 0;
+  memcpy(&slot, &(chunk->bytecodes[offset + 1]), param_size);
+  printf("%-16s %4u ", name, slot);
+  print_value(vm.global_names.values[slot]);
+  printf("\n");
+  return offset + param_size + 1;
+}
+
 int single_param_inst(const char* name,
                       Chunk* chunk,
                       int offset,
@@ -60,6 +74,15 @@ int call_instruction(const char* name, Chunk* chunk, int offset) {
   return offset + 2;
 }
 
+int local_const_instruction(const char* name, Chunk* chunk, int offset) {
+  uint8_t slot = chunk->bytecodes[offset + 1];
+  uint8_t const_offset = chunk->bytecodes[offset + 2];
+  printf("%-16s %4d %4d ", name, slot, const_offset);
+  print_value(chunk->constants.values[const_offset]);
+  printf("\n");
+  return offset + 3;
+}
+
 int invoke_instruction(const char* name, Chunk* chunk, int offset) {
   uint8_t const_offset = chunk->bytecodes[offset + 1];
   uint8_t param_count = chunk->bytecodes[offset + 2];
@@ -69,13 +92,27 @@ int invoke_instruction(const char* name, Chunk* chunk, int offset) {
   return offset + 3;
 }
 
-int invoke_long_instruction(const char* name, Chunk* chunk, int offset) {
-  uint32_t const_offset = chunk->bytecodes[offset + 1];
-  uint8_t param_count = chunk->bytecodes[offset + 4];
-  printf("%-16s (%d args) %4d ", name, param_count, const_offset);
+// property_instruction: instructions that take a constant offset of
+// @const_size bytes, followed by @extra_size bytes of other parameters,
+// and the offset of an inline cache.
+int property_instruction(const char* name,
+                         Chunk* chunk,
+                         int offset,
+                         size_t const_size,
+                         size_t extra_size) {
+  uint32_t const_offset = 0;
+  memcpy(&const_offset, &(chunk->bytecodes[offset + 1]), const_size);
+  uint16_t cache_offset = 0;
+  memcpy(&cache_offset,
+         &(chunk->bytecodes[offset + 1 + const_size + extra_size]),
+         CACHE_OFFSET_SIZE);
+
+  printf("%-16s %4u ", name, const_offset);
   print_value(chunk->constants.values[const_offset]);
-  printf("\n");
-  return offset + 5;
+  if (extra_size == 1)
+    printf(" (%d args)", chunk->bytecodes[offset + 1 + const_size]);
+  printf(" [cache %u]\n", cache_offset);
+  return offset + 1 + const_size + extra_size + CACHE_OFFSET_SIZE;
 }
 
 int const_long_instruction(const char* name, Chunk* chunk, int offset) {
@@ -123,6 +160,42 @@ int loop_instruction(const char* name, Chunk* chunk, int offset) {
   return offset + 3;
 }
 
+// register_instruction: print an instruction of the register engine. Each
+// character of @operands describes one operand: 'r' a register, 'n' an
+// argument count and 'u' an upvalue index, one byte each; 'k' a constant, 'g'
+// a global slot, 'c' an inline cache and 'j' a jump distance, two bytes each.
+int register_instruction(const char* name,
+                         Chunk* chunk,
+                         int offset,
+                         const char* operands) {
+  printf("%-16s", name);
+  int pos = offset + 1;
+  for (const char* op = operands; *op != '\0'; op++) {
+    if (*op == 'r' || *op == 'n' || *op == 'u') {
+      printf(" %c%d", *op == 'r' ? 'r' : ' ', chunk->bytecodes[pos]);
+      pos++;
+      continue;
+    }
+
+    uint16_t param;
+    memcpy(&param, &chunk->bytecodes[pos], 2);
+    pos += 2;
+    if (*op == 'k') {
+      printf(" ");
+      print_value(chunk->constants.values[param]);
+    } else if (*op == 'g') {
+      printf(" ");
+      print_value(vm.global_names.values[param]);
+    } else if (*op == 'c') {
+      printf(" [cache %u]", param);
+    } else {
+      printf(" -> %u", pos + param);
+    }
+  }
+  printf("\n");
+  return pos;
+}
+
 // int param_instruction(const char * name, Chunk * chunk, int offset, uint8_t
 // param_size)
 //{
@@ -190,11 +263,20 @@ int disassemble_inst(Chunk* chunk, size_t offset) {
     case OP_POP:
       return simple_instruction("OP_POP", offset);
     case OP_DEFINE_GLOBAL:
-      return const_instruction("OP_DEFINE_GLOBAL", chunk, offset);
+      return global_instruction("OP_DEFINE_GLOBAL", chunk, offset, 1);
+    case OP_DEFINE_GLOBAL_LONG:
+      return global_instruction("OP_DEFINE_GLOBAL_LONG", chunk, offset,
+                                LONG_GLOBAL_OFFSET_SIZE);
     case OP_GET_GLOBAL:
-      return const_instruction("OP_GET_GLOBAL", chunk, offset);
+      return global_instruction("OP_GET_GLOBAL", chunk, offset, 1);
+    case OP_GET_GLOBAL_LONG:
+      return global_instruction("OP_GET_GLOBAL_LONG", chunk, offset,
+                                LONG_GLOBAL_OFFSET_SIZE);
     case OP_SET_GLOBAL:
-      return const_instruction("OP_SET_GLOBAL", chunk, offset);
+      return global_instruction("OP_SET_GLOBAL", chunk, offset, 1);
+    case OP_SET_GLOBAL_LONG:
+      return global_instruction("OP_SET_GLOBAL_LONG", chunk, offset,
+                                LONG_GLOBAL_OFFSET_SIZE);
     case OP_GET_LOCAL:
       return single_param_inst("OP_GET_LOCAL", chunk, offset, 1);
     case OP_SET_LOCAL:
@@ -247,13 +329,15 @@ int disassemble_inst(Chunk* chunk, size_t offset) {
     case OP_CLASS_LONG:
       return const_long_instruction("OP_CLASS_LONG", chunk, offset);
     case OP_GET_PROPERTY:
-      return const_instruction("OP_GET_PROPERTY", chunk, offset);
+      return property_instruction("OP_GET_PROPERTY", chunk, offset, 1, 0);
     case OP_GET_PROPERTY_LONG:
-      return const_long_instruction("OP_GET_PROPERTY_LONG", chunk, offset);
+      return property_instruction("OP_GET_PROPERTY_LONG", chunk, offset,
+                                  LONG_CONST_OFFSET_SIZE, 0);
     case OP_SET_PROPERTY:
-      return const_instruction("OP_SET_PROPERTY", chunk, offset);
+      return property_instruction("OP_SET_PROPERTY", chunk, offset, 1, 0);
     case OP_SET_PROPERTY_LONG:
-      return const_long_instruction("OP_SET_PROPERTY_LONG", chunk, offset);
+      return property_instruction("OP_SET_PROPERTY_LONG", chunk, offset,
+                                  LONG_CONST_OFFSET_SIZE, 0);
     case OP_METHOD:
       return const_instruction("OP_METHOD", chunk, offset);
     case OP_METHOD_LONG:
@@ -261,9 +345,10 @@ int disassemble_inst(Chunk* chunk, size_t offset) {
     case OP_EXIT:
       return simple_instruction("OP_EXIT", offset);
     case OP_INVOKE:
-      return invoke_instruction("OP_INVOKE", chunk, offset);
+      return property_instruction("OP_INVOKE", chunk, offset, 1, 1);
     case OP_INVOKE_LONG:
-      return invoke_instruction("OP_INVOKE_LONG", chunk, offset);
+      return property_instruction("OP_INVOKE_LONG", chunk, offset,
+                                  LONG_CONST_OFFSET_SIZE, 1);
     case OP_INHERIT:
       return simple_instruction("OP_INHERIT", offset);
     case OP_GET_SUPER:
@@ -274,6 +359,153 @@ int disassemble_inst(Chunk* chunk, size_t offset) {
       return invoke_instruction("OP_SUPER_INVOKE", chunk, offset);
     case OP_SUPER_INVOKE_LONG:
       return invoke_instruction("OP_SUPER_INVOKE_LONG", chunk, offset);
+    case OP_CONCAT_N:
+      return single_param_inst("OP_CONCAT_N", chunk, offset, 1);
+    case OP_ADD_LOCAL_CONST:
+      return local_const_instruction("OP_ADD_LOCAL_CONST", chunk, offset);
+    case OP_SET_LOCAL_POP:
+      return single_param_inst("OP_SET_LOCAL_POP", chunk, offset, 1);
+    case OP_GET_THIS_PROPERTY:
+      return property_instruction("OP_GET_THIS_PROPERTY", chunk, offset, 1, 0);
+    case OP_JMP_IF_NOT_LESS:
+      return jump_instruction("OP_JMP_IF_NOT_LESS", chunk, offset);
+    case OP_JMP_IF_NOT_GREATER:
+      return jump_instruction("OP_JMP_IF_NOT_GREATER", chunk, offset);
+    case OP_JMP_IF_LESS:
+      return jump_instruction("OP_JMP_IF_LESS", chunk, offset);
+    case OP_JMP_IF_GREATER:
+      return jump_instruction("OP_JMP_IF_GREATER", chunk, offset);
+    case OP_ADD_NUM:
+      return simple_instruction("OP_ADD_NUM", offset);
+    case OP_ADD_STR:
+      return simple_instruction("OP_ADD_STR", offset);
+    case OP_SUBTRACT_NUM:
+      return simple_instruction("OP_SUBTRACT_NUM", offset);
+    case OP_MUL_NUM:
+      return simple_instruction("OP_MUL_NUM", offset);
+    case OP_DIV_NUM:
+      return simple_instruction("OP_DIV_NUM", offset);
+    case OP_LESS_NUM:
+      return simple_instruction("OP_LESS_NUM", offset);
+    case OP_GREATER_NUM:
+      return simple_instruction("OP_GREATER_NUM", offset);
+    case OP_R_MOVE:
+      return register_instruction("OP_R_MOVE", chunk, offset, "rr");
+    case OP_R_LOADK:
+      return register_instruction("OP_R_LOADK", chunk, offset, "rk");
+    case OP_R_LOADNIL:
+      return register_instruction("OP_R_LOADNIL", chunk, offset, "r");
+    case OP_R_LOADTRUE:
+      return register_instruction("OP_R_LOADTRUE", chunk, offset, "r");
+    case OP_R_LOADFALSE:
+      return register_instruction("OP_R_LOADFALSE", chunk, offset, "r");
+    case OP_R_DEFINE_GLOBAL:
+      return register_instruction("OP_R_DEFINE_GLOBAL", chunk, offset, "rg");
+    case OP_R_GET_GLOBAL:
+      return register_instruction("OP_R_GET_GLOBAL", chunk, offset, "rg");
+    case OP_R_SET_GLOBAL:
+      return register_instruction("OP_R_SET_GLOBAL", chunk, offset, "rg");
+    case OP_R_GET_UPVAL:
+      return register_instruction("OP_R_GET_UPVAL", chunk, offset, "ru");
+    case OP_R_SET_UPVAL:
+      return register_instruction("OP_R_SET_UPVAL", chunk, offset, "ru");
+    case OP_R_ADD:
+      return register_instruction("OP_R_ADD", chunk, offset, "rrr");
+    case OP_R_SUBTRACT:
+      return register_instruction("OP_R_SUBTRACT", chunk, offset, "rrr");
+    case OP_R_ADDK:
+      return register_instruction("OP_R_ADDK", chunk, offset, "rrk");
+    case OP_R_SUBTRACTK:
+      return register_instruction("OP_R_SUBTRACTK", chunk, offset, "rrk");
+    case OP_R_MUL:
+      return register_instruction("OP_R_MUL", chunk, offset, "rrr");
+    case OP_R_DIV:
+      return register_instruction("OP_R_DIV", chunk, offset, "rrr");
+    case OP_R_LESS:
+      return register_instruction("OP_R_LESS", chunk, offset, "rrr");
+    case OP_R_GREATER:
+      return register_instruction("OP_R_GREATER", chunk, offset, "rrr");
+    case OP_R_EQUAL:
+      return register_instruction("OP_R_EQUAL", chunk, offset, "rrr");
+    case OP_R_NOT:
+      return register_instruction("OP_R_NOT", chunk, offset, "rr");
+    case OP_R_NEGATE:
+      return register_instruction("OP_R_NEGATE", chunk, offset, "rr");
+    case OP_R_PRINT:
+      return register_instruction("OP_R_PRINT", chunk, offset, "r");
+    case OP_R_JMP_IF_FALSE:
+      return register_instruction("OP_R_JMP_IF_FALSE", chunk, offset, "rj");
+    case OP_R_JMP_IF_TRUE:
+      return register_instruction("OP_R_JMP_IF_TRUE", chunk, offset, "rj");
+    case OP_R_JMP_IF_NOT_LESS:
+      return register_instruction("OP_R_JMP_IF_NOT_LESS", chunk, offset,
+                                  "rrj");
+    case OP_R_JMP_IF_NOT_GREATER:
+      return register_instruction("OP_R_JMP_IF_NOT_GREATER", chunk, offset,
+                                  "rrj");
+    case OP_R_JMP_IF_LESS:
+      return register_instruction("OP_R_JMP_IF_LESS", chunk, offset, "rrj");
+    case OP_R_JMP_IF_GREATER:
+      return register_instruction("OP_R_JMP_IF_GREATER", chunk, offset,
+                                  "rrj");
+    case OP_R_JMP_IF_NOT_LESSK:
+      return register_instruction("OP_R_JMP_IF_NOT_LESSK", chunk, offset,
+                                  "rkj");
+    case OP_R_JMP_IF_NOT_GREATERK:
+      return register_instruction("OP_R_JMP_IF_NOT_GREATERK", chunk, offset,
+                                  "rkj");
+    case OP_R_JMP_IF_LESSK:
+      return register_instruction("OP_R_JMP_IF_LESSK", chunk, offset, "rkj");
+    case OP_R_JMP_IF_GREATERK:
+      return register_instruction("OP_R_JMP_IF_GREATERK", chunk, offset,
+                                  "rkj");
+    case OP_R_CALL:
+      return register_instruction("OP_R_CALL", chunk, offset, "rn");
+    case OP_R_RETURN:
+      return register_instruction("OP_R_RETURN", chunk, offset, "r");
+    case OP_R_CLOSURE: {
+      uint16_t constant_offset;
+      memcpy(&constant_offset, &chunk->bytecodes[offset + 2], 2);
+      offset = register_instruction("OP_R_CLOSURE", chunk, offset, "rk");
+
+      ClosureObj* closure =
+          AS_CLOSURE(chunk->constants.values[constant_offset]);
+      for (int i = 0; i < closure->function->upval_count; i++) {
+        uint8_t upval_info = chunk->bytecodes[offset++];
+        bool local = upval_info & 1;
+        bool long_offset = (upval_info & (1 << 1)) >> 1;
+
+        uint32_t upval_index = 0;
+        if (long_offset) {
+          memcpy(&upval_index, &chunk->bytecodes[offset], 2);
+          offset += 2;
+        } else
+          upval_index = chunk->bytecodes[offset++];
+
+        printf("%04lu   |                     %s %d\n", offset - 2,
+               local ? "local" : "upvalue", upval_index);
+      }
+
+      return offset;
+    }
+    case OP_R_CLOSE_UPVAL:
+      return register_instruction("OP_R_CLOSE_UPVAL", chunk, offset, "r");
+    case OP_R_CLASS:
+      return register_instruction("OP_R_CLASS", chunk, offset, "rk");
+    case OP_R_METHOD:
+      return register_instruction("OP_R_METHOD", chunk, offset, "rrk");
+    case OP_R_INHERIT:
+      return register_instruction("OP_R_INHERIT", chunk, offset, "rr");
+    case OP_R_GET_PROPERTY:
+      return register_instruction("OP_R_GET_PROPERTY", chunk, offset, "rrkc");
+    case OP_R_SET_PROPERTY:
+      return register_instruction("OP_R_SET_PROPERTY", chunk, offset, "rkrc");
+    case OP_R_INVOKE:
+      return register_instruction("OP_R_INVOKE", chunk, offset, "rknc");
+    case OP_R_GET_SUPER:
+      return register_instruction("OP_R_GET_SUPER", chunk, offset, "rrrk");
+    case OP_R_SUPER_INVOKE:
+      return register_instruction("OP_R_SUPER_INVOKE", chunk, offset, "rknr");
     default:
       printf("Unknown opcode\n");
       return offset + 1;
@@ -281,3 +513,37 @@ int disassemble_inst(Chunk* chunk, size_t offset) {
 
   return offset;
 }
+
+#ifdef DBG_IC_STATS
+void print_inline_caches(Chunk* chunk, const char* name) {
+  for (uint32_t i = 0; i < chunk->cache_count; i++) {
+    InlineCache* cache = &chunk->caches[i];
+    const char* opcode = "OP_GET_PROPERTY";
+    if (cache->opcode == OP_SET_PROPERTY ||
+        cache->opcode == OP_SET_PROPERTY_LONG)
+      opcode = "OP_SET_PROPERTY";
+    else if (cache->opcode == OP_INVOKE || cache->opcode == OP_INVOKE_LONG)
+      opcode = "OP_INVOKE";
+    else if (cache->opcode == OP_R_GET_PROPERTY)
+      opcode = "OP_R_GET_PROPERTY";
+    else if (cache->opcode == OP_R_SET_PROPERTY)
+      opcode = "OP_R_SET_PROPERTY";
+    else if (cache->opcode == OP_R_INVOKE)
+      opcode = "OP_R_INVOKE";
+
+    const char* state = "megamorphic";
+    if (cache->count == 0)
+      state = "uninitialized";
+    else if (cache->count == 1)
+      state = "monomorphic";
+    else if (cache->count != IC_MEGAMORPHIC)
+      state = "polymorphic";
+
+    fprintf(stderr, "%-16s %4u  %-16s %-16s %-14s %12" PRIu64 " hits %12" PRIu64
+            " misses\n",
+            name, cache->line, opcode,
+            AS_CSTRING(chunk->constants.values[cache->name_offset]), state,
+            cache->hits, cache->misses);
+  }
+}
+#endif
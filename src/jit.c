@@ -0,0 +1,571 @@
+#include "jit.h"
+
+#ifdef JIT_AVAILABLE
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+#include "x64.h"
+
+/** The code of a function follows the System V calling convention of its
+ * entry, JitEntry: a prologue jumping to the given start, followed by the
+ * templates of the instructions. It keeps the state of the frame in
+ * callee-saved registers, as run() keeps it in locals:
+ * @rbx: the top of the value stack (sp)
+ * @r12: frame->slots
+ * @r13: the frame
+ * @r14: QNAN, with NAN_BOXING
+ *
+ * vm.stack_top and frame->pc are only written by the runtime entry points
+ * (see jit.h), which receive @sp and @pc as arguments.
+ * */
+
+// the value at @distance from the top of the stack, as PEEK() in run()
+#define PEEK_DISP(distance) (-((int32_t)(distance) + 1) * VALUE_SIZE)
+
+/* Labels of the code, see x64.h: the special targets below, then the start
+ * of the instruction at each bytecode offset. */
+#define TARGET_RETURN 0
+#define TARGET_ERROR 1
+#define LABEL_AT(offset) ((offset) + 2)
+
+/** Templates of values, besides those of x64.h. */
+
+static void emit_push(Assembler* as) {
+  x64_lea(as, RBX, RBX, VALUE_SIZE);
+}
+
+static void emit_push_value(Assembler* as, Value value) {
+  x64_store_value(as, RBX, 0, value);
+  emit_push(as);
+}
+
+static void emit_pop(Assembler* as, int count) {
+  x64_lea(as, RBX, RBX, -count * VALUE_SIZE);
+}
+
+/* emit_jmp_if_same: jump to the label @target if the value at
+ * [@base + @disp] has the same type as @value, which is a nil, a boolean or
+ * undefined. */
+static void emit_jmp_if_same(Assembler* as,
+                             int base,
+                             int32_t disp,
+                             Value value,
+                             uint32_t target) {
+#ifdef NAN_BOXING
+  x64_load(as, RAX, base, disp);
+  x64_mov_imm64(as, RCX, value);
+  x64_cmp(as, RAX, RCX);
+  x64_jcc(as, CC_E, target);
+#else
+  x64_op_mem(as, 0, false, 0x83, 7, base, disp + TYPE_OFFSET);
+  x64_byte(as, value.type);
+  if (value.type != VAL_BOOL) {
+    x64_jcc(as, CC_E, target);
+    return;
+  }
+
+  size_t other_type = x64_jcc_forward(as, CC_NE);
+  // cmp byte [base + disp + 8], value.as.boolean
+  x64_op_mem(as, 0, false, 0x80, 7, base,
+              disp + (int32_t)offsetof(Value, as.boolean));
+  x64_byte(as, value.as.boolean);
+  x64_jcc(as, CC_E, target);
+  x64_patch_here(as, other_type);
+#endif
+}
+
+/** Templates of instructions. */
+
+/* emit_call_helper: call the runtime entry point @helper with the state of
+ * the frame at the instruction ending at @pc. */
+static void emit_call_helper(Assembler* as,
+                             JitHelper helper,
+                             uint8_t* pc,
+                             uint32_t operand) {
+  x64_mov(as, RDI, R13);
+  x64_mov(as, RSI, RBX);
+  x64_mov_imm64(as, RDX, (uint64_t)(uintptr_t)pc);
+  x64_mov_imm32(as, RCX, operand);
+  x64_call(as, (void*)helper);
+}
+
+/* emit_update_sp: take the top of the stack returned by the last runtime
+ * entry point, or leave on a runtime error. */
+static void emit_update_sp(Assembler* as) {
+  x64_test(as, RAX);
+  x64_jcc(as, CC_E, TARGET_ERROR);
+  x64_mov(as, RBX, RAX);
+}
+
+/* emit_type_error: the slow path of an instruction whose operands must be
+ * numbers. */
+static void emit_type_error(Assembler* as, Opcode opcode, uint8_t* pc) {
+  emit_call_helper(as, jit_type_error, pc, opcode);
+  x64_jmp(as, TARGET_ERROR);
+}
+
+/* emit_arithmetic: OP_ADD, OP_SUBTRACT, OP_MUL and OP_DIV. */
+static void emit_arithmetic(Assembler* as, Opcode opcode, uint8_t* pc) {
+  size_t left_slow = x64_check_number(as, RBX, PEEK_DISP(1));
+  size_t right_slow = x64_check_number(as, RBX, PEEK_DISP(0));
+
+  uint16_t sse_op = 0;
+  switch (opcode) {
+    case OP_ADD:
+      sse_op = 0x0f58;
+      break;
+    case OP_SUBTRACT:
+      sse_op = 0x0f5c;
+      break;
+    case OP_MUL:
+      sse_op = 0x0f59;
+      break;
+    default:
+      sse_op = 0x0f5e;
+      break;
+  }
+  x64_movsd_load(as, XMM0, RBX, PEEK_DISP(1));
+  x64_op_mem(as, 0xf2, false, sse_op, XMM0, RBX,
+              PEEK_DISP(0) + NUMBER_OFFSET);
+  x64_movsd_store(as, RBX, PEEK_DISP(1), XMM0);
+  emit_pop(as, 1);
+  size_t done = x64_jmp_forward(as);
+
+  x64_patch_here(as, left_slow);
+  x64_patch_here(as, right_slow);
+  if (opcode == OP_ADD) {
+    // concatenate strings
+    emit_call_helper(as, jit_add, pc, 0);
+    emit_update_sp(as);
+  } else {
+    emit_type_error(as, opcode, pc);
+  }
+  x64_patch_here(as, done);
+}
+
+/* emit_concat: OP_CONCAT_N of @count operands. */
+static void emit_concat(Assembler* as, uint32_t count, uint8_t* pc) {
+  size_t slow[UINT8_MAX];
+  for (uint32_t i = 0; i < count; i++) {
+    slow[i] = x64_check_number(as, RBX, PEEK_DISP(i));
+  }
+
+  x64_movsd_load(as, XMM0, RBX, PEEK_DISP(count - 1));
+  for (uint32_t i = count - 1; i-- > 0;) {
+    x64_op_mem(as, 0xf2, false, 0x0f58, XMM0, RBX,
+               PEEK_DISP(i) + NUMBER_OFFSET);
+  }
+  x64_movsd_store(as, RBX, PEEK_DISP(count - 1), XMM0);
+  emit_pop(as, count - 1);
+  size_t done = x64_jmp_forward(as);
+
+  // let jit_concat() concatenate the strings or report the error.
+  for (uint32_t i = 0; i < count; i++) {
+    x64_patch_here(as, slow[i]);
+  }
+  emit_call_helper(as, jit_concat, pc, count);
+  emit_update_sp(as);
+  x64_patch_here(as, done);
+}
+
+/* emit_compare: compare the two numbers on top of the stack, setting the
+ * flags so that CC_A means the comparison @opcode (OP_LESS or OP_GREATER)
+ * holds. */
+static void emit_compare(Assembler* as,
+                         Opcode opcode,
+                         Opcode error_opcode,
+                         uint8_t* error_pc) {
+  size_t left_slow = x64_check_number(as, RBX, PEEK_DISP(1));
+  size_t right_slow = x64_check_number(as, RBX, PEEK_DISP(0));
+  size_t fast = x64_jmp_forward(as);
+  x64_patch_here(as, left_slow);
+  x64_patch_here(as, right_slow);
+  emit_type_error(as, error_opcode, error_pc);
+  x64_patch_here(as, fast);
+
+  // left < right is right > left, so that an unordered comparison (NaN)
+  // is false in both cases.
+  bool less = (opcode == OP_LESS);
+  x64_movsd_load(as, XMM0, RBX, PEEK_DISP(less ? 0 : 1));
+  x64_ucomisd(as, XMM0, RBX, PEEK_DISP(less ? 1 : 0));
+}
+
+/* emit_upvalue: load the address of the value of the upvalue @index of the
+ * running closure in @rax. */
+static void emit_upvalue(Assembler* as, uint32_t index) {
+  x64_load(as, RAX, R13, offsetof(CallFrame, closure));
+  x64_load(as, RAX, RAX, offsetof(ClosureObj, upvalues));
+  x64_load(as, RAX, RAX, (int32_t)(index * sizeof(UpvalueObj*)));
+  x64_load(as, RAX, RAX, offsetof(UpvalueObj, value));
+}
+
+/* emit_global: load the address of the global variable @slot in @rcx, and
+ * leave if it is undefined. vm.globals may have grown since the function was
+ * compiled, so its array is loaded every time. */
+static void emit_global(Assembler* as, uint32_t slot, uint8_t* pc) {
+  int32_t disp = (int32_t)(slot * sizeof(Value));
+  x64_mov_imm64(as, RCX, (uint64_t)(uintptr_t)&vm.globals.values);
+  x64_load(as, RCX, RCX, 0);
+  x64_lea(as, RCX, RCX, disp);
+
+#ifdef NAN_BOXING
+  x64_load(as, RAX, RCX, 0);
+  x64_mov_imm64(as, RDX, UNDEFINED_VAL());
+  x64_cmp(as, RAX, RDX);
+  size_t defined = x64_jcc_forward(as, CC_NE);
+#else
+  x64_op_mem(as, 0, false, 0x83, 7, RCX, TYPE_OFFSET);
+  x64_byte(as, VAL_UNDEFINED);
+  size_t defined = x64_jcc_forward(as, CC_NE);
+#endif
+  emit_call_helper(as, jit_undefined_global, pc, slot);
+  x64_jmp(as, TARGET_ERROR);
+  x64_patch_here(as, defined);
+}
+
+static void emit_prologue(Assembler* as) {
+  // six pushes and the return address: re-align the stack on 16 bytes.
+  x64_push_frame(as, 8);
+  x64_mov(as, R13, RDI);
+  x64_load(as, R12, R13, offsetof(CallFrame, slots));
+  x64_mov_imm64(as, RAX, (uint64_t)(uintptr_t)&vm.stack_top);
+  x64_load(as, RBX, RAX, 0);
+#ifdef NAN_BOXING
+  x64_mov_imm64(as, R14, QNAN);
+#endif
+  x64_byte(as, 0xff);  // jmp rsi: the start given to the entry
+  x64_byte(as, 0xe6);
+}
+
+/* emit_epilogue: return @result from the entry. */
+static void emit_epilogue(Assembler* as, InterpretResult result) {
+  x64_mov_imm32(as, RAX, result);
+  x64_pop_frame(as, 8);
+}
+
+static uint32_t read_operand(uint8_t* bytes, int size) {
+  uint32_t operand = 0;
+  memcpy(&operand, bytes, size);
+  return operand;
+}
+
+/* emit_instruction: the template of the instruction at @offset.
+ * return the offset of the next instruction, or 0 if the instruction has no
+ * template. */
+static uint32_t emit_instruction(Assembler* as,
+                                 FunctionObj* function,
+                                 uint32_t offset) {
+  Chunk* chunk = &function->chunk;
+  uint8_t* code = chunk->bytecodes;
+  Value* constants = chunk->constants.values;
+  Opcode opcode = opcode_generic(code[offset]);
+
+  // size of the operands of the instruction
+  uint32_t size = 0;
+  switch (opcode) {
+    case OP_CONST:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_POP:
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_UPVAL:
+    case OP_SET_UPVAL:
+    case OP_CALL:
+    case OP_CLOSURE:
+    case OP_CONCAT_N:
+      size = 1;
+      break;
+    case OP_CONST_LONG:
+    case OP_CLOSURE_LONG:
+      size = LONG_CONST_OFFSET_SIZE;
+      break;
+    case OP_GET_LOCAL_LONG:
+    case OP_SET_LOCAL_LONG:
+      size = LONG_LOCAL_OFFSET_SIZE;
+      break;
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_GET_GLOBAL_LONG:
+    case OP_SET_GLOBAL_LONG:
+      size = LONG_GLOBAL_OFFSET_SIZE;
+      break;
+    case OP_GET_UPVAL_LONG:
+    case OP_SET_UPVAL_LONG:
+      size = LONG_UPVAL_OFFSET_SIZE;
+      break;
+    case OP_ADD_LOCAL_CONST:
+    case OP_JMP_IF_FALSE:
+    case OP_JMP:
+    case OP_LOOP:
+    case OP_JMP_IF_NOT_LESS:
+    case OP_JMP_IF_NOT_GREATER:
+    case OP_JMP_IF_LESS:
+    case OP_JMP_IF_GREATER:
+      size = 2;
+      break;
+    default:
+      break;
+  }
+
+  uint32_t operand = read_operand(&code[offset + 1], size);
+  uint32_t next = offset + 1 + size;
+  // the program counter of the interpreter once the operands are read
+  uint8_t* pc = &code[next];
+
+  switch (opcode) {
+    case OP_CONST:
+    case OP_CONST_LONG:
+      x64_mov_imm64(as, RCX, (uint64_t)(uintptr_t)&constants[operand]);
+      x64_copy_value(as, RBX, 0, RCX, 0);
+      emit_push(as);
+      break;
+    case OP_NIL:
+      emit_push_value(as, NIL_VAL());
+      break;
+    case OP_TRUE:
+      emit_push_value(as, BOOL_VAL(true));
+      break;
+    case OP_FALSE:
+      emit_push_value(as, BOOL_VAL(false));
+      break;
+    case OP_POP:
+      emit_pop(as, 1);
+      break;
+    case OP_GET_LOCAL:
+    case OP_GET_LOCAL_LONG:
+      x64_copy_value(as, RBX, 0, R12, operand * VALUE_SIZE);
+      emit_push(as);
+      break;
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_LONG:
+    case OP_SET_LOCAL_POP:
+      x64_copy_value(as, R12, operand * VALUE_SIZE, RBX, PEEK_DISP(0));
+      if (opcode == OP_SET_LOCAL_POP)
+        emit_pop(as, 1);
+      break;
+    case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_GLOBAL_LONG:
+      x64_mov_imm64(as, RCX, (uint64_t)(uintptr_t)&vm.globals.values);
+      x64_load(as, RCX, RCX, 0);
+      x64_copy_value(as, RCX, operand * VALUE_SIZE, RBX, PEEK_DISP(0));
+      emit_pop(as, 1);
+      break;
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_LONG:
+      emit_global(as, operand, pc);
+      x64_copy_value(as, RBX, 0, RCX, 0);
+      emit_push(as);
+      break;
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_LONG:
+      emit_global(as, operand, pc);
+      x64_copy_value(as, RCX, 0, RBX, PEEK_DISP(0));
+      break;
+    case OP_GET_UPVAL:
+    case OP_GET_UPVAL_LONG:
+      emit_upvalue(as, operand);
+      x64_copy_value(as, RBX, 0, RAX, 0);
+      emit_push(as);
+      break;
+    case OP_SET_UPVAL:
+    case OP_SET_UPVAL_LONG:
+      emit_call_helper(as, jit_set_upvalue, pc, operand);
+      x64_mov(as, RBX, RAX);
+      break;
+    case OP_CLOSE_UPVAL:
+      emit_call_helper(as, jit_close_upvalue, pc, 0);
+      x64_mov(as, RBX, RAX);
+      break;
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MUL:
+    case OP_DIV:
+      emit_arithmetic(as, opcode, pc);
+      break;
+    case OP_CONCAT_N:
+      emit_concat(as, operand, pc);
+      break;
+    case OP_ADD_LOCAL_CONST: {
+      // push the local, then add the constant to it in place
+      uint32_t slot = operand & 0xff;
+      Value constant = constants[operand >> 8];
+      x64_copy_value(as, RBX, 0, R12, slot * VALUE_SIZE);
+      emit_push(as);
+      size_t slow = x64_check_number(as, RBX, PEEK_DISP(0));
+      size_t not_number = 0;
+      if (!IS_NUMBER(constant))
+        not_number = x64_jmp_forward(as);
+      x64_mov_imm64(as, RCX, (uint64_t)(uintptr_t)&constants[operand >> 8]);
+      x64_movsd_load(as, XMM0, RBX, PEEK_DISP(0));
+      x64_op_mem(as, 0xf2, false, 0x0f58, XMM0, RCX, NUMBER_OFFSET);
+      x64_movsd_store(as, RBX, PEEK_DISP(0), XMM0);
+      size_t done = x64_jmp_forward(as);
+
+      // let jit_add() concatenate the strings or report the error.
+      x64_patch_here(as, slow);
+      if (not_number != 0)
+        x64_patch_here(as, not_number);
+      x64_mov_imm64(as, RCX, (uint64_t)(uintptr_t)&constants[operand >> 8]);
+      x64_copy_value(as, RBX, 0, RCX, 0);
+      emit_push(as);
+      emit_call_helper(as, jit_add, pc, 0);
+      emit_update_sp(as);
+      x64_patch_here(as, done);
+      break;
+    }
+    case OP_LESS:
+    case OP_GREATER:
+      emit_compare(as, opcode, opcode, pc);
+      x64_setcc(as, CC_A);
+      x64_store_bool(as, RBX, PEEK_DISP(1));
+      emit_pop(as, 1);
+      break;
+    case OP_JMP_IF_NOT_LESS:
+    case OP_JMP_IF_NOT_GREATER:
+    case OP_JMP_IF_LESS:
+    case OP_JMP_IF_GREATER: {
+      bool less = (opcode == OP_JMP_IF_NOT_LESS || opcode == OP_JMP_IF_LESS);
+      bool jmp_if = (opcode == OP_JMP_IF_LESS || opcode == OP_JMP_IF_GREATER);
+      // a type error is reported at the superinstruction, see run()
+      emit_compare(as, less ? OP_LESS : OP_GREATER, opcode, &code[offset + 1]);
+      emit_pop(as, 2);  // lea leaves the flags alone
+      x64_jcc(as, jmp_if ? CC_A : CC_BE, LABEL_AT(next + operand));
+      break;
+    }
+    case OP_EQUAL:
+      emit_call_helper(as, jit_equal, pc, 0);
+      x64_mov(as, RBX, RAX);
+      break;
+    case OP_NOT:
+      emit_call_helper(as, jit_not, pc, 0);
+      x64_mov(as, RBX, RAX);
+      break;
+    case OP_NEGATE: {
+      size_t slow = x64_check_number(as, RBX, PEEK_DISP(0));
+      x64_load(as, RAX, RBX, PEEK_DISP(0) + NUMBER_OFFSET);
+      x64_byte(as, 0x48);  // btc rax, 63: flip the sign bit
+      x64_byte(as, 0x0f);
+      x64_byte(as, 0xba);
+      x64_byte(as, 0xf8);
+      x64_byte(as, 63);
+      x64_store(as, RBX, PEEK_DISP(0) + NUMBER_OFFSET, RAX);
+      size_t done = x64_jmp_forward(as);
+      x64_patch_here(as, slow);
+      emit_type_error(as, opcode, pc);
+      x64_patch_here(as, done);
+      break;
+    }
+    case OP_PRINT:
+      emit_call_helper(as, jit_print, pc, 0);
+      x64_mov(as, RBX, RAX);
+      break;
+    case OP_JMP:
+      x64_jmp(as, LABEL_AT(next + operand));
+      break;
+    case OP_LOOP:
+      x64_jmp(as, LABEL_AT(next - operand));
+      break;
+    case OP_JMP_IF_FALSE:
+      emit_jmp_if_same(as, RBX, PEEK_DISP(0), NIL_VAL(),
+                       LABEL_AT(next + operand));
+      emit_jmp_if_same(as, RBX, PEEK_DISP(0), BOOL_VAL(false),
+                       LABEL_AT(next + operand));
+      break;
+    case OP_CALL:
+      emit_call_helper(as, jit_call, pc, operand);
+      emit_update_sp(as);
+      break;
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG: {
+      // jit_closure() reads the upvalues following the operand.
+      emit_call_helper(as, jit_closure, pc, operand);
+      x64_mov(as, RBX, RAX);
+      ClosureObj* closure = AS_CLOSURE(constants[operand]);
+      for (int i = 0; i < closure->function->upval_count; i++) {
+        bool long_offset = (code[next] & (1 << 1)) >> 1;
+        next += long_offset ? 3 : 2;
+      }
+      break;
+    }
+    case OP_RETURN:
+      emit_call_helper(as, jit_return, pc, 0);
+      x64_jmp(as, TARGET_RETURN);
+      break;
+    default:
+      return 0;
+  }
+
+  return next;
+}
+
+bool jit_compile(FunctionObj* function) {
+  Chunk* chunk = &function->chunk;
+  Assembler as;
+  x64_init(&as, LABEL_AT(chunk->size));
+
+  emit_prologue(&as);
+  bool supported = true;
+  for (uint32_t offset = 0; offset < chunk->size && supported;) {
+    x64_bind(&as, LABEL_AT(offset));
+    offset = emit_instruction(&as, function, offset);
+    supported = (offset != 0);
+  }
+
+  x64_bind(&as, TARGET_RETURN);
+  emit_epilogue(&as, INTERPRET_OK);
+  x64_bind(&as, TARGET_ERROR);
+  emit_epilogue(&as, INTERPRET_RUNTIME_ERROR);
+
+  void* memory = NULL;
+  if (supported && x64_link(&as))
+    memory = x64_install(&as);
+  JitCode* jit_code = NULL;
+  if (memory != NULL) {
+    jit_code = malloc(sizeof(JitCode));
+    // the function is left to the interpreter
+    if (jit_code == NULL)
+      x64_uninstall(memory, as.size);
+  }
+  if (jit_code != NULL) {
+    jit_code->entry = (JitEntry)memory;
+    jit_code->size = as.size;
+    // keep the positions of the instructions only
+    memmove(as.labels, &as.labels[LABEL_AT(0)],
+            chunk->size * sizeof(uint32_t));
+    jit_code->positions = as.labels;
+    as.labels = NULL;
+    function->jit_code = jit_code;
+  }
+
+  x64_free(&as);
+  return function->jit_code != NULL;
+}
+
+void jit_free(FunctionObj* function) {
+  if (function->jit_code == NULL)
+    return;
+  x64_uninstall((void*)function->jit_code->entry, function->jit_code->size);
+  free(function->jit_code->positions);
+  free(function->jit_code);
+  function->jit_code = NULL;
+}
+
+#else
+
+bool jit_compile(FunctionObj* function) {
+  (void)function;
+  return false;
+}
+
+void jit_free(FunctionObj* function) {
+  (void)function;
+}
+
+#endif
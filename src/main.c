@@ -1,10 +1,19 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include "jit.h"
 #include "vm.h"
 
 // read-eval-print loop
 static void repl();
 
+static _Noreturn void usage() {
+  fprintf(stderr,
+          "Usage: clox [--register] [--jit | --trace-jit] "
+          "[--gc-<option>=<value>]... [path]\n");
+  exit(64);
+}
+
 static void run_file(const char*);
 
 /* Take file path as an argument and return string representation
@@ -15,17 +24,58 @@ char* read_file(const char*);
 InterpretResult interpret(const char*);
 
 int main(int argc, char** argv) {
-  vm_init(argc == 1);
+  // --register selects the register-based engine, see Engine in vm.h
+  // --jit compiles the hot functions of the stack engine, see jit.h
+  // --trace-jit compiles the hot loops of the stack engine, see trace.h
+  // --gc-<option>=<value> tunes the garbage collector, see GCConfig in
+  // memory.h
+  Engine engine = ENGINE_STACK;
+  JitMode jit = JIT_NONE;
+  GCConfig gc_config;
+  gc_config_init(&gc_config);
+  const char* path = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--gc-", 5) == 0) {
+      char option[16];
+      const char* value = strchr(argv[i], '=');
+      size_t length = value == NULL ? 0 : value - argv[i] - 5;
+      if (length == 0 || length >= sizeof(option)) {
+        usage();
+      }
+      memcpy(option, argv[i] + 5, length);
+      option[length] = '\0';
+      if (!gc_configure(&gc_config, option, value + 1)) {
+        fprintf(stderr, "Invalid option '%s'.\n", argv[i]);
+        exit(64);
+      }
+    } else if (strcmp(argv[i], "--register") == 0 && engine == ENGINE_STACK) {
+      engine = ENGINE_REGISTER;
+    } else if (strcmp(argv[i], "--jit") == 0 && jit == JIT_NONE) {
+      jit = JIT_METHOD;
+    } else if (strcmp(argv[i], "--trace-jit") == 0 && jit == JIT_NONE) {
+      jit = JIT_TRACE;
+    } else if (path == NULL) {
+      path = argv[i];
+    } else {
+      usage();
+    }
+  }
 
-  if (argc == 1) {
-    // go to read-eval-print loop if the user pass no arguments
+#ifndef JIT_AVAILABLE
+  if (jit != JIT_NONE) {
+    fprintf(stderr, "The JIT is not available on this platform.\n");
+    jit = JIT_NONE;
+  }
+#endif
+
+  vm_init(path == NULL, engine, jit, &gc_config);
+
+  if (path == NULL) {
+    // go to read-eval-print loop if the user pass no source file
     repl();
-  } else if (argc == 2) {
-    // compile and execute the source program passed by the user
-    run_file(argv[1]);
   } else {
-    fprintf(stderr, "Usage: clox [path]\n");
-    exit(64);
+    // compile and execute the source program passed by the user
+    run_file(path);
   }
 
   vm_free();
@@ -1,8 +1,21 @@
 #include "memory.h"
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
+#ifdef DBG_ALLOC_STATS
+#include <inttypes.h>
+#endif
+#if defined(CONCURRENT_GC) || GC_MARK_THREADS > 1
+#include <stdatomic.h>
+#endif
+#if defined(CONCURRENT_GC) || GC_MARK_THREADS > 1 || defined(BACKGROUND_FREE)
+#include <threads.h>
+#endif
 
 #include "compiler.h"  // for mark_compiler_roots()
+#include "jit.h"
 #include "object.h"
+#include "trace.h"
 #include "vm.h"
 
 #ifdef DBG_LOG_GC
@@ -17,69 +30,617 @@
  */
 void dbg_print_object(Obj* obj) {
   printf("(\033[1;31m%p\033[0m, ", obj);
-  print_value(OBJ_VAL(*obj));
+  // printing a rope would flatten it
+  if (obj->type == OBJ_STRING && ((StringObj*)obj)->chars == NULL)
+    printf("<rope of %u characters>", ((StringObj*)obj)->length);
+  else
+    print_value(OBJ_VAL(*obj));
   printf(")");
 }
 #endif
 
-void* reallocate(void* arr, size_t old_sz, size_t new_sz) {
+#ifdef CONCURRENT_GC
+/** The marking thread of a concurrent full collection, see collect_garbage().
+ *
+ * @marker_done: set by the marking thread once it has traversed the heap.
+ * @deferred: the blocks released while the marking thread runs, which may
+ * still be reading them. They are freed by the final pause. */
+typedef struct {
+  void* arr;
+  size_t size;
+} DeferredBlock;
+
+static thrd_t marker;
+static atomic_bool marker_done;
+static DeferredBlock* deferred;
+static uint32_t deferred_count;
+static uint32_t deferred_capacity;
+
+static void finish_marking();
+#endif
+
+#if GC_MARK_THREADS > 1
+/* MarkWorker: a thread marking the heap with the others, in parallel.
+ * @stack: its gray stack, of @count objects.
+ * @shared: gray objects moved from @stack while other workers are idle, for
+ * them to steal. */
+typedef struct {
+  Obj** stack;
+  uint32_t count;
+  uint32_t capacity;
+  mtx_t lock;  // of @shared
+  Obj** shared;
+  uint32_t shared_count;
+  uint32_t shared_capacity;
+} MarkWorker;
+
+static MarkWorker workers[GC_MARK_THREADS];
+static atomic_uint idle_workers;
+// set once gray objects are dropped for want of memory: the marks are then
+// incomplete, and the collecting thread fails with out of memory.
+static atomic_bool mark_failed;
+// the worker run by the current thread, while the heap is marked in parallel
+static _Thread_local MarkWorker* worker;
+
+/* grow_objects: grow the array @*objects of @*capacity objects to hold
+ * @count of them. return false if it can't be, leaving it as it is. */
+static bool grow_objects(Obj*** objects, uint32_t* capacity, uint32_t count) {
+  if (count <= *capacity)
+    return true;
+  uint32_t new_capacity = *capacity;
+  while (count > new_capacity)
+    new_capacity = GROW_CAPACITY(new_capacity);
+  Obj** grown = realloc(*objects, new_capacity * sizeof(Obj*));
+  if (grown == NULL)
+    return false;
+  *objects = grown;
+  *capacity = new_capacity;
+  return true;
+}
+#endif
+
+#ifdef BACKGROUND_FREE
+/** The thread calling free() on the memory released by the program, which
+ * hands it over in batches of FREE_BATCH pointers.
+ *
+ * @free_queue: the batches handed over, @free_stop: set to end the thread,
+ * both under @free_lock.
+ * @free_batch: the batch being filled by the program. */
+#define FREE_BATCH 4096
+
+typedef struct FreeBatch {
+  struct FreeBatch* next;
+  uint32_t count;
+  void* pointers[FREE_BATCH];
+} FreeBatch;
+
+static thrd_t freer;
+static bool freer_started;
+static mtx_t free_lock;
+static cnd_t free_cond;
+static FreeBatch* free_queue;
+static bool free_stop;
+static FreeBatch* free_batch;
+
+/* free_batches: free the blocks of @batch and of the batches after it. */
+static void free_batches(FreeBatch* batch) {
+  while (batch != NULL) {
+    FreeBatch* next = batch->next;
+    for (uint32_t i = 0; i < batch->count; i++) {
+      free(batch->pointers[i]);
+    }
+    free(batch);
+    batch = next;
+  }
+}
+
+static int free_work(void* unused) {
+  (void)unused;
+  mtx_lock(&free_lock);
+  while (true) {
+    while (free_queue == NULL && !free_stop)
+      cnd_wait(&free_cond, &free_lock);
+    FreeBatch* batch = free_queue;
+    free_queue = NULL;
+    if (batch == NULL)
+      break;
+    mtx_unlock(&free_lock);
+
+    free_batches(batch);
+    mtx_lock(&free_lock);
+  }
+  mtx_unlock(&free_lock);
+  return 0;
+}
+
+/* start_freer: start the thread, false if it can't be. */
+static bool start_freer() {
+  if (mtx_init(&free_lock, mtx_plain) != thrd_success)
+    return false;
+  if (cnd_init(&free_cond) != thrd_success) {
+    mtx_destroy(&free_lock);
+    return false;
+  }
+  if (thrd_create(&freer, free_work, NULL) != thrd_success) {
+    cnd_destroy(&free_cond);
+    mtx_destroy(&free_lock);
+    return false;
+  }
+  return true;
+}
+
+/* hand_over: hand @free_batch over to the thread, starting it if needed.
+ * Without the thread, the batch is freed here. */
+static void hand_over() {
+  if (!freer_started) {
+    freer_started = start_freer();
+    if (!freer_started) {
+      free_batch->next = NULL;
+      free_batches(free_batch);
+      free_batch = NULL;
+      return;
+    }
+  }
+
+  mtx_lock(&free_lock);
+  free_batch->next = free_queue;
+  free_queue = free_batch;
+  cnd_signal(&free_cond);
+  mtx_unlock(&free_lock);
+  free_batch = NULL;
+}
+
+/* stop_freeing: hand the last batch over, and wait for the thread to free
+ * everything. */
+static void stop_freeing() {
+  if (free_batch != NULL)
+    hand_over();
+  if (!freer_started)
+    return;
+
+  mtx_lock(&free_lock);
+  free_stop = true;
+  cnd_signal(&free_cond);
+  mtx_unlock(&free_lock);
+  thrd_join(freer, NULL);
+  mtx_destroy(&free_lock);
+  cnd_destroy(&free_cond);
+  freer_started = free_stop = false;
+}
+#endif
+
+#define POOL_CLASSES (POOL_MAX_SIZE / POOL_GRANULE)
+#define POOL_CLASS(size) (((size) - 1) / POOL_GRANULE)
+
+#ifndef DISABLE_POOL
+/** The pool allocator, serving the blocks of up to POOL_MAX_SIZE bytes.
+ *
+ * Blocks are rounded up to a size class, a multiple of POOL_GRANULE bytes.
+ * Each class carves its blocks out of its own pages of POOL_PAGE_SIZE bytes,
+ * and keeps the blocks released in a free list, reused first. The pages are
+ * only returned to the system by free_objects().
+ *
+ * @pages: all of the pages, linked through their first word.
+ * @free_lists: the blocks released, by size class.
+ * @cursors, @limits: the part of the last page of each class not carved out
+ * yet. */
+typedef struct PoolBlock {
+  struct PoolBlock* next;
+} PoolBlock;
+
+static void* pages;
+static PoolBlock* free_lists[POOL_CLASSES];
+static char* cursors[POOL_CLASSES];
+static char* limits[POOL_CLASSES];
+#endif
+
+#ifdef DBG_ALLOC_STATS
+static struct {
+  uint64_t pooled;    // blocks allocated by the pool
+  uint64_t reused;    // of which from a free list
+  uint64_t malloced;  // blocks allocated by malloc()
+  uint64_t resized;   // blocks resized without moving
+  uint64_t moved;     // blocks resized by moving them
+  uint32_t pages;
+  uint32_t object_pages;
+} alloc_stats;
+
+void alloc_print_stats() {
+  size_t free_bytes = 0;
+#ifndef DISABLE_POOL
+  for (int i = 0; i < POOL_CLASSES; i++) {
+    size_t size = (i + 1) * POOL_GRANULE;
+    for (PoolBlock* block = free_lists[i]; block != NULL; block = block->next)
+      free_bytes += size;
+    free_bytes += limits[i] - cursors[i];
+  }
+#endif
+  fprintf(stderr,
+          "[alloc] %" PRIu64 " pooled (%" PRIu64 " reused), %" PRIu64
+          " malloced, %" PRIu64 " resized in place, %" PRIu64
+          " moved, %u pages, %zu KB free in pages, %u object pages\n",
+          alloc_stats.pooled, alloc_stats.reused, alloc_stats.malloced,
+          alloc_stats.resized, alloc_stats.moved, alloc_stats.pages,
+          free_bytes / 1024, alloc_stats.object_pages);
+}
+#define ALLOC_STAT(stat) (alloc_stats.stat++)
+#else
+#define ALLOC_STAT(stat) ((void)0)
+#endif
+
+#ifndef DISABLE_POOL
+/* pool_allocate: return a zeroed block of the class of @size bytes. */
+static void* pool_allocate(size_t size) {
+  uint32_t class = POOL_CLASS(size);
+  PoolBlock* block = free_lists[class];
+  if (block != NULL) {
+    free_lists[class] = block->next;
+    memset(block, 0, size);
+    ALLOC_STAT(reused);
+    ALLOC_STAT(pooled);
+    return block;
+  }
+
+  size_t class_size = (class + 1) * POOL_GRANULE;
+  if (cursors[class] + class_size > limits[class]) {
+    // the first POOL_GRANULE bytes of a page link it to the others
+    char* page = calloc(POOL_PAGE_SIZE, 1);
+    if (page == NULL)
+      vm_out_of_memory();
+    *(void**)page = pages;
+    pages = page;
+    cursors[class] = page + POOL_GRANULE;
+    limits[class] = page + POOL_PAGE_SIZE;
+    ALLOC_STAT(pages);
+  }
+  // the pages are zeroed by calloc()
+  void* new_block = cursors[class];
+  cursors[class] += class_size;
+  ALLOC_STAT(pooled);
+  return new_block;
+}
+
+/* pool_release: put the block @arr of @size bytes back in its free list. */
+static void pool_release(void* arr, size_t size) {
+  PoolBlock* block = arr;
+  uint32_t class = POOL_CLASS(size);
+  block->next = free_lists[class];
+  free_lists[class] = block;
+}
+
+/* pool_free_pages: return all of the pages to the system. */
+static void pool_free_pages() {
+  while (pages != NULL) {
+    void* next = *(void**)pages;
+    free(pages);
+    pages = next;
+  }
+  for (int i = 0; i < POOL_CLASSES; i++) {
+    free_lists[i] = NULL;
+    cursors[i] = limits[i] = NULL;
+  }
+}
+#endif
+
+/** The pages of objects, see Page in memory.h.
+ *
+ * The objects of up to PAGE_MAX_OBJECT bytes are rounded up to a size class
+ * of POOL_GRANULE bytes, and carved out of @small_pages as the pool allocator
+ * does. Their pages are only returned to the system by free_objects(). A
+ * larger object has a page of its own in @large_pages, returned once the
+ * object is freed.
+ *
+ * @object_free_lists: the blocks released, by size class.
+ * @object_cursors, @object_limits: the part of the last page of each class
+ * not carved out yet. */
+#define PAGE_MAX_OBJECT (POOL_PAGE_SIZE / 16)
+#define PAGE_CLASSES (PAGE_MAX_OBJECT / POOL_GRANULE)
+#define PAGE_HEADER_SIZE \
+  ((sizeof(Page) + POOL_GRANULE - 1) / POOL_GRANULE * POOL_GRANULE)
+#define BIT_MASK(bit) ((uint64_t)1 << ((bit) % 64))
+
+typedef struct ObjBlock {
+  struct ObjBlock* next;
+} ObjBlock;
+
+static Page* small_pages;
+static Page* large_pages;
+static ObjBlock* object_free_lists[PAGE_CLASSES];
+static char* object_cursors[PAGE_CLASSES];
+static char* object_limits[PAGE_CLASSES];
+
+#ifdef LAZY_SWEEP
+static void sweep_some(uint32_t count);
+static void sweep_lazily(Page* page);
+#endif
+
+/* new_page: return a page of @size bytes, a multiple of POOL_PAGE_SIZE, for
+ * objects of @block_size bytes. */
+static Page* new_page(size_t size, uint32_t block_size) {
+  Page* page = aligned_alloc(POOL_PAGE_SIZE, size);
+  if (page == NULL)
+    vm_out_of_memory();
+  memset(page, 0, PAGE_HEADER_SIZE);
+  page->block_size = block_size;
+  ALLOC_STAT(object_pages);
+  return page;
+}
+
+/* large_object: the object of the page @page of a large object. */
+static Obj* large_object(Page* page) {
+  return (Obj*)((char*)page + PAGE_HEADER_SIZE);
+}
+
+/* take_object_block: return a block for an object of @size bytes. */
+static Obj* take_object_block(size_t size) {
+  if (size > PAGE_MAX_OBJECT) {
+    size_t page_size = (PAGE_HEADER_SIZE + size + POOL_PAGE_SIZE - 1) /
+                       POOL_PAGE_SIZE * POOL_PAGE_SIZE;
+    Page* page = new_page(page_size, size);
+    page->next = large_pages;
+    large_pages = page;
+    return large_object(page);
+  }
+
+  uint32_t class = POOL_CLASS(size);
+  Obj* obj = (Obj*)object_free_lists[class];
+  if (obj != NULL) {
+    object_free_lists[class] = object_free_lists[class]->next;
+  } else {
+    size_t class_size = (class + 1) * POOL_GRANULE;
+    if ((size_t)(object_limits[class] - object_cursors[class]) < class_size) {
+      Page* page = new_page(POOL_PAGE_SIZE, class_size);
+      page->next = small_pages;
+      small_pages = page;
+      object_cursors[class] = (char*)page + PAGE_HEADER_SIZE;
+      object_limits[class] = (char*)page + POOL_PAGE_SIZE;
+    }
+    obj = (Obj*)object_cursors[class];
+    object_cursors[class] += class_size;
+  }
+
+#ifdef LAZY_SWEEP
+  // the sweep tells the garbage from the young objects by their marks, so
+  // it has to come first
+  if (OBJ_PAGE(obj)->unswept)
+    sweep_lazily(OBJ_PAGE(obj));
+#endif
+  return obj;
+}
+
+/* release_object: give the block of the object @obj of @size bytes back to
+ * its page. The page of a large object is freed by its sweep. */
+static void release_object(Obj* obj, size_t size) {
+  vm.gc.allocated -= size;
+  Page* page = OBJ_PAGE(obj);
+  uint32_t bit = OBJ_BIT(obj);
+  page->live[bit / 64] &= ~BIT_MASK(bit);
+  if (page->block_size <= PAGE_MAX_OBJECT) {
+    ObjBlock* block = (ObjBlock*)obj;
+    uint32_t class = POOL_CLASS(page->block_size);
+    block->next = object_free_lists[class];
+    object_free_lists[class] = block;
+  }
+}
+
+/* set_mark: mark the object @obj. */
+static void set_mark(Obj* obj) {
+  uint32_t bit = OBJ_BIT(obj);
+  OBJ_PAGE(obj)->marks[bit / 64] |= BIT_MASK(bit);
+}
+
+/* allocate: return a zeroed block of @size bytes. */
+static void* allocate(size_t size) {
+#ifndef DISABLE_POOL
+  if (size <= POOL_MAX_SIZE)
+    return pool_allocate(size);
+#endif
+  void* block = calloc(size, 1);
+  if (block == NULL)
+    vm_out_of_memory();
+  ALLOC_STAT(malloced);
+  return block;
+}
+
+/* release: free the block @arr of @size bytes, once it is safe. */
+static void release(void* arr, size_t size) {
+  if (arr == NULL)
+    return;
+#ifdef CONCURRENT_GC
+  if (vm.gc.phase == GC_MARKING) {
+    if (deferred_count == deferred_capacity) {
+      uint32_t capacity = GROW_CAPACITY(deferred_capacity);
+      DeferredBlock* blocks =
+          realloc(deferred, capacity * sizeof(DeferredBlock));
+      if (blocks == NULL)
+        vm_out_of_memory();
+      deferred = blocks;
+      deferred_capacity = capacity;
+    }
+    deferred[deferred_count++] = (DeferredBlock){arr, size};
+    return;
+  }
+#endif
+#ifndef DISABLE_POOL
+  if (size <= POOL_MAX_SIZE) {
+    pool_release(arr, size);
+    return;
+  }
+#else
+  (void)size;
+#endif
+#ifdef BACKGROUND_FREE
+  if (free_batch == NULL) {
+    free_batch = malloc(sizeof(FreeBatch));
+    if (free_batch == NULL)
+      vm_out_of_memory();
+    free_batch->count = 0;
+  }
+  free_batch->pointers[free_batch->count++] = arr;
+  if (free_batch->count == FREE_BATCH)
+    hand_over();
+#else
+  free(arr);
+#endif
+}
+
+/* resize: resize the block @arr of @old_sz bytes to @new_sz bytes without
+ * moving it if possible, zeroing the bytes added.
+ * return value: the block, or NULL if it has to be moved. */
+static void* resize(void* arr, size_t old_sz, size_t new_sz) {
+  if (arr == NULL)
+    return NULL;
+#ifdef CONCURRENT_GC
+  // realloc() may free the block while the marking thread reads it
+  if (vm.gc.phase == GC_MARKING)
+    return NULL;
+#endif
+
+  char* new_arr;
+#ifndef DISABLE_POOL
+  if (old_sz <= POOL_MAX_SIZE || new_sz <= POOL_MAX_SIZE) {
+    // a pooled block only grows within its size class
+    if (old_sz > POOL_MAX_SIZE || new_sz > POOL_MAX_SIZE ||
+        POOL_CLASS(old_sz) != POOL_CLASS(new_sz))
+      return NULL;
+    new_arr = arr;
+  } else
+#endif
+  {
+    new_arr = realloc(arr, new_sz);
+    if (new_arr == NULL)
+      vm_out_of_memory();
+  }
+
+  if (new_sz > old_sz)
+    memset(new_arr + old_sz, 0, new_sz - old_sz);
+  if (new_arr == arr)
+    ALLOC_STAT(resized);
+  else
+    ALLOC_STAT(moved);
+  return new_arr;
+}
+
+static void make_room(size_t size);
+
+// set between gc_hold() and gc_unhold()
+static bool held;
+
+void gc_hold() {
+  held = true;
+}
+
+void gc_unhold() {
+  held = false;
+}
+
+/* count_bytes: count the bytes allocated going from @old_sz to @new_sz, and
+ * collect garbage once it is time to. */
+static void count_bytes(size_t old_sz, size_t new_sz) {
+  if (held) {
+    // no collection can make room here, but the limit still holds
+    if (new_sz > old_sz &&
+        vm.gc.allocated + (new_sz - old_sz) > vm.gc.config.heap_limit)
+      vm_out_of_memory();
+    vm.gc.allocated += (new_sz - old_sz);
+    return;
+  }
+  if (new_sz > old_sz &&
+      vm.gc.allocated + (new_sz - old_sz) > vm.gc.config.heap_limit)
+    make_room(new_sz - old_sz);
   vm.gc.allocated += (new_sz - old_sz);
 
   if (new_sz > old_sz) {
+#ifdef LAZY_SWEEP
+    if (vm.gc.sweep != NULL)
+      sweep_some(GC_SWEEP_WORK);
+#endif
 #ifdef DBG_STRESS_GC
     collect_garbage();
 #else
-    if (vm.gc.allocated >= vm.gc.threshold) {
+    if (vm.gc.allocated >= vm.gc.young_limit) {
       collect_garbage();
     }
 #endif
   }
+}
+
+void* reallocate(void* arr, size_t old_sz, size_t new_sz) {
+  count_bytes(old_sz, new_sz);
 
   if (new_sz == 0) {
-    free(arr);
+    release(arr, old_sz);
     return NULL;
   }
 
-  void* new_arr = calloc(new_sz, sizeof(uint8_t));
-  if (new_arr == NULL)
-    exit(1);
-  memcpy(new_arr, arr, old_sz);
-  free(arr);
+  void* new_arr = resize(arr, old_sz, new_sz);
+  if (new_arr != NULL)
+    return new_arr;
 
+  new_arr = allocate(new_sz);
+  if (arr != NULL) {
+    memcpy(new_arr, arr, old_sz < new_sz ? old_sz : new_sz);
+    release(arr, old_sz);
+    ALLOC_STAT(moved);
+  }
   return new_arr;
 }
 
+Obj* gc_allocate(size_t size) {
+  count_bytes(0, size);
+
+  Obj* obj = take_object_block(size);
+  memset(obj, 0, size);
+  Page* page = OBJ_PAGE(obj);
+  uint32_t bit = OBJ_BIT(obj);
+  page->live[bit / 64] |= BIT_MASK(bit);
+  page->young = true;
+  return obj;
+}
+
 void free_string_obj(StringObj* obj) {
-  FREE_ARRAY(char, obj->chars, obj->length + 1);
-  FREE(StringObj, obj);
+  // a rope has no characters, and a flattened one shares those of @left
+  if (obj->left == NULL)
+    FREE_ARRAY(char, obj->chars, obj->length + 1);
+  release_object(&obj->obj, sizeof(StringObj));
 }
 
 void free_function_obj(FunctionObj* obj) {
+  jit_free(obj);
+  trace_free(obj);
   chunk_free(&obj->chunk);
-  FREE(FunctionObj, obj);
+  release_object(&obj->obj, sizeof(FunctionObj));
 }
 
 void free_closure_obj(ClosureObj* obj) {
-  FREE(ClosureObj, obj);
+  FREE_ARRAY(UpvalueObj*, obj->upvalues, obj->upval_count);
+  release_object(&obj->obj, sizeof(ClosureObj));
 }
 
 void free_upvalue_obj(UpvalueObj* obj) {
-  FREE(UpvalueObj, obj);
+  release_object(&obj->obj, sizeof(UpvalueObj));
 }
 
 void free_native_fn_obj(NativeFnObj* obj) {
-  FREE(NativeFnObj, obj);
+  release_object(&obj->obj, sizeof(NativeFnObj));
 }
 
 void free_class_obj(ClassObj* obj) {
   table_free(&obj->methods);
-  FREE(ClassObj, obj);
+  Shape_free(obj->shape);
+  release_object(&obj->obj, sizeof(ClassObj));
+}
+
+void free_bound_method_obj(BoundMethodObj* obj) {
+  release_object(&obj->obj, sizeof(BoundMethodObj));
 }
 
 void free_instance_obj(InstanceObj* instance) {
-  table_free(&(instance->fields));
+  if (instance->fields != instance->inline_fields)
+    FREE_ARRAY(Value, instance->fields, instance->field_capacity);
   instance->klass = NULL;
-  FREE(InstanceObj, instance);
+  release_object(&instance->obj, sizeof(InstanceObj) +
+                                     sizeof(Value) * instance->inline_capacity);
 }
 
 void free_object(Obj* object) {
@@ -111,17 +672,215 @@ void free_object(Obj* object) {
     case OBJ_INSTANCE:
       free_instance_obj((InstanceObj*)object);
       break;
+    case OBJ_BOUND_METHOD:
+      free_bound_method_obj((BoundMethodObj*)object);
+      break;
     default:
       break;
   }
 }
 
+/** sweep_page: Free the unmarked objects of @page, scanning its bitmaps. */
+static void sweep_page(Page* page) {
+  page->young = false;
+#ifdef LAZY_SWEEP
+  page->unswept = false;
+#endif
+  for (uint32_t i = 0; i < PAGE_BITMAP_WORDS; i++) {
+    uint64_t dead = page->live[i] & ~page->marks[i];
+    while (dead != 0) {
+      uint32_t bit = i * 64 + __builtin_ctzll(dead);
+      dead &= dead - 1;
+      free_object((Obj*)((char*)page + bit * POOL_GRANULE));
+    }
+  }
+}
+
+/** sweep_large_pages: Sweep the pages of the large objects allocated since
+ * the last collection, or all of them if @full, and free the pages left
+ * empty. */
+static void sweep_large_pages(bool full) {
+  Page** link = &large_pages;
+  while (*link != NULL) {
+    Page* page = *link;
+    if (full || page->young)
+      sweep_page(page);
+    uint32_t bit = OBJ_BIT(large_object(page));
+    if (page->live[bit / 64] & BIT_MASK(bit)) {
+      link = &page->next;
+    } else {
+      *link = page->next;
+      free(page);
+    }
+  }
+}
+
+/* unmark_pages: Clear the marks of the pages from @page on. */
+static void unmark_pages(Page* page) {
+  for (; page != NULL; page = page->next) {
+    memset(page->marks, 0, sizeof(page->marks));
+  }
+}
+
+/* page_blocks: the number of blocks of @block_size bytes of a page. */
+static uint32_t page_blocks(uint32_t block_size) {
+  return (POOL_PAGE_SIZE - PAGE_HEADER_SIZE) / block_size;
+}
+
+/* page_objects: the number of objects of @page. */
+static uint32_t page_objects(Page* page) {
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < PAGE_BITMAP_WORDS; i++) {
+    count += __builtin_popcountll(page->live[i]);
+  }
+  return count;
+}
+
+/** fragmentation: The share of the pages of small objects that would be left
+ * empty if the objects of each size class were packed in as few pages as
+ * possible, i.e. the share gc_compact() would return to the system. */
+static double fragmentation() {
+  uint32_t objects[PAGE_CLASSES] = {0};
+  uint32_t total = 0;
+  for (Page* page = small_pages; page != NULL; page = page->next) {
+    objects[POOL_CLASS(page->block_size)] += page_objects(page);
+    total++;
+  }
+  if (total == 0)
+    return 0;
+
+  uint32_t needed = 0;
+  for (uint32_t class = 0; class < PAGE_CLASSES; class++) {
+    uint32_t blocks = page_blocks((class + 1) * POOL_GRANULE);
+    needed += (objects[class] + blocks - 1) / blocks;
+  }
+  return 1 - (double)needed / total;
+}
+
+void gc_visit_objects(void (*visit)(Obj*)) {
+  Page* lists[] = {small_pages, large_pages};
+  for (int i = 0; i < 2; i++) {
+    for (Page* page = lists[i]; page != NULL; page = page->next) {
+      for (uint32_t j = 0; j < PAGE_BITMAP_WORDS; j++) {
+        for (uint64_t live = page->live[j]; live != 0; live &= live - 1) {
+          uint32_t bit = j * 64 + __builtin_ctzll(live);
+          visit((Obj*)((char*)page + bit * POOL_GRANULE));
+        }
+      }
+    }
+  }
+}
+
 void free_objects() {
-  Obj* current_obj = vm.objects;
-  while (current_obj != NULL) {
-    Obj* next = current_obj->next;
-    free_object(current_obj);
-    current_obj = next;
+#ifdef CONCURRENT_GC
+  if (vm.gc.phase == GC_MARKING)
+    finish_marking();
+  free(deferred);
+#endif
+#if GC_MARK_THREADS > 1
+  for (int i = 0; i < GC_MARK_THREADS; i++) {
+    free(workers[i].stack);
+    free(workers[i].shared);
+  }
+#endif
+  unmark_pages(small_pages);
+  unmark_pages(large_pages);
+  for (Page* page = small_pages; page != NULL; page = page->next) {
+    sweep_page(page);
+  }
+  sweep_large_pages(true);
+  while (small_pages != NULL) {
+    Page* next = small_pages->next;
+    free(small_pages);
+    small_pages = next;
+  }
+  for (int i = 0; i < PAGE_CLASSES; i++) {
+    object_free_lists[i] = NULL;
+    object_cursors[i] = object_limits[i] = NULL;
+  }
+  vm.gc.sweep = NULL;
+#ifdef BACKGROUND_FREE
+  stop_freeing();
+#endif
+#ifndef DISABLE_POOL
+  pool_free_pages();
+#endif
+}
+
+/* parse_size: parse @text, a number of bytes followed by an optional K, M
+ * or G suffix, into @size. */
+static bool parse_size(const char* text, size_t* size) {
+  if (*text < '0' || *text > '9')
+    return false;
+  char* end;
+  unsigned long long value = strtoull(text, &end, 10);
+  int shift = 0;
+  switch (*end) {
+    case 'K':
+      shift = 10;
+      break;
+    case 'M':
+      shift = 20;
+      break;
+    case 'G':
+      shift = 30;
+      break;
+  }
+  if (shift > 0)
+    end++;
+  if (*end != '\0' || value > (SIZE_MAX >> shift))
+    return false;
+  *size = (size_t)value << shift;
+  return true;
+}
+
+/* parse_number: parse @text into @number, between @min and @max. */
+static bool parse_number(const char* text, double min, double max,
+                         double* number) {
+  char* end;
+  double value = strtod(text, &end);
+  if (end == text || *end != '\0' || !(value >= min && value <= max))
+    return false;
+  *number = value;
+  return true;
+}
+
+bool gc_configure(GCConfig* config, const char* option, const char* value) {
+  if (strcmp(option, "initial") == 0)
+    return parse_size(value, &config->initial);
+  if (strcmp(option, "grow") == 0)
+    return parse_number(value, 1, GC_GROW_MAX, &config->grow_factor);
+  if (strcmp(option, "min") == 0)
+    return parse_size(value, &config->min_threshold);
+  if (strcmp(option, "max") == 0)
+    return parse_size(value, &config->max_threshold);
+  if (strcmp(option, "limit") == 0)
+    return parse_size(value, &config->heap_limit);
+  if (strcmp(option, "target") == 0)
+    return parse_number(value, 0, 1, &config->target);
+  return false;
+}
+
+void gc_config_init(GCConfig* config) {
+  static const char* const variables[][2] = {
+      {"initial", "CLOX_GC_INITIAL"}, {"grow", "CLOX_GC_GROW"},
+      {"min", "CLOX_GC_MIN"},         {"max", "CLOX_GC_MAX"},
+      {"limit", "CLOX_GC_LIMIT"},     {"target", "CLOX_GC_TARGET"},
+  };
+
+  *config = (GCConfig){
+      .initial = GC_INITIAL_HEAP,
+      .grow_factor = GC_GROW_FACTOR,
+      .min_threshold = GC_MIN_THRESHOLD,
+      .max_threshold = SIZE_MAX,
+      .heap_limit = SIZE_MAX,
+      .target = 0,
+  };
+  for (size_t i = 0; i < sizeof(variables) / sizeof(variables[0]); i++) {
+    const char* value = getenv(variables[i][1]);
+    if (value != NULL && !gc_configure(config, variables[i][0], value))
+      fprintf(stderr, "Ignoring the invalid %s '%s'.\n", variables[i][1],
+              value);
   }
 }
 
@@ -133,7 +892,7 @@ bool mark_object(Obj* obj) {
     return false;
 
 #ifdef DBG_LOG_GC
-  if (!obj->gc_marked) {
+  if (!gc_is_marked(obj)) {
     printf("mark object: ");
     dbg_print_object(obj);
   } else {
@@ -143,22 +902,66 @@ bool mark_object(Obj* obj) {
   printf("\n");
 #endif
 
-  if (obj->gc_marked)
+#if GC_MARK_THREADS > 1
+  if (worker != NULL) {
+    // other workers may reach the object at the same time
+    uint32_t bit = OBJ_BIT(obj);
+    uint64_t mask = BIT_MASK(bit);
+    if (__atomic_fetch_or(&OBJ_PAGE(obj)->marks[bit / 64], mask,
+                          __ATOMIC_RELAXED) &
+        mask)
+      return true;
+    if (!grow_objects(&worker->stack, &worker->capacity, worker->count + 1)) {
+      atomic_store(&mark_failed, true);
+      return true;
+    }
+    worker->stack[worker->count++] = obj;
+    return true;
+  }
+#endif
+
+  if (gc_is_marked(obj))
     return true;
   gc_push(obj);
-  return (obj->gc_marked = true);
+  set_mark(obj);
+  return true;
 }
 
 bool mark_value(Value val) {
   return IS_OBJ(val) && mark_object(AS_OBJ(val));
 }
 
+#ifndef LINEAR_PROBE_TABLE
+static void mark_slots(StringObj** keys, Value* values, uint32_t capacity) {
+  // the slots are freed once moved (see INCREMENTAL_REHASH)
+  if (keys == NULL || values == NULL)
+    return;
+  for (uint32_t i = 0; i < capacity; i++) {
+    StringObj* key = keys[i];
+    if (key != NULL) {
+      mark_object(&key->obj);
+      mark_value(values[i]);
+    }
+  }
+}
+#endif
+
 void mark_table(Table* table) {
-  for (uint32_t i = 0; i < table->capacity; i++) {
-    Entry* current = &(table->entries[i]);
+  uint32_t capacity = GC_READ(table->capacity);
+#ifdef LINEAR_PROBE_TABLE
+  Entry* entries = table->entries;
+  for (uint32_t i = 0; i < capacity; i++) {
+    Entry* current = &entries[i];
     mark_object((Obj*)current->key);
     mark_value(current->value);
   }
+#else
+  mark_slots(table->keys, table->values, capacity);
+#ifdef INCREMENTAL_REHASH
+  uint32_t old_capacity = GC_READ(table->old_capacity);
+  mark_slots(table->old_keys, table->old_values, old_capacity);
+#endif
+#endif
 }
 
 /** mark_vm_roots: Mark all reachable roots
@@ -175,7 +978,11 @@ void mark_vm_roots() {
 #ifdef DBG_LOG_GC
   printf("Start discovering objects from global variable table\n");
 #endif
-  mark_table(&vm.globals);
+  for (uint32_t i = 0; i < vm.globals.size; i++) {
+    mark_value(vm.globals.values[i]);
+    mark_value(vm.global_names.values[i]);
+  }
+  mark_table(&vm.global_slots);
 
 #ifdef DBG_LOG_GC
   printf("Marked all objects reachable global variable table\n");
@@ -213,6 +1020,16 @@ void mark_vm_roots() {
 #endif
 }
 
+/** Mark the field names of @shape and of all shapes reachable from its
+ * transitions. */
+static void mark_shape(Shape* shape) {
+  mark_object((Obj*)shape->name);
+  uint32_t count = GC_READ(shape->transition_count);
+  for (uint32_t i = 0; i < count; i++) {
+    mark_shape(shape->transitions[i]);
+  }
+}
+
 /** Mark all reachable objects from object @obj.
  *
  *  @obj: the starting point to search for other reachable nodes.
@@ -224,6 +1041,12 @@ void mark_reachable_objects(Obj* obj) {
   printf("\n");
 #endif
   switch (obj->type) {
+    case OBJ_STRING: {
+      StringObj* string = (StringObj*)obj;
+      mark_object((Obj*)string->left);
+      mark_object((Obj*)string->right);
+      break;
+    }
     case OBJ_CLOSURE: {
       ClosureObj* closure = (ClosureObj*)obj;
       mark_object((Obj*)closure->function);
@@ -240,8 +1063,23 @@ void mark_reachable_objects(Obj* obj) {
       FunctionObj* function = (FunctionObj*)obj;
       mark_object((Obj*)function->name);
       ValueArr* const_pool = &(function->chunk.constants);
-      for (size_t i = 0; i < const_pool->size; i++) {
-        mark_value(const_pool->values[i]);
+      uint32_t const_count = GC_READ(const_pool->size);
+      Value* constants = const_pool->values;
+      for (uint32_t i = 0; i < const_count; i++) {
+        mark_value(constants[i]);
+      }
+
+      // keep the classes owning the shapes recorded by the inline caches
+      // alive, so that the shapes aren't freed while a cache refers to them.
+      uint32_t cache_count = GC_READ(function->chunk.cache_count);
+      InlineCache* caches = function->chunk.caches;
+      for (uint32_t i = 0; i < cache_count; i++) {
+        InlineCache* cache = &caches[i];
+        for (int j = 0; j < IC_POLY_MAX; j++) {
+          if (cache->entries[j].shape != NULL)
+            mark_object((Obj*)cache->entries[j].shape->klass);
+          mark_object((Obj*)cache->entries[j].method);
+        }
       }
       break;
     }
@@ -257,12 +1095,20 @@ void mark_reachable_objects(Obj* obj) {
       mark_object((Obj*)obj);
       ClassObj* klass = (ClassObj*)obj;
       mark_table(&klass->methods);
+      mark_shape(klass->shape);
       break;
     }
     case OBJ_INSTANCE: {
       InstanceObj* instance = (InstanceObj*)obj;
       mark_object((Obj*)instance->klass);
-      mark_table(&(instance->fields));
+      // the shape may be ahead of the array of fields, while a field is added
+      uint32_t count = GC_READ(instance->field_capacity);
+      Value* fields = instance->fields;
+      if (instance->shape->field_count < count)
+        count = instance->shape->field_count;
+      for (uint32_t i = 0; i < count; i++) {
+        mark_value(fields[i]);
+      }
       break;
     }
     case OBJ_BOUND_METHOD: {
@@ -276,6 +1122,129 @@ void mark_reachable_objects(Obj* obj) {
   }
 }
 
+#if GC_MARK_THREADS > 1
+/* move_objects: move @count objects from @src to the array @dst of
+ * @*count_dst objects and @*capacity_dst capacity. return false if @dst
+ * can't grow to hold them. */
+static bool move_objects(Obj** src,
+                         uint32_t count,
+                         Obj*** dst,
+                         uint32_t* count_dst,
+                         uint32_t* capacity_dst) {
+  if (!grow_objects(dst, capacity_dst, *count_dst + count))
+    return false;
+  memcpy(*dst + *count_dst, src, count * sizeof(Obj*));
+  *count_dst += count;
+  return true;
+}
+
+/* share: make the bottom half of the gray stack of @self stealable. */
+static void share(MarkWorker* self) {
+  uint32_t half = self->count / 2;
+  mtx_lock(&self->lock);
+  bool moved = move_objects(self->stack, half, &self->shared,
+                            &self->shared_count, &self->shared_capacity);
+  mtx_unlock(&self->lock);
+  // the objects not shared are simply kept
+  if (!moved)
+    return;
+  memmove(self->stack, self->stack + half,
+          (self->count - half) * sizeof(Obj*));
+  self->count -= half;
+}
+
+/* steal: move the objects shared by a worker, @self first, to the gray stack
+ * of @self. return false if none was shared. */
+static bool steal(MarkWorker* self) {
+  for (int i = 0; i < GC_MARK_THREADS; i++) {
+    MarkWorker* victim = &workers[(self - workers + i) % GC_MARK_THREADS];
+    mtx_lock(&victim->lock);
+    uint32_t count = victim->shared_count;
+    if (count > 0) {
+      if (!move_objects(victim->shared, count, &self->stack, &self->count,
+                        &self->capacity))
+        atomic_store(&mark_failed, true);
+      victim->shared_count = 0;
+    }
+    mtx_unlock(&victim->lock);
+    if (count > 0)
+      return true;
+  }
+  return false;
+}
+
+/* mark_work: traverse the gray objects of the worker @arg, then steal the
+ * objects of the others until all of the workers are idle. */
+static int mark_work(void* arg) {
+  MarkWorker* self = arg;
+  worker = self;
+  uint32_t traversed = 0;
+  while (true) {
+    while (self->count > 0) {
+      mark_reachable_objects(self->stack[--self->count]);
+      if (++traversed % 64 == 0 && self->count > 1 &&
+          atomic_load_explicit(&idle_workers, memory_order_relaxed) > 0)
+        share(self);
+    }
+    if (steal(self))
+      continue;
+
+    // a worker only shares objects while it isn't idle: once all of them
+    // are, there is nothing left to steal.
+    atomic_fetch_add(&idle_workers, 1);
+    while (!steal(self)) {
+      if (atomic_load(&idle_workers) == GC_MARK_THREADS) {
+        worker = NULL;
+        return 0;
+      }
+      thrd_yield();
+    }
+    atomic_fetch_sub(&idle_workers, 1);
+  }
+}
+
+/** mark_in_parallel: Traverse the objects of the gray stack and the objects
+ * reachable from them with GC_MARK_THREADS workers, among which the roots are
+ * dealt. */
+static void mark_in_parallel() {
+  static bool ready = false;
+  if (!ready) {
+    for (int i = 0; i < GC_MARK_THREADS; i++) {
+      if (mtx_init(&workers[i].lock, mtx_plain) != thrd_success)
+        exit(1);
+    }
+    ready = true;
+  }
+
+  for (uint32_t i = 0; i < vm.gc.count; i++) {
+    MarkWorker* w = &workers[i % GC_MARK_THREADS];
+    if (!move_objects(&vm.gc.objects[i], 1, &w->stack, &w->count,
+                      &w->capacity))
+      atomic_store(&mark_failed, true);
+  }
+  vm.gc.count = 0;
+
+  atomic_store(&idle_workers, 0);
+  thrd_t threads[GC_MARK_THREADS];
+  for (int i = 1; i < GC_MARK_THREADS; i++) {
+    if (thrd_create(&threads[i], mark_work, &workers[i]) != thrd_success)
+      exit(1);
+  }
+  mark_work(&workers[0]);
+  for (int i = 1; i < GC_MARK_THREADS; i++) {
+    thrd_join(threads[i], NULL);
+  }
+
+  if (atomic_load(&mark_failed)) {
+    // the objects left unmarked may be reachable: the next collection is a
+    // full one, marking the heap again from the start.
+    atomic_store(&mark_failed, false);
+    vm.gc.threshold = 0;
+    vm_out_of_memory();
+  }
+}
+#endif
+
 void discover_all_reachable() {
   while (!gc_empty()) {
     Obj* obj = gc_pop();
@@ -288,32 +1257,363 @@ void discover_all_reachable() {
   }
 }
 
-void sweep_unreachable() {
-  Obj* prev = NULL;
-  Obj* current = vm.objects;
+void gc_remember(Obj* obj) {
+  if (obj->gc_remembered)
+    return;
+
+  if (vm.gc.remembered_count == vm.gc.remembered_capacity) {
+    int new_cap = GROW_CAPACITY(vm.gc.remembered_capacity);
+    Obj** remembered = realloc(vm.gc.remembered, new_cap * sizeof(Obj*));
+    if (remembered == NULL)
+      vm_out_of_memory();
+    vm.gc.remembered = remembered;
+    vm.gc.remembered_capacity = new_cap;
+  }
+
+  obj->gc_remembered = true;
+  vm.gc.remembered[vm.gc.remembered_count++] = obj;
+}
+
+/** trace_remembered: Mark the objects reachable from the old objects of the
+ * remembered set, which aren't traversed otherwise by a minor collection.
+ * The unmarked ones, only remembered by a concurrent collection, are
+ * traversed if they are reached. */
+static void trace_remembered() {
+  for (uint32_t i = 0; i < vm.gc.remembered_count; i++) {
+    if (gc_is_marked(vm.gc.remembered[i]))
+      mark_reachable_objects(vm.gc.remembered[i]);
+  }
+}
+
+/** forget_remembered: Empty the remembered set. Once the young objects are
+ * promoted or freed, no old object refers to a young one. */
+static void forget_remembered() {
+  for (uint32_t i = 0; i < vm.gc.remembered_count; i++) {
+    vm.gc.remembered[i]->gc_remembered = false;
+  }
+  vm.gc.remembered_count = 0;
+}
+
+static double now() {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/** The adaptive policy, see @target in GCConfig.
+ *
+ * @cycle_start: when the last full collection ended.
+ * @collecting: the seconds spent collecting since.
+ * @pause_start: when the collection in progress started, 0 outside of
+ * collections. */
+static double cycle_start;
+static double collecting;
+static double pause_start;
+
+/** next_threshold: The threshold of the next full collection, once the last
+ * one left vm.gc.allocated bytes. With a target, the grow factor is first
+ * adjusted to the share of the time spent collecting since the previous full
+ * collection: it grows as much as that share exceeds the target, up to twice,
+ * or shrinks as much as it falls short, down to half. */
+static size_t next_threshold() {
+  GCConfig* config = &vm.gc.config;
+  if (config->target > 0) {
+    double time = now();
+    if (pause_start > 0) {
+      collecting += time - pause_start;
+      pause_start = time;
+    }
+    if (cycle_start > 0 && time > cycle_start) {
+      double ratio = collecting / (time - cycle_start) / config->target;
+      if (ratio < 0.5)
+        ratio = 0.5;
+      else if (ratio > 2)
+        ratio = 2;
+      double grow_factor = 1 + (config->grow_factor - 1) * ratio;
+      if (grow_factor < GC_GROW_MIN)
+        grow_factor = GC_GROW_MIN;
+      else if (grow_factor > GC_GROW_MAX)
+        grow_factor = GC_GROW_MAX;
+      config->grow_factor = grow_factor;
+    }
+    cycle_start = time;
+    collecting = 0;
+  }
+
+  double threshold = vm.gc.allocated * config->grow_factor;
+  if (threshold >= (double)config->max_threshold)
+    return config->max_threshold;
+  if (threshold < config->min_threshold)
+    return config->min_threshold;
+  return threshold;
+}
+
+#ifdef LAZY_SWEEP
+/** sweep_lazily: Sweep @page, left unswept by the last full collection. The
+ * freed bytes don't make room for young objects. */
+static void sweep_lazily(Page* page) {
+  size_t allocated = vm.gc.allocated;
+  sweep_page(page);
+  vm.gc.old_allocated -= allocated - vm.gc.allocated;
+#ifndef DISABLE_GENERATIONS
+  vm.gc.young_limit -= allocated - vm.gc.allocated;
+#endif
+}
+
+/** sweep_some: Sweep the next @count pages left unswept by the last full
+ * collection. Once all of them are swept, set the threshold of the next full
+ * collection from the bytes left. */
+static void sweep_some(uint32_t count) {
+  Page** link = vm.gc.sweep;
+  for (; count > 0 && *link != NULL; count--) {
+    if ((*link)->unswept)
+      sweep_lazily(*link);
+    link = &(*link)->next;
+  }
+
+  if (*link != NULL) {
+    vm.gc.sweep = link;
+    return;
+  }
+  vm.gc.sweep = NULL;
+  vm.gc.threshold = next_threshold();
+#ifdef DISABLE_GENERATIONS
+  vm.gc.young_limit = vm.gc.threshold;
+#endif
+#ifdef COMPACT_GC
+  if (fragmentation() * 100 >= GC_COMPACT_THRESHOLD)
+    vm.gc.compact = true;
+#endif
+}
+#endif
+
+/** sweep_pages: Free the unmarked objects of the pages where objects were
+ * allocated since the last collection, or of every page if @full. The others
+ * stay marked, i.e. old.
+ *
+ * With LAZY_SWEEP, a full collection only sweeps the large objects, and
+ * leaves the other pages to sweep_some(). */
+static void sweep_pages(bool full) {
+#ifdef LAZY_SWEEP
+  if (full) {
+    for (Page* page = small_pages; page != NULL; page = page->next) {
+      page->unswept = true;
+    }
+    vm.gc.sweep = &small_pages;
+    sweep_large_pages(true);
+    return;
+  }
+#endif
+  for (Page* page = small_pages; page != NULL; page = page->next) {
+    if (full || page->young)
+      sweep_page(page);
+  }
+  sweep_large_pages(full);
+}
+
+#ifdef DBG_GC_STATS
+static struct {
+  uint32_t minor;
+  uint32_t full;
+  uint32_t slices;  // of the incremental marking
+  double total;     // seconds spent collecting
+  double marking;   // seconds spent traversing the heap in full collections
+  double max_pause;
+  uint32_t compactions;
+  uint32_t pages_freed;  // by the compactions
+  // the fragmentation before and after the last compaction
+  double fragmented;
+  double compacted;
+} gc_stats;
+
+static void record_pause(double start) {
+  double pause = now() - start;
+  gc_stats.total += pause;
+  if (pause > gc_stats.max_pause)
+    gc_stats.max_pause = pause;
+}
+
+void gc_print_stats() {
+  fprintf(stderr,
+          "[gc] %u minor, %u full, %u slices, %.3f ms in total, "
+          "%.3f ms marking full collections, %.0f us max pause\n",
+          gc_stats.minor, gc_stats.full, gc_stats.slices, gc_stats.total * 1e3,
+          gc_stats.marking * 1e3, gc_stats.max_pause * 1e6);
+  if (gc_stats.compactions > 0)
+    fprintf(stderr,
+            "[gc] %u compactions, %u pages freed, last one from %.1f%% to "
+            "%.1f%% fragmentation\n",
+            gc_stats.compactions, gc_stats.pages_freed,
+            gc_stats.fragmented * 100, gc_stats.compacted * 100);
+}
+#endif
 
-  while (current != NULL) {
-    if (current->gc_marked) {
-      // Reset the gc_marked state for the next garbage-collecting turn
-      current->gc_marked = false;
-      prev = current;
-      current = current->next;
+#ifdef INCREMENTAL_GC
+/** mark_slice: Advance the collection cycle in progress by GC_SLICE_WORK
+ * pages unmarked or objects traversed, or for GC_SLICE_US microseconds when
+ * it is defined, whichever comes first.
+ *
+ * The cycle first unmarks the pages, from vm.gc.cursor on. Then it
+ * marks the roots and traverses the gray objects, as well as the black ones
+ * remembered by gc_write_barrier() for having been given a reference to a
+ * white object since.
+ *
+ * return value: true once there is nothing left to traverse.
+ * */
+static bool mark_slice() {
+#ifdef GC_SLICE_US
+  double deadline = now() + GC_SLICE_US * 1e-6;
+#endif
+
+  for (uint32_t work = 1; work <= GC_SLICE_WORK; work++) {
+    if (vm.gc.phase == GC_UNMARKING) {
+      if (vm.gc.cursor == NULL) {
+        // the objects remembered so far are white now
+        forget_remembered();
+        mark_vm_roots();
+        mark_compiler_roots();
+        vm.gc.phase = GC_MARKING;
+      } else {
+        memset(vm.gc.cursor->marks, 0, sizeof(vm.gc.cursor->marks));
+        vm.gc.cursor = vm.gc.cursor->next;
+      }
+    } else if (!gc_empty()) {
+      mark_reachable_objects(gc_pop());
+    } else if (vm.gc.remembered_count > 0) {
+      Obj* obj = vm.gc.remembered[--vm.gc.remembered_count];
+      obj->gc_remembered = false;
+      mark_reachable_objects(obj);
     } else {
-      // The object is unreachable, delete it
-      Obj* unreachable = current;
-      current = current->next;
-      if (prev == NULL)
-        vm.objects = current;
-      else
-        prev->next = current;
-      free_object(unreachable);
+      return true;
     }
+
+#ifdef GC_SLICE_US
+    if (work % 64 == 0 && now() >= deadline)
+      break;
+#endif
   }
+  return false;
 }
+#endif
+
+#ifdef CONCURRENT_GC
+/** mark_concurrently: The marking thread. Mark the objects reachable from the
+ * roots left in the gray stack by start_marking(). */
+static int mark_concurrently(void* unused) {
+  (void)unused;
+  discover_all_reachable();
+  atomic_store(&marker_done, true);
+  return 0;
+}
+
+/** start_marking: The initial pause of a concurrent collection. Clear the
+ * marks, which only takes clearing the bitmaps of the pages, mark the roots
+ * and start the marking thread.
+ *
+ * Until finish_marking(), the program must neither read nor write the marks,
+ * nor free the memory the marking thread may read: gc_write_barrier()
+ * remembers every object given a reference instead, and release() defers
+ * the frees. */
+static void start_marking() {
+  // the objects remembered so far will be traversed by the marking thread
+  forget_remembered();
+  unmark_pages(small_pages);
+  unmark_pages(large_pages);
+  mark_vm_roots();
+  mark_compiler_roots();
+
+  atomic_store(&marker_done, false);
+  vm.gc.phase = GC_MARKING;
+  if (thrd_create(&marker, mark_concurrently, NULL) != thrd_success)
+    exit(1);
+}
+
+/** finish_marking: Wait for the marking thread, and free the memory released
+ * meanwhile. */
+static void finish_marking() {
+  thrd_join(marker, NULL);
+  vm.gc.phase = GC_IDLE;
+  for (uint32_t i = 0; i < deferred_count; i++) {
+    release(deferred[i].arr, deferred[i].size);
+  }
+  deferred_count = 0;
+}
+#endif
+
+// set to run a full collection to the end, see make_room()
+static bool collect_fully;
+
+/** collect: The collection run by collect_garbage(). */
+static void collect() {
+#ifdef DISABLE_GENERATIONS
+  bool full = true;
+#else
+  bool full = collect_fully || vm.gc.old_allocated >= vm.gc.threshold;
+#endif
+#ifdef DBG_GC_STATS
+  double start = now();
+#endif
+#ifdef LAZY_SWEEP
+  // the garbage left by the last full collection is unmarked as well
+  if (full && vm.gc.sweep != NULL)
+    sweep_some(UINT32_MAX);
+#endif
+
+#ifdef INCREMENTAL_GC
+  // a full collection is a cycle of slices, without minor collections until
+  // it ends with the final pause below.
+  if (full && vm.gc.phase == GC_IDLE) {
+    vm.gc.phase = GC_UNMARKING;
+    unmark_pages(large_pages);
+    vm.gc.cursor = small_pages;
+  }
+  while (vm.gc.phase != GC_IDLE && !mark_slice()) {
+    if (!collect_fully) {
+      vm.gc.young_limit = vm.gc.allocated + GC_SLICE_BYTES;
+#ifdef DBG_GC_STATS
+      gc_stats.slices++;
+      record_pause(start);
+#endif
+      return;
+    }
+  }
+  // the old objects remembered since the marking began are black, and have
+  // to be traversed again.
+  bool rescan = true;
+#elif defined(CONCURRENT_GC)
+  // the heap is marked by another thread, while the program runs until it
+  // allocates once the thread is done, or once the heap has grown by
+  // the grow factor. The final pause below then marks the roots again and
+  // traverses the objects remembered meanwhile.
+  if (full && vm.gc.phase == GC_IDLE) {
+    start_marking();
+    if (!collect_fully) {
+      vm.gc.young_limit = vm.gc.allocated + GC_SLICE_BYTES;
+#ifdef DBG_GC_STATS
+      record_pause(start);
+#endif
+      return;
+    }
+  }
+  if (vm.gc.phase == GC_MARKING) {
+    if (!collect_fully && !atomic_load(&marker_done) &&
+        vm.gc.allocated < vm.gc.threshold * vm.gc.config.grow_factor) {
+      vm.gc.young_limit = vm.gc.allocated + GC_SLICE_BYTES;
+      return;
+    }
+    finish_marking();
+  }
+  bool rescan = true;
+#else
+  if (full) {
+    unmark_pages(small_pages);
+    unmark_pages(large_pages);
+  }
+  bool rescan = !full;
+#endif
 
-void collect_garbage() {
 #ifdef DBG_LOG_GC
-  printf("== begin gc ==\n");
+  printf("== begin %s gc ==\n", full ? "full" : "minor");
 #endif
 
 #ifdef DBG_LOG_GC
@@ -332,13 +1632,413 @@ void collect_garbage() {
   printf("gc finishes mark_compiler_roots\n");
 #endif
 
+#ifdef DBG_GC_STATS
+  double mark_start = now();
+#endif
+  if (rescan)
+    trace_remembered();
+#if GC_MARK_THREADS > 1
+  if (full)
+    mark_in_parallel();
+#endif
   discover_all_reachable();
-  table_remove_unmarked_object(&vm.strings);
-  sweep_unreachable();
+#ifdef DBG_GC_STATS
+  if (full)
+    gc_stats.marking += now() - mark_start;
+#endif
+  forget_remembered();
+  string_set_remove_unmarked(&vm.strings);
+  sweep_pages(full);
+  vm.gc.phase = GC_IDLE;
 
 #ifdef DBG_LOG_GC
   printf("== end gc ==\n");
 #endif
 
-  vm.gc.threshold = vm.gc.allocated * GC_GROW_FACTOR;
+  if (full) {
+#ifdef LAZY_SWEEP
+    // set once the garbage is freed, see sweep_some()
+    vm.gc.threshold = SIZE_MAX;
+#else
+    vm.gc.threshold = next_threshold();
+#ifdef COMPACT_GC
+    if (fragmentation() * 100 >= GC_COMPACT_THRESHOLD)
+      vm.gc.compact = true;
+#endif
+#endif
+  }
+  vm.gc.old_allocated = vm.gc.allocated;
+#ifdef DISABLE_GENERATIONS
+  vm.gc.young_limit = vm.gc.threshold;
+#else
+  vm.gc.young_limit = vm.gc.allocated + GC_NURSERY_SIZE;
+#endif
+
+#ifdef DBG_GC_STATS
+  if (full)
+    gc_stats.full++;
+  else
+    gc_stats.minor++;
+  record_pause(start);
+#endif
+}
+
+void collect_garbage() {
+  if (vm.gc.config.target == 0) {
+    collect();
+    return;
+  }
+  pause_start = now();
+  collect();
+  collecting += now() - pause_start;
+  pause_start = 0;
+}
+
+/** make_room: Free all of the garbage, for @size more bytes to fit in the
+ * heap limit. Fail with an out of memory error if they still don't. */
+static void make_room(size_t size) {
+  collect_fully = true;
+  collect_garbage();
+  collect_fully = false;
+#ifdef LAZY_SWEEP
+  if (vm.gc.sweep != NULL)
+    sweep_some(UINT32_MAX);
+#endif
+  if (vm.gc.allocated + size > vm.gc.config.heap_limit)
+    vm_out_of_memory();
+}
+
+/** Compaction: the pages of small objects of each size class are sorted by
+ * the number of objects they hold. The fullest ones are kept, as many as
+ * needed to hold all of the objects of the class, and the objects of the
+ * others are moved to the free blocks of the pages kept. A moved object
+ * leaves its new address in the word following its header, read by
+ * forward() to update the references to it. The large objects don't move.
+ */
+#define FORWARDING(obj) (*(Obj**)((char*)(obj) + sizeof(Obj)))
+
+typedef struct {
+  Page* page;
+  uint32_t objects;
+} PageUse;
+
+/* compare_uses: order the pages by size class, then the fullest first. */
+static int compare_uses(const void* a, const void* b) {
+  const PageUse* left = a;
+  const PageUse* right = b;
+  if (left->page->block_size != right->page->block_size)
+    return left->page->block_size < right->page->block_size ? -1 : 1;
+  if (left->objects != right->objects)
+    return left->objects > right->objects ? -1 : 1;
+  return 0;
+}
+
+/* move_object: move @obj to the block @block of its size class. */
+static void move_object(Obj* obj, Obj* block) {
+  Page* page = OBJ_PAGE(obj);
+  memcpy(block, obj, page->block_size);
+
+  // the pointers of the object into itself
+  switch (obj->type) {
+    case OBJ_UPVALUE: {
+      UpvalueObj* upvalue = (UpvalueObj*)block;
+      if (upvalue->value == &((UpvalueObj*)obj)->cloned)
+        upvalue->value = &upvalue->cloned;
+      break;
+    }
+    case OBJ_INSTANCE: {
+      InstanceObj* instance = (InstanceObj*)block;
+      if (instance->fields == ((InstanceObj*)obj)->inline_fields)
+        instance->fields = instance->inline_fields;
+      break;
+    }
+    default:
+      break;
+  }
+
+  Page* dest = OBJ_PAGE(block);
+  uint32_t bit = OBJ_BIT(block);
+  dest->live[bit / 64] |= BIT_MASK(bit);
+  if (gc_is_marked(obj))
+    dest->marks[bit / 64] |= BIT_MASK(bit);
+  else
+    dest->young = true;
+  FORWARDING(obj) = block;
+}
+
+/** evacuate: Move the objects of the pages of @uses but the first @kept ones,
+ * all of a size class, to the free blocks of the first @kept ones. Those
+ * blocks make up the free list of the class afterwards. */
+static void evacuate(PageUse* uses, uint32_t kept, uint32_t count) {
+  uint32_t block_size = uses[0].page->block_size;
+  uint32_t class = POOL_CLASS(block_size);
+  uint32_t blocks = page_blocks(block_size);
+
+  // the free blocks of the fullest page come first
+  ObjBlock* free_list = NULL;
+  for (uint32_t i = kept; i-- > 0;) {
+    Page* page = uses[i].page;
+    for (uint32_t j = blocks; j-- > 0;) {
+      Obj* block = (Obj*)((char*)page + PAGE_HEADER_SIZE + j * block_size);
+      uint32_t bit = OBJ_BIT(block);
+      if (!(page->live[bit / 64] & BIT_MASK(bit))) {
+        ((ObjBlock*)block)->next = free_list;
+        free_list = (ObjBlock*)block;
+      }
+    }
+  }
+
+  for (uint32_t i = kept; i < count; i++) {
+    Page* page = uses[i].page;
+    page->evacuated = true;
+    for (uint32_t j = 0; j < PAGE_BITMAP_WORDS; j++) {
+      for (uint64_t live = page->live[j]; live != 0; live &= live - 1) {
+        uint32_t bit = j * 64 + __builtin_ctzll(live);
+        Obj* block = (Obj*)free_list;
+        free_list = free_list->next;
+        move_object((Obj*)((char*)page + bit * POOL_GRANULE), block);
+      }
+    }
+  }
+
+  object_free_lists[class] = free_list;
+  object_cursors[class] = object_limits[class] = NULL;
+}
+
+/* forward: the address of @obj, which may have moved. */
+static Obj* forward(Obj* obj) {
+  if (obj != NULL && OBJ_PAGE(obj)->evacuated)
+    return FORWARDING(obj);
+  return obj;
+}
+
+#define FORWARD(ptr) ((ptr) = (void*)forward((Obj*)(ptr)))
+
+static void forward_value(Value* value) {
+  if (IS_OBJ(*value))
+    *value = OBJ_VAL(*forward(AS_OBJ(*value)));
+}
+
+static void forward_table(Table* table) {
+#ifdef LINEAR_PROBE_TABLE
+  for (uint32_t i = 0; i < table->capacity; i++) {
+    FORWARD(table->entries[i].key);
+    forward_value(&table->entries[i].value);
+  }
+#else
+  for (uint32_t i = 0; i < table->capacity; i++) {
+    if (table->keys[i] != NULL) {
+      FORWARD(table->keys[i]);
+      forward_value(&table->values[i]);
+    }
+  }
+#ifdef INCREMENTAL_REHASH
+  for (uint32_t i = 0; i < table->old_capacity; i++) {
+    if (table->old_keys[i] != NULL) {
+      FORWARD(table->old_keys[i]);
+      forward_value(&table->old_values[i]);
+    }
+  }
+#endif
+#endif
+}
+
+static void forward_string_set(StringSet* set) {
+  for (uint32_t i = 0; i < set->capacity; i++) {
+    FORWARD(set->entries[i].string);
+  }
+#ifdef INCREMENTAL_REHASH
+  for (uint32_t i = 0; i < set->old_capacity; i++) {
+    FORWARD(set->old_entries[i].string);
+  }
+#endif
+}
+
+static void forward_shape(Shape* shape) {
+  FORWARD(shape->klass);
+  FORWARD(shape->name);
+  for (uint32_t i = 0; i < shape->transition_count; i++) {
+    forward_shape(shape->transitions[i]);
+  }
+}
+
+/* forward_object: update the references held by @obj, as traversed by
+ * mark_reachable_objects(). */
+static void forward_object(Obj* obj) {
+  switch (obj->type) {
+    case OBJ_STRING: {
+      StringObj* string = (StringObj*)obj;
+      FORWARD(string->left);
+      FORWARD(string->right);
+      break;
+    }
+    case OBJ_CLOSURE: {
+      ClosureObj* closure = (ClosureObj*)obj;
+      FORWARD(closure->function);
+      for (int i = 0; i < closure->upval_count; i++) {
+        FORWARD(closure->upvalues[i]);
+      }
+      break;
+    }
+    case OBJ_FUNCTION: {
+      FunctionObj* function = (FunctionObj*)obj;
+      FORWARD(function->name);
+      ValueArr* const_pool = &function->chunk.constants;
+      for (uint32_t i = 0; i < const_pool->size; i++) {
+        forward_value(&const_pool->values[i]);
+      }
+      for (uint32_t i = 0; i < function->chunk.cache_count; i++) {
+        InlineCache* cache = &function->chunk.caches[i];
+        for (int j = 0; j < IC_POLY_MAX; j++) {
+          FORWARD(cache->entries[j].method);
+        }
+      }
+      break;
+    }
+    case OBJ_UPVALUE: {
+      UpvalueObj* upvalue = (UpvalueObj*)obj;
+      forward_value(&upvalue->cloned);
+      FORWARD(upvalue->next);
+      break;
+    }
+    case OBJ_CLASS: {
+      ClassObj* klass = (ClassObj*)obj;
+      FORWARD(klass->name);
+      forward_table(&klass->methods);
+      forward_shape(klass->shape);
+      break;
+    }
+    case OBJ_INSTANCE: {
+      InstanceObj* instance = (InstanceObj*)obj;
+      FORWARD(instance->klass);
+      uint32_t count = instance->field_capacity;
+      if (instance->shape->field_count < count)
+        count = instance->shape->field_count;
+      for (uint32_t i = 0; i < count; i++) {
+        forward_value(&instance->fields[i]);
+      }
+      break;
+    }
+    case OBJ_BOUND_METHOD: {
+      BoundMethodObj* bmethod = (BoundMethodObj*)obj;
+      forward_value(&bmethod->receiver);
+      FORWARD(bmethod->method);
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+/* forward_pages: update the references held by the objects of the pages
+ * from @page on, but those evacuated. */
+static void forward_pages(Page* page) {
+  for (; page != NULL; page = page->next) {
+    if (page->evacuated)
+      continue;
+    for (uint32_t i = 0; i < PAGE_BITMAP_WORDS; i++) {
+      for (uint64_t live = page->live[i]; live != 0; live &= live - 1) {
+        uint32_t bit = i * 64 + __builtin_ctzll(live);
+        forward_object((Obj*)((char*)page + bit * POOL_GRANULE));
+      }
+    }
+  }
+}
+
+/* forward_roots: update the references held by the VM, see
+ * mark_vm_roots(). */
+static void forward_roots() {
+  for (Value* it = vm.stack; it < vm.stack_top; it++) {
+    forward_value(it);
+  }
+  for (uint32_t i = 0; i < vm.globals.size; i++) {
+    forward_value(&vm.globals.values[i]);
+    forward_value(&vm.global_names.values[i]);
+  }
+  forward_table(&vm.global_slots);
+  forward_string_set(&vm.strings);
+  FORWARD(vm.cls_init_strlit);
+  for (uint8_t i = 0; i < vm.frame_count; i++) {
+    FORWARD(vm.frames[i].closure);
+  }
+  FORWARD(vm.open_upvalues);
+  for (uint32_t i = 0; i < vm.gc.remembered_count; i++) {
+    FORWARD(vm.gc.remembered[i]);
+  }
+}
+
+void gc_compact() {
+  if (vm.gc.phase != GC_IDLE)
+    return;
+  vm.gc.compact = false;
+#ifdef LAZY_SWEEP
+  if (vm.gc.sweep != NULL)
+    sweep_some(UINT32_MAX);
+#endif
+  double fragmented = fragmentation();
+  if (fragmented == 0)
+    return;
+#ifdef DBG_GC_STATS
+  double start = now();
+#endif
+
+  uint32_t count = 0;
+  for (Page* page = small_pages; page != NULL; page = page->next) {
+    count++;
+  }
+  PageUse* uses = malloc(count * sizeof(PageUse));
+  // compacting is optional: the heap is left as it is
+  if (uses == NULL)
+    return;
+  count = 0;
+  for (Page* page = small_pages; page != NULL; page = page->next) {
+    uses[count++] = (PageUse){page, page_objects(page)};
+  }
+  qsort(uses, count, sizeof(PageUse), compare_uses);
+
+  // the pages of a size class follow each other, from @first to @last
+  uint32_t last;
+  for (uint32_t first = 0; first < count; first = last) {
+    uint32_t block_size = uses[first].page->block_size;
+    uint32_t objects = 0;
+    for (last = first;
+         last < count && uses[last].page->block_size == block_size; last++) {
+      objects += uses[last].objects;
+    }
+    uint32_t blocks = page_blocks(block_size);
+    uint32_t kept = (objects + blocks - 1) / blocks;
+    if (kept < last - first)
+      evacuate(&uses[first], kept, last - first);
+  }
+  free(uses);
+
+  forward_roots();
+  forward_pages(small_pages);
+  forward_pages(large_pages);
+
+  uint32_t freed = 0;
+  Page** link = &small_pages;
+  while (*link != NULL) {
+    Page* page = *link;
+    if (page->evacuated) {
+      *link = page->next;
+      free(page);
+      freed++;
+    } else {
+      link = &page->next;
+    }
+  }
+
+#ifdef DBG_LOG_GC
+  printf("== compaction: %u pages freed ==\n", freed);
+#endif
+#ifdef DBG_GC_STATS
+  gc_stats.compactions++;
+  gc_stats.pages_freed += freed;
+  gc_stats.fragmented = fragmented;
+  gc_stats.compacted = fragmentation();
+  record_pause(start);
+#else
+  (void)freed;
+#endif
 }
@@ -3,6 +3,7 @@
 #include "native_fns.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 bool _has_attribute(Value value, StringObj* attrname) {
   if (!IS_INSTANCE_OBJ(value)) {
@@ -11,12 +12,19 @@ bool _has_attribute(Value value, StringObj* attrname) {
 
   InstanceObj* instance = AS_INSTANCE(value);
   Value dest;
-  return table_get(&(instance->fields), attrname, &dest);
+  return InstanceObj_get_field(instance, attrname, &dest);
 }
 
 Value native_fn_has_attribute(int param_count, Value* params) {
   assert(param_count == 2);
   Value val = params[0];
-  StringObj* attrname = AS_STRING(params[1]);
+  StringObj* attrname = StringObj_intern(AS_STRING(params[1]));
   return BOOL_VAL(_has_attribute(val, attrname));
 }
+
+Value native_fn_compact(int param_count, Value* params) {
+  assert(param_count == 0);
+  (void)params;
+  vm.gc.compact = true;
+  return NIL_VAL();
+}
@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory.h"
@@ -9,56 +10,48 @@
   (type*)allocate_object(sizeof(type), objectType)
 
 void* allocate_object(size_t size, ObjType type) {
-  Obj* obj_ref = reallocate(NULL, 0, size);
+  /* the new object belongs to virtual machine's young generation */
+  Obj* obj_ref = gc_allocate(size);
   obj_ref->type = type;
-  obj_ref->gc_marked = false;
+  obj_ref->gc_remembered = false;
 
 #ifdef DBG_LOG_GC
   printf("%p allocate %zu for %d\n", (void*)obj_ref, size, type);
 #endif
 
-  /* add the new object to virtual machine's object pool */
-  obj_ref->next = vm.objects;
-  vm.objects = obj_ref;
-
   return obj_ref;
 }
 
-/* hash_string: hash a string using FNV algorithm */
+/* hash_string: hash a string a word at a time. Each 8 characters are mixed
+ * into the state by a multiplication, which spreads them to its high bits,
+ * and a shift, which folds these back. The finalizer of MurmurHash3
+ * avalanches the state at the end, so that the low bits used as an index by
+ * the hash tables depend on all of the characters. */
 uint32_t hash_string(const char* s, int length) {
-  uint32_t hashcode = 2166136261u;       // FNV offset basis
-  const uint32_t fnv_prime = 16777619u;  // FNV prime
-  for (int i = 0; i < length; i++) {
-    hashcode ^= s[i];
-    hashcode *= fnv_prime;
+  const uint64_t multiplier = 0x9e3779b97f4a7c15u;
+  uint64_t hashcode = (uint64_t)length * multiplier;
+  int i = 0;
+  for (; i + 8 <= length; i += 8) {
+    uint64_t word;
+    memcpy(&word, s + i, sizeof(word));
+    hashcode = (hashcode ^ word) * multiplier;
+    hashcode ^= hashcode >> 32;
   }
-  return hashcode;
-}
-
-/* return the entry containing a string that is the same as @chars or
- * an empty entry. */
-Entry* find_existing_string_entry(const char* chars,
-                                  size_t length,
-                                  uint32_t hashcode) {
-  if (vm.strings.capacity == 0)
-    return NULL;
-  uint32_t start = hashcode % vm.strings.capacity;
-  Entry* entry = NULL;
-  for (uint32_t i = 0; i < vm.strings.capacity; i++) {
-    uint32_t entry_idx = (start + i) % vm.strings.capacity;
-    entry = &vm.strings.entries[entry_idx];
-    if (entry->key != NULL) {
-      StringObj* current_str = entry->key;
-      if (current_str->length == length &&
-          memcmp(current_str->chars, chars, length) == 0) {
-        return entry;
-      }
-    } else if (!entry->tombstone) {
-      return entry;
+  if (i < length) {
+    uint64_t word = 0;
+    for (int shift = 0; i < length; i++, shift += 8) {
+      word |= (uint64_t)(uint8_t)s[i] << shift;
     }
+    hashcode = (hashcode ^ word) * multiplier;
+    hashcode ^= hashcode >> 32;
   }
 
-  return NULL;
+  hashcode ^= hashcode >> 33;
+  hashcode *= 0xff51afd7ed558ccdu;
+  hashcode ^= hashcode >> 33;
+  hashcode *= 0xc4ceb9fe1a85ec53u;
+  hashcode ^= hashcode >> 33;
+  return (uint32_t)hashcode;
 }
 
 StringObj* StringObj_allocate(char* chars, size_t length, uint32_t hashcode) {
@@ -69,15 +62,20 @@ StringObj* StringObj_allocate(char* chars, size_t length, uint32_t hashcode) {
   return str_obj;
 }
 
+/* intern: add @string, which has no equal string yet, to vm.strings */
+static void intern(StringObj* string) {
+  vm_stack_push(OBJ_VAL(*string));
+  string_set_add(&vm.strings, string);
+  vm_stack_pop();
+}
+
 StringObj* StringObj_construct(const char* chars, size_t length) {
   /* If there is an existing string that is the same as @chars,
-   * we reuse that string.
-   * If there isn't, @entry is the empty entry where we will put the
-   * string object in. */
+   * we reuse that string. */
   uint32_t hashcode = hash_string(chars, length);
-  Entry* entry = find_existing_string_entry(chars, length, hashcode);
-  if (entry != NULL && entry->key != NULL)
-    return entry->key;
+  StringObj* interned = string_set_find(&vm.strings, chars, length, hashcode);
+  if (interned != NULL)
+    return interned;
 
   /* Clone the string, the new string is stored in heap */
   char* str_clone = ALLOCATE(char, length + 1);
@@ -87,29 +85,175 @@ StringObj* StringObj_construct(const char* chars, size_t length) {
   /* Allocate a string object (StringObj) to store the clone string */
   StringObj* str_obj = StringObj_allocate(str_clone, length, hashcode);
 
-  vm_stack_push(OBJ_VAL(*str_obj));
+  /* Add the new string to the string set */
+  intern(str_obj);
 
-  /* Add the new string to the string table */
-  if (entry == NULL) {
-    table_set(&vm.strings, str_obj, NIL_VAL());
-  } else {
-    entry->key = str_obj;
-    entry->value = NIL_VAL();
-    entry->tombstone = false;
-    vm.strings.count++;
-  }
+  return str_obj;
+}
 
-  vm_stack_pop();
+/* take_string: the interned string of the @length characters of @chars, a
+ * block allocated for @length + 1 characters, which the string takes or
+ * else frees. */
+static StringObj* take_string(char* chars, size_t length) {
+  chars[length] = '\0';
+  uint32_t hashcode = hash_string(chars, length);
+  StringObj* interned = string_set_find(&vm.strings, chars, length, hashcode);
+  if (interned != NULL) {
+    FREE_ARRAY(char, chars, length + 1);
+    return interned;
+  }
 
+  StringObj* str_obj = StringObj_allocate(chars, length, hashcode);
+  intern(str_obj);
   return str_obj;
 }
 
+/* join: the interned string of the @count strings of @strings, which aren't
+ * ropes, @length characters in all. */
+static StringObj* join(StringObj** strings, uint32_t count, size_t length) {
+  char buffer[ROPE_MIN_LENGTH];
+  char* chars = length < ROPE_MIN_LENGTH ? buffer : ALLOCATE(char, length + 1);
+  size_t offset = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    memcpy(chars + offset, strings[i]->chars, strings[i]->length);
+    offset += strings[i]->length;
+  }
+  if (chars == buffer)
+    return StringObj_construct(buffer, length);
+  return take_string(chars, length);
+}
+
+StringObj* StringObj_concat(StringObj* left, StringObj* right) {
+  if (left->length == 0)
+    return right;
+  if (right->length == 0)
+    return left;
+
+  size_t total_length = left->length + right->length;
+  if (total_length >= ROPE_MIN_LENGTH) {
+    StringObj* rope = OBJ_ALLOC(StringObj, OBJ_STRING);
+    rope->length = total_length;
+    rope->left = left;
+    rope->right = right;
+    return rope;
+  }
+
+  // both strings are shorter than a rope, hence not ropes
+  StringObj* strings[] = {left, right};
+  return join(strings, 2, total_length);
+}
+
+StringObj* StringObj_concat_n(StringObj** strings, uint32_t count) {
+  // the pieces built aren't reachable until the end
+  gc_hold();
+  StringObj* result = NULL;
+  for (uint32_t i = 0; i < count;) {
+    uint32_t end = i;
+    size_t length = 0;
+    while (end < count && strings[end]->length < ROPE_MIN_LENGTH) {
+      length += strings[end]->length;
+      end++;
+    }
+
+    StringObj* piece = strings[i];
+    if (end == i)
+      end++;
+    else if (end - i > 1)
+      piece = join(&strings[i], end - i, length);
+    result = (result == NULL) ? piece : StringObj_concat(result, piece);
+    i = end;
+  }
+  gc_unhold();
+  return result;
+}
+
+/* A rope left to copy by flatten(), to @chars + @offset. */
+typedef struct {
+  StringObj* rope;
+  uint32_t offset;
+} Piece;
+
+/* flatten: copy the characters of @rope to @chars. The ropes built by
+ * appending (or prepending) to a string are as deep as long: the right
+ * (left) operands are copied on the way down, and only the ropes on both
+ * sides of a concatenation are left for later, in @pieces. */
+static void flatten(StringObj* rope, char* chars) {
+  Piece* pieces = NULL;
+  uint32_t count = 0;
+  uint32_t capacity = 0;
+  uint32_t offset = 0;
+
+  for (;;) {
+    if (rope->chars != NULL) {
+      memcpy(chars + offset, rope->chars, rope->length);
+      if (count == 0)
+        break;
+      count--;
+      rope = pieces[count].rope;
+      offset = pieces[count].offset;
+    } else if (rope->right->chars != NULL) {
+      memcpy(chars + offset + rope->left->length, rope->right->chars,
+             rope->right->length);
+      rope = rope->left;
+    } else if (rope->left->chars != NULL) {
+      memcpy(chars + offset, rope->left->chars, rope->left->length);
+      offset += rope->left->length;
+      rope = rope->right;
+    } else {
+      if (count == capacity) {
+        capacity = GROW_CAPACITY(capacity);
+        pieces = realloc(pieces, capacity * sizeof(Piece));
+        if (pieces == NULL)
+          vm_out_of_memory();
+      }
+      pieces[count++] = (Piece){rope->right, offset + rope->left->length};
+      rope = rope->left;
+    }
+  }
+  free(pieces);
+}
+
+StringObj* StringObj_intern(StringObj* string) {
+  if (string->chars != NULL)
+    return string->left == NULL ? string : string->left;
+
+  gc_hold();
+  char* chars = ALLOCATE(char, string->length + 1);
+  flatten(string, chars);
+  chars[string->length] = '\0';
+
+  uint32_t hashcode = hash_string(chars, string->length);
+  StringObj* interned =
+      string_set_find(&vm.strings, chars, string->length, hashcode);
+  if (interned != NULL) {
+    // share the characters of the equal string, which @left keeps alive
+    FREE_ARRAY(char, chars, string->length + 1);
+    string->chars = interned->chars;
+    string->hashcode = hashcode;
+    string->left = interned;
+    string->right = NULL;
+    gc_write_barrier(&string->obj, OBJ_VAL(interned->obj));
+  } else {
+    string->chars = chars;
+    string->hashcode = hashcode;
+    string->left = string->right = NULL;
+    string_set_add(&vm.strings, string);
+    interned = string;
+  }
+  gc_unhold();
+  return interned;
+}
+
 FunctionObj* FunctionObj_construct() {
   FunctionObj* function = OBJ_ALLOC(FunctionObj, OBJ_FUNCTION);
   function->arity = 0;
   function->upval_count = 0;
+  function->reg_count = 0;
   chunk_init(&function->chunk);
   function->name = NULL;
+  function->jit_code = NULL;
+  function->hotness = 0;
+  function->traces = NULL;
   return function;
 }
 
@@ -121,7 +265,7 @@ ClosureObj* ClosureObj_construct(FunctionObj* function) {
   closure->function = function;
   closure->upvalues =
       (function->upval_count)
-          ? ALLOCATE(UpvalueObj*, sizeof(UpvalueObj*) * function->upval_count)
+          ? ALLOCATE(UpvalueObj*, function->upval_count)
           : NULL;
   for (int i = 0; i < function->upval_count; i++) {
     closure->upvalues[i] = NULL;
@@ -145,19 +289,126 @@ NativeFnObj* NativeFnObj_construct(NativeFn func) {
 }
 
 ClassObj* ClassObj_construct(StringObj* name) {
+  // the root shape isn't reachable until the class is set up, so it is
+  // allocated first: a collection triggered by allocating the class only
+  // sees a detached block.
+  Shape* root = ALLOCATE(Shape, 1);
   ClassObj* new_class = OBJ_ALLOC(ClassObj, OBJ_CLASS);
   new_class->name = name;
   table_init(&new_class->methods);
+  root->klass = new_class;
+  new_class->shape = root;
+  new_class->inline_fields = 0;
   return new_class;
 }
 
+int Shape_lookup(Shape* shape, StringObj* name) {
+  for (; shape->name != NULL; shape = shape->parent) {
+    if (shape->name == name)
+      return shape->field_count - 1;
+  }
+  return -1;
+}
+
+Shape* Shape_transition(Shape* shape, StringObj* name) {
+  for (uint32_t i = 0; i < shape->transition_count; i++) {
+    if (shape->transitions[i]->name == name)
+      return shape->transitions[i];
+  }
+
+  Shape* child = ALLOCATE(Shape, 1);
+  child->klass = shape->klass;
+  child->parent = shape;
+  child->name = name;
+  child->field_count = shape->field_count + 1;
+
+  if (shape->transition_count == shape->transition_capacity) {
+    uint32_t old_capacity = shape->transition_capacity;
+    shape->transition_capacity = old_capacity < 2 ? 2 : old_capacity * 2;
+    shape->transitions = GROW_ARRAY(Shape*, shape->transitions, old_capacity,
+                                    shape->transition_capacity);
+  }
+  shape->transitions[shape->transition_count] = child;
+  GC_PUBLISH(shape->transition_count, shape->transition_count + 1);
+
+  ClassObj* klass = shape->klass;
+  gc_write_barrier(&klass->obj, OBJ_VAL(name->obj));
+  if (child->field_count > klass->inline_fields &&
+      child->field_count <= INSTANCE_INLINE_FIELDS_MAX)
+    klass->inline_fields = child->field_count;
+  return child;
+}
+
+void Shape_free(Shape* shape) {
+  for (uint32_t i = 0; i < shape->transition_count; i++) {
+    Shape_free(shape->transitions[i]);
+  }
+  FREE_ARRAY(Shape*, shape->transitions, shape->transition_capacity);
+  FREE(Shape, shape);
+}
+
 InstanceObj* InstanceObj_construct(ClassObj* klass) {
-  InstanceObj* new_instance = OBJ_ALLOC(InstanceObj, OBJ_INSTANCE);
+  // instances of the class are given room for as many fields as the largest
+  // of its instances so far, so that they rarely need an out-of-line array.
+  uint32_t inline_capacity = klass->inline_fields;
+  InstanceObj* new_instance = (InstanceObj*)allocate_object(
+      sizeof(InstanceObj) + sizeof(Value) * inline_capacity, OBJ_INSTANCE);
   new_instance->klass = klass;
-  table_init(&(new_instance->fields));
+  new_instance->shape = klass->shape;
+  new_instance->fields = new_instance->inline_fields;
+  new_instance->field_capacity = inline_capacity;
+  new_instance->inline_capacity = inline_capacity;
   return new_instance;
 }
 
+bool InstanceObj_get_field(InstanceObj* instance,
+                           StringObj* name,
+                           Value* dest) {
+  int slot = Shape_lookup(instance->shape, name);
+  if (slot < 0)
+    return false;
+  *dest = instance->fields[slot];
+  return true;
+}
+
+void InstanceObj_reserve_fields(InstanceObj* instance, uint32_t count) {
+  if (count <= instance->field_capacity)
+    return;
+
+  uint32_t old_capacity = instance->field_capacity;
+  uint32_t capacity = old_capacity < 4 ? 4 : old_capacity * 2;
+  if (capacity < count)
+    capacity = count;
+
+  Value* fields = ALLOCATE(Value, capacity);
+  memcpy(fields, instance->fields,
+         sizeof(Value) * instance->shape->field_count);
+  if (instance->fields != instance->inline_fields)
+    FREE_ARRAY(Value, instance->fields, old_capacity);
+  instance->fields = fields;
+  GC_PUBLISH(instance->field_capacity, capacity);
+}
+
+bool InstanceObj_set_field(InstanceObj* instance,
+                           StringObj* name,
+                           Value value) {
+  int slot = Shape_lookup(instance->shape, name);
+  if (slot >= 0) {
+    instance->fields[slot] = value;
+    gc_write_barrier(&instance->obj, value);
+    return true;
+  }
+
+  // the fields are only switched to the new shape once there is room for the
+  // value, the collector marks the slots of the current shape meanwhile.
+  Shape* shape = Shape_transition(instance->shape, name);
+  InstanceObj_reserve_fields(instance, shape->field_count);
+  instance->fields[shape->field_count - 1] = value;
+  instance->shape = shape;
+  gc_write_barrier(&instance->obj, value);
+  return false;
+}
+
 BoundMethodObj* BoundMethodObj_construct(Value receiver, ClosureObj* method) {
   BoundMethodObj* bmethod = OBJ_ALLOC(BoundMethodObj, OBJ_BOUND_METHOD);
   bmethod->receiver = receiver;
@@ -166,11 +417,14 @@ BoundMethodObj* BoundMethodObj_construct(Value receiver, ClosureObj* method) {
 }
 
 bool object_equal(Obj* obj1, Obj* obj2) {
+  if (obj1 == obj2)
+    return true;
   if (obj1->type == OBJ_STRING && obj2->type == OBJ_STRING) {
     StringObj* str_1 = (StringObj*)obj1;
     StringObj* str_2 = (StringObj*)obj2;
+    // equal strings are interned as the same one
     return str_1->length == str_2->length &&
-           strcmp(str_1->chars, str_2->chars) == 0;
+           StringObj_intern(str_1) == StringObj_intern(str_2);
   }
 
   return obj1 == obj2;
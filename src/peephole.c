@@ -0,0 +1,349 @@
+#include "peephole.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "object.h"
+#include "value.h"
+
+/* Superinst: the result of matching a sequence at some position.
+ * @opcode: the fused opcode, or -1 if the instruction is kept as is
+ * @length: number of bytes of the original sequence
+ * */
+typedef struct Superinst {
+  int opcode;
+  uint32_t length;
+} Superinst;
+
+static uint16_t read_u16(uint8_t* bytes) {
+  uint16_t value;
+  memcpy(&value, bytes, 2);
+  return value;
+}
+
+static void write_u16(uint8_t* bytes, uint16_t value) {
+  memcpy(bytes, &value, 2);
+}
+
+/* inst_size: size in bytes of the instruction at @offset, operands
+ * included. */
+static uint32_t inst_size(Chunk* chunk, uint32_t offset) {
+  Opcode opcode = chunk->bytecodes[offset];
+  switch (opcode) {
+    case OP_RETURN:
+    case OP_NEGATE:
+    case OP_EXIT:
+    case OP_NOT:
+    case OP_PRINT:
+    case OP_POP:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_NIL:
+    case OP_LESS:
+    case OP_GREATER:
+    case OP_EQUAL:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_CLOSE_UPVAL:
+    case OP_INHERIT:
+      return 1;
+    case OP_CONST:
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_UPVAL:
+    case OP_SET_UPVAL:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_CALL:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_GET_SUPER:
+    case OP_SET_LOCAL_POP:
+    case OP_CONCAT_N:
+      return 2;
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_GET_THIS_PROPERTY:
+      return 2 + CACHE_OFFSET_SIZE;
+    case OP_GET_PROPERTY_LONG:
+    case OP_SET_PROPERTY_LONG:
+      return 1 + LONG_CONST_OFFSET_SIZE + CACHE_OFFSET_SIZE;
+    case OP_INVOKE:
+      return 3 + CACHE_OFFSET_SIZE;
+    case OP_INVOKE_LONG:
+      return 2 + LONG_CONST_OFFSET_SIZE + CACHE_OFFSET_SIZE;
+    case OP_GET_UPVAL_LONG:
+    case OP_SET_UPVAL_LONG:
+      return 1 + LONG_UPVAL_OFFSET_SIZE;
+    case OP_GET_LOCAL_LONG:
+    case OP_SET_LOCAL_LONG:
+      return 1 + LONG_LOCAL_OFFSET_SIZE;
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_GET_GLOBAL_LONG:
+    case OP_SET_GLOBAL_LONG:
+      return 1 + LONG_GLOBAL_OFFSET_SIZE;
+    case OP_CONST_LONG:
+    case OP_CLASS_LONG:
+    case OP_METHOD_LONG:
+    case OP_GET_SUPER_LONG:
+      return 1 + LONG_CONST_OFFSET_SIZE;
+    case OP_SUPER_INVOKE:
+    case OP_ADD_LOCAL_CONST:
+    case OP_JMP_IF_FALSE:
+    case OP_JMP:
+    case OP_LOOP:
+    case OP_JMP_IF_NOT_LESS:
+    case OP_JMP_IF_NOT_GREATER:
+    case OP_JMP_IF_LESS:
+    case OP_JMP_IF_GREATER:
+      return 3;
+    case OP_SUPER_INVOKE_LONG:
+      return 2 + LONG_CONST_OFFSET_SIZE;
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG: {
+      uint32_t const_offset = 0;
+      uint32_t size = 1;
+      if (opcode == OP_CLOSURE) {
+        const_offset = chunk->bytecodes[offset + 1];
+        size += 1;
+      } else {
+        memcpy(&const_offset, &chunk->bytecodes[offset + 1],
+               LONG_CONST_OFFSET_SIZE);
+        size += LONG_CONST_OFFSET_SIZE;
+      }
+
+      // each captured upvalue is encoded as <info> <1 or 2-byte index>
+      ClosureObj* closure = AS_CLOSURE(chunk->constants.values[const_offset]);
+      for (int i = 0; i < closure->function->upval_count; i++) {
+        bool long_offset = (chunk->bytecodes[offset + size] & (1 << 1)) >> 1;
+        size += long_offset ? 3 : 2;
+      }
+      return size;
+    }
+    default:  // the register engine's instructions are never optimized here
+      break;
+  }
+
+  assert(false && "inst_size: unknown opcode.");
+  return 1;
+}
+
+/* Destination of the jump instruction at @offset (OP_JMP, OP_JMP_IF_FALSE or
+ * OP_LOOP). */
+static uint32_t jump_dest(Chunk* chunk, uint32_t offset) {
+  uint16_t jmp_dist = read_u16(&chunk->bytecodes[offset + 1]);
+  if (chunk->bytecodes[offset] == OP_LOOP)
+    return offset + 3 - jmp_dist;
+  return offset + 3 + jmp_dist;
+}
+
+/* match: find a superinstruction for the sequence starting at @offset.
+ *
+ * A sequence is only fused if none of its instructions but the first one is
+ * a jump target, otherwise a jump would land in the middle of the fused
+ * instruction.
+ *
+ * The compare-and-branch superinstructions pop the comparison's operands on
+ * both paths. Therefore they are only produced if the jump target is the
+ * OP_POP discarding the condition on the false path, which they jump over.
+ * */
+static Superinst match(Chunk* chunk, uint32_t offset, bool* is_target) {
+  uint8_t* code = chunk->bytecodes;
+  Superinst keep = {.opcode = -1, .length = inst_size(chunk, offset)};
+
+  // positions of the following instructions in the sequence
+  uint32_t next = offset + keep.length;
+  uint32_t seq[4] = {offset, next, 0, 0};
+  for (int i = 2; i < 4; i++) {
+    if (seq[i - 1] >= chunk->size)
+      break;
+    seq[i] = seq[i - 1] + inst_size(chunk, seq[i - 1]);
+  }
+
+#define HAS_INST(i) \
+  (seq[i] != 0 && seq[i] < chunk->size && !is_target[seq[i]])
+
+  switch (code[offset]) {
+    case OP_GET_LOCAL:
+      if (HAS_INST(1) && HAS_INST(2) && code[seq[1]] == OP_CONST &&
+          code[seq[2]] == OP_ADD) {
+        return (Superinst){OP_ADD_LOCAL_CONST, seq[2] + 1 - offset};
+      }
+      if (HAS_INST(1) && code[offset + 1] == 0 &&
+          code[seq[1]] == OP_GET_PROPERTY) {
+        return (Superinst){OP_GET_THIS_PROPERTY, seq[2] - offset};
+      }
+      break;
+    case OP_SET_LOCAL:
+      if (HAS_INST(1) && code[seq[1]] == OP_POP) {
+        return (Superinst){OP_SET_LOCAL_POP, seq[1] + 1 - offset};
+      }
+      break;
+    case OP_LESS:
+    case OP_GREATER: {
+      bool negated = HAS_INST(1) && code[seq[1]] == OP_NOT;
+      int jmp = negated ? 2 : 1;
+      if (!(HAS_INST(jmp) && HAS_INST(jmp + 1) &&
+            code[seq[jmp]] == OP_JMP_IF_FALSE && code[seq[jmp + 1]] == OP_POP))
+        break;
+
+      uint32_t dest = jump_dest(chunk, seq[jmp]);
+      if (dest >= chunk->size || code[dest] != OP_POP)
+        break;
+
+      int opcode;
+      if (code[offset] == OP_LESS)
+        opcode = negated ? OP_JMP_IF_LESS : OP_JMP_IF_NOT_LESS;
+      else
+        opcode = negated ? OP_JMP_IF_GREATER : OP_JMP_IF_NOT_GREATER;
+      return (Superinst){opcode, seq[jmp + 1] + 1 - offset};
+    }
+    default:;
+  }
+
+#undef HAS_INST
+
+  return keep;
+}
+
+/* Size of the superinstruction emitted for @superinst. */
+static uint32_t superinst_size(Superinst superinst) {
+  switch (superinst.opcode) {
+    case -1:
+      return superinst.length;
+    case OP_SET_LOCAL_POP:
+      return 2;
+    case OP_GET_THIS_PROPERTY:
+      return 2 + CACHE_OFFSET_SIZE;
+    default:
+      return 3;
+  }
+}
+
+/* Prepend a line record to @tracker, unless @line is already the line of the
+ * previous record. */
+static BytecodeLine* track_line(BytecodeLine* tracker,
+                                uint32_t pos,
+                                uint32_t line) {
+  if (tracker != NULL && tracker->line == line)
+    return tracker;
+
+  BytecodeLine* bytecode_line = malloc(sizeof(BytecodeLine));
+  bytecode_line->line = line;
+  bytecode_line->pos = pos;
+  bytecode_line->next = tracker;
+  return bytecode_line;
+}
+
+void peephole_optimize(Chunk* chunk) {
+  uint32_t size = chunk->size;
+  if (size == 0)
+    return;
+
+  uint8_t* code = chunk->bytecodes;
+  bool* is_target = calloc(size + 1, sizeof(bool));
+  uint32_t* new_pos = malloc((size + 1) * sizeof(uint32_t));
+  uint32_t* lines = malloc(size * sizeof(uint32_t));
+  uint8_t* optimized = malloc(size);
+
+  // The line tracker is sorted by position in descending order, expand it to
+  // the line of every byte.
+  uint32_t end = size;
+  for (BytecodeLine* iter = chunk->line_tracker; iter != NULL;
+       iter = iter->next) {
+    for (uint32_t i = iter->pos; i < end; i++)
+      lines[i] = iter->line;
+    if (iter->pos < end)
+      end = iter->pos;
+  }
+
+  // Mark every jump target. The instruction following the target of a
+  // conditional jump is also marked, a compare-and-branch superinstruction
+  // may jump there.
+  for (uint32_t offset = 0; offset < size; offset += inst_size(chunk, offset)) {
+    Opcode opcode = code[offset];
+    if (opcode != OP_JMP && opcode != OP_JMP_IF_FALSE && opcode != OP_LOOP)
+      continue;
+
+    uint32_t dest = jump_dest(chunk, offset);
+    assert(dest <= size);
+    is_target[dest] = true;
+    if (opcode == OP_JMP_IF_FALSE && dest < size && code[dest] == OP_POP)
+      is_target[dest + 1] = true;
+  }
+
+  // Compute the new position of every instruction.
+  uint32_t new_size = 0;
+  for (uint32_t offset = 0; offset < size;) {
+    Superinst superinst = match(chunk, offset, is_target);
+    new_pos[offset] = new_size;
+    offset += superinst.length;
+    new_size += superinst_size(superinst);
+  }
+  new_pos[size] = new_size;
+
+  // Emit the new bytecodes, relocating the jumps.
+  BytecodeLine* tracker = NULL;
+  for (uint32_t offset = 0; offset < size;) {
+    Superinst superinst = match(chunk, offset, is_target);
+    uint32_t pos = new_pos[offset];
+    uint8_t* out = &optimized[pos];
+
+    tracker = track_line(tracker, pos, lines[offset]);
+
+    switch (superinst.opcode) {
+      case -1: {
+        memcpy(out, &code[offset], superinst.length);
+        Opcode opcode = code[offset];
+        if (opcode == OP_JMP || opcode == OP_JMP_IF_FALSE) {
+          write_u16(out + 1, new_pos[jump_dest(chunk, offset)] - (pos + 3));
+        } else if (opcode == OP_LOOP) {
+          write_u16(out + 1, (pos + 3) - new_pos[jump_dest(chunk, offset)]);
+        }
+        break;
+      }
+      case OP_ADD_LOCAL_CONST:
+        out[1] = code[offset + 1];  // local slot
+        out[2] = code[offset + 3];  // constant offset
+        break;
+      case OP_SET_LOCAL_POP:
+        out[1] = code[offset + 1];
+        break;
+      case OP_GET_THIS_PROPERTY:
+        // name and cache operands of OP_GET_PROPERTY
+        memcpy(out + 1, &code[offset + 3], 1 + CACHE_OFFSET_SIZE);
+        break;
+      default: {
+        // compare-and-branch, the OP_JMP_IF_FALSE is 4 bytes before the end
+        uint32_t jmp = offset + superinst.length - 4;
+        uint32_t dest = jump_dest(chunk, jmp) + 1;
+        write_u16(out + 1, new_pos[dest] - (pos + 3));
+        break;
+      }
+    }
+
+    if (superinst.opcode != -1)
+      out[0] = superinst.opcode;
+    offset += superinst.length;
+  }
+
+  memcpy(code, optimized, new_size);
+  chunk->size = new_size;
+
+  while (chunk->line_tracker != NULL) {
+    BytecodeLine* deleted = chunk->line_tracker;
+    chunk->line_tracker = chunk->line_tracker->next;
+    free(deleted);
+  }
+  chunk->line_tracker = tracker;
+
+  free(is_target);
+  free(new_pos);
+  free(lines);
+  free(optimized);
+}
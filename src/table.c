@@ -1,9 +1,15 @@
 #include "table.h"
 #include <assert.h>
+#include <string.h>
 #include "memory.h"
 #include "object.h"
 #include "value.h"
 
+#if !defined(LINEAR_PROBE_TABLE) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#ifdef LINEAR_PROBE_TABLE
 void table_init(Table* table) {
   table->count = 0;
   table->capacity = 0;
@@ -65,7 +71,7 @@ static void table_expand(Table* table) {
 
   FREE_ARRAY(Entry, table->entries, table->capacity);
   table->entries = expanded_entries;
-  table->capacity = new_capacity;
+  GC_PUBLISH(table->capacity, new_capacity);
 }
 
 bool table_set(Table* table, StringObj* key, Value val) {
@@ -108,19 +114,555 @@ bool table_delete(Table* table, StringObj* key, Value* dest) {
   return true;
 }
 
-void table_remove_unmarked_object(Table* table) {
+void table_add_all(Table* dest, Table* src) {
+  for (Entry* ent = src->entries; ent < src->entries + src->capacity; ent++) {
+    if (ent->key != NULL) {
+      table_set(dest, ent->key, ent->value);
+    }
+  }
+}
+
+#else
+/* The slot of a key is looked up from the groups picked by the high bits of
+ * its hash, among the slots whose control byte is its 7 low bits. */
+#define H1(hashcode) ((hashcode) >> 7)
+#define H2(hashcode) ((uint8_t)((hashcode)&0x7f))
+#define NOT_FOUND UINT32_MAX
+
+/* block_size: the size of the block holding the control bytes, the keys and
+ * the values of @capacity slots, which start at BLOCK_KEYS() and
+ * BLOCK_VALUES() after the control bytes @control. */
+static size_t block_size(uint32_t capacity) {
+  return capacity * (sizeof(uint8_t) + sizeof(StringObj*) + sizeof(Value));
+}
+#define BLOCK_KEYS(control, capacity) ((StringObj**)((control) + (capacity)))
+#define BLOCK_VALUES(control, capacity) \
+  ((Value*)(BLOCK_KEYS(control, capacity) + (capacity)))
+
+/* allocate_block: the control bytes of a new block of @capacity empty slots */
+static uint8_t* allocate_block(uint32_t capacity) {
+  uint8_t* control = ALLOCATE(uint8_t, block_size(capacity));
+  memset(control, TABLE_EMPTY, capacity);
+  return control;
+}
+
+void table_init(Table* table) {
+  table->count = 0;
+  table->tombstones = 0;
+  table->capacity = 0;
+  table->control = NULL;
+  table->keys = NULL;
+  table->values = NULL;
+#ifdef INCREMENTAL_REHASH
+  table->old_capacity = 0;
+  table->moved = 0;
+  table->old_control = NULL;
+  table->old_keys = NULL;
+  table->old_values = NULL;
+#endif
+}
+
+void table_free(Table* table) {
+  FREE_ARRAY(uint8_t, table->control, block_size(table->capacity));
+#ifdef INCREMENTAL_REHASH
+  FREE_ARRAY(uint8_t, table->old_control, block_size(table->old_capacity));
+#endif
+  table_init(table);
+}
+
+#ifndef __SSE2__
+/* Without SSE2, a group is read as two words of 8 control bytes. */
+#define BYTES(byte) (0x0101010101010101u * (byte))
+
+/* group_word: the control bytes @half of @group, the first one lowest. */
+static inline uint64_t group_word(const uint8_t* group, uint32_t half) {
+  uint64_t word;
+  memcpy(&word, group + half * 8, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  word = __builtin_bswap64(word);
+#endif
+  return word;
+}
+
+/* high_bits: the bit mask of the bytes of @word whose high bit is set. */
+static inline uint32_t high_bits(uint64_t word) {
+  return (((word >> 7) & BYTES(1)) * 0x0102040810204080u) >> 56;
+}
+#endif
+
+/* group_match: the bit mask of the control bytes of @group equal to @byte. */
+static inline uint32_t group_match(const uint8_t* group, uint8_t byte) {
+#ifdef __SSE2__
+  __m128i control = _mm_loadu_si128((const __m128i*)group);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8(byte)));
+#else
+  uint32_t mask = 0;
+  for (uint32_t half = 0; half < 2; half++) {
+    // the bytes equal to @byte become zero, and only these get their high
+    // bit set.
+    uint64_t word = group_word(group, half) ^ BYTES(byte);
+    uint64_t zero =
+        ~(((word & BYTES(0x7f)) + BYTES(0x7f)) | word | BYTES(0x7f));
+    mask |= high_bits(zero) << (half * 8);
+  }
+  return mask;
+#endif
+}
+
+/* group_free: the bit mask of the slots of @group that are empty or deleted,
+ * the control bytes whose high bit is set. */
+static inline uint32_t group_free(const uint8_t* group) {
+#ifdef __SSE2__
+  return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+#else
+  return high_bits(group_word(group, 0)) | high_bits(group_word(group, 1)) << 8;
+#endif
+}
+
+/* find_key: the slot of @key among the @capacity slots of the control bytes
+ * @control and the keys @keys, or NOT_FOUND.
+ *
+ * The groups are probed at triangular offsets from the first one, which
+ * visits all of them as their number is a power of two. The load of the
+ * table leaves empty slots, so that the loop ends. */
+static uint32_t find_key(const uint8_t* control,
+                         StringObj** keys,
+                         uint32_t capacity,
+                         StringObj* key) {
+  uint32_t group_mask = capacity / TABLE_GROUP - 1;
+  uint32_t group = H1(key->hashcode) & group_mask;
+  for (uint32_t stride = 1;; stride++) {
+    const uint8_t* group_control = control + group * TABLE_GROUP;
+    uint32_t match = group_match(group_control, H2(key->hashcode));
+    for (; match != 0; match &= match - 1) {
+      uint32_t slot = group * TABLE_GROUP + __builtin_ctz(match);
+      if (keys[slot] == key)
+        return slot;
+    }
+    if (group_match(group_control, TABLE_EMPTY) != 0)
+      return NOT_FOUND;
+    group = (group + stride) & group_mask;
+  }
+}
+
+/* find_slot: the slot of @key in @table, or else the first empty or deleted
+ * slot of its probe sequence. */
+static uint32_t find_slot(Table* table, StringObj* key) {
+  uint32_t group_mask = table->capacity / TABLE_GROUP - 1;
+  uint32_t group = H1(key->hashcode) & group_mask;
+  uint32_t free_slot = NOT_FOUND;
+  for (uint32_t stride = 1;; stride++) {
+    const uint8_t* control = table->control + group * TABLE_GROUP;
+    uint32_t match = group_match(control, H2(key->hashcode));
+    for (; match != 0; match &= match - 1) {
+      uint32_t slot = group * TABLE_GROUP + __builtin_ctz(match);
+      if (table->keys[slot] == key)
+        return slot;
+    }
+    uint32_t free = group_free(control);
+    if (free_slot == NOT_FOUND && free != 0)
+      free_slot = group * TABLE_GROUP + __builtin_ctz(free);
+    if (group_match(control, TABLE_EMPTY) != 0)
+      return free_slot;
+    group = (group + stride) & group_mask;
+  }
+}
+
+/* find_free: the first empty or deleted slot of the probe sequence of
+ * @hashcode among the @capacity control bytes @control. */
+static uint32_t find_free(const uint8_t* control,
+                          uint32_t capacity,
+                          uint32_t hashcode) {
+  uint32_t group_mask = capacity / TABLE_GROUP - 1;
+  uint32_t group = H1(hashcode) & group_mask;
+  for (uint32_t stride = 1;; stride++) {
+    uint32_t free = group_free(control + group * TABLE_GROUP);
+    if (free != 0)
+      return group * TABLE_GROUP + __builtin_ctz(free);
+    group = (group + stride) & group_mask;
+  }
+}
+
+#ifndef INCREMENTAL_REHASH
+/* table_rehash: move the keys of @table to @new_capacity slots, leaving out
+ * the tombstones. */
+static void table_rehash(Table* table, uint32_t new_capacity) {
+  uint8_t* control = allocate_block(new_capacity);
+  StringObj** keys = BLOCK_KEYS(control, new_capacity);
+  Value* values = BLOCK_VALUES(control, new_capacity);
+
   for (uint32_t i = 0; i < table->capacity; i++) {
-    Entry* entry = &table->entries[i];
-    if (entry->key != NULL && !entry->key->obj.gc_marked) {
-      table_delete(table, entry->key, NULL);
+    StringObj* key = table->keys[i];
+    if (key == NULL)
+      continue;
+    uint32_t slot = find_free(control, new_capacity, key->hashcode);
+    control[slot] = H2(key->hashcode);
+    keys[slot] = key;
+    values[slot] = table->values[i];
+  }
+
+  FREE_ARRAY(uint8_t, table->control, block_size(table->capacity));
+  table->control = control;
+  table->keys = keys;
+  table->values = values;
+  table->tombstones = 0;
+  GC_PUBLISH(table->capacity, new_capacity);
+}
+#else
+/* table_move: move up to @slots of the former slots of @table left to its
+ * new ones, and free the former ones once they are all moved. */
+static void table_move(Table* table, uint32_t slots) {
+  uint32_t end = table->old_capacity - table->moved <= slots
+                     ? table->old_capacity
+                     : table->moved + slots;
+  for (; table->moved < end; table->moved++) {
+    StringObj* key = table->old_keys[table->moved];
+    if (key == NULL)
+      continue;
+    uint32_t slot = find_free(table->control, table->capacity, key->hashcode);
+    if (table->control[slot] == TABLE_DELETED)
+      table->tombstones--;
+    table->control[slot] = H2(key->hashcode);
+    table->values[slot] = table->old_values[table->moved];
+    table->keys[slot] = key;
+    table->old_control[table->moved] = TABLE_DELETED;
+    table->old_keys[table->moved] = NULL;
+  }
+
+  if (table->moved == table->old_capacity) {
+    uint8_t* old_control = table->old_control;
+    uint32_t old_capacity = table->old_capacity;
+    GC_PUBLISH(table->old_capacity, 0);
+    table->old_control = NULL;
+    table->old_keys = NULL;
+    table->old_values = NULL;
+    FREE_ARRAY(uint8_t, old_control, block_size(old_capacity));
+  }
+}
+
+/* table_grow: give @table @new_capacity new slots, its current ones being
+ * moved there by the insertions to come. */
+static void table_grow(Table* table, uint32_t new_capacity) {
+  if (table->old_control != NULL)
+    table_move(table, UINT32_MAX);
+  uint8_t* control = allocate_block(new_capacity);
+
+  if (table->capacity != 0) {
+    table->old_control = table->control;
+    table->old_keys = table->keys;
+    table->old_values = table->values;
+    table->moved = 0;
+    GC_PUBLISH(table->old_capacity, table->capacity);
+  }
+  table->control = control;
+  table->keys = BLOCK_KEYS(control, new_capacity);
+  table->values = BLOCK_VALUES(control, new_capacity);
+  table->tombstones = 0;
+  GC_PUBLISH(table->capacity, new_capacity);
+}
+#endif
+
+bool table_set(Table* table, StringObj* key, Value val) {
+#ifdef INCREMENTAL_REHASH
+  if (table->old_control != NULL) {
+    table_move(table, REHASH_STEP);
+    if (table->old_control != NULL) {
+      uint32_t slot = find_key(table->old_control, table->old_keys,
+                               table->old_capacity, key);
+      if (slot != NOT_FOUND) {
+        table->old_values[slot] = val;
+        return true;
+      }
+    }
+  }
+#endif
+
+  /* Ensure that the load factor, tombstones included, does not exceed
+   * MAX_LOAD. The table keeps its capacity if rehashing it drops enough
+   * tombstones. */
+  if (table->count + table->tombstones + 1 > MAX_LOAD * table->capacity) {
+    uint32_t new_capacity = table->capacity;
+    if (table->count + 1 > MAX_LOAD * table->capacity / 2)
+      new_capacity = GROW_CAPACITY(table->capacity);
+#ifdef INCREMENTAL_REHASH
+    // the key would be left behind in the former slots
+    if (table->count != 0) {
+      uint32_t slot =
+          find_key(table->control, table->keys, table->capacity, key);
+      if (slot != NOT_FOUND) {
+        table->values[slot] = val;
+        return true;
+      }
     }
+    table_grow(table, new_capacity);
+#else
+    table_rehash(table, new_capacity);
+#endif
+  }
+
+  uint32_t slot = find_slot(table, key);
+  bool exist = table->keys[slot] == key;
+  if (!exist) {
+    if (table->control[slot] == TABLE_DELETED)
+      table->tombstones--;
+    table->control[slot] = H2(key->hashcode);
+    table->keys[slot] = key;
+    table->count++;
   }
+  table->values[slot] = val;
+  return exist;
+}
+
+bool table_get(Table* table, StringObj* key, Value* dest) {
+  if (table->count == 0)
+    return false;
+  uint32_t slot = find_key(table->control, table->keys, table->capacity, key);
+  if (slot != NOT_FOUND) {
+    *dest = table->values[slot];
+    return true;
+  }
+#ifdef INCREMENTAL_REHASH
+  if (table->old_control != NULL) {
+    slot = find_key(table->old_control, table->old_keys, table->old_capacity,
+                    key);
+    if (slot != NOT_FOUND) {
+      *dest = table->old_values[slot];
+      return true;
+    }
+  }
+#endif
+  return false;
+}
+
+bool table_delete(Table* table, StringObj* key, Value* dest) {
+  if (table->count == 0)
+    return false;
+  uint32_t slot = find_key(table->control, table->keys, table->capacity, key);
+  if (slot == NOT_FOUND) {
+#ifdef INCREMENTAL_REHASH
+    if (table->old_control == NULL)
+      return false;
+    slot = find_key(table->old_control, table->old_keys, table->old_capacity,
+                    key);
+    if (slot == NOT_FOUND)
+      return false;
+    // the former slots are moved from one after the other, their tombstones
+    // aren't counted.
+    if (dest != NULL)
+      *dest = table->old_values[slot];
+    table->old_control[slot] = TABLE_DELETED;
+    table->old_keys[slot] = NULL;
+    table->count--;
+    return true;
+#else
+    return false;
+#endif
+  }
+  if (dest != NULL)
+    *dest = table->values[slot];
+
+  // No probe sequence goes past a group with an empty slot: in such a group
+  // the slot becomes empty, elsewhere a tombstone.
+  uint8_t* group = table->control + (slot & ~(TABLE_GROUP - 1));
+  if (group_match(group, TABLE_EMPTY) != 0) {
+    table->control[slot] = TABLE_EMPTY;
+  } else {
+    table->control[slot] = TABLE_DELETED;
+    table->tombstones++;
+  }
+  table->keys[slot] = NULL;
+  table->values[slot] = NIL_VAL();
+  table->count--;
+  return true;
 }
 
 void table_add_all(Table* dest, Table* src) {
-  for (Entry* ent = src->entries; ent < src->entries + src->capacity; ent++) {
-    if (ent->key != NULL) {
-      table_set(dest, ent->key, ent->value);
+  bool copy = dest->count == 0 && src->count != 0;
+#ifdef INCREMENTAL_REHASH
+  if (dest->old_control != NULL)
+    table_move(dest, UINT32_MAX);
+  copy = copy && src->old_control == NULL;
+#endif
+
+  // a subclass inherits the methods of its superclass in an empty table: it
+  // takes a copy of the slots as they are.
+  if (copy) {
+    if (dest->capacity != src->capacity) {
+      uint8_t* control = ALLOCATE(uint8_t, block_size(src->capacity));
+      FREE_ARRAY(uint8_t, dest->control, block_size(dest->capacity));
+      dest->control = control;
+      dest->keys = BLOCK_KEYS(control, src->capacity);
+      dest->values = BLOCK_VALUES(control, src->capacity);
+    }
+    memcpy(dest->control, src->control, block_size(src->capacity));
+    dest->count = src->count;
+    dest->tombstones = src->tombstones;
+    GC_PUBLISH(dest->capacity, src->capacity);
+    return;
+  }
+
+  for (uint32_t i = 0; i < src->capacity; i++) {
+    if (src->keys[i] != NULL) {
+      table_set(dest, src->keys[i], src->values[i]);
+    }
+  }
+#ifdef INCREMENTAL_REHASH
+  for (uint32_t i = 0; i < src->old_capacity; i++) {
+    if (src->old_keys[i] != NULL) {
+      table_set(dest, src->old_keys[i], src->old_values[i]);
     }
   }
+#endif
+}
+#endif
+
+void string_set_init(StringSet* set) {
+  set->count = 0;
+  set->capacity = 0;
+  set->entries = NULL;
+#ifdef INCREMENTAL_REHASH
+  set->old_capacity = 0;
+  set->moved = 0;
+  set->old_entries = NULL;
+#endif
+}
+
+void string_set_free(StringSet* set) {
+  FREE_ARRAY(SetEntry, set->entries, set->capacity);
+#ifdef INCREMENTAL_REHASH
+  FREE_ARRAY(SetEntry, set->old_entries, set->old_capacity);
+#endif
+  string_set_init(set);
+}
+
+/* set_probe: the string of the @length characters @chars, whose hash is
+ * @hashcode, among the @capacity entries @entries, or NULL. */
+static StringObj* set_probe(SetEntry* entries,
+                            uint32_t capacity,
+                            const char* chars,
+                            uint32_t length,
+                            uint32_t hashcode) {
+  uint32_t mask = capacity - 1;
+  for (uint32_t i = hashcode & mask;; i = (i + 1) & mask) {
+    SetEntry* entry = &entries[i];
+    if (entry->string == NULL)
+      return NULL;
+    if (entry->hashcode == hashcode && entry->length == length &&
+        memcmp(entry->string->chars, chars, length) == 0)
+      return entry->string;
+  }
+}
+
+StringObj* string_set_find(StringSet* set,
+                           const char* chars,
+                           uint32_t length,
+                           uint32_t hashcode) {
+  if (set->count == 0)
+    return NULL;
+
+  StringObj* string =
+      set_probe(set->entries, set->capacity, chars, length, hashcode);
+#ifdef INCREMENTAL_REHASH
+  if (string == NULL && set->old_entries != NULL)
+    string = set_probe(set->old_entries, set->old_capacity, chars, length,
+                       hashcode);
+#endif
+  return string;
+}
+
+/* set_insert: put @string in the first empty entry of its cluster. */
+static void set_insert(SetEntry* entries, uint32_t mask, StringObj* string) {
+  uint32_t i = string->hashcode & mask;
+  while (entries[i].string != NULL) {
+    i = (i + 1) & mask;
+  }
+  entries[i] = (SetEntry){string, string->hashcode, string->length};
+}
+
+#ifdef INCREMENTAL_REHASH
+/* set_move: move up to @entries of the former entries of @set left to its
+ * new ones, and free the former ones once they are all moved. */
+static void set_move(StringSet* set, uint32_t entries) {
+  uint32_t end = set->old_capacity - set->moved <= entries
+                     ? set->old_capacity
+                     : set->moved + entries;
+  for (; set->moved < end; set->moved++) {
+    StringObj* string = set->old_entries[set->moved].string;
+    if (string != NULL)
+      set_insert(set->entries, set->capacity - 1, string);
+  }
+
+  if (set->moved == set->old_capacity) {
+    FREE_ARRAY(SetEntry, set->old_entries, set->old_capacity);
+    set->old_entries = NULL;
+    set->old_capacity = 0;
+  }
+}
+#endif
+
+void string_set_add(StringSet* set, StringObj* string) {
+#ifdef INCREMENTAL_REHASH
+  if (set->old_entries != NULL)
+    set_move(set, REHASH_STEP);
+#endif
+
+  if (set->count + 1 > MAX_LOAD * set->capacity) {
+    uint32_t new_capacity = GROW_CAPACITY(set->capacity);
+    // the strings that are garbage may be removed from the old entries
+    // while the new ones are allocated.
+    SetEntry* entries = ALLOCATE(SetEntry, new_capacity);
+#ifdef INCREMENTAL_REHASH
+    if (set->old_entries != NULL)
+      set_move(set, UINT32_MAX);
+    if (set->capacity != 0) {
+      set->old_entries = set->entries;
+      set->old_capacity = set->capacity;
+      set->moved = 0;
+    }
+#else
+    for (uint32_t i = 0; i < set->capacity; i++) {
+      if (set->entries[i].string != NULL)
+        set_insert(entries, new_capacity - 1, set->entries[i].string);
+    }
+    FREE_ARRAY(SetEntry, set->entries, set->capacity);
+#endif
+    set->entries = entries;
+    set->capacity = new_capacity;
+  }
+
+  set_insert(set->entries, set->capacity - 1, string);
+  set->count++;
+}
+
+/* set_remove: empty the entry @hole, moving back the entries of its cluster
+ * that can't be found past it anymore. */
+static void set_remove(StringSet* set, uint32_t hole) {
+  uint32_t mask = set->capacity - 1;
+  for (uint32_t i = (hole + 1) & mask; set->entries[i].string != NULL;
+       i = (i + 1) & mask) {
+    // the entry moves unless the hole is before its home position
+    uint32_t home = set->entries[i].hashcode & mask;
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      set->entries[hole] = set->entries[i];
+      hole = i;
+    }
+  }
+  set->entries[hole].string = NULL;
+  set->count--;
+}
+
+void string_set_remove_unmarked(StringSet* set) {
+#ifdef INCREMENTAL_REHASH
+  // the former entries would keep the strings removed
+  if (set->old_entries != NULL)
+    set_move(set, UINT32_MAX);
+#endif
+  for (uint32_t i = 0; i < set->capacity;) {
+    StringObj* string = set->entries[i].string;
+    // the entry is examined again once another one is moved to it
+    if (string != NULL && !gc_is_marked(&string->obj))
+      set_remove(set, i);
+    else
+      i++;
+  }
 }
@@ -0,0 +1,1359 @@
+#include "trace.h"
+
+int16_t trace_counters[TRACE_COUNTERS];
+
+#ifdef JIT_AVAILABLE
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "value.h"
+#include "x64.h"
+#ifdef DBG_DUMP_TRACES
+#include "debug.h"
+#endif
+
+/** The IR of a trace.
+ *
+ * A trace is a list of instructions, each defining at most one value named
+ * by its index in the list (an IrRef). Values are either unboxed numbers or
+ * booleans. The last instruction jumps back to the first one, so the list is
+ * the body of a loop.
+ * */
+
+typedef uint32_t IrRef;
+#define REF_NONE UINT32_MAX
+
+typedef enum {
+  IR_KNUM,         // the number @number
+  IR_KBOOL,        // the boolean @number != 0
+  IR_SLOAD,        // the number or boolean in the slot @a of the frame
+  IR_SSTORE,       // store @b in the slot @a of the frame
+  IR_GLOAD,        // the number in the global @a, or exit
+  IR_GSTORE,       // store the number @b in the global @a, or exit
+  IR_ADD,          // @a + @b
+  IR_SUB,          // @a - @b
+  IR_MUL,          // @a * @b
+  IR_DIV,          // @a / @b
+  IR_NEG,          // -@a
+  IR_LT,           // @a < @b, numbers
+  IR_GT,           // @a > @b, numbers
+  IR_EQ,           // @a == @b, two numbers or two booleans
+  IR_NOT,          // !@a, a boolean
+  IR_GUARD_TRUE,   // exit unless @a
+  IR_GUARD_FALSE,  // exit if @a
+} IrOp;
+
+typedef enum {
+  IRT_VOID,
+  IRT_NUM,
+  IRT_BOOL,
+} IrType;
+
+/* IrIns: an instruction of the IR.
+ * @snapshot: where the instructions that may exit leave the trace.
+ * @invariant: the instruction doesn't depend on the iteration, and runs once
+ * before the loop.
+ * @live: the instruction is needed, see optimize().
+ * @reg, @fused: where the value lives, see allocate(). */
+typedef struct {
+  IrOp op;
+  IrType type;
+  uint32_t a;
+  uint32_t b;
+  double number;
+  uint32_t snapshot;
+  bool invariant;
+  bool live;
+  int8_t reg;
+  bool fused;
+} IrIns;
+
+/* Snapshot: the state of the frame at an exit of the trace. run() resumes at
+ * @pc with @depth values on the stack of the frame. The values above the
+ * locals of the loop are the refs of Recorder.snapshot_refs starting at
+ * @refs; the locals themselves are always up to date (see IR_SSTORE).
+ * Snapshot 0 is the head of the loop. */
+typedef struct {
+  uint8_t* pc;
+  uint32_t depth;
+  uint32_t refs;
+} Snapshot;
+
+/** Recorder: the state of a recording.
+ *
+ * The recorder runs the loop as run() would, on the frame itself. Next to
+ * each slot of the frame, @stack keeps the ref of the value it holds, or
+ * REF_NONE for the locals below @base the trace hasn't read yet.
+ * */
+typedef struct {
+  FunctionObj* function;
+  uint8_t* start;  // the head of the loop
+  uint8_t* pc;
+  Value* slots;
+  Value* sp;
+  uint32_t base;  // the stack height at the head of the loop
+  IrRef* stack;
+
+  IrIns* ir;
+  uint32_t ir_count;
+  uint32_t ir_capacity;
+
+  Snapshot* snapshots;
+  uint32_t snapshot_count;
+  uint32_t snapshot_capacity;
+  IrRef* snapshot_refs;
+  uint32_t snapshot_ref_count;
+  uint32_t snapshot_ref_capacity;
+
+  // the offsets of the instructions recorded
+  uint32_t bytecodes[TRACE_MAX_LENGTH];
+  uint32_t length;
+
+  // set once an array couldn't grow, see grow()
+  bool failed;
+} Recorder;
+
+typedef enum {
+  RECORD_NEXT,
+  RECORD_DONE,
+  RECORD_ABORT,
+} RecordStatus;
+
+/* grow: make room for one more element in @array, of @*count elements of
+ * @size bytes, allocated by record(). If it can't grow, the recording is
+ * abandoned (@r->failed): the last element is overwritten until it stops. */
+static void* grow(Recorder* r,
+                  void* array,
+                  uint32_t* count,
+                  uint32_t* capacity,
+                  size_t size) {
+  if (*count < *capacity)
+    return array;
+  void* grown = realloc(array, *capacity * 2 * size);
+  if (grown == NULL) {
+    r->failed = true;
+    (*count)--;
+    return array;
+  }
+  *capacity *= 2;
+  return grown;
+}
+
+static IrRef ir_emit(Recorder* r,
+                     IrOp op,
+                     IrType type,
+                     uint32_t a,
+                     uint32_t b) {
+  r->ir = grow(r, r->ir, &r->ir_count, &r->ir_capacity, sizeof(IrIns));
+  r->ir[r->ir_count] = (IrIns){.op = op, .type = type, .a = a, .b = b};
+  return r->ir_count++;
+}
+
+/* ir_const: the constant @number, IR_KNUM or IR_KBOOL. */
+static IrRef ir_const(Recorder* r, IrOp op, double number) {
+  for (IrRef ref = 0; ref < r->ir_count; ref++) {
+    if (r->ir[ref].op == op && memcmp(&r->ir[ref].number, &number, 8) == 0)
+      return ref;
+  }
+  IrRef ref = ir_emit(r, op, op == IR_KNUM ? IRT_NUM : IRT_BOOL, 0, 0);
+  r->ir[ref].number = number;
+  return ref;
+}
+
+static bool ir_is_const(Recorder* r, IrRef ref) {
+  return r->ir[ref].op == IR_KNUM || r->ir[ref].op == IR_KBOOL;
+}
+
+/* ir_binary: @a @op @b, folded if both are constants. */
+static IrRef ir_binary(Recorder* r, IrOp op, IrRef a, IrRef b) {
+  bool compare = (op == IR_LT || op == IR_GT || op == IR_EQ);
+  if (ir_is_const(r, a) && ir_is_const(r, b)) {
+    double x = r->ir[a].number;
+    double y = r->ir[b].number;
+    switch (op) {
+      case IR_ADD:
+        return ir_const(r, IR_KNUM, x + y);
+      case IR_SUB:
+        return ir_const(r, IR_KNUM, x - y);
+      case IR_MUL:
+        return ir_const(r, IR_KNUM, x * y);
+      case IR_DIV:
+        return ir_const(r, IR_KNUM, x / y);
+      case IR_LT:
+        return ir_const(r, IR_KBOOL, x < y);
+      case IR_GT:
+        return ir_const(r, IR_KBOOL, x > y);
+      default:
+        return ir_const(r, IR_KBOOL, x == y);
+    }
+  }
+  return ir_emit(r, op, compare ? IRT_BOOL : IRT_NUM, a, b);
+}
+
+/* ir_unary: IR_NEG or IR_NOT of @a, folded if it is a constant. */
+static IrRef ir_unary(Recorder* r, IrOp op, IrRef a) {
+  if (ir_is_const(r, a)) {
+    double x = r->ir[a].number;
+    return op == IR_NEG ? ir_const(r, IR_KNUM, -x)
+                        : ir_const(r, IR_KBOOL, x == 0);
+  }
+  return ir_emit(r, op, op == IR_NEG ? IRT_NUM : IRT_BOOL, a, 0);
+}
+
+/* snapshot: the state of the frame, to resume at @pc. */
+static uint32_t snapshot(Recorder* r, uint8_t* pc) {
+  uint32_t depth = r->sp - r->slots;
+  r->snapshots = grow(r, r->snapshots, &r->snapshot_count,
+                      &r->snapshot_capacity, sizeof(Snapshot));
+  r->snapshots[r->snapshot_count] = (Snapshot){
+      .pc = pc, .depth = depth, .refs = r->snapshot_ref_count};
+  for (uint32_t slot = r->base; slot < depth; slot++) {
+    r->snapshot_refs = grow(r, r->snapshot_refs, &r->snapshot_ref_count,
+                            &r->snapshot_ref_capacity, sizeof(IrRef));
+    r->snapshot_refs[r->snapshot_ref_count++] = r->stack[slot];
+  }
+  return r->snapshot_count++;
+}
+
+/* ir_guard: exit to @exit_pc unless @cond is @expected. */
+static void ir_guard(Recorder* r, IrRef cond, bool expected, uint8_t* exit_pc) {
+  if (ir_is_const(r, cond))
+    return;  // holds on every iteration
+  IrRef ref = ir_emit(r, expected ? IR_GUARD_TRUE : IR_GUARD_FALSE, IRT_VOID,
+                      cond, 0);
+  r->ir[ref].snapshot = snapshot(r, exit_pc);
+}
+
+/* slot_ref: the ref of the value in @slot. REF_NONE if the trace can't read
+ * the value. */
+static IrRef slot_ref(Recorder* r, uint32_t slot) {
+  Value value = r->slots[slot];
+  if (r->stack[slot] == REF_NONE && (IS_NUMBER(value) || IS_BOOL(value))) {
+    IrType type = IS_NUMBER(value) ? IRT_NUM : IRT_BOOL;
+    r->stack[slot] = ir_emit(r, IR_SLOAD, type, slot, 0);
+  }
+  return r->stack[slot];
+}
+
+/* global_ref: the ref of the value of the global @slot, if the trace has
+ * already loaded or stored it. Nothing else can change it meanwhile. */
+static IrRef global_ref(Recorder* r, uint32_t slot) {
+  for (IrRef ref = r->ir_count; ref-- > 0;) {
+    IrIns* ins = &r->ir[ref];
+    if (ins->op == IR_GLOAD && ins->a == slot)
+      return ref;
+    if (ins->op == IR_GSTORE && ins->a == slot)
+      return ins->b;
+  }
+  return REF_NONE;
+}
+
+static void push(Recorder* r, Value value, IrRef ref) {
+  r->stack[r->sp - r->slots] = ref;
+  *r->sp++ = value;
+}
+
+static IrRef pop(Recorder* r) {
+  r->sp--;
+  return r->stack[r->sp - r->slots];
+}
+
+static IrRef peek_ref(Recorder* r, int distance) {
+  return r->stack[r->sp - r->slots - 1 - distance];
+}
+
+static uint32_t read_operand(uint8_t** pc, int size) {
+  uint32_t operand = 0;
+  memcpy(&operand, *pc, size);
+  *pc += size;
+  return operand;
+}
+
+/* record_instruction: run the instruction at r->pc and record it.
+ * The frame is left as it was if the recording is aborted, so that run()
+ * executes the instruction itself. */
+static RecordStatus record_instruction(Recorder* r) {
+  Value* constants = r->function->chunk.constants.values;
+  uint8_t* pc = r->pc;
+  Opcode opcode = opcode_generic(*pc++);
+  uint32_t depth = r->sp - r->slots;
+
+  switch (opcode) {
+    case OP_CONST:
+    case OP_CONST_LONG: {
+      int size = (opcode == OP_CONST) ? 1 : LONG_CONST_OFFSET_SIZE;
+      Value value = constants[read_operand(&pc, size)];
+      if (!IS_NUMBER(value))
+        return RECORD_ABORT;
+      push(r, value, ir_const(r, IR_KNUM, AS_NUMBER(value)));
+      break;
+    }
+    case OP_TRUE:
+    case OP_FALSE: {
+      bool value = (opcode == OP_TRUE);
+      push(r, BOOL_VAL(value), ir_const(r, IR_KBOOL, value));
+      break;
+    }
+    case OP_POP:
+      if (depth == r->base)
+        return RECORD_ABORT;  // leaving the scope of the loop
+      pop(r);
+      break;
+    case OP_GET_LOCAL:
+    case OP_GET_LOCAL_LONG: {
+      int size = (opcode == OP_GET_LOCAL) ? 1 : LONG_LOCAL_OFFSET_SIZE;
+      uint32_t slot = read_operand(&pc, size);
+      IrRef ref = slot_ref(r, slot);
+      if (ref == REF_NONE)
+        return RECORD_ABORT;
+      push(r, r->slots[slot], ref);
+      break;
+    }
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_LONG:
+    case OP_SET_LOCAL_POP: {
+      int size = (opcode == OP_SET_LOCAL_LONG) ? LONG_LOCAL_OFFSET_SIZE : 1;
+      uint32_t slot = read_operand(&pc, size);
+      IrRef ref = peek_ref(r, 0);
+      r->slots[slot] = r->sp[-1];
+      r->stack[slot] = ref;
+      if (slot < r->base)
+        ir_emit(r, IR_SSTORE, IRT_VOID, slot, ref);
+      if (opcode == OP_SET_LOCAL_POP)
+        pop(r);
+      break;
+    }
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_LONG: {
+      int size = (opcode == OP_GET_GLOBAL) ? 1 : LONG_GLOBAL_OFFSET_SIZE;
+      uint32_t slot = read_operand(&pc, size);
+      Value value = vm.globals.values[slot];
+      if (!IS_NUMBER(value))
+        return RECORD_ABORT;
+      IrRef ref = global_ref(r, slot);
+      if (ref == REF_NONE) {
+        ref = ir_emit(r, IR_GLOAD, IRT_NUM, slot, 0);
+        r->ir[ref].snapshot = snapshot(r, r->pc);
+      }
+      push(r, value, ref);
+      break;
+    }
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_LONG: {
+      int size = (opcode == OP_SET_GLOBAL) ? 1 : LONG_GLOBAL_OFFSET_SIZE;
+      uint32_t slot = read_operand(&pc, size);
+      if (!IS_NUMBER(r->sp[-1]) || !IS_NUMBER(vm.globals.values[slot]))
+        return RECORD_ABORT;
+      IrRef ref = ir_emit(r, IR_GSTORE, IRT_VOID, slot, peek_ref(r, 0));
+      r->ir[ref].snapshot = snapshot(r, r->pc);
+      vm.globals.values[slot] = r->sp[-1];
+      break;
+    }
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_LESS:
+    case OP_GREATER: {
+      if (!IS_NUMBER(r->sp[-1]) || !IS_NUMBER(r->sp[-2]))
+        return RECORD_ABORT;
+      double right = AS_NUMBER(r->sp[-1]);
+      double left = AS_NUMBER(r->sp[-2]);
+      IrRef b = pop(r);
+      IrRef a = pop(r);
+      switch (opcode) {
+        case OP_ADD:
+          push(r, NUMBER_VAL(left + right), ir_binary(r, IR_ADD, a, b));
+          break;
+        case OP_SUBTRACT:
+          push(r, NUMBER_VAL(left - right), ir_binary(r, IR_SUB, a, b));
+          break;
+        case OP_MUL:
+          push(r, NUMBER_VAL(left * right), ir_binary(r, IR_MUL, a, b));
+          break;
+        case OP_DIV:
+          push(r, NUMBER_VAL(left / right), ir_binary(r, IR_DIV, a, b));
+          break;
+        case OP_LESS:
+          push(r, BOOL_VAL(left < right), ir_binary(r, IR_LT, a, b));
+          break;
+        default:
+          push(r, BOOL_VAL(left > right), ir_binary(r, IR_GT, a, b));
+          break;
+      }
+      break;
+    }
+    case OP_ADD_LOCAL_CONST: {
+      uint32_t slot = read_operand(&pc, 1);
+      Value constant = constants[read_operand(&pc, 1)];
+      if (!IS_NUMBER(constant) || !IS_NUMBER(r->slots[slot]))
+        return RECORD_ABORT;
+      IrRef local = slot_ref(r, slot);
+      IrRef increment = ir_const(r, IR_KNUM, AS_NUMBER(constant));
+      IrRef sum = ir_binary(r, IR_ADD, local, increment);
+      push(r, NUMBER_VAL(AS_NUMBER(r->slots[slot]) + AS_NUMBER(constant)),
+           sum);
+      break;
+    }
+    case OP_CONCAT_N: {
+      // a sum of numbers, added from left to right
+      uint32_t count = read_operand(&pc, 1);
+      Value* operands = r->sp - count;
+      IrRef* refs = &r->stack[depth - count];
+      for (uint32_t i = 0; i < count; i++) {
+        if (!IS_NUMBER(operands[i]))
+          return RECORD_ABORT;
+      }
+      double sum = AS_NUMBER(operands[0]);
+      IrRef ref = refs[0];
+      for (uint32_t i = 1; i < count; i++) {
+        sum += AS_NUMBER(operands[i]);
+        ref = ir_binary(r, IR_ADD, ref, refs[i]);
+      }
+      r->sp -= count;
+      push(r, NUMBER_VAL(sum), ref);
+      break;
+    }
+    case OP_EQUAL: {
+      Value right = r->sp[-1];
+      Value left = r->sp[-2];
+      bool numbers = IS_NUMBER(left) && IS_NUMBER(right);
+      bool booleans = IS_BOOL(left) && IS_BOOL(right);
+      bool mixed = (IS_NUMBER(left) && IS_BOOL(right)) ||
+                   (IS_BOOL(left) && IS_NUMBER(right));
+      if (!numbers && !booleans && !mixed)
+        return RECORD_ABORT;
+      IrRef b = pop(r);
+      IrRef a = pop(r);
+      // a number never equals a boolean
+      IrRef ref = mixed ? ir_const(r, IR_KBOOL, false)
+                        : ir_binary(r, IR_EQ, a, b);
+      push(r, BOOL_VAL(value_equal(left, right)), ref);
+      break;
+    }
+    case OP_NOT: {
+      Value value = r->sp[-1];
+      if (!IS_NUMBER(value) && !IS_BOOL(value))
+        return RECORD_ABORT;
+      IrRef a = pop(r);
+      // numbers are truthy
+      IrRef ref = IS_NUMBER(value) ? ir_const(r, IR_KBOOL, false)
+                                   : ir_unary(r, IR_NOT, a);
+      push(r, BOOL_VAL(IS_BOOL(value) && !AS_BOOL(value)), ref);
+      break;
+    }
+    case OP_NEGATE: {
+      Value value = r->sp[-1];
+      if (!IS_NUMBER(value))
+        return RECORD_ABORT;
+      IrRef a = pop(r);
+      push(r, NUMBER_VAL(-AS_NUMBER(value)), ir_unary(r, IR_NEG, a));
+      break;
+    }
+    case OP_JMP:
+      pc += read_operand(&pc, 2);
+      break;
+    case OP_LOOP:
+      pc -= read_operand(&pc, 2);
+      if (pc == r->start) {
+        r->pc = pc;
+        return RECORD_DONE;
+      }
+      break;
+    case OP_JMP_IF_FALSE: {
+      uint32_t distance = read_operand(&pc, 2);
+      Value cond = r->sp[-1];
+      if (IS_BOOL(cond)) {
+        bool jump = !AS_BOOL(cond);
+        ir_guard(r, peek_ref(r, 0), AS_BOOL(cond), jump ? pc : pc + distance);
+        if (jump)
+          pc += distance;
+      } else if (!IS_NUMBER(cond)) {
+        return RECORD_ABORT;
+      }
+      break;
+    }
+    case OP_JMP_IF_NOT_LESS:
+    case OP_JMP_IF_NOT_GREATER:
+    case OP_JMP_IF_LESS:
+    case OP_JMP_IF_GREATER: {
+      bool less = (opcode == OP_JMP_IF_NOT_LESS || opcode == OP_JMP_IF_LESS);
+      bool jmp_if = (opcode == OP_JMP_IF_LESS || opcode == OP_JMP_IF_GREATER);
+      uint32_t distance = read_operand(&pc, 2);
+      if (!IS_NUMBER(r->sp[-1]) || !IS_NUMBER(r->sp[-2]))
+        return RECORD_ABORT;
+      double right = AS_NUMBER(r->sp[-1]);
+      double left = AS_NUMBER(r->sp[-2]);
+      bool holds = less ? left < right : left > right;
+      IrRef b = pop(r);
+      IrRef a = pop(r);
+      IrRef cond = ir_binary(r, less ? IR_LT : IR_GT, a, b);
+      uint8_t* if_holds = jmp_if ? pc + distance : pc;
+      uint8_t* if_fails = jmp_if ? pc : pc + distance;
+      ir_guard(r, cond, holds, holds ? if_fails : if_holds);
+      pc = holds ? if_holds : if_fails;
+      break;
+    }
+    default:
+      return RECORD_ABORT;
+  }
+
+  r->pc = pc;
+  return RECORD_NEXT;
+}
+
+/* type_stable: check that the locals the trace reads are only assigned
+ * values of the type they are read with, which they keep on the next
+ * iteration. */
+static bool type_stable(Recorder* r) {
+  for (IrRef store = 0; store < r->ir_count; store++) {
+    IrIns* ins = &r->ir[store];
+    if (ins->op != IR_SSTORE)
+      continue;
+    for (IrRef load = 0; load < r->ir_count; load++) {
+      if (r->ir[load].op == IR_SLOAD && r->ir[load].a == ins->a &&
+          r->ir[load].type != r->ir[ins->b].type)
+        return false;
+    }
+  }
+  return true;
+}
+
+/* stored: whether the trace stores to the slot or global @index, with
+ * @op IR_SSTORE or IR_GSTORE. */
+static bool stored(Recorder* r, IrOp op, uint32_t index) {
+  for (IrRef ref = 0; ref < r->ir_count; ref++) {
+    if (r->ir[ref].op == op && r->ir[ref].a == index)
+      return true;
+  }
+  return false;
+}
+
+static void mark_live(Recorder* r, IrRef ref) {
+  if (ref != REF_NONE)
+    r->ir[ref].live = true;
+}
+
+/* optimize: find the invariant instructions, hoisted out of the loop, then
+ * the live ones. Constants are already folded by the recorder. */
+static void optimize(Recorder* r) {
+  for (IrRef ref = 0; ref < r->ir_count; ref++) {
+    IrIns* ins = &r->ir[ref];
+    switch (ins->op) {
+      case IR_KNUM:
+      case IR_KBOOL:
+        ins->invariant = true;
+        break;
+      case IR_SLOAD:
+        ins->invariant = !stored(r, IR_SSTORE, ins->a);
+        break;
+      case IR_GLOAD:
+        ins->invariant = !stored(r, IR_GSTORE, ins->a);
+        break;
+      case IR_SSTORE:
+      case IR_GSTORE:
+        ins->invariant = false;
+        break;
+      case IR_NEG:
+      case IR_NOT:
+      case IR_GUARD_TRUE:
+      case IR_GUARD_FALSE:
+        ins->invariant = r->ir[ins->a].invariant;
+        break;
+      default:
+        ins->invariant = r->ir[ins->a].invariant && r->ir[ins->b].invariant;
+        break;
+    }
+  }
+
+  // stores and guards are needed, then whatever they use
+  for (IrRef ref = r->ir_count; ref-- > 0;) {
+    IrIns* ins = &r->ir[ref];
+    switch (ins->op) {
+      case IR_SSTORE:
+      case IR_GSTORE:
+      case IR_GUARD_TRUE:
+      case IR_GUARD_FALSE:
+        ins->live = true;
+        break;
+      default:
+        break;
+    }
+    if (!ins->live)
+      continue;
+
+    switch (ins->op) {
+      case IR_KNUM:
+      case IR_KBOOL:
+      case IR_SLOAD:
+      case IR_GLOAD:
+        break;
+      case IR_SSTORE:
+      case IR_GSTORE:
+        mark_live(r, ins->b);
+        break;
+      case IR_NEG:
+      case IR_NOT:
+      case IR_GUARD_TRUE:
+      case IR_GUARD_FALSE:
+        mark_live(r, ins->a);
+        break;
+      default:
+        mark_live(r, ins->a);
+        mark_live(r, ins->b);
+        break;
+    }
+    if (!ins->invariant && ins->snapshot != 0) {
+      Snapshot* snap = &r->snapshots[ins->snapshot];
+      for (uint32_t i = 0; i < snap->depth - r->base; i++)
+        mark_live(r, r->snapshot_refs[snap->refs + i]);
+    }
+  }
+}
+
+/** Code generation.
+ *
+ * The code of a trace follows the System V calling convention of
+ * TraceEntry, with:
+ * @rbx: vm.globals.values, which can't grow during the trace
+ * @r12: frame->slots
+ * @r13: the frame
+ * @r14: QNAN, with NAN_BOXING
+ *
+ * Values live in registers, see allocate(): numbers in @xmm0-14, booleans as
+ * 0 or 1 in general registers. A value left without one lives in its 8-byte
+ * spill slot on the machine stack, at SPILL(ref).
+ * */
+
+#define SPILL(ref) ((int32_t)(ref) * 8)
+
+#define REG_NONE -1
+#define XMM_SCRATCH 15
+// @rax, @rcx and @rdx are scratch
+static const int8_t bool_regs[] = {RSI, RDI, RBP, R8, R9, R10, R11, R15};
+
+/* Labels of the code, see x64.h. */
+#define LABEL_LOOP 0
+#define LABEL_RETURN 1
+#define LABEL_EXIT(snapshot) ((snapshot) + 2)
+
+/* operands: the values @ins uses, stored in @refs. Return their number. */
+static int operands(IrIns* ins, IrRef refs[2]) {
+  switch (ins->op) {
+    case IR_KNUM:
+    case IR_KBOOL:
+    case IR_SLOAD:
+    case IR_GLOAD:
+      return 0;
+    case IR_SSTORE:
+    case IR_GSTORE:
+      refs[0] = ins->b;
+      return 1;
+    case IR_NEG:
+    case IR_NOT:
+    case IR_GUARD_TRUE:
+    case IR_GUARD_FALSE:
+      refs[0] = ins->a;
+      return 1;
+    default:
+      refs[0] = ins->a;
+      refs[1] = ins->b;
+      return 2;
+  }
+}
+
+/* carried: the value the loop stores in the local it reads with the
+ * IR_SLOAD @load, which @load is on the next iteration. */
+static IrRef carried(Recorder* r, IrRef load) {
+  IrRef value = REF_NONE;
+  for (IrRef ref = 0; ref < r->ir_count; ref++) {
+    if (r->ir[ref].op == IR_SSTORE && r->ir[ref].a == r->ir[load].a)
+      value = r->ir[ref].b;
+  }
+  return value;
+}
+
+/* temporary: whether the value @ref only lives within an iteration. */
+static bool temporary(Recorder* r, IrRef ref) {
+  return !r->ir[ref].invariant && r->ir[ref].op != IR_SLOAD;
+}
+
+/* RegPool: the free registers. */
+typedef struct {
+  bool xmm[16];
+  bool gpr[16];
+} RegPool;
+
+static int8_t reg_take(RegPool* pool, IrType type) {
+  bool* free_regs = (type == IRT_NUM) ? pool->xmm : pool->gpr;
+  for (int8_t reg = 0; reg < 16; reg++) {
+    if (free_regs[reg]) {
+      free_regs[reg] = false;
+      return reg;
+    }
+  }
+  return REG_NONE;
+}
+
+static void reg_release(RegPool* pool, IrIns* ins) {
+  if (ins->reg != REG_NONE)
+    ((ins->type == IRT_NUM) ? pool->xmm : pool->gpr)[ins->reg] = true;
+}
+
+/* allocate: give registers to the live values.
+ * The invariant values and the locals the loop reads keep theirs across the
+ * whole trace, as they are used on every iteration. At the end of an
+ * iteration, the value stored to a local is moved to the register of its
+ * IR_SLOAD, which becomes the value of the local for the next one. The
+ * other values only hold their register until their last use, including by
+ * the snapshots of exits, and are allocated by a linear scan of the loop.
+ * A comparison only used by the guard after it isn't given a register: it
+ * sets the flags the guard jumps on (@fused).
+ * return false if memory runs out. */
+static bool allocate(Recorder* r) {
+  RegPool pool = {0};
+  for (int reg = 0; reg < XMM_SCRATCH; reg++)
+    pool.xmm[reg] = true;
+  for (size_t i = 0; i < sizeof(bool_regs); i++)
+    pool.gpr[bool_regs[i]] = true;
+
+  uint32_t* uses = calloc(r->ir_count, sizeof(uint32_t));
+  IrRef* last_use = calloc(r->ir_count, sizeof(IrRef));
+  if (uses == NULL || last_use == NULL) {
+    free(uses);
+    free(last_use);
+    return false;
+  }
+  for (IrRef ref = 0; ref < r->ir_count; ref++) {
+    IrIns* ins = &r->ir[ref];
+    ins->reg = REG_NONE;
+    if (!ins->live)
+      continue;
+    IrRef refs[2];
+    for (int i = operands(ins, refs); i-- > 0;) {
+      uses[refs[i]]++;
+      last_use[refs[i]] = ref;
+    }
+    if (!ins->invariant && ins->snapshot != 0) {
+      Snapshot* snap = &r->snapshots[ins->snapshot];
+      for (uint32_t i = 0; i < snap->depth - r->base; i++) {
+        uses[r->snapshot_refs[snap->refs + i]]++;
+        last_use[r->snapshot_refs[snap->refs + i]] = ref;
+      }
+    }
+  }
+  for (IrRef ref = 0; ref < r->ir_count; ref++) {
+    if (r->ir[ref].live && r->ir[ref].op == IR_SLOAD && !r->ir[ref].invariant)
+      last_use[carried(r, ref)] = r->ir_count;
+  }
+
+  for (IrRef ref = 0; ref < r->ir_count; ref++) {
+    IrIns* ins = &r->ir[ref];
+    if (!ins->live || (ins->op != IR_LT && ins->op != IR_GT) ||
+        uses[ref] != 1)
+      continue;
+    IrRef next = ref + 1;
+    while (next < r->ir_count && (!r->ir[next].live ||
+                                  r->ir[next].invariant != ins->invariant))
+      next++;
+    ins->fused = next < r->ir_count && r->ir[next].a == ref &&
+                 (r->ir[next].op == IR_GUARD_TRUE ||
+                  r->ir[next].op == IR_GUARD_FALSE);
+  }
+
+  for (IrRef ref = 0; ref < r->ir_count; ref++) {
+    IrIns* ins = &r->ir[ref];
+    if (ins->live && ins->type != IRT_VOID && !ins->fused &&
+        !temporary(r, ref))
+      ins->reg = reg_take(&pool, ins->type);
+  }
+  for (IrRef ref = 0; ref < r->ir_count; ref++) {
+    IrIns* ins = &r->ir[ref];
+    if (!ins->live || ins->invariant)
+      continue;
+    if (ins->type != IRT_VOID && !ins->fused && temporary(r, ref))
+      ins->reg = reg_take(&pool, ins->type);
+    // the operands are released after the result is allocated, so that an
+    // operand is never overwritten before it is read
+    IrRef refs[2];
+    for (int i = operands(ins, refs); i-- > 0;) {
+      if (last_use[refs[i]] == ref && temporary(r, refs[i]))
+        reg_release(&pool, &r->ir[refs[i]]);
+    }
+    if (ins->snapshot != 0) {
+      Snapshot* snap = &r->snapshots[ins->snapshot];
+      for (uint32_t i = 0; i < snap->depth - r->base; i++) {
+        IrRef used = r->snapshot_refs[snap->refs + i];
+        if (last_use[used] == ref && temporary(r, used))
+          reg_release(&pool, &r->ir[used]);
+      }
+    }
+  }
+  free(uses);
+  free(last_use);
+  return true;
+}
+
+/* emit_sse: the SSE instruction @opcode on @xmm and the number @ref. */
+static void emit_sse(Assembler* as,
+                     Recorder* r,
+                     uint8_t prefix,
+                     uint16_t opcode,
+                     int xmm,
+                     IrRef ref) {
+  if (r->ir[ref].reg != REG_NONE)
+    x64_op_regs(as, prefix, false, opcode, xmm, r->ir[ref].reg);
+  else
+    x64_op_mem(as, prefix, false, opcode, xmm, RSP, SPILL(ref));
+}
+
+/* emit_load_number: copy the number @ref to @xmm. */
+static void emit_load_number(Assembler* as, Recorder* r, int xmm, IrRef ref) {
+  int8_t reg = r->ir[ref].reg;
+  if (reg == REG_NONE)
+    x64_op_mem(as, 0xf2, false, 0x0f10, xmm, RSP, SPILL(ref));  // movsd
+  else if (reg != xmm)
+    x64_op_regs(as, 0, false, 0x0f28, xmm, reg);  // movaps
+}
+
+/* emit_number: the register holding the number @ref, loaded in the scratch
+ * register if it is spilled. */
+static int emit_number(Assembler* as, Recorder* r, IrRef ref) {
+  if (r->ir[ref].reg != REG_NONE)
+    return r->ir[ref].reg;
+  emit_load_number(as, r, XMM_SCRATCH, ref);
+  return XMM_SCRATCH;
+}
+
+/* target: the register to compute the number @ref in. */
+static int target(Recorder* r, IrRef ref) {
+  return r->ir[ref].reg != REG_NONE ? r->ir[ref].reg : XMM_SCRATCH;
+}
+
+/* emit_set_number: make the number in @xmm the value @ref. */
+static void emit_set_number(Assembler* as, Recorder* r, IrRef ref, int xmm) {
+  int8_t reg = r->ir[ref].reg;
+  if (reg == REG_NONE)
+    x64_op_mem(as, 0xf2, false, 0x0f11, xmm, RSP, SPILL(ref));  // movsd
+  else if (reg != xmm)
+    x64_op_regs(as, 0, false, 0x0f28, reg, xmm);  // movaps
+}
+
+/* emit_load_bool: copy the boolean @ref to @rax. */
+static void emit_load_bool(Assembler* as, Recorder* r, IrRef ref) {
+  if (r->ir[ref].reg != REG_NONE)
+    x64_mov(as, RAX, r->ir[ref].reg);
+  else
+    x64_load(as, RAX, RSP, SPILL(ref));
+}
+
+/* emit_set_bool: make the boolean in @rax the value @ref. */
+static void emit_set_bool(Assembler* as, Recorder* r, IrRef ref) {
+  if (r->ir[ref].reg != REG_NONE)
+    x64_mov(as, r->ir[ref].reg, RAX);
+  else
+    x64_store(as, RSP, SPILL(ref), RAX);
+}
+
+/* emit_set_flag: make the boolean in @al the value @ref. */
+static void emit_set_flag(Assembler* as, Recorder* r, IrRef ref) {
+  x64_byte(as, 0x0f);  // movzx eax, al
+  x64_byte(as, 0xb6);
+  x64_byte(as, 0xc0);
+  emit_set_bool(as, r, ref);
+}
+
+/* emit_guard_bool: jump to @label if the value at [@base + @disp] isn't a
+ * boolean. */
+static void emit_guard_bool(Assembler* as,
+                            int base,
+                            int32_t disp,
+                            uint32_t label) {
+#ifdef NAN_BOXING
+  x64_load(as, RAX, base, disp);
+  x64_byte(as, 0x48);  // or rax, 1
+  x64_byte(as, 0x83);
+  x64_byte(as, 0xc8);
+  x64_byte(as, 0x01);
+  x64_mov_imm64(as, RCX, BOOL_VAL(true));
+  x64_cmp(as, RAX, RCX);
+  x64_jcc(as, CC_NE, label);
+#else
+  // cmp dword [base + disp], VAL_BOOL
+  x64_op_mem(as, 0, false, 0x83, 7, base, disp + TYPE_OFFSET);
+  x64_byte(as, VAL_BOOL);
+  x64_jcc(as, CC_NE, label);
+#endif
+}
+
+/* emit_box: store the value @ref as a Value at [@base + @disp]. */
+static void emit_box(Assembler* as,
+                     Recorder* r,
+                     IrRef ref,
+                     int base,
+                     int32_t disp) {
+  if (r->ir[ref].type == IRT_BOOL) {
+    emit_load_bool(as, r, ref);
+    x64_store_bool(as, base, disp);
+  } else {
+    x64_store_number(as, base, disp, emit_number(as, r, ref));
+  }
+}
+
+/* emit_ir: the code of the instruction @ref, exiting through @exit. */
+static void emit_ir(Assembler* as, Recorder* r, IrRef ref, uint32_t exit) {
+  IrIns* ins = &r->ir[ref];
+  switch (ins->op) {
+    case IR_KNUM: {
+      uint64_t bits;
+      memcpy(&bits, &ins->number, sizeof(bits));
+      x64_mov_imm64(as, RAX, bits);
+      if (ins->reg != REG_NONE)
+        x64_op_regs(as, 0x66, true, 0x0f6e, ins->reg, RAX);  // movq
+      else
+        x64_store(as, RSP, SPILL(ref), RAX);
+      break;
+    }
+    case IR_KBOOL:
+      x64_mov_imm32(as, RAX, ins->number != 0);
+      emit_set_bool(as, r, ref);
+      break;
+    case IR_SLOAD:
+      if (ins->type == IRT_NUM) {
+        x64_movsd_load(as, target(r, ref), R12, ins->a * VALUE_SIZE);
+        emit_set_number(as, r, ref, target(r, ref));
+        break;
+      }
+#ifdef NAN_BOXING
+      x64_load(as, RAX, R12, ins->a * VALUE_SIZE);
+      x64_byte(as, 0x83);  // and eax, 1
+      x64_byte(as, 0xe0);
+      x64_byte(as, 0x01);
+#else
+      x64_op_mem(as, 0, false, 0x0fb6, RAX, R12,  // movzx eax, byte [..]
+                 ins->a * VALUE_SIZE + (int32_t)offsetof(Value, as.boolean));
+#endif
+      emit_set_bool(as, r, ref);
+      break;
+    case IR_SSTORE:
+      emit_box(as, r, ins->b, R12, ins->a * VALUE_SIZE);
+      break;
+    case IR_GLOAD:
+      x64_guard_number(as, RBX, ins->a * VALUE_SIZE, LABEL_EXIT(exit));
+      x64_movsd_load(as, target(r, ref), RBX, ins->a * VALUE_SIZE);
+      emit_set_number(as, r, ref, target(r, ref));
+      break;
+    case IR_GSTORE:
+      // a global can't change type during the trace, but may have outside
+      x64_guard_number(as, RBX, ins->a * VALUE_SIZE, LABEL_EXIT(exit));
+      emit_box(as, r, ins->b, RBX, ins->a * VALUE_SIZE);
+      break;
+    case IR_ADD:
+    case IR_SUB:
+    case IR_MUL:
+    case IR_DIV: {
+      static const uint16_t sse_ops[] = {
+          [IR_ADD] = 0x0f58, [IR_SUB] = 0x0f5c,
+          [IR_MUL] = 0x0f59, [IR_DIV] = 0x0f5e};
+      emit_load_number(as, r, target(r, ref), ins->a);
+      emit_sse(as, r, 0xf2, sse_ops[ins->op], target(r, ref), ins->b);
+      emit_set_number(as, r, ref, target(r, ref));
+      break;
+    }
+    case IR_NEG:
+      emit_load_number(as, r, target(r, ref), ins->a);
+      x64_op_regs(as, 0x66, true, 0x0f7e, target(r, ref), RAX);  // movq
+      x64_byte(as, 0x48);  // btc rax, 63: flip the sign bit
+      x64_byte(as, 0x0f);
+      x64_byte(as, 0xba);
+      x64_byte(as, 0xf8);
+      x64_byte(as, 63);
+      x64_op_regs(as, 0x66, true, 0x0f6e, target(r, ref), RAX);  // movq
+      emit_set_number(as, r, ref, target(r, ref));
+      break;
+    case IR_LT:
+    case IR_GT: {
+      // a < b is b > a, so that an unordered comparison (NaN) is false in
+      // both cases.
+      bool less = (ins->op == IR_LT);
+      int left = emit_number(as, r, less ? ins->b : ins->a);
+      emit_sse(as, r, 0x66, 0x0f2e, left, less ? ins->a : ins->b);  // ucomisd
+      if (!ins->fused) {
+        x64_setcc(as, CC_A);
+        emit_set_flag(as, r, ref);
+      }
+      break;
+    }
+    case IR_EQ:
+      if (r->ir[ins->a].type == IRT_NUM) {
+        int left = emit_number(as, r, ins->a);
+        emit_sse(as, r, 0x66, 0x0f2e, left, ins->b);  // ucomisd
+        x64_setcc(as, CC_E);
+        x64_byte(as, 0x0f);  // setnp cl: false if unordered
+        x64_byte(as, 0x90 + CC_NP);
+        x64_byte(as, 0xc1);
+        x64_byte(as, 0x20);  // and al, cl
+        x64_byte(as, 0xc8);
+      } else {
+        emit_load_bool(as, r, ins->a);
+        if (r->ir[ins->b].reg != REG_NONE)
+          x64_cmp(as, RAX, r->ir[ins->b].reg);
+        else
+          x64_op_mem(as, 0, true, 0x3b, RAX, RSP, SPILL(ins->b));  // cmp
+        x64_setcc(as, CC_E);
+      }
+      emit_set_flag(as, r, ref);
+      break;
+    case IR_NOT:
+      emit_load_bool(as, r, ins->a);
+      x64_byte(as, 0x83);  // xor eax, 1
+      x64_byte(as, 0xf0);
+      x64_byte(as, 0x01);
+      emit_set_bool(as, r, ref);
+      break;
+    case IR_GUARD_TRUE:
+    case IR_GUARD_FALSE: {
+      bool expected = (ins->op == IR_GUARD_TRUE);
+      IrIns* cond = &r->ir[ins->a];
+      if (cond->fused) {
+        x64_jcc(as, expected ? CC_BE : CC_A, LABEL_EXIT(exit));
+        break;
+      }
+      if (cond->reg != REG_NONE) {
+        x64_test(as, cond->reg);
+      } else {
+        // cmp byte [rsp + a], 0
+        x64_op_mem(as, 0, false, 0x80, 7, RSP, SPILL(ins->a));
+        x64_byte(as, 0);
+      }
+      x64_jcc(as, expected ? CC_E : CC_NE, LABEL_EXIT(exit));
+      break;
+    }
+  }
+}
+
+/* emit_next_iteration: move the values stored to the locals to the
+ * registers of their IR_SLOAD, see allocate(). */
+static void emit_next_iteration(Assembler* as, Recorder* r) {
+  for (IrRef ref = 0; ref < r->ir_count; ref++) {
+    IrIns* ins = &r->ir[ref];
+    if (!ins->live || ins->op != IR_SLOAD || ins->invariant)
+      continue;
+    IrRef value = carried(r, ref);
+    if (r->ir[value].op == IR_SLOAD) {
+      // its register may already hold the next iteration's value: load the
+      // local, stored by now
+      emit_ir(as, r, ref, 0);
+    } else if (ins->type == IRT_NUM) {
+      emit_set_number(as, r, ref, emit_number(as, r, value));
+    } else {
+      emit_load_bool(as, r, value);
+      emit_set_bool(as, r, ref);
+    }
+  }
+}
+
+/* emit_exit: leave the trace at @snapshot, see Snapshot. */
+static void emit_exit(Assembler* as, Recorder* r, uint32_t snapshot) {
+  Snapshot* snap = &r->snapshots[snapshot];
+  x64_bind(as, LABEL_EXIT(snapshot));
+  for (uint32_t slot = r->base; slot < snap->depth; slot++) {
+    IrRef ref = r->snapshot_refs[snap->refs + slot - r->base];
+    emit_box(as, r, ref, R12, slot * VALUE_SIZE);
+  }
+  x64_mov_imm64(as, RAX, (uint64_t)(uintptr_t)snap->pc);
+  x64_store(as, R13, offsetof(CallFrame, pc), RAX);
+  x64_lea(as, RAX, R12, snap->depth * VALUE_SIZE);
+  x64_mov_imm64(as, RCX, (uint64_t)(uintptr_t)&vm.stack_top);
+  x64_store(as, RCX, 0, RAX);
+  x64_mov_imm32(as, RAX, snapshot);
+  x64_jmp(as, LABEL_RETURN);
+}
+
+static void compile(Recorder* r, Trace* trace) {
+  if (!allocate(r))
+    return;
+  // the spill slots, keeping the machine stack aligned
+  int32_t frame_size = SPILL(r->ir_count);
+  if (frame_size % 16 == 0)
+    frame_size += 8;
+
+  Assembler as;
+  x64_init(&as, LABEL_EXIT(r->snapshot_count));
+  x64_push_frame(&as, frame_size);
+  x64_mov(&as, R13, RDI);
+  x64_load(&as, R12, R13, offsetof(CallFrame, slots));
+  x64_mov_imm64(&as, RBX, (uint64_t)(uintptr_t)&vm.globals.values);
+  x64_load(&as, RBX, RBX, 0);
+#ifdef NAN_BOXING
+  x64_mov_imm64(&as, R14, QNAN);
+#endif
+
+  // the locals read must have the type they were recorded with, then they
+  // keep it (see type_stable())
+  for (IrRef ref = 0; ref < r->ir_count; ref++) {
+    IrIns* ins = &r->ir[ref];
+    if (!ins->live || ins->op != IR_SLOAD)
+      continue;
+    if (ins->type == IRT_NUM)
+      x64_guard_number(&as, R12, ins->a * VALUE_SIZE, LABEL_EXIT(0));
+    else
+      emit_guard_bool(&as, R12, ins->a * VALUE_SIZE, LABEL_EXIT(0));
+  }
+  // the invariant instructions and the first loads of the locals exit to the
+  // head of the loop, as nothing is done yet.
+  for (IrRef ref = 0; ref < r->ir_count; ref++) {
+    IrIns* ins = &r->ir[ref];
+    if (ins->live && (ins->invariant || ins->op == IR_SLOAD))
+      emit_ir(&as, r, ref, 0);
+  }
+  x64_bind(&as, LABEL_LOOP);
+  for (IrRef ref = 0; ref < r->ir_count; ref++) {
+    IrIns* ins = &r->ir[ref];
+    if (ins->live && !ins->invariant && ins->op != IR_SLOAD)
+      emit_ir(&as, r, ref, ins->snapshot);
+  }
+  emit_next_iteration(&as, r);
+  x64_jmp(&as, LABEL_LOOP);
+
+  // the exits of the instructions in the loop, and the head of the loop
+  for (uint32_t snapshot = 0; snapshot < r->snapshot_count; snapshot++) {
+    bool used = (snapshot == 0);
+    for (IrRef ref = 0; ref < r->ir_count && !used; ref++) {
+      IrIns* ins = &r->ir[ref];
+      used = ins->live && !ins->invariant && ins->snapshot == snapshot;
+    }
+    if (used)
+      emit_exit(&as, r, snapshot);
+  }
+  x64_bind(&as, LABEL_RETURN);
+  x64_pop_frame(&as, frame_size);
+
+  void* memory = NULL;
+  if (x64_link(&as))
+    memory = x64_install(&as);
+  if (memory != NULL) {
+    trace->entry = (TraceEntry)memory;
+    trace->size = as.size;
+  }
+  x64_free(&as);
+}
+
+#ifdef DBG_DUMP_TRACES
+static const char* ir_names[] = {
+    [IR_KNUM] = "KNUM",   [IR_KBOOL] = "KBOOL",
+    [IR_SLOAD] = "SLOAD", [IR_SSTORE] = "SSTORE",
+    [IR_GLOAD] = "GLOAD", [IR_GSTORE] = "GSTORE",
+    [IR_ADD] = "ADD",     [IR_SUB] = "SUB",
+    [IR_MUL] = "MUL",     [IR_DIV] = "DIV",
+    [IR_NEG] = "NEG",     [IR_LT] = "LT",
+    [IR_GT] = "GT",       [IR_EQ] = "EQ",
+    [IR_NOT] = "NOT",     [IR_GUARD_TRUE] = "GUARD_TRUE",
+    [IR_GUARD_FALSE] = "GUARD_FALSE",
+};
+
+static const char* global_name(uint32_t slot) {
+  return AS_CSTRING(vm.global_names.values[slot]);
+}
+
+/* dump: print the recorded instructions and the IR of the trace. The IR is
+ * marked with '>' for the instructions hoisted out of the loop and '-' for
+ * the dead ones. */
+static void dump(Recorder* r, Trace* trace, bool recorded) {
+  Chunk* chunk = &r->function->chunk;
+  const char* name = r->function->name ? r->function->name->chars : "script";
+  printf("== trace of %s at %04u (line %u): ", name, trace->start,
+         chunk_get_line(chunk, trace->start));
+  if (!recorded) {
+    printf("aborted at %04u ==\n", r->bytecodes[r->length - 1]);
+    return;
+  }
+  printf("%u instructions ==\n", r->length);
+  for (uint32_t i = 0; i < r->length; i++)
+    disassemble_inst(chunk, r->bytecodes[i]);
+
+  printf("-- ir --\n");
+  for (IrRef ref = 0; ref < r->ir_count; ref++) {
+    IrIns* ins = &r->ir[ref];
+    const char* type = ins->type == IRT_NUM    ? "num"
+                       : ins->type == IRT_BOOL ? "bool"
+                                               : "";
+    printf("%04u %c %-4s %-11s ", ref,
+           !ins->live ? '-' : ins->invariant ? '>' : ' ', type,
+           ir_names[ins->op]);
+    switch (ins->op) {
+      case IR_KNUM:
+        printf("%g", ins->number);
+        break;
+      case IR_KBOOL:
+        printf("%s", ins->number != 0 ? "true" : "false");
+        break;
+      case IR_SLOAD:
+        printf("#%u", ins->a);
+        break;
+      case IR_SSTORE:
+        printf("#%u %04u", ins->a, ins->b);
+        break;
+      case IR_GLOAD:
+        printf("%s", global_name(ins->a));
+        break;
+      case IR_GSTORE:
+        printf("%s %04u", global_name(ins->a), ins->b);
+        break;
+      case IR_NEG:
+      case IR_NOT:
+      case IR_GUARD_TRUE:
+      case IR_GUARD_FALSE:
+        printf("%04u", ins->a);
+        break;
+      default:
+        printf("%04u %04u", ins->a, ins->b);
+        break;
+    }
+    if (ins->snapshot != 0)
+      printf("  -> exit %u", ins->snapshot);
+    printf("\n");
+  }
+
+  printf("-- exits --\n");
+  for (uint32_t i = 0; i < r->snapshot_count; i++) {
+    Snapshot* snap = &r->snapshots[i];
+    uint32_t offset = snap->pc - chunk->bytecodes;
+    printf("%4u at %04u (line %u), stack [", i, offset,
+           chunk_get_line(chunk, offset));
+    for (uint32_t slot = r->base; slot < snap->depth; slot++) {
+      printf(slot == r->base ? "%04u" : " %04u",
+             r->snapshot_refs[snap->refs + slot - r->base]);
+    }
+    printf("]\n");
+  }
+  printf("-- %zu bytes of machine code --\n", trace->size);
+}
+#endif
+
+/* record: record the loop of @trace, starting at the current iteration of
+ * @frame, and compile it. */
+static void record(Trace* trace, CallFrame* frame) {
+  Recorder r = {0};
+  r.function = frame->closure->function;
+  r.start = r.pc = frame->pc;
+  r.slots = frame->slots;
+  r.sp = vm.stack_top;
+  r.base = r.sp - r.slots;
+  r.stack = malloc((r.base + TRACE_MAX_LENGTH + 1) * sizeof(IrRef));
+  r.ir_capacity = r.snapshot_capacity = r.snapshot_ref_capacity = 32;
+  r.ir = malloc(r.ir_capacity * sizeof(IrIns));
+  r.snapshots = malloc(r.snapshot_capacity * sizeof(Snapshot));
+  r.snapshot_refs = malloc(r.snapshot_ref_capacity * sizeof(IrRef));
+
+  // without memory, the loop is left to run() as if the recording aborted
+  RecordStatus status = RECORD_ABORT;
+  if (r.stack != NULL && r.ir != NULL && r.snapshots != NULL &&
+      r.snapshot_refs != NULL) {
+    for (uint32_t slot = 0; slot < r.base; slot++)
+      r.stack[slot] = REF_NONE;
+    snapshot(&r, r.start);
+    status = RECORD_NEXT;
+  }
+  while (status == RECORD_NEXT && !r.failed) {
+    if (r.length == TRACE_MAX_LENGTH) {
+      status = RECORD_ABORT;
+      break;
+    }
+    r.bytecodes[r.length++] = r.pc - r.function->chunk.bytecodes;
+    status = record_instruction(&r);
+  }
+  frame->pc = r.pc;
+  vm.stack_top = r.sp;
+
+  bool recorded = (status == RECORD_DONE && !r.failed &&
+                   r.sp == r.slots + r.base && type_stable(&r));
+  if (recorded) {
+    optimize(&r);
+    compile(&r, trace);
+  }
+  if (trace->entry == NULL)
+    trace->aborts++;
+#ifdef DBG_DUMP_TRACES
+  dump(&r, trace, recorded);
+#endif
+
+  free(r.stack);
+  free(r.ir);
+  free(r.snapshots);
+  free(r.snapshot_refs);
+}
+
+/* discard: drop the code of @trace, so that its loop is recorded again. */
+static void discard(Trace* trace) {
+  x64_uninstall((void*)trace->entry, trace->size);
+  trace->entry = NULL;
+  trace->aborts++;
+}
+
+void trace_loop(CallFrame* frame) {
+  FunctionObj* function = frame->closure->function;
+  uint32_t start = frame->pc - function->chunk.bytecodes;
+  int16_t* counter = &trace_counters[(uintptr_t)frame->pc % TRACE_COUNTERS];
+  *counter = 0;
+  Trace* trace = function->traces;
+  while (trace != NULL && trace->start != start)
+    trace = trace->next;
+  if (trace == NULL) {
+    trace = malloc(sizeof(Trace));
+    if (trace == NULL) {
+      // left to run(), as a loop that can't be traced
+      *counter = INT16_MIN;
+      return;
+    }
+    *trace = (Trace){.start = start, .next = function->traces};
+    function->traces = trace;
+  }
+  if (trace->entry == NULL) {
+    if (trace->aborts >= TRACE_MAX_ABORTS) {
+      // left to run(), which only comes back much later
+      *counter = INT16_MIN;
+      return;
+    }
+    // the recording ends at the head of the loop, where the trace starts
+    record(trace, frame);
+    if (trace->entry == NULL)
+      return;
+  }
+
+  // a trace that keeps failing before its first iteration (its path is no
+  // longer taken) is recorded again
+  if (trace->entry(frame) != 0)
+    trace->misses = 0;
+  else if (++trace->misses == TRACE_HOT_LOOP)
+    discard(trace);
+  // run() enters the trace again at the next back-edge
+  if (trace->entry != NULL)
+    *counter = TRACE_HOT_LOOP - 1;
+}
+
+void trace_free(FunctionObj* function) {
+  while (function->traces != NULL) {
+    Trace* trace = function->traces;
+    function->traces = trace->next;
+    if (trace->entry != NULL)
+      x64_uninstall((void*)trace->entry, trace->size);
+    free(trace);
+  }
+}
+
+#else
+
+void trace_loop(CallFrame* frame) {
+  (void)frame;
+}
+
+void trace_free(FunctionObj* function) {
+  (void)function;
+}
+
+#endif
@@ -56,7 +56,8 @@ void value_arr_append(ValueArr* vl_arr, Value val) {
     vl_arr->capacity = new_cap;
   }
 
-  vl_arr->values[vl_arr->size++] = val;
+  vl_arr->values[vl_arr->size] = val;
+  GC_PUBLISH(vl_arr->size, vl_arr->size + 1);
 }
 
 void print_value(Value val) {
@@ -95,7 +96,7 @@ void print_value(Value val) {
 void print_object(Obj* obj) {
   switch (obj->type) {
     case OBJ_STRING:
-      printf("'%s'", ((StringObj*)obj)->chars);
+      printf("'%s'", StringObj_intern((StringObj*)obj)->chars);
       break;
     case OBJ_FUNCTION: {
       FunctionObj* func = (FunctionObj*)obj;
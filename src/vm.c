@@ -1,6 +1,8 @@
 #include "vm.h"
 
 #include <assert.h>
+#include <inttypes.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -10,14 +12,38 @@
 
 #include "chunk.h"
 #include "compiler.h"
+#ifdef DBG_IC_STATS
+#include "debug.h"
+#endif
+#include "jit.h"
 #include "memory.h"
 #include "native_fns.h"
 #include "object.h"
 #include "table.h"
+#include "trace.h"
 #include "value.h"
 
+/* Labels-as-values is a GNU extension, so threaded dispatch is only used by
+ * compilers that support it. Define FORCE_SWITCH_DISPATCH to always use the
+ * portable switch. */
+#if defined(__GNUC__) && !defined(FORCE_SWITCH_DISPATCH)
+#define THREADED_DISPATCH
+#endif
+
+/* GCC's cross-jumping merges the identical dispatch sequences at the end of
+ * every handler back into one shared indirect jump, which defeats the point
+ * of threaded dispatch. */
+#if defined(THREADED_DISPATCH) && !defined(__clang__)
+#define DISPATCH_LOOP_ATTR __attribute__((optimize("no-crossjumping")))
+#else
+#define DISPATCH_LOOP_ATTR
+#endif
+
 VM vm;
 
+// where vm_out_of_memory() resumes interpret(), NULL outside of it
+static jmp_buf* out_of_memory_exit;
+
 static void call_frame_reset() {
   // TODO: free the call frame resources
   vm.frame_count = 0;
@@ -59,43 +85,79 @@ static Value clock_native(int param_count, Value* params) {
 static void define_native_fn(const char* name, NativeFn func) {
   vm_stack_push(OBJ_VAL(*StringObj_construct(name, strlen(name))));
   vm_stack_push(OBJ_VAL(*NativeFnObj_construct(func)));
-  table_set(&vm.globals, AS_STRING(vm_stack_peek(1)), vm_stack_peek(0));
+  uint32_t slot = vm_global_slot(AS_STRING(vm_stack_peek(1)));
+  vm.globals.values[slot] = vm_stack_peek(0);
   vm_stack_pop();
   vm_stack_pop();
 }
 
-void vm_init(bool repl) {
+void vm_init(bool repl,
+             Engine engine,
+             JitMode jit,
+             const GCConfig* gc_config) {
   stack_reset();
   call_frame_reset();
-  table_init(&vm.strings);
-  table_init(&vm.globals);
+  string_set_init(&vm.strings);
+  value_arr_init(&vm.globals);
+  table_init(&vm.global_slots);
+  value_arr_init(&vm.global_names);
 
   vm.open_upvalues = NULL;
-  vm.objects = NULL;
   vm.frame_count = 0;
   vm.repl = repl;
+  vm.engine = engine;
+  vm.jit = jit;
   vm.gc.objects = NULL;
   vm.gc.count = 0;
   vm.gc.capacity = 0;
+  vm.gc.remembered = NULL;
+  vm.gc.remembered_count = 0;
+  vm.gc.remembered_capacity = 0;
   vm.gc.allocated = 0;
-  vm.gc.threshold = GC_THRESHOLD;
+  vm.gc.young_limit = GC_NURSERY_SIZE;
+  vm.gc.old_allocated = 0;
+  vm.gc.config = *gc_config;
+  vm.gc.threshold = gc_config->initial;
+  vm.gc.phase = GC_IDLE;
+  vm.gc.cursor = NULL;
+  vm.gc.sweep = NULL;
+  vm.gc.compact = false;
 
   vm.cls_init_strlit = NULL;
   vm.cls_init_strlit = StringObj_construct("init", 4);
 
   define_native_fn("clock", clock_native);
   define_native_fn("hasattr", native_fn_has_attribute);
+  define_native_fn("compact", native_fn_compact);
 }
 
 void vm_free() {
-  table_free(&vm.strings);
-  table_free(&vm.globals);
+  string_set_free(&vm.strings);
+  value_arr_free(&vm.globals);
+  table_free(&vm.global_slots);
+  value_arr_free(&vm.global_names);
   free_objects();
+  free(vm.gc.remembered);
+  vm.gc.remembered = NULL;
+  vm.gc.remembered_count = vm.gc.remembered_capacity = 0;
   stack_reset();
   call_frame_reset();
   vm.cls_init_strlit = NULL;
 }
 
+uint32_t vm_global_slot(StringObj* name) {
+  Value slot;
+  if (table_get(&vm.global_slots, name, &slot))
+    return (uint32_t)AS_NUMBER(slot);
+
+  // @name is reachable through @global_names from here on.
+  uint32_t new_slot = vm.globals.size;
+  value_arr_append(&vm.global_names, OBJ_VAL(*name));
+  value_arr_append(&vm.globals, UNDEFINED_VAL());
+  table_set(&vm.global_slots, name, NUMBER_VAL(new_slot));
+  return new_slot;
+}
+
 bool gc_empty() {
   return vm.gc.count == 0;
 }
@@ -116,35 +178,17 @@ Obj* gc_pop() {
   return vm.gc.objects[--vm.gc.count];
 }
 
+
 static bool is_falsey(Value val) {
   return IS_NIL(val) || (IS_BOOL(val) && !AS_BOOL(val));
 }
 
-static inline uint16_t read_short(CallFrame* frame) {
-  uint16_t v = *((uint16_t*)frame->pc);
-  frame->pc += 2;
+static inline uint16_t read_short(uint8_t** pc) {
+  uint16_t v = *((uint16_t*)*pc);
+  *pc += 2;
   return v;
 }
 
-/** Concatenate two strings that are on top of the stack.
- *  The result of the concatenation is pushed back into the stack.
- * */
-static Value concatenate(Value left, Value right) {
-  StringObj* sleft = AS_STRING(left);
-  StringObj* sright = AS_STRING(right);
-
-  size_t total_length = sright->length + sleft->length;
-
-  char* concat_string = ALLOCATE(char, total_length + 1);
-  memcpy(concat_string, sleft->chars, sleft->length);
-  memcpy(concat_string + sleft->length, sright->chars, sright->length);
-  concat_string[total_length] = '\0';
-
-  StringObj* concat_str_obj = StringObj_construct(concat_string, total_length);
-  FREE(char, concat_string);
-  return OBJ_VAL(*concat_str_obj);
-}
-
 /* runtime_error: print out error message to stderr and reset the stack */
 static void runtime_error(const char* format, ...) {
   va_list args;
@@ -161,7 +205,10 @@ static void runtime_error(const char* format, ...) {
   for (CallFrame* frame = &vm.frames[vm.frame_count - 1]; frame >= vm.frames;
        frame--) {
     FunctionObj* function = frame->closure->function;
-    int inst_offset = frame->pc - function->chunk.bytecodes;
+    // the last byte of a register instruction, right before @pc, is on the
+    // instruction's line.
+    int inst_offset = frame->pc - function->chunk.bytecodes -
+                      (vm.engine == ENGINE_REGISTER);
     int line = chunk_get_line(&function->chunk, inst_offset);
     fprintf(stderr, "[line %d] in ", line);
     if (function->name == NULL)
@@ -178,6 +225,14 @@ static void runtime_error(const char* format, ...) {
   call_frame_reset();
 }
 
+_Noreturn void vm_out_of_memory() {
+  if (out_of_memory_exit == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(70);
+  }
+  longjmp(*out_of_memory_exit, 1);
+}
+
 #ifdef DBG_VM
 
 /** panic: for internal runtime errors that cannot be recovered.
@@ -343,250 +398,654 @@ static void close_upvalues(Value* last) {
 
     closed_upval->cloned = *(closed_upval->value);
     closed_upval->value = &closed_upval->cloned;
+    gc_write_barrier(&closed_upval->obj, closed_upval->cloned);
     closed_upval->next = NULL;
   }
 }
 
-static InterpretResult run() {
-  // current frame being executed
-
-#define READ_BYTE() *(frame->pc++)
-#define READ_SHORT() (read_short(frame))
-#define READ_BYTES(n) read_bytes(&(frame->pc), n)
-#define READ_CONST() \
-  frame->closure->function->chunk.constants.values[READ_BYTE()]
-#define READ_CONST_LONG()                   \
-  frame->closure->function->chunk.constants \
-      .values[READ_BYTES(LONG_CONST_OFFSET_SIZE)]
-#define READ_CONST_AT(offset) \
-  frame->closure->function->chunk.constants.values[offset]
-#define BINARY_OP(value_type, op)                                        \
-  do {                                                                   \
-    if (!(IS_NUMBER(vm_stack_peek(0)) && IS_NUMBER(vm_stack_peek(1)))) { \
-      runtime_error("Operands must be numbers.");                        \
-      return INTERPRET_RUNTIME_ERROR;                                    \
-    }                                                                    \
-    double right = AS_NUMBER(vm_stack_pop());                            \
-    double left = AS_NUMBER(vm_stack_pop());                             \
-    vm_stack_push(value_type(left op right));                            \
+#ifdef DBG_TRACE_EXECUTION
+static void trace_execution(Value* stack_top) {
+  /* Print stack values */
+  printf("== begin value stack trace ==\n");
+  for (Value* ptr = vm.stack; ptr < stack_top; ++ptr) {
+    printf("[ ");
+    print_value(*ptr);
+    printf(" ]\n");
+  }
+  printf("== end value stack trace ==\n");
+}
+#define TRACE_EXECUTION() trace_execution(sp)
+#define TRACE_REGISTERS() trace_execution(vm.stack_top)
+#else
+#define TRACE_EXECUTION()
+#define TRACE_REGISTERS()
+#endif
+
+#ifdef DBG_COUNT_DISPATCH
+// number of instructions dispatched by the last call to interpret()
+static uint64_t dispatch_count;
+#define COUNT_DISPATCH() (dispatch_count++)
+#else
+#define COUNT_DISPATCH()
+#endif
+
+#ifdef DBG_IC_STATS
+#define IC_HIT(cache) ((cache)->hits++)
+#define IC_MISS(cache) ((cache)->misses++)
+#else
+#define IC_HIT(cache)
+#define IC_MISS(cache)
+#endif
+
+/* ic_lookup: find the entry of @cache recorded for receivers of layout
+ * @shape.
+ *
+ * The shape fixes which fields the receiver has and at which slots, so a
+ * matching entry always applies: a method entry means the receiver has no
+ * field shadowing the method.
+ *
+ * return value: the applicable entry, or NULL on a cache miss.
+ * */
+static InlineCacheEntry* ic_lookup(InlineCache* cache, Shape* shape) {
+  if (cache->count != IC_MEGAMORPHIC) {
+    for (int i = 0; i < cache->count; i++) {
+      InlineCacheEntry* entry = &cache->entries[i];
+      if (entry->shape == shape) {
+        IC_HIT(cache);
+        return entry;
+      }
+    }
+  }
+
+  IC_MISS(cache);
+  return NULL;
+}
+
+/* ic_update: record in @cache, of the function of the running frame, how a
+ * property was resolved for receivers of layout @shape after a cache miss:
+ * either @method, or the field at @slot if @method is NULL. @transition is
+ * the shape the receiver moves to when an OP_SET_PROPERTY adds the field,
+ * NULL otherwise.
+ * */
+static void ic_update(InlineCache* cache,
+                      Shape* shape,
+                      Shape* transition,
+                      ClosureObj* method,
+                      uint32_t slot) {
+  if (cache->count == IC_MEGAMORPHIC)
+    return;
+
+  InlineCacheEntry* entry = NULL;
+  for (int i = 0; i < cache->count; i++) {
+    if (cache->entries[i].shape == shape) {
+      entry = &cache->entries[i];
+      break;
+    }
+  }
+
+  if (entry == NULL) {
+    if (cache->count == IC_POLY_MAX) {
+      cache->count = IC_MEGAMORPHIC;
+      return;
+    }
+    entry = &cache->entries[cache->count++];
+  }
+
+  entry->shape = shape;
+  entry->transition = transition;
+  entry->method = method;
+  entry->slot = slot;
+  // the function keeps the class of the shape and the method alive.
+  Obj* owner = &vm.frames[vm.frame_count - 1].closure->function->obj;
+  gc_write_barrier(owner, OBJ_VAL(shape->klass->obj));
+  if (method != NULL)
+    gc_write_barrier(owner, OBJ_VAL(method->obj));
+}
+
+#ifdef JIT_AVAILABLE
+/* enter_jit: if the last call from the frame @caller pushed a frame whose
+ * function is compiled by the JIT, run that frame natively. It has returned
+ * once this is done.
+ * return false on a runtime error. */
+static bool enter_jit(CallFrame* caller) {
+  CallFrame* callee = &vm.frames[vm.frame_count - 1];
+  if (callee == caller)
+    return true;  // a native function, or a class without initializer
+  JitCode* code = jit_hot_code(callee->closure->function);
+  return code == NULL || jit_run(code, callee) == INTERPRET_OK;
+}
+#endif
+
+/* concatenate: OP_CONCAT_N. Replace operands[0] by the sum of the @count
+ * values of @operands, which stay reachable meanwhile. The sum is that of
+ * numbers or the concatenation of strings: any other mix fails one of the
+ * additions from left to right.
+ * return false on a type error, which is left to report. */
+static bool concatenate(Value* operands, uint32_t count) {
+  if (IS_NUMBER(operands[0])) {
+    double sum = AS_NUMBER(operands[0]);
+    for (uint32_t i = 1; i < count; i++) {
+      if (!IS_NUMBER(operands[i]))
+        return false;
+      sum += AS_NUMBER(operands[i]);
+    }
+    operands[0] = NUMBER_VAL(sum);
+    return true;
+  }
+
+  StringObj* strings[UINT8_MAX];
+  for (uint32_t i = 0; i < count; i++) {
+    if (!IS_STRING_OBJ(operands[i]))
+      return false;
+    strings[i] = AS_STRING(operands[i]);
+  }
+  operands[0] = OBJ_VAL(*StringObj_concat_n(strings, count));
+  return true;
+}
+
+/* run: execute the frame on top of the call stack, until the top-level
+ * function returns or the number of frames drops to @exit_depth. The latter
+ * lets code compiled by the JIT call functions that aren't compiled (see
+ * jit_call()). */
+DISPATCH_LOOP_ATTR static InterpretResult run(uint8_t exit_depth) {
+  /* The state of the current frame is cached in locals so that it can stay in
+   * registers across instructions:
+   * @frame: current frame being executed
+   * @pc: frame->pc
+   * @slots: frame->slots
+   * @constants: the constant pool of the running function
+   * @sp: vm.stack_top
+   *
+   * They are reloaded from the frame only when the current frame changes
+   * (calls and returns). @pc and @sp are written back by STORE_FRAME() only
+   * before something can observe them: an allocation that may trigger the
+   * garbage collector, a call or a runtime error.
+   * */
+  CallFrame* frame;
+  uint8_t* pc;
+  Value* slots;
+  Value* constants;
+  Value* sp;
+  Opcode inst;
+
+#define READ_BYTE() (*pc++)
+#define READ_SHORT() (read_short(&pc))
+#define READ_BYTES(n) read_bytes(&pc, n)
+#define READ_CONST() constants[READ_BYTE()]
+#define READ_CONST_LONG() constants[READ_BYTES(LONG_CONST_OFFSET_SIZE)]
+#define READ_CACHE() \
+  (&frame->closure->function->chunk.caches[READ_SHORT()])
+#define PUSH(value) (*sp++ = (value))
+#define POP() (*--sp)
+#define PEEK(distance) (sp[-1 - (int)(distance)])
+#define STORE_FRAME() (frame->pc = pc, vm.stack_top = sp)
+#define LOAD_FRAME()                                              \
+  do {                                                            \
+    frame = &vm.frames[vm.frame_count - 1];                       \
+    pc = frame->pc;                                               \
+    slots = frame->slots;                                         \
+    constants = frame->closure->function->chunk.constants.values; \
+  } while (false)
+#define RUNTIME_ERROR(...)          \
+  do {                              \
+    STORE_FRAME();                  \
+    runtime_error(__VA_ARGS__);     \
+    return INTERPRET_RUNTIME_ERROR; \
+  } while (false)
+#ifdef JIT_AVAILABLE
+#define ENTER_JIT()                                \
+  do {                                             \
+    if (vm.jit == JIT_METHOD && !enter_jit(frame)) \
+      return INTERPRET_RUNTIME_ERROR;              \
+  } while (false)
+/* Continue a hot loop natively: until the frame returns with JIT_METHOD, or
+ * until its trace exits with JIT_TRACE. */
+#define LOOP_JIT()                                                          \
+  do {                                                                      \
+    JitCode* code;                                                          \
+    if (vm.jit == JIT_TRACE) {                                              \
+      if (trace_hot(pc)) {                                                  \
+        STORE_FRAME();                                                      \
+        trace_loop(frame);                                                  \
+        sp = vm.stack_top;                                                  \
+        pc = frame->pc;                                                     \
+      }                                                                     \
+    } else if (vm.jit == JIT_METHOD &&                                      \
+               (code = jit_hot_code(frame->closure->function))) {           \
+      STORE_FRAME();                                                        \
+      if (jit_run(code, frame) != INTERPRET_OK)                             \
+        return INTERPRET_RUNTIME_ERROR;                                     \
+      if (vm.frame_count == exit_depth)                                     \
+        return INTERPRET_OK;                                                \
+      sp = vm.stack_top;                                                    \
+      LOAD_FRAME();                                                         \
+    }                                                                       \
+  } while (false)
+#else
+#define ENTER_JIT()
+#define LOOP_JIT()
+#endif
+#define NUMBER_OP(value_type, op)       \
+  do {                                  \
+    double right = AS_NUMBER(POP());    \
+    double left = AS_NUMBER(PEEK(0));   \
+    sp[-1] = value_type(left op right); \
+  } while (false)
+#define BINARY_OP(value_type, op)                      \
+  do {                                                 \
+    if (!(IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1)))) { \
+      RUNTIME_ERROR("Operands must be numbers.");      \
+    }                                                  \
+    NUMBER_OP(value_type, op);                         \
+  } while (false)
+/* Rewrite the instruction being executed, which has no operand, into
+ * @opcode: a quickened instruction once its operands have been seen, or
+ * the generic one again. */
+#define QUICKEN(opcode) (pc[-1] = (opcode))
+/* Check the operands of a quickened instruction, or turn it back into the
+ * @generic instruction and execute that one instead. Not a do-while, as NEXT
+ * may be a break. */
+#define GUARD(check, generic) \
+  if (!(check)) {             \
+    QUICKEN(generic);         \
+    pc--;                     \
+    NEXT;                     \
+  }
+#define ARE_NUMBERS() (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1)))
+/* Compare the two numbers on top of the stack, pop them and jump if the
+ * result is @jmp_if. A type error is reported at the superinstruction rather
+ * than at the jump destination. */
+#define COMPARE_JMP(op, jmp_if)                        \
+  do {                                                 \
+    uint16_t jmp_dist = READ_SHORT();                  \
+    if (!(IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1)))) { \
+      pc -= 2;                                         \
+      RUNTIME_ERROR("Operands must be numbers.");      \
+    }                                                  \
+    double right = AS_NUMBER(POP());                   \
+    double left = AS_NUMBER(POP());                    \
+    if ((left op right) == (jmp_if))                   \
+      pc += jmp_dist;                                  \
+  } while (false)
+
+#ifdef THREADED_DISPATCH
+  /* Each handler ends with its own indirect jump through this table instead
+   * of branching back to a shared switch, so the branch predictor can learn
+   * opcode-to-opcode transitions. */
+  static void* dispatch_table[] = {
+      [OP_CONST] = &&target_OP_CONST,
+      [OP_CONST_LONG] = &&target_OP_CONST_LONG,
+      [OP_RETURN] = &&target_OP_RETURN,
+      [OP_NEGATE] = &&target_OP_NEGATE,
+      [OP_EXIT] = &&target_OP_EXIT,
+      [OP_NOT] = &&target_OP_NOT,
+      [OP_PRINT] = &&target_OP_PRINT,
+      [OP_POP] = &&target_OP_POP,
+      [OP_DEFINE_GLOBAL] = &&target_OP_DEFINE_GLOBAL,
+      [OP_DEFINE_GLOBAL_LONG] = &&target_OP_DEFINE_GLOBAL_LONG,
+      [OP_GET_GLOBAL] = &&target_OP_GET_GLOBAL,
+      [OP_GET_GLOBAL_LONG] = &&target_OP_GET_GLOBAL_LONG,
+      [OP_SET_GLOBAL] = &&target_OP_SET_GLOBAL,
+      [OP_SET_GLOBAL_LONG] = &&target_OP_SET_GLOBAL_LONG,
+      [OP_GET_UPVAL] = &&target_OP_GET_UPVAL,
+      [OP_GET_UPVAL_LONG] = &&target_OP_GET_UPVAL_LONG,
+      [OP_SET_UPVAL] = &&target_OP_SET_UPVAL,
+      [OP_SET_UPVAL_LONG] = &&target_OP_SET_UPVAL_LONG,
+      [OP_TRUE] = &&target_OP_TRUE,
+      [OP_FALSE] = &&target_OP_FALSE,
+      [OP_NIL] = &&target_OP_NIL,
+      [OP_LESS] = &&target_OP_LESS,
+      [OP_GREATER] = &&target_OP_GREATER,
+      [OP_EQUAL] = &&target_OP_EQUAL,
+      [OP_ADD] = &&target_OP_ADD,
+      [OP_SUBTRACT] = &&target_OP_SUBTRACT,
+      [OP_MUL] = &&target_OP_MUL,
+      [OP_DIV] = &&target_OP_DIV,
+      [OP_GET_LOCAL] = &&target_OP_GET_LOCAL,
+      [OP_GET_LOCAL_LONG] = &&target_OP_GET_LOCAL_LONG,
+      [OP_SET_LOCAL] = &&target_OP_SET_LOCAL,
+      [OP_SET_LOCAL_LONG] = &&target_OP_SET_LOCAL_LONG,
+      [OP_JMP_IF_FALSE] = &&target_OP_JMP_IF_FALSE,
+      [OP_JMP] = &&target_OP_JMP,
+      [OP_LOOP] = &&target_OP_LOOP,
+      [OP_CALL] = &&target_OP_CALL,
+      [OP_CLOSURE] = &&target_OP_CLOSURE,
+      [OP_CLOSURE_LONG] = &&target_OP_CLOSURE_LONG,
+      [OP_CLOSE_UPVAL] = &&target_OP_CLOSE_UPVAL,
+      [OP_CLASS] = &&target_OP_CLASS,
+      [OP_CLASS_LONG] = &&target_OP_CLASS_LONG,
+      [OP_GET_PROPERTY] = &&target_OP_GET_PROPERTY,
+      [OP_GET_PROPERTY_LONG] = &&target_OP_GET_PROPERTY_LONG,
+      [OP_SET_PROPERTY] = &&target_OP_SET_PROPERTY,
+      [OP_SET_PROPERTY_LONG] = &&target_OP_SET_PROPERTY_LONG,
+      [OP_METHOD] = &&target_OP_METHOD,
+      [OP_METHOD_LONG] = &&target_OP_METHOD_LONG,
+      [OP_INVOKE] = &&target_OP_INVOKE,
+      [OP_INVOKE_LONG] = &&target_OP_INVOKE_LONG,
+      [OP_INHERIT] = &&target_OP_INHERIT,
+      [OP_GET_SUPER] = &&target_OP_GET_SUPER,
+      [OP_GET_SUPER_LONG] = &&target_OP_GET_SUPER_LONG,
+      [OP_SUPER_INVOKE] = &&target_OP_SUPER_INVOKE,
+      [OP_SUPER_INVOKE_LONG] = &&target_OP_SUPER_INVOKE_LONG,
+      [OP_CONCAT_N] = &&target_OP_CONCAT_N,
+      [OP_ADD_LOCAL_CONST] = &&target_OP_ADD_LOCAL_CONST,
+      [OP_SET_LOCAL_POP] = &&target_OP_SET_LOCAL_POP,
+      [OP_GET_THIS_PROPERTY] = &&target_OP_GET_THIS_PROPERTY,
+      [OP_JMP_IF_NOT_LESS] = &&target_OP_JMP_IF_NOT_LESS,
+      [OP_JMP_IF_NOT_GREATER] = &&target_OP_JMP_IF_NOT_GREATER,
+      [OP_JMP_IF_LESS] = &&target_OP_JMP_IF_LESS,
+      [OP_JMP_IF_GREATER] = &&target_OP_JMP_IF_GREATER,
+      [OP_ADD_NUM] = &&target_OP_ADD_NUM,
+      [OP_ADD_STR] = &&target_OP_ADD_STR,
+      [OP_SUBTRACT_NUM] = &&target_OP_SUBTRACT_NUM,
+      [OP_MUL_NUM] = &&target_OP_MUL_NUM,
+      [OP_DIV_NUM] = &&target_OP_DIV_NUM,
+      [OP_LESS_NUM] = &&target_OP_LESS_NUM,
+      [OP_GREATER_NUM] = &&target_OP_GREATER_NUM,
+  };
+
+#define CASE(opcode) target_##opcode:
+#define DISPATCH()                            \
+  do {                                        \
+    TRACE_EXECUTION();                        \
+    COUNT_DISPATCH();                         \
+    goto* dispatch_table[inst = READ_BYTE()]; \
   } while (false)
+#define NEXT DISPATCH()
+#else
+#define CASE(opcode) case opcode:
+#define NEXT break
+#endif
+
+  LOAD_FRAME();
+  sp = vm.stack_top;
 
+#ifdef THREADED_DISPATCH
+  DISPATCH();
+#else
   for (;;) {
-    CallFrame* frame = &vm.frames[vm.frame_count - 1];
-#ifdef DBG_TRACE_EXECUTION
-    /* Print stack values */
-    printf("== begin value stack trace ==\n");
-    for (Value* ptr = vm.stack; ptr < vm.stack_top; ++ptr) {
-      printf("[ ");
-      print_value(*ptr);
-      printf(" ]\n");
-    }
-    printf("== end value stack trace ==\n");
+    TRACE_EXECUTION();
+    COUNT_DISPATCH();
+    switch (inst = READ_BYTE())
 #endif
-    Opcode inst;
-    switch (inst = READ_BYTE()) {
-      case OP_EXIT:
+    {
+      CASE(OP_EXIT)
         return INTERPRET_OK;
-      case OP_RETURN: {
-        Value return_value = vm_stack_pop();
+      CASE(OP_RETURN) {
+        Value return_value = POP();
         if (vm.frame_count == 1) {
           vm.frame_count = 0;
-          vm_stack_pop();  // pop the top-level function
+          vm.stack_top = sp - 1;  // pop the top-level function
           return INTERPRET_OK;
         }
 
-        close_upvalues(frame->slots);
-        vm.stack_top = frame->slots;
+        close_upvalues(slots);
+        sp = slots;
         vm.frame_count--;
-        frame = &vm.frames[vm.frame_count - 1];
-        vm_stack_push(return_value);
-        break;
+        PUSH(return_value);
+        if (vm.frame_count == exit_depth) {
+          vm.stack_top = sp;
+          return INTERPRET_OK;
+        }
+        LOAD_FRAME();
+        NEXT;
       }
-      case OP_CONST:
-      case OP_CONST_LONG: {
+      CASE(OP_CONST)
+      CASE(OP_CONST_LONG) {
         Value constant = (inst == OP_CONST) ? READ_CONST() : READ_CONST_LONG();
-        vm_stack_push(constant);
-        break;
+        PUSH(constant);
+        NEXT;
       }
-      case OP_TRUE: {
-        vm_stack_push(BOOL_VAL(true));
-        break;
+      CASE(OP_TRUE) {
+        PUSH(BOOL_VAL(true));
+        NEXT;
       }
-      case OP_FALSE: {
-        vm_stack_push(BOOL_VAL(false));
-        break;
+      CASE(OP_FALSE) {
+        PUSH(BOOL_VAL(false));
+        NEXT;
       }
-      case OP_NIL: {
-        vm_stack_push(NIL_VAL());
-        break;
+      CASE(OP_NIL) {
+        PUSH(NIL_VAL());
+        NEXT;
       }
-      case OP_NEGATE: {
-        if (!IS_NUMBER(vm_stack_peek(0))) {
-          runtime_error("Cannot negate a non-numeric value.");
-          return INTERPRET_RUNTIME_ERROR;
+      CASE(OP_NEGATE) {
+        if (!IS_NUMBER(PEEK(0))) {
+          RUNTIME_ERROR("Cannot negate a non-numeric value.");
         }
 
-        Value val_wrapper = vm_stack_pop();
-        double negated_val = -AS_NUMBER(val_wrapper);
-        vm_stack_push(NUMBER_VAL(negated_val));
-        break;
+        double negated_val = -AS_NUMBER(PEEK(0));
+        sp[-1] = NUMBER_VAL(negated_val);
+        NEXT;
       }
-      case OP_NOT: {
-        Value val_wrapper = vm_stack_pop();
-        vm_stack_push(BOOL_VAL(is_falsey(val_wrapper)));
-        break;
+      CASE(OP_NOT) {
+        sp[-1] = BOOL_VAL(is_falsey(PEEK(0)));
+        NEXT;
       }
-      case OP_ADD: {
-        Value left = vm_stack_peek(1);
-        Value right = vm_stack_peek(0);
+      CASE(OP_ADD)
+        // the type error, if any, is reported by OP_ADD_STR turned back
+        QUICKEN(ARE_NUMBERS() ? OP_ADD_NUM : OP_ADD_STR);
+      add: {
+        Value left = PEEK(1);
+        Value right = PEEK(0);
         Value result;
 
         bool are_nums = IS_NUMBER(left) && IS_NUMBER(right);
         bool are_strs = IS_STRING_OBJ(left) && IS_STRING_OBJ(right);
 
         if (!(are_nums || are_strs)) {
-          runtime_error("Both operands must be either strings or numbers");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("Both operands must be either strings or numbers");
         }
 
         if (are_nums) {
           result = NUMBER_VAL(AS_NUMBER(left) + AS_NUMBER(right));
         } else {
-          result = concatenate(left, right);
+          // the operands stay on the stack while the result is allocated.
+          STORE_FRAME();
+          result =
+              OBJ_VAL(*StringObj_concat(AS_STRING(left), AS_STRING(right)));
         }
 
-        vm_stack_pop();
-        vm_stack_pop();
-        vm_stack_push(result);
-        break;
+        sp--;
+        sp[-1] = result;
+        NEXT;
+      }
+      CASE(OP_ADD_NUM)
+        GUARD(ARE_NUMBERS(), OP_ADD);
+        NUMBER_OP(NUMBER_VAL, +);
+        NEXT;
+      CASE(OP_ADD_STR) {
+        GUARD(IS_STRING_OBJ(PEEK(0)) && IS_STRING_OBJ(PEEK(1)), OP_ADD);
+        STORE_FRAME();
+        Value result =
+            OBJ_VAL(*StringObj_concat(AS_STRING(PEEK(1)), AS_STRING(PEEK(0))));
+        sp--;
+        sp[-1] = result;
+        NEXT;
+      }
+      CASE(OP_CONCAT_N) {
+        uint8_t count = READ_BYTE();
+        Value* operands = sp - count;
+        // a sum of numbers is done right here
+        if (IS_NUMBER(operands[0])) {
+          double sum = AS_NUMBER(operands[0]);
+          uint8_t i = 1;
+          while (i < count && IS_NUMBER(operands[i]))
+            sum += AS_NUMBER(operands[i++]);
+          if (i == count) {
+            operands[0] = NUMBER_VAL(sum);
+            sp = operands + 1;
+            NEXT;
+          }
+        }
+        // the operands stay on the stack while the result is allocated.
+        STORE_FRAME();
+        if (!concatenate(operands, count)) {
+          RUNTIME_ERROR("Both operands must be either strings or numbers");
+        }
+        sp = operands + 1;
+        NEXT;
       }
-      case OP_SUBTRACT:
+      CASE(OP_SUBTRACT)
         BINARY_OP(NUMBER_VAL, -);
-        break;
-      case OP_MUL:
+        QUICKEN(OP_SUBTRACT_NUM);
+        NEXT;
+      CASE(OP_SUBTRACT_NUM)
+        GUARD(ARE_NUMBERS(), OP_SUBTRACT);
+        NUMBER_OP(NUMBER_VAL, -);
+        NEXT;
+      CASE(OP_MUL)
         BINARY_OP(NUMBER_VAL, *);
-        break;
-      case OP_DIV:
+        QUICKEN(OP_MUL_NUM);
+        NEXT;
+      CASE(OP_MUL_NUM)
+        GUARD(ARE_NUMBERS(), OP_MUL);
+        NUMBER_OP(NUMBER_VAL, *);
+        NEXT;
+      CASE(OP_DIV)
         BINARY_OP(NUMBER_VAL, /);
-        break;
-      case OP_EQUAL: {
-        Value x = vm_stack_pop();
-        Value y = vm_stack_pop();
-        vm_stack_push(BOOL_VAL(value_equal(x, y)));
-        break;
-      }
-      case OP_LESS:
+        QUICKEN(OP_DIV_NUM);
+        NEXT;
+      CASE(OP_DIV_NUM)
+        GUARD(ARE_NUMBERS(), OP_DIV);
+        NUMBER_OP(NUMBER_VAL, /);
+        NEXT;
+      CASE(OP_EQUAL) {
+        Value x = POP();
+        Value y = PEEK(0);
+        sp[-1] = BOOL_VAL(value_equal(x, y));
+        NEXT;
+      }
+      CASE(OP_LESS)
         BINARY_OP(BOOL_VAL, <);
-        break;
-      case OP_GREATER:
+        QUICKEN(OP_LESS_NUM);
+        NEXT;
+      CASE(OP_LESS_NUM)
+        GUARD(ARE_NUMBERS(), OP_LESS);
+        NUMBER_OP(BOOL_VAL, <);
+        NEXT;
+      CASE(OP_GREATER)
         BINARY_OP(BOOL_VAL, >);
-        break;
-      case OP_PRINT: {
-        Value value = vm_stack_pop();
+        QUICKEN(OP_GREATER_NUM);
+        NEXT;
+      CASE(OP_GREATER_NUM)
+        GUARD(ARE_NUMBERS(), OP_GREATER);
+        NUMBER_OP(BOOL_VAL, >);
+        NEXT;
+      CASE(OP_PRINT) {
+        Value value = POP();
         print_value(value);
         printf("\n");
-        break;
-      }
-      case OP_POP:
-        vm_stack_pop();
-        break;
-      case OP_DEFINE_GLOBAL:
-      case OP_DEFINE_GLOBAL_LONG: {
-        uint32_t iden_offset = (inst == OP_DEFINE_GLOBAL)
-                                   ? READ_BYTE()
-                                   : READ_BYTES(LONG_CONST_OFFSET_SIZE);
-        StringObj* identifier = AS_STRING(READ_CONST_AT(iden_offset));
-        table_set(&vm.globals, identifier, vm_stack_peek(0));
-        vm_stack_pop();
-        break;
-      }
-      case OP_GET_GLOBAL:
-      case OP_GET_GLOBAL_LONG: {
-        uint32_t offset = (inst == OP_GET_GLOBAL)
-                              ? READ_BYTE()
-                              : READ_BYTES(LONG_CONST_OFFSET_SIZE);
-        StringObj* identifier = AS_STRING(READ_CONST_AT(offset));
-        Value value;
-        if (!table_get(&vm.globals, identifier, &value)) {
-          runtime_error("Undefined identifier: '%s'.", identifier->chars);
-          return INTERPRET_RUNTIME_ERROR;
-        } else {
-          vm_stack_push(value);
-        }
-        break;
-      }
-      case OP_SET_GLOBAL:
-      case OP_SET_GLOBAL_LONG: {
-        uint32_t offset = (inst == OP_SET_GLOBAL)
-                              ? READ_BYTE()
-                              : READ_BYTES(LONG_CONST_OFFSET_SIZE);
-        StringObj* identifier = AS_STRING(READ_CONST_AT(offset));
-        Value rhs = vm_stack_peek(0);
-        if (!table_set(&vm.globals, identifier, rhs)) {
+        NEXT;
+      }
+      CASE(OP_POP)
+        sp--;
+        NEXT;
+      CASE(OP_DEFINE_GLOBAL)
+      CASE(OP_DEFINE_GLOBAL_LONG) {
+        /* The operand of the global variable instructions is the variable's
+         * slot in vm.globals (see vm_global_slot()). */
+        uint32_t slot = (inst == OP_DEFINE_GLOBAL)
+                            ? READ_BYTE()
+                            : READ_BYTES(LONG_GLOBAL_OFFSET_SIZE);
+        vm.globals.values[slot] = PEEK(0);
+        sp--;
+        NEXT;
+      }
+      CASE(OP_GET_GLOBAL)
+      CASE(OP_GET_GLOBAL_LONG) {
+        uint32_t slot = (inst == OP_GET_GLOBAL)
+                            ? READ_BYTE()
+                            : READ_BYTES(LONG_GLOBAL_OFFSET_SIZE);
+        Value value = vm.globals.values[slot];
+        if (IS_UNDEFINED(value)) {
+          RUNTIME_ERROR("Undefined identifier: '%s'.",
+                        AS_CSTRING(vm.global_names.values[slot]));
+        }
+        PUSH(value);
+        NEXT;
+      }
+      CASE(OP_SET_GLOBAL)
+      CASE(OP_SET_GLOBAL_LONG) {
+        uint32_t slot = (inst == OP_SET_GLOBAL)
+                            ? READ_BYTE()
+                            : READ_BYTES(LONG_GLOBAL_OFFSET_SIZE);
+        if (IS_UNDEFINED(vm.globals.values[slot])) {
           // the identifier has yet to be defined.
-          runtime_error("Undefined identifier: '%s'.", identifier->chars);
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("Undefined identifier: '%s'.",
+                        AS_CSTRING(vm.global_names.values[slot]));
         }
-        break;
+        vm.globals.values[slot] = PEEK(0);
+        NEXT;
       }
-      case OP_GET_LOCAL:
-      case OP_GET_LOCAL_LONG: {
+      CASE(OP_GET_LOCAL)
+      CASE(OP_GET_LOCAL_LONG) {
         uint32_t slot = (inst == OP_GET_LOCAL)
                             ? READ_BYTE()
                             : READ_BYTES(LONG_LOCAL_OFFSET_SIZE);
-        vm_stack_push(frame->slots[slot]);
-        break;
+        PUSH(slots[slot]);
+        NEXT;
       }
-      case OP_SET_LOCAL:
-      case OP_SET_LOCAL_LONG: {
+      CASE(OP_SET_LOCAL)
+      CASE(OP_SET_LOCAL_LONG) {
         uint32_t slot = (inst == OP_SET_LOCAL)
                             ? READ_BYTE()
                             : READ_BYTES(LONG_LOCAL_OFFSET_SIZE);
-        frame->slots[slot] = vm_stack_peek(0);
-        break;
+        slots[slot] = PEEK(0);
+        NEXT;
       }
-      case OP_JMP_IF_FALSE: {
+      CASE(OP_JMP_IF_FALSE) {
         uint16_t jmp_dist = READ_SHORT();
-        if (is_falsey(vm_stack_peek(0)))
-          frame->pc += jmp_dist;
-        break;
+        if (is_falsey(PEEK(0)))
+          pc += jmp_dist;
+        NEXT;
       }
-      case OP_JMP: {
+      CASE(OP_JMP) {
         uint16_t jmp_dist = READ_SHORT();
-        frame->pc += jmp_dist;
-        break;
+        pc += jmp_dist;
+        NEXT;
       }
-      case OP_LOOP: {
+      CASE(OP_LOOP) {
         uint32_t jmp_dist = READ_SHORT();
-        frame->pc -= jmp_dist;
-        break;
+        pc -= jmp_dist;
+        // the frames of a nested run() are called from the runtime, whose
+        // locals may refer to objects
+        if (vm.gc.compact && exit_depth == 0) {
+          STORE_FRAME();
+          gc_compact();
+        }
+        LOOP_JIT();
+        NEXT;
       }
-      case OP_CALL: {
+      CASE(OP_CALL) {
         uint8_t param_count = READ_BYTE();
-        Value called_obj = vm_stack_peek(param_count);
+        Value called_obj = PEEK(param_count);
 
         if (!callable(called_obj)) {
-          runtime_error("object is not callable.");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("object is not callable.");
         }
 
+        STORE_FRAME();
         if (!call_value(called_obj, param_count)) {
           return INTERPRET_RUNTIME_ERROR;
         }
-
-        break;
+        ENTER_JIT();
+        sp = vm.stack_top;
+        LOAD_FRAME();
+        NEXT;
       }
-      case OP_CLOSURE:
-      case OP_CLOSURE_LONG: {
+      CASE(OP_CLOSURE)
+      CASE(OP_CLOSURE_LONG) {
         /** Load the closure object from the constant pool and
          * capture all upvalues that are refered during the closure
          * execution.
          * */
         Value closure_val =
             (inst == OP_CLOSURE) ? READ_CONST() : READ_CONST_LONG();
-        vm_stack_push(closure_val);
+        PUSH(closure_val);
         ClosureObj* closure = AS_CLOSURE(closure_val);
 
+        // capturing upvalues allocates.
+        STORE_FRAME();
         for (int i = 0; i < closure->function->upval_count; i++) {
           uint8_t upval_info = READ_BYTE();
 
@@ -596,49 +1055,53 @@ static InterpretResult run() {
           uint32_t upvalue_pos = (long_offset) ? READ_BYTES(2) : READ_BYTE();
 
           if (local) {
-            closure->upvalues[i] = capture_upval(&frame->slots[upvalue_pos]);
+            closure->upvalues[i] = capture_upval(&slots[upvalue_pos]);
           } else {
             closure->upvalues[i] = frame->closure->upvalues[upvalue_pos];
           }
+          gc_write_barrier(&closure->obj, OBJ_VAL(closure->upvalues[i]->obj));
         }
 
-        break;
+        NEXT;
       }
-      case OP_GET_UPVAL:
-      case OP_GET_UPVAL_LONG: {
+      CASE(OP_GET_UPVAL)
+      CASE(OP_GET_UPVAL_LONG) {
         uint32_t upval_index = (inst == OP_GET_UPVAL)
                                    ? READ_BYTE()
                                    : READ_BYTES(LONG_UPVAL_OFFSET_SIZE);
         UpvalueObj* upvalue = frame->closure->upvalues[upval_index];
-        vm_stack_push(*(upvalue->value));
-        break;
+        PUSH(*(upvalue->value));
+        NEXT;
       }
-      case OP_SET_UPVAL:
-      case OP_SET_UPVAL_LONG: {
+      CASE(OP_SET_UPVAL)
+      CASE(OP_SET_UPVAL_LONG) {
         uint32_t upval_index = (inst == OP_SET_UPVAL)
                                    ? READ_BYTE()
                                    : READ_BYTES(LONG_UPVAL_OFFSET_SIZE);
         UpvalueObj* upvalue = frame->closure->upvalues[upval_index];
-        *(upvalue->value) = vm_stack_peek(0);
-        break;
+        *(upvalue->value) = PEEK(0);
+        gc_write_barrier(&upvalue->obj, PEEK(0));
+        NEXT;
       }
-      case OP_CLOSE_UPVAL: {
-        close_upvalues(vm.stack_top - 1);
-        vm_stack_pop();
-        break;
+      CASE(OP_CLOSE_UPVAL) {
+        close_upvalues(sp - 1);
+        sp--;
+        NEXT;
       }
-      case OP_CLASS:
-      case OP_CLASS_LONG: {
+      CASE(OP_CLASS)
+      CASE(OP_CLASS_LONG) {
         // Create a new class, take class name's offset in the chunk's
         // array of values as parameter.
         Value class_name_val =
             (inst == OP_CLASS) ? READ_CONST() : READ_CONST_LONG();
+        STORE_FRAME();
         ClassObj* new_class = ClassObj_construct(AS_STRING(class_name_val));
-        vm_stack_push(OBJ_VAL(*new_class));
-        break;
+        PUSH(OBJ_VAL(*new_class));
+        NEXT;
       }
-      case OP_GET_PROPERTY:
-      case OP_GET_PROPERTY_LONG: {
+      CASE(OP_GET_PROPERTY)
+      CASE(OP_GET_PROPERTY_LONG)
+      get_property: {
         /** Get a property from the top object in the stack. After the
          * operation is completed, the instance will be popped from the
          * stack and the property value of the instance will be pushed into
@@ -648,45 +1111,56 @@ static InterpretResult run() {
          * is of type closure), the operation returns a bound method object.
          *
          * ============= Bytecode Format =============
-         * OP_GET_PROPERTY     	<1-byte offset>
-         * OP_GET_PROPERTY_LONG <3-byte offset>
+         * OP_GET_PROPERTY     	<1-byte offset> <cache>
+         * OP_GET_PROPERTY_LONG <4-byte offset> <cache>
          * ===========================================
          * <offset>: Offset of the string representing the property's name
          * in the value array.
+         * <cache>: 2-byte offset of the site's inline cache.
          * */
         Value name =
-            (inst == OP_GET_PROPERTY) ? READ_CONST() : READ_CONST_LONG();
-        Value top = vm_stack_peek(0);
+            (inst != OP_GET_PROPERTY_LONG) ? READ_CONST() : READ_CONST_LONG();
+        InlineCache* cache = READ_CACHE();
+        Value top = PEEK(0);
         if (!IS_INSTANCE_OBJ(top)) {
-          runtime_error("Only instances have properties.");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("Only instances have properties.");
         }
 
-        InstanceObj* instance = AS_INSTANCE(vm_stack_peek(0));
-        Value property, method;
+        InstanceObj* instance = AS_INSTANCE(top);
+        InlineCacheEntry* entry = ic_lookup(cache, instance->shape);
+        int slot;
+        Value method;
 
         // try property look-up first, then method look-up
-        if (table_get(&instance->fields, AS_STRING(name), &property)) {
-          vm_stack_pop();  // Pop the class instance.
-          vm_stack_push(property);
+        if (entry != NULL && entry->method == NULL) {
+          sp[-1] = instance->fields[entry->slot];
+        } else if (entry != NULL) {
+          STORE_FRAME();
+          BoundMethodObj* bmethod =
+              BoundMethodObj_construct(top, entry->method);
+          sp[-1] = OBJ_VAL(*bmethod);
+        } else if ((slot = Shape_lookup(instance->shape, AS_STRING(name))) >=
+                   0) {
+          ic_update(cache, instance->shape, NULL, NULL, slot);
+          sp[-1] = instance->fields[slot];  // Replace the class instance.
         } else if (table_get(&instance->klass->methods, AS_STRING(name),
                              &method)) {
           assert(IS_CLOSURE_OBJ(method));
+          ic_update(cache, instance->shape, NULL, AS_CLOSURE(method), 0);
 
+          STORE_FRAME();
           BoundMethodObj* bmethod =
               BoundMethodObj_construct(top, AS_CLOSURE(method));
-          vm_stack_pop();
-          vm_stack_push(OBJ_VAL(*bmethod));
+          sp[-1] = OBJ_VAL(*bmethod);
         } else {
           StringObj* class_name = instance->klass->name;
-          runtime_error("'%s' object has no property '%s'.", class_name->chars,
+          RUNTIME_ERROR("'%s' object has no property '%s'.", class_name->chars,
                         AS_CSTRING(name));
-          return INTERPRET_RUNTIME_ERROR;
         }
-        break;
+        NEXT;
       }
-      case OP_SET_PROPERTY:
-      case OP_SET_PROPERTY_LONG: {
+      CASE(OP_SET_PROPERTY)
+      CASE(OP_SET_PROPERTY_LONG) {
         /** Stack's precondition:
          * == Stack ==
          * ... <class instance> <value>
@@ -699,29 +1173,51 @@ static InterpretResult run() {
          *
          * Set the property of the class instance to value <value>.
          * == Bytecode format ==
-         * OP_SET_PROPERTY <offset>
+         * OP_SET_PROPERTY <offset> <cache>
          * =====================
          * @param <offset> the offset of the StringObj representing the
          * property's name in the value array.
+         * @param <cache> the offset of the site's inline cache.
          * */
         Value property_name_val =
             (inst == OP_SET_PROPERTY) ? READ_CONST() : READ_CONST_LONG();
+        InlineCache* cache = READ_CACHE();
 
-        if (!IS_INSTANCE_OBJ(vm_stack_peek(1))) {
-          runtime_error("Only instances have properties.");
-          return INTERPRET_RUNTIME_ERROR;
+        if (!IS_INSTANCE_OBJ(PEEK(1))) {
+          RUNTIME_ERROR("Only instances have properties.");
         }
 
-        Value rhs_value = vm_stack_peek(0);
-        InstanceObj* instance = AS_INSTANCE(vm_stack_peek(1));
-        table_set(&(instance->fields), AS_STRING(property_name_val), rhs_value);
-        rhs_value = vm_stack_pop();
-        vm_stack_pop();
-        vm_stack_push(rhs_value);
-        break;
+        Value rhs_value = PEEK(0);
+        InstanceObj* instance = AS_INSTANCE(PEEK(1));
+        StringObj* property_name = AS_STRING(property_name_val);
+        // only fields are recorded by the caches of OP_SET_PROPERTY, along
+        // with the transition taken if the field is added.
+        InlineCacheEntry* entry = ic_lookup(cache, instance->shape);
+        int slot;
+
+        if (entry != NULL && (entry->transition == NULL ||
+                              entry->slot < instance->field_capacity)) {
+          instance->fields[entry->slot] = rhs_value;
+          if (entry->transition != NULL)
+            instance->shape = entry->transition;
+        } else if ((slot = Shape_lookup(instance->shape, property_name)) >=
+                   0) {
+          instance->fields[slot] = rhs_value;
+          ic_update(cache, instance->shape, NULL, NULL, slot);
+        } else {
+          Shape* shape = instance->shape;
+          STORE_FRAME();
+          InstanceObj_set_field(instance, property_name, rhs_value);
+          ic_update(cache, shape, instance->shape, NULL,
+                    instance->shape->field_count - 1);
+        }
+        gc_write_barrier(&instance->obj, rhs_value);
+        sp--;
+        sp[-1] = rhs_value;
+        NEXT;
       }
-      case OP_METHOD:
-      case OP_METHOD_LONG: {
+      CASE(OP_METHOD)
+      CASE(OP_METHOD_LONG) {
         /** OP_METHOD/OP_METHOD_LONG adds the closure at the top of the
          * value stack to the method table of the class object next to
          * that closure. It takes the method name's offset in the constant
@@ -741,24 +1237,26 @@ static InterpretResult run() {
         Value method_name_val =
             (inst == OP_METHOD) ? READ_CONST() : READ_CONST_LONG();
 
-        VM_ASSERT((IS_CLASS_OBJ(vm_stack_peek(1)) &&
-                   IS_CLOSURE_OBJ(vm_stack_peek(0)) &&
+        VM_ASSERT((IS_CLASS_OBJ(PEEK(1)) && IS_CLOSURE_OBJ(PEEK(0)) &&
                    IS_STRING_OBJ(method_name_val)),
                   "OP_METHOD's pre-condition check fails.");
 
         StringObj* method_name = AS_STRING(method_name_val);
-        ClassObj* klass = AS_CLASS(vm_stack_peek(1));
-        ClosureObj* method = AS_CLOSURE(vm_stack_peek(0));
+        ClassObj* klass = AS_CLASS(PEEK(1));
+        ClosureObj* method = AS_CLOSURE(PEEK(0));
 
+        STORE_FRAME();
         table_set(&klass->methods, method_name, OBJ_VAL(method->obj));
-        vm_stack_pop();
-        break;
+        gc_write_barrier(&klass->obj, OBJ_VAL(method->obj));
+        sp--;
+        NEXT;
       }
-      case OP_INVOKE:
-      case OP_INVOKE_LONG: {
+      CASE(OP_INVOKE)
+      CASE(OP_INVOKE_LONG) {
         Value v_method_name =
             (inst == OP_INVOKE) ? READ_CONST() : READ_CONST_LONG();
         uint32_t param_count = READ_BYTE();
+        InlineCache* cache = READ_CACHE();
 
         VM_ASSERT(
             IS_STRING_OBJ(v_method_name),
@@ -766,41 +1264,52 @@ static InterpretResult run() {
 
         StringObj* method_name = AS_STRING(v_method_name);
 
-        Value v_instance = vm_stack_peek(param_count);
+        Value v_instance = PEEK(param_count);
         if (!IS_INSTANCE_OBJ(v_instance)) {
-          runtime_error("The receiver is not an instance.");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("The receiver is not an instance.");
         }
 
-        ClassObj* klass = AS_INSTANCE(v_instance)->klass;
+        InstanceObj* instance = AS_INSTANCE(v_instance);
+        ClassObj* klass = instance->klass;
+        InlineCacheEntry* entry = ic_lookup(cache, instance->shape);
+        int slot;
         Value callable_val;
 
-        // check if there is any property defined with the name
-        if (table_get(&AS_INSTANCE(v_instance)->fields, method_name,
-                      &callable_val)) {
-          if (!callable(callable_val)) {
-            runtime_error("property is not callable.");
-            return INTERPRET_RUNTIME_ERROR;
-          }
+        if (entry != NULL) {
+          callable_val = (entry->method != NULL)
+                             ? OBJ_VAL(entry->method->obj)
+                             : instance->fields[entry->slot];
+        } else if ((slot = Shape_lookup(instance->shape, method_name)) >= 0) {
+          // there is a property defined with the name
+          ic_update(cache, instance->shape, NULL, NULL, slot);
+          callable_val = instance->fields[slot];
         } else {
           // resolve method
           if (!table_get(&klass->methods, method_name, &callable_val)) {
-            runtime_error("Class '%s' doesn't have method/property '%s'.",
+            RUNTIME_ERROR("Class '%s' doesn't have method/property '%s'.",
                           klass->name->chars, AS_CSTRING(v_method_name));
-            return INTERPRET_RUNTIME_ERROR;
           }
 
           VM_ASSERT(IS_CLOSURE_OBJ(callable_val),
                     "'method' must be a closure.");
+          ic_update(cache, instance->shape, NULL, AS_CLOSURE(callable_val), 0);
+        }
+
+        if (!callable(callable_val)) {
+          RUNTIME_ERROR("property is not callable.");
         }
 
+        STORE_FRAME();
         if (!call_value(callable_val, param_count)) {
           return INTERPRET_RUNTIME_ERROR;
         }
+        ENTER_JIT();
+        sp = vm.stack_top;
+        LOAD_FRAME();
 
-        break;
+        NEXT;
       }
-      case OP_INHERIT: {
+      CASE(OP_INHERIT) {
         /* Copy all methods from the superclass to the method table of the
          * subclass.
          *
@@ -814,24 +1323,26 @@ static InterpretResult run() {
          * ... <superclass>
          * ===========
          */
-        Value v_supercls = vm_stack_peek(1);
-        Value v_subcls = vm_stack_peek(0);
+        Value v_supercls = PEEK(1);
+        Value v_subcls = PEEK(0);
 
         VM_ASSERT(IS_CLASS_OBJ(v_subcls), "OP_INHERIT");
 
         if (!IS_CLASS_OBJ(v_supercls)) {
-          runtime_error("Superclass must be a class.");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("Superclass must be a class.");
         }
 
         ClassObj* supercls = AS_CLASS(v_supercls);
         ClassObj* subcls = AS_CLASS(v_subcls);
+        STORE_FRAME();
         table_add_all(&subcls->methods, &supercls->methods);
-        vm_stack_pop();
-        break;
+        // some of the methods copied may be young.
+        gc_write_barrier_any(&subcls->obj);
+        sp--;
+        NEXT;
       }
-      case OP_GET_SUPER:
-      case OP_GET_SUPER_LONG: {
+      CASE(OP_GET_SUPER)
+      CASE(OP_GET_SUPER_LONG) {
         /* OP_GET_SUPER: Create a bound method object from the instance receiver
          * and the method resolved from the superclass.
          */
@@ -840,8 +1351,8 @@ static InterpretResult run() {
         // variable. If we pop the stack to obtain the receiver then the garbage
         // collector might accidentally delete the receiver during the
         // execution.
-        Value v_super_cls = vm_stack_peek(0);
-        Value v_receiver = vm_stack_peek(1);
+        Value v_super_cls = PEEK(0);
+        Value v_receiver = PEEK(1);
         Value method_name =
             (inst == OP_GET_SUPER) ? READ_CONST() : READ_CONST_LONG();
 
@@ -852,20 +1363,20 @@ static InterpretResult run() {
 
         if (!table_get(&AS_CLASS(v_super_cls)->methods, AS_STRING(method_name),
                        &v_method)) {
-          runtime_error("Superclass '%s' doesn't have method '%s'.",
-                        AS_CSTRING(method_name),
-                        AS_CLOSURE(v_method)->function->name->chars);
+          RUNTIME_ERROR("Superclass '%s' doesn't have method '%s'.",
+                        AS_CLASS(v_super_cls)->name->chars,
+                        AS_CSTRING(method_name));
         }
 
+        STORE_FRAME();
         BoundMethodObj* bmethod =
             BoundMethodObj_construct(v_receiver, AS_CLOSURE(v_method));
-        vm_stack_pop();
-        vm_stack_pop();
-        vm_stack_push(OBJ_VAL(bmethod->obj));
-        break;
+        sp--;
+        sp[-1] = OBJ_VAL(bmethod->obj);
+        NEXT;
       }
-      case OP_SUPER_INVOKE:
-      case OP_SUPER_INVOKE_LONG: {
+      CASE(OP_SUPER_INVOKE)
+      CASE(OP_SUPER_INVOKE_LONG) {
         /* OP_SUPER_INVOKE: invoke super method.
          *
          * Value stack pre-condition:
@@ -887,7 +1398,7 @@ static InterpretResult run() {
         VM_ASSERT(IS_STRING_OBJ(method_name),
                   "(OP_SUPER_INVOKE) expect method_name to be a string.");
 
-        Value v_super_cls = vm_stack_pop();
+        Value v_super_cls = POP();
         VM_ASSERT(IS_CLASS_OBJ(v_super_cls),
                   "(OP_SUPER_INVOKE) expect stack top to be a class.");
 
@@ -895,34 +1406,887 @@ static InterpretResult run() {
         Value method;
         if (!table_get(&AS_CLASS(v_super_cls)->methods, AS_STRING(method_name),
                        &method)) {
-          runtime_error("Superclass '%s' doesn't have method '%s'.",
-                        AS_CSTRING(method_name),
-                        AS_CLOSURE(method)->function->name->chars);
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("Superclass '%s' doesn't have method '%s'.",
+                        AS_CLASS(v_super_cls)->name->chars,
+                        AS_CSTRING(method_name));
         }
 
         VM_ASSERT(IS_CLOSURE_OBJ(method),
                   "(OP_SUPER_INVOKE) method must be a closure.");
 
         uint8_t param_count = READ_BYTE();
+        STORE_FRAME();
         if (!call_value(method, param_count)) {
           return INTERPRET_RUNTIME_ERROR;
         }
-        break;
+        ENTER_JIT();
+        sp = vm.stack_top;
+        LOAD_FRAME();
+        NEXT;
+      }
+      CASE(OP_ADD_LOCAL_CONST) {
+        Value left = slots[READ_BYTE()];
+        Value right = READ_CONST();
+        if (IS_NUMBER(left) && IS_NUMBER(right)) {
+          PUSH(NUMBER_VAL(AS_NUMBER(left) + AS_NUMBER(right)));
+          NEXT;
+        }
+
+        // let OP_ADD concatenate the strings or report the error.
+        PUSH(left);
+        PUSH(right);
+        goto add;
+      }
+      CASE(OP_SET_LOCAL_POP) {
+        slots[READ_BYTE()] = POP();
+        NEXT;
+      }
+      CASE(OP_GET_THIS_PROPERTY) {
+        PUSH(slots[0]);
+        goto get_property;
       }
+      CASE(OP_JMP_IF_NOT_LESS)
+        COMPARE_JMP(<, false);
+        NEXT;
+      CASE(OP_JMP_IF_NOT_GREATER)
+        COMPARE_JMP(>, false);
+        NEXT;
+      CASE(OP_JMP_IF_LESS)
+        COMPARE_JMP(<, true);
+        NEXT;
+      CASE(OP_JMP_IF_GREATER)
+        COMPARE_JMP(>, true);
+        NEXT;
+#ifndef THREADED_DISPATCH
+      default:
+        RUNTIME_ERROR("Unknown opcode %d.", inst);
+#endif
     }
+#ifndef THREADED_DISPATCH
   }
+#endif
 
 #undef READ_BYTE
 #undef READ_BYTES
 #undef READ_SHORT
 #undef READ_CONST
 #undef READ_CONST_LONG
-#undef READ_CONST_AT
+#undef READ_CACHE
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef RUNTIME_ERROR
+#undef ENTER_JIT
+#undef LOOP_JIT
+#undef NUMBER_OP
 #undef BINARY_OP
+#undef QUICKEN
+#undef GUARD
+#undef ARE_NUMBERS
+#undef COMPARE_JMP
+#undef CASE
+#undef NEXT
+#undef DISPATCH
 }
 
-InterpretResult interpret(const char* source) {
+/* set_register_top: make @top the top of the value stack, clearing the slots
+ * it uncovers so that the garbage collector never sees stale values in them.
+ * */
+static inline void set_register_top(Value* top) {
+  for (Value* slot = vm.stack_top; slot < top; slot++)
+    *slot = NIL_VAL();
+  vm.stack_top = top;
+}
+
+DISPATCH_LOOP_ATTR static InterpretResult run_register() {
+  /* The register engine executes the OP_R_* instructions (see chunk.h).
+   *
+   * A frame's registers are its slots of the value stack: @regs[0] is the
+   * callee, followed by the parameters, the other local variables and the
+   * temporaries. vm.stack_top is kept right above the registers of the
+   * current frame (see LOAD_WINDOW()), so the garbage collector marks them
+   * all. A call moves the top right above the arguments, and the frame of the
+   * callee starts at the callee's register, as in the stack engine.
+   *
+   * @frame, @pc, @regs and @constants cache the state of the current frame as
+   * in run(). Instructions read all of their operands before writing their
+   * destination register, which may be one of the operands.
+   * */
+  CallFrame* frame;
+  uint8_t* pc;
+  Value* regs;
+  Value* constants;
+  Opcode inst;
+
+#define READ_BYTE() (*pc++)
+#define READ_SHORT() (read_short(&pc))
+#define READ_BYTES(n) read_bytes(&pc, n)
+#define READ_CONST() constants[READ_SHORT()]
+#define READ_CACHE() \
+  (&frame->closure->function->chunk.caches[READ_SHORT()])
+#define STORE_FRAME() (frame->pc = pc)
+#define LOAD_FRAME()                                              \
+  do {                                                            \
+    frame = &vm.frames[vm.frame_count - 1];                       \
+    pc = frame->pc;                                               \
+    regs = frame->slots;                                          \
+    constants = frame->closure->function->chunk.constants.values; \
+  } while (false)
+#define LOAD_WINDOW() \
+  set_register_top(regs + frame->closure->function->reg_count)
+#define RUNTIME_ERROR(...)          \
+  do {                              \
+    STORE_FRAME();                  \
+    runtime_error(__VA_ARGS__);     \
+    return INTERPRET_RUNTIME_ERROR; \
+  } while (false)
+/* Call @callee with the @argc arguments in the registers following @base.
+ * A closure of the right arity gets its frame right here. Otherwise
+ * call_value() does the work: a native function or a class without
+ * initializer returns right away, and its result is moved to @base. */
+#define CALL(callee, base, argc)                                        \
+  do {                                                                  \
+    STORE_FRAME();                                                      \
+    vm.stack_top = &regs[(base) + (argc) + 1];                          \
+    if (IS_CLOSURE_OBJ(callee) &&                                       \
+        AS_CLOSURE(callee)->function->arity == (argc) &&                \
+        vm.frame_count < CALL_FRAME_MAX) {                              \
+      frame = &vm.frames[vm.frame_count++];                             \
+      frame->closure = AS_CLOSURE(callee);                              \
+      frame->pc = frame->closure->function->chunk.bytecodes;            \
+      frame->slots = &regs[(base)];                                     \
+    } else {                                                            \
+      int frame_count = vm.frame_count;                                 \
+      if (!call_value((callee), (argc))) {                              \
+        return INTERPRET_RUNTIME_ERROR;                                 \
+      }                                                                 \
+      if (vm.frame_count == frame_count)                                \
+        regs[(base)] = vm.stack_top[-1];                                \
+    }                                                                   \
+    LOAD_FRAME();                                                       \
+    LOAD_WINDOW();                                                      \
+  } while (false)
+// @read_right reads the right operand: a register, or a constant for the
+// *K instructions.
+#define ADD_OP(read_right)                                                \
+  do {                                                                    \
+    uint8_t dst = READ_BYTE();                                            \
+    Value left = regs[READ_BYTE()];                                       \
+    Value right = read_right;                                             \
+    if (IS_NUMBER(left) && IS_NUMBER(right)) {                            \
+      regs[dst] = NUMBER_VAL(AS_NUMBER(left) + AS_NUMBER(right));         \
+    } else if (IS_STRING_OBJ(left) && IS_STRING_OBJ(right)) {             \
+      /* the operands stay in their registers or in the constant pool     \
+       * while the result is allocated. */                                \
+      STORE_FRAME();                                                      \
+      regs[dst] =                                                         \
+          OBJ_VAL(*StringObj_concat(AS_STRING(left), AS_STRING(right)));  \
+    } else {                                                              \
+      RUNTIME_ERROR("Both operands must be either strings or numbers");   \
+    }                                                                     \
+  } while (false)
+#define BINARY_OP(value_type, op, read_right)                     \
+  do {                                                            \
+    uint8_t dst = READ_BYTE();                                    \
+    Value left = regs[READ_BYTE()];                               \
+    Value right = read_right;                                     \
+    if (!(IS_NUMBER(left) && IS_NUMBER(right))) {                 \
+      RUNTIME_ERROR("Operands must be numbers.");                 \
+    }                                                             \
+    regs[dst] = value_type(AS_NUMBER(left) op AS_NUMBER(right));  \
+  } while (false)
+#define COMPARE_JMP(op, jmp_if, read_right)                       \
+  do {                                                            \
+    Value left = regs[READ_BYTE()];                               \
+    Value right = read_right;                                     \
+    uint16_t jmp_dist = READ_SHORT();                             \
+    if (!(IS_NUMBER(left) && IS_NUMBER(right))) {                 \
+      RUNTIME_ERROR("Operands must be numbers.");                 \
+    }                                                             \
+    if ((AS_NUMBER(left) op AS_NUMBER(right)) == (jmp_if))        \
+      pc += jmp_dist;                                             \
+  } while (false)
+
+#ifdef THREADED_DISPATCH
+  static void* dispatch_table[] = {
+      [OP_JMP] = &&target_OP_JMP,
+      [OP_LOOP] = &&target_OP_LOOP,
+      [OP_R_MOVE] = &&target_OP_R_MOVE,
+      [OP_R_LOADK] = &&target_OP_R_LOADK,
+      [OP_R_LOADNIL] = &&target_OP_R_LOADNIL,
+      [OP_R_LOADTRUE] = &&target_OP_R_LOADTRUE,
+      [OP_R_LOADFALSE] = &&target_OP_R_LOADFALSE,
+      [OP_R_DEFINE_GLOBAL] = &&target_OP_R_DEFINE_GLOBAL,
+      [OP_R_GET_GLOBAL] = &&target_OP_R_GET_GLOBAL,
+      [OP_R_SET_GLOBAL] = &&target_OP_R_SET_GLOBAL,
+      [OP_R_GET_UPVAL] = &&target_OP_R_GET_UPVAL,
+      [OP_R_SET_UPVAL] = &&target_OP_R_SET_UPVAL,
+      [OP_R_ADD] = &&target_OP_R_ADD,
+      [OP_R_SUBTRACT] = &&target_OP_R_SUBTRACT,
+      [OP_R_ADDK] = &&target_OP_R_ADDK,
+      [OP_R_SUBTRACTK] = &&target_OP_R_SUBTRACTK,
+      [OP_R_MUL] = &&target_OP_R_MUL,
+      [OP_R_DIV] = &&target_OP_R_DIV,
+      [OP_R_LESS] = &&target_OP_R_LESS,
+      [OP_R_GREATER] = &&target_OP_R_GREATER,
+      [OP_R_EQUAL] = &&target_OP_R_EQUAL,
+      [OP_R_NOT] = &&target_OP_R_NOT,
+      [OP_R_NEGATE] = &&target_OP_R_NEGATE,
+      [OP_R_PRINT] = &&target_OP_R_PRINT,
+      [OP_R_JMP_IF_FALSE] = &&target_OP_R_JMP_IF_FALSE,
+      [OP_R_JMP_IF_TRUE] = &&target_OP_R_JMP_IF_TRUE,
+      [OP_R_JMP_IF_NOT_LESS] = &&target_OP_R_JMP_IF_NOT_LESS,
+      [OP_R_JMP_IF_NOT_GREATER] = &&target_OP_R_JMP_IF_NOT_GREATER,
+      [OP_R_JMP_IF_LESS] = &&target_OP_R_JMP_IF_LESS,
+      [OP_R_JMP_IF_GREATER] = &&target_OP_R_JMP_IF_GREATER,
+      [OP_R_JMP_IF_NOT_LESSK] = &&target_OP_R_JMP_IF_NOT_LESSK,
+      [OP_R_JMP_IF_NOT_GREATERK] = &&target_OP_R_JMP_IF_NOT_GREATERK,
+      [OP_R_JMP_IF_LESSK] = &&target_OP_R_JMP_IF_LESSK,
+      [OP_R_JMP_IF_GREATERK] = &&target_OP_R_JMP_IF_GREATERK,
+      [OP_R_CALL] = &&target_OP_R_CALL,
+      [OP_R_RETURN] = &&target_OP_R_RETURN,
+      [OP_R_CLOSURE] = &&target_OP_R_CLOSURE,
+      [OP_R_CLOSE_UPVAL] = &&target_OP_R_CLOSE_UPVAL,
+      [OP_R_CLASS] = &&target_OP_R_CLASS,
+      [OP_R_METHOD] = &&target_OP_R_METHOD,
+      [OP_R_INHERIT] = &&target_OP_R_INHERIT,
+      [OP_R_GET_PROPERTY] = &&target_OP_R_GET_PROPERTY,
+      [OP_R_SET_PROPERTY] = &&target_OP_R_SET_PROPERTY,
+      [OP_R_INVOKE] = &&target_OP_R_INVOKE,
+      [OP_R_GET_SUPER] = &&target_OP_R_GET_SUPER,
+      [OP_R_SUPER_INVOKE] = &&target_OP_R_SUPER_INVOKE,
+  };
+
+#define CASE(opcode) target_##opcode:
+#define DISPATCH()                            \
+  do {                                        \
+    TRACE_REGISTERS();                        \
+    COUNT_DISPATCH();                         \
+    goto* dispatch_table[inst = READ_BYTE()]; \
+  } while (false)
+#define NEXT DISPATCH()
+#else
+#define CASE(opcode) case opcode:
+#define NEXT break
+#endif
+
+  LOAD_FRAME();
+  LOAD_WINDOW();
+
+#ifdef THREADED_DISPATCH
+  DISPATCH();
+#else
+  for (;;) {
+    TRACE_REGISTERS();
+    COUNT_DISPATCH();
+    switch (inst = READ_BYTE())
+#endif
+    {
+      CASE(OP_R_MOVE) {
+        uint8_t dst = READ_BYTE();
+        regs[dst] = regs[READ_BYTE()];
+        NEXT;
+      }
+      CASE(OP_R_LOADK) {
+        uint8_t dst = READ_BYTE();
+        regs[dst] = READ_CONST();
+        NEXT;
+      }
+      CASE(OP_R_LOADNIL) {
+        regs[READ_BYTE()] = NIL_VAL();
+        NEXT;
+      }
+      CASE(OP_R_LOADTRUE) {
+        regs[READ_BYTE()] = BOOL_VAL(true);
+        NEXT;
+      }
+      CASE(OP_R_LOADFALSE) {
+        regs[READ_BYTE()] = BOOL_VAL(false);
+        NEXT;
+      }
+      CASE(OP_R_DEFINE_GLOBAL) {
+        Value value = regs[READ_BYTE()];
+        vm.globals.values[READ_SHORT()] = value;
+        NEXT;
+      }
+      CASE(OP_R_GET_GLOBAL) {
+        uint8_t dst = READ_BYTE();
+        uint16_t slot = READ_SHORT();
+        Value value = vm.globals.values[slot];
+        if (IS_UNDEFINED(value)) {
+          RUNTIME_ERROR("Undefined identifier: '%s'.",
+                        AS_CSTRING(vm.global_names.values[slot]));
+        }
+        regs[dst] = value;
+        NEXT;
+      }
+      CASE(OP_R_SET_GLOBAL) {
+        Value value = regs[READ_BYTE()];
+        uint16_t slot = READ_SHORT();
+        if (IS_UNDEFINED(vm.globals.values[slot])) {
+          RUNTIME_ERROR("Undefined identifier: '%s'.",
+                        AS_CSTRING(vm.global_names.values[slot]));
+        }
+        vm.globals.values[slot] = value;
+        NEXT;
+      }
+      CASE(OP_R_GET_UPVAL) {
+        uint8_t dst = READ_BYTE();
+        regs[dst] = *frame->closure->upvalues[READ_BYTE()]->value;
+        NEXT;
+      }
+      CASE(OP_R_SET_UPVAL) {
+        Value value = regs[READ_BYTE()];
+        UpvalueObj* upvalue = frame->closure->upvalues[READ_BYTE()];
+        *upvalue->value = value;
+        gc_write_barrier(&upvalue->obj, value);
+        NEXT;
+      }
+      CASE(OP_R_ADD)
+        ADD_OP(regs[READ_BYTE()]);
+        NEXT;
+      CASE(OP_R_SUBTRACT)
+        BINARY_OP(NUMBER_VAL, -, regs[READ_BYTE()]);
+        NEXT;
+      CASE(OP_R_ADDK)
+        ADD_OP(READ_CONST());
+        NEXT;
+      CASE(OP_R_SUBTRACTK)
+        BINARY_OP(NUMBER_VAL, -, READ_CONST());
+        NEXT;
+      CASE(OP_R_MUL)
+        BINARY_OP(NUMBER_VAL, *, regs[READ_BYTE()]);
+        NEXT;
+      CASE(OP_R_DIV)
+        BINARY_OP(NUMBER_VAL, /, regs[READ_BYTE()]);
+        NEXT;
+      CASE(OP_R_LESS)
+        BINARY_OP(BOOL_VAL, <, regs[READ_BYTE()]);
+        NEXT;
+      CASE(OP_R_GREATER)
+        BINARY_OP(BOOL_VAL, >, regs[READ_BYTE()]);
+        NEXT;
+      CASE(OP_R_EQUAL) {
+        uint8_t dst = READ_BYTE();
+        Value left = regs[READ_BYTE()];
+        Value right = regs[READ_BYTE()];
+        regs[dst] = BOOL_VAL(value_equal(left, right));
+        NEXT;
+      }
+      CASE(OP_R_NOT) {
+        uint8_t dst = READ_BYTE();
+        regs[dst] = BOOL_VAL(is_falsey(regs[READ_BYTE()]));
+        NEXT;
+      }
+      CASE(OP_R_NEGATE) {
+        uint8_t dst = READ_BYTE();
+        Value operand = regs[READ_BYTE()];
+        if (!IS_NUMBER(operand)) {
+          RUNTIME_ERROR("Cannot negate a non-numeric value.");
+        }
+        regs[dst] = NUMBER_VAL(-AS_NUMBER(operand));
+        NEXT;
+      }
+      CASE(OP_R_PRINT) {
+        print_value(regs[READ_BYTE()]);
+        printf("\n");
+        NEXT;
+      }
+      CASE(OP_JMP) {
+        uint16_t jmp_dist = READ_SHORT();
+        pc += jmp_dist;
+        NEXT;
+      }
+      CASE(OP_LOOP) {
+        uint16_t jmp_dist = READ_SHORT();
+        pc -= jmp_dist;
+        if (vm.gc.compact) {
+          STORE_FRAME();
+          gc_compact();
+        }
+        NEXT;
+      }
+      CASE(OP_R_JMP_IF_FALSE) {
+        Value condition = regs[READ_BYTE()];
+        uint16_t jmp_dist = READ_SHORT();
+        if (is_falsey(condition))
+          pc += jmp_dist;
+        NEXT;
+      }
+      CASE(OP_R_JMP_IF_TRUE) {
+        Value condition = regs[READ_BYTE()];
+        uint16_t jmp_dist = READ_SHORT();
+        if (!is_falsey(condition))
+          pc += jmp_dist;
+        NEXT;
+      }
+      CASE(OP_R_JMP_IF_NOT_LESS)
+        COMPARE_JMP(<, false, regs[READ_BYTE()]);
+        NEXT;
+      CASE(OP_R_JMP_IF_NOT_GREATER)
+        COMPARE_JMP(>, false, regs[READ_BYTE()]);
+        NEXT;
+      CASE(OP_R_JMP_IF_LESS)
+        COMPARE_JMP(<, true, regs[READ_BYTE()]);
+        NEXT;
+      CASE(OP_R_JMP_IF_GREATER)
+        COMPARE_JMP(>, true, regs[READ_BYTE()]);
+        NEXT;
+      CASE(OP_R_JMP_IF_NOT_LESSK)
+        COMPARE_JMP(<, false, READ_CONST());
+        NEXT;
+      CASE(OP_R_JMP_IF_NOT_GREATERK)
+        COMPARE_JMP(>, false, READ_CONST());
+        NEXT;
+      CASE(OP_R_JMP_IF_LESSK)
+        COMPARE_JMP(<, true, READ_CONST());
+        NEXT;
+      CASE(OP_R_JMP_IF_GREATERK)
+        COMPARE_JMP(>, true, READ_CONST());
+        NEXT;
+      CASE(OP_R_CALL) {
+        uint8_t base = READ_BYTE();
+        uint8_t param_count = READ_BYTE();
+        Value callee = regs[base];
+        if (!callable(callee)) {
+          RUNTIME_ERROR("object is not callable.");
+        }
+
+        CALL(callee, base, param_count);
+        NEXT;
+      }
+      CASE(OP_R_RETURN) {
+        Value return_value = regs[READ_BYTE()];
+        close_upvalues(regs);
+        if (vm.frame_count == 1) {
+          vm.frame_count = 0;
+          vm.stack_top = regs;  // pop the top-level function
+          return INTERPRET_OK;
+        }
+
+        // the result replaces the callee in the caller's registers
+        vm.frame_count--;
+        regs[0] = return_value;
+        vm.stack_top = regs + 1;
+        LOAD_FRAME();
+        LOAD_WINDOW();
+        NEXT;
+      }
+      CASE(OP_R_CLOSURE) {
+        uint8_t dst = READ_BYTE();
+        Value closure_val = READ_CONST();
+        regs[dst] = closure_val;
+        ClosureObj* closure = AS_CLOSURE(closure_val);
+
+        // capturing upvalues allocates.
+        STORE_FRAME();
+        for (int i = 0; i < closure->function->upval_count; i++) {
+          uint8_t upval_info = READ_BYTE();
+
+          bool local = upval_info & 1;
+          bool long_offset = (upval_info & (1 << 1)) >> 1;
+
+          uint32_t upvalue_pos = (long_offset) ? READ_BYTES(2) : READ_BYTE();
+
+          if (local) {
+            closure->upvalues[i] = capture_upval(&regs[upvalue_pos]);
+          } else {
+            closure->upvalues[i] = frame->closure->upvalues[upvalue_pos];
+          }
+          gc_write_barrier(&closure->obj, OBJ_VAL(closure->upvalues[i]->obj));
+        }
+        NEXT;
+      }
+      CASE(OP_R_CLOSE_UPVAL) {
+        close_upvalues(&regs[READ_BYTE()]);
+        NEXT;
+      }
+      CASE(OP_R_CLASS) {
+        uint8_t dst = READ_BYTE();
+        Value class_name_val = READ_CONST();
+        STORE_FRAME();
+        regs[dst] = OBJ_VAL(*ClassObj_construct(AS_STRING(class_name_val)));
+        NEXT;
+      }
+      CASE(OP_R_METHOD) {
+        ClassObj* klass = AS_CLASS(regs[READ_BYTE()]);
+        Value method = regs[READ_BYTE()];
+        StringObj* method_name = AS_STRING(READ_CONST());
+
+        STORE_FRAME();
+        table_set(&klass->methods, method_name, method);
+        gc_write_barrier(&klass->obj, method);
+        NEXT;
+      }
+      CASE(OP_R_INHERIT) {
+        Value v_subcls = regs[READ_BYTE()];
+        Value v_supercls = regs[READ_BYTE()];
+
+        if (!IS_CLASS_OBJ(v_supercls)) {
+          RUNTIME_ERROR("Superclass must be a class.");
+        }
+
+        STORE_FRAME();
+        ClassObj* subcls = AS_CLASS(v_subcls);
+        table_add_all(&subcls->methods, &AS_CLASS(v_supercls)->methods);
+        // some of the methods copied may be young.
+        gc_write_barrier_any(&subcls->obj);
+        NEXT;
+      }
+      CASE(OP_R_GET_PROPERTY) {
+        uint8_t dst = READ_BYTE();
+        Value object = regs[READ_BYTE()];
+        Value name = READ_CONST();
+        InlineCache* cache = READ_CACHE();
+        if (!IS_INSTANCE_OBJ(object)) {
+          RUNTIME_ERROR("Only instances have properties.");
+        }
+
+        InstanceObj* instance = AS_INSTANCE(object);
+        InlineCacheEntry* entry = ic_lookup(cache, instance->shape);
+        int slot;
+        Value method;
+
+        // the receiver stays in its register while a bound method is
+        // allocated.
+        if (entry != NULL && entry->method == NULL) {
+          regs[dst] = instance->fields[entry->slot];
+        } else if (entry != NULL) {
+          STORE_FRAME();
+          regs[dst] = OBJ_VAL(*BoundMethodObj_construct(object, entry->method));
+        } else if ((slot = Shape_lookup(instance->shape, AS_STRING(name))) >=
+                   0) {
+          ic_update(cache, instance->shape, NULL, NULL, slot);
+          regs[dst] = instance->fields[slot];
+        } else if (table_get(&instance->klass->methods, AS_STRING(name),
+                             &method)) {
+          ic_update(cache, instance->shape, NULL, AS_CLOSURE(method), 0);
+          STORE_FRAME();
+          regs[dst] =
+              OBJ_VAL(*BoundMethodObj_construct(object, AS_CLOSURE(method)));
+        } else {
+          RUNTIME_ERROR("'%s' object has no property '%s'.",
+                        instance->klass->name->chars, AS_CSTRING(name));
+        }
+        NEXT;
+      }
+      CASE(OP_R_SET_PROPERTY) {
+        Value object = regs[READ_BYTE()];
+        StringObj* property_name = AS_STRING(READ_CONST());
+        Value rhs_value = regs[READ_BYTE()];
+        InlineCache* cache = READ_CACHE();
+
+        if (!IS_INSTANCE_OBJ(object)) {
+          RUNTIME_ERROR("Only instances have properties.");
+        }
+
+        InstanceObj* instance = AS_INSTANCE(object);
+        InlineCacheEntry* entry = ic_lookup(cache, instance->shape);
+        int slot;
+
+        if (entry != NULL && (entry->transition == NULL ||
+                              entry->slot < instance->field_capacity)) {
+          instance->fields[entry->slot] = rhs_value;
+          if (entry->transition != NULL)
+            instance->shape = entry->transition;
+        } else if ((slot = Shape_lookup(instance->shape, property_name)) >=
+                   0) {
+          instance->fields[slot] = rhs_value;
+          ic_update(cache, instance->shape, NULL, NULL, slot);
+        } else {
+          Shape* shape = instance->shape;
+          STORE_FRAME();
+          InstanceObj_set_field(instance, property_name, rhs_value);
+          ic_update(cache, shape, instance->shape, NULL,
+                    instance->shape->field_count - 1);
+        }
+        gc_write_barrier(&instance->obj, rhs_value);
+        NEXT;
+      }
+      CASE(OP_R_INVOKE) {
+        uint8_t base = READ_BYTE();
+        Value v_method_name = READ_CONST();
+        uint8_t param_count = READ_BYTE();
+        InlineCache* cache = READ_CACHE();
+
+        StringObj* method_name = AS_STRING(v_method_name);
+        Value v_instance = regs[base];
+        if (!IS_INSTANCE_OBJ(v_instance)) {
+          RUNTIME_ERROR("The receiver is not an instance.");
+        }
+
+        InstanceObj* instance = AS_INSTANCE(v_instance);
+        ClassObj* klass = instance->klass;
+        InlineCacheEntry* entry = ic_lookup(cache, instance->shape);
+        int slot;
+        Value callable_val;
+
+        if (entry != NULL) {
+          callable_val = (entry->method != NULL)
+                             ? OBJ_VAL(entry->method->obj)
+                             : instance->fields[entry->slot];
+        } else if ((slot = Shape_lookup(instance->shape, method_name)) >= 0) {
+          ic_update(cache, instance->shape, NULL, NULL, slot);
+          callable_val = instance->fields[slot];
+        } else {
+          if (!table_get(&klass->methods, method_name, &callable_val)) {
+            RUNTIME_ERROR("Class '%s' doesn't have method/property '%s'.",
+                          klass->name->chars, method_name->chars);
+          }
+          ic_update(cache, instance->shape, NULL, AS_CLOSURE(callable_val), 0);
+        }
+
+        if (!callable(callable_val)) {
+          RUNTIME_ERROR("property is not callable.");
+        }
+
+        CALL(callable_val, base, param_count);
+        NEXT;
+      }
+      CASE(OP_R_GET_SUPER) {
+        uint8_t dst = READ_BYTE();
+        Value v_receiver = regs[READ_BYTE()];
+        Value v_super_cls = regs[READ_BYTE()];
+        Value method_name = READ_CONST();
+        Value v_method;
+
+        if (!table_get(&AS_CLASS(v_super_cls)->methods, AS_STRING(method_name),
+                       &v_method)) {
+          RUNTIME_ERROR("Superclass '%s' doesn't have method '%s'.",
+                        AS_CLASS(v_super_cls)->name->chars,
+                        AS_CSTRING(method_name));
+        }
+
+        STORE_FRAME();
+        regs[dst] = OBJ_VAL(
+            BoundMethodObj_construct(v_receiver, AS_CLOSURE(v_method))->obj);
+        NEXT;
+      }
+      CASE(OP_R_SUPER_INVOKE) {
+        uint8_t base = READ_BYTE();
+        Value method_name = READ_CONST();
+        uint8_t param_count = READ_BYTE();
+        Value v_super_cls = regs[READ_BYTE()];
+        Value method;
+
+        if (!table_get(&AS_CLASS(v_super_cls)->methods, AS_STRING(method_name),
+                       &method)) {
+          RUNTIME_ERROR("Superclass '%s' doesn't have method '%s'.",
+                        AS_CLASS(v_super_cls)->name->chars,
+                        AS_CSTRING(method_name));
+        }
+
+        CALL(method, base, param_count);
+        NEXT;
+      }
+#ifndef THREADED_DISPATCH
+      default:
+        RUNTIME_ERROR("Unknown opcode %d.", inst);
+#endif
+    }
+#ifndef THREADED_DISPATCH
+  }
+#endif
+
+#undef READ_BYTE
+#undef READ_BYTES
+#undef READ_SHORT
+#undef READ_CONST
+#undef READ_CACHE
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef LOAD_WINDOW
+#undef RUNTIME_ERROR
+#undef CALL
+#undef ADD_OP
+#undef BINARY_OP
+#undef COMPARE_JMP
+#undef CASE
+#undef NEXT
+#undef DISPATCH
+}
+
+#ifdef JIT_AVAILABLE
+/** Runtime entry points of the code compiled by the JIT (see jit.h). They
+ * first publish the state of the frame, as STORE_FRAME() does in run(). */
+#define JIT_STORE_FRAME() (frame->pc = pc, vm.stack_top = sp)
+
+Value* jit_type_error(CallFrame* frame,
+                      Value* sp,
+                      uint8_t* pc,
+                      uint32_t operand) {
+  JIT_STORE_FRAME();
+  if (operand == OP_NEGATE)
+    runtime_error("Cannot negate a non-numeric value.");
+  else
+    runtime_error("Operands must be numbers.");
+  return NULL;
+}
+
+Value* jit_undefined_global(CallFrame* frame,
+                            Value* sp,
+                            uint8_t* pc,
+                            uint32_t operand) {
+  JIT_STORE_FRAME();
+  runtime_error("Undefined identifier: '%s'.",
+                AS_CSTRING(vm.global_names.values[operand]));
+  return NULL;
+}
+
+/* jit_add: OP_ADD on operands that aren't both numbers. */
+Value* jit_add(CallFrame* frame, Value* sp, uint8_t* pc, uint32_t operand) {
+  (void)operand;
+  JIT_STORE_FRAME();
+  Value left = sp[-2];
+  Value right = sp[-1];
+  if (!(IS_STRING_OBJ(left) && IS_STRING_OBJ(right))) {
+    runtime_error("Both operands must be either strings or numbers");
+    return NULL;
+  }
+
+  // the operands stay on the stack while the result is allocated.
+  sp[-2] = OBJ_VAL(*StringObj_concat(AS_STRING(left), AS_STRING(right)));
+  return sp - 1;
+}
+
+/* jit_concat: OP_CONCAT_N on operands that aren't all numbers. */
+Value* jit_concat(CallFrame* frame, Value* sp, uint8_t* pc, uint32_t operand) {
+  JIT_STORE_FRAME();
+  // the operands stay on the stack while the result is allocated.
+  if (!concatenate(sp - operand, operand)) {
+    runtime_error("Both operands must be either strings or numbers");
+    return NULL;
+  }
+  return sp - operand + 1;
+}
+
+Value* jit_equal(CallFrame* frame, Value* sp, uint8_t* pc, uint32_t operand) {
+  (void)frame, (void)pc, (void)operand;
+  sp[-2] = BOOL_VAL(value_equal(sp[-1], sp[-2]));
+  return sp - 1;
+}
+
+Value* jit_not(CallFrame* frame, Value* sp, uint8_t* pc, uint32_t operand) {
+  (void)frame, (void)pc, (void)operand;
+  sp[-1] = BOOL_VAL(is_falsey(sp[-1]));
+  return sp;
+}
+
+Value* jit_print(CallFrame* frame, Value* sp, uint8_t* pc, uint32_t operand) {
+  (void)frame, (void)pc, (void)operand;
+  print_value(sp[-1]);
+  printf("\n");
+  return sp - 1;
+}
+
+/* jit_call: call the value below the @operand arguments on top of the stack.
+ * The frame of the callee is run to completion, natively if its function is
+ * compiled, by run() otherwise. */
+Value* jit_call(CallFrame* frame, Value* sp, uint8_t* pc, uint32_t operand) {
+  JIT_STORE_FRAME();
+  Value callee = sp[-1 - (int)operand];
+  if (!callable(callee)) {
+    runtime_error("object is not callable.");
+    return NULL;
+  }
+  if (!call_value(callee, operand))
+    return NULL;
+
+  CallFrame* callee_frame = &vm.frames[vm.frame_count - 1];
+  if (callee_frame != frame) {
+    JitCode* code = jit_hot_code(callee_frame->closure->function);
+    InterpretResult result = (code != NULL) ? jit_run(code, callee_frame)
+                                            : run(vm.frame_count - 1);
+    if (result != INTERPRET_OK)
+      return NULL;
+  }
+  return vm.stack_top;
+}
+
+/* jit_closure: OP_CLOSURE, @pc points to the upvalues after the operand. */
+Value* jit_closure(CallFrame* frame,
+                   Value* sp,
+                   uint8_t* pc,
+                   uint32_t operand) {
+  Value closure_val = frame->closure->function->chunk.constants.values[operand];
+  *sp++ = closure_val;
+  JIT_STORE_FRAME();  // capturing upvalues allocates.
+
+  ClosureObj* closure = AS_CLOSURE(closure_val);
+  for (int i = 0; i < closure->function->upval_count; i++) {
+    uint8_t upval_info = *pc++;
+
+    bool local = upval_info & 1;
+    bool long_offset = (upval_info & (1 << 1)) >> 1;
+
+    uint32_t upvalue_pos = (long_offset) ? read_bytes(&pc, 2) : *pc++;
+
+    if (local) {
+      closure->upvalues[i] = capture_upval(&frame->slots[upvalue_pos]);
+    } else {
+      closure->upvalues[i] = frame->closure->upvalues[upvalue_pos];
+    }
+    gc_write_barrier(&closure->obj, OBJ_VAL(closure->upvalues[i]->obj));
+  }
+  return sp;
+}
+
+Value* jit_set_upvalue(CallFrame* frame,
+                       Value* sp,
+                       uint8_t* pc,
+                       uint32_t operand) {
+  (void)pc;
+  UpvalueObj* upvalue = frame->closure->upvalues[operand];
+  *upvalue->value = sp[-1];
+  gc_write_barrier(&upvalue->obj, sp[-1]);
+  return sp;
+}
+
+Value* jit_close_upvalue(CallFrame* frame,
+                         Value* sp,
+                         uint8_t* pc,
+                         uint32_t operand) {
+  (void)frame, (void)pc, (void)operand;
+  close_upvalues(sp - 1);
+  return sp - 1;
+}
+
+/* jit_return: pop the frame, leaving the return value in place of the
+ * callee. */
+Value* jit_return(CallFrame* frame, Value* sp, uint8_t* pc, uint32_t operand) {
+  (void)pc, (void)operand;
+  if (vm.frame_count == 1) {
+    vm.frame_count = 0;
+    vm.stack_top = sp - 2;  // pop the top-level function, as run() does
+    return vm.stack_top;
+  }
+
+  Value return_value = sp[-1];
+  close_upvalues(frame->slots);
+  frame->slots[0] = return_value;
+  vm.stack_top = frame->slots + 1;
+  vm.frame_count--;
+  return vm.stack_top;
+}
+
+#undef JIT_STORE_FRAME
+#endif
+
+#ifdef DBG_IC_STATS
+static void print_function_caches(Obj* obj) {
+  if (obj->type == OBJ_FUNCTION) {
+    FunctionObj* function = (FunctionObj*)obj;
+    print_inline_caches(&function->chunk, function->name == NULL
+                                              ? "script"
+                                              : function->name->chars);
+  }
+}
+#endif
+
+/* execute: compile and run @source, see interpret(). */
+static InterpretResult execute(const char* source) {
   ClosureObj* closure = compile(source);
 
   if (closure == NULL)
@@ -931,5 +2295,38 @@ InterpretResult interpret(const char* source) {
   vm_stack_push(OBJ_VAL(*closure));
   // push the top-level code to the frame stack
   call_value(OBJ_VAL(*closure), 0);
-  return run();
+#ifdef DBG_COUNT_DISPATCH
+  dispatch_count = 0;
+#endif
+  InterpretResult result =
+      (vm.engine == ENGINE_REGISTER) ? run_register() : run(0);
+#ifdef DBG_COUNT_DISPATCH
+  fprintf(stderr, "[dispatch] %" PRIu64 " instructions\n", dispatch_count);
+#endif
+#ifdef DBG_GC_STATS
+  gc_print_stats();
+#endif
+#ifdef DBG_ALLOC_STATS
+  alloc_print_stats();
+#endif
+#ifdef DBG_IC_STATS
+  fprintf(stderr, "== inline caches ==\n");
+  gc_visit_objects(print_function_caches);
+#endif
+  return result;
+}
+
+InterpretResult interpret(const char* source) {
+  jmp_buf resume;
+  if (setjmp(resume) != 0) {
+    out_of_memory_exit = NULL;
+    compiler_reset();
+    gc_unhold();
+    runtime_error("Out of memory.");
+    return INTERPRET_RUNTIME_ERROR;
+  }
+  out_of_memory_exit = &resume;
+  InterpretResult result = execute(source);
+  out_of_memory_exit = NULL;
+  return result;
 }
@@ -0,0 +1,362 @@
+#define _DEFAULT_SOURCE  // for MAP_ANONYMOUS
+#include "x64.h"
+
+#include "jit.h"
+
+#ifdef JIT_AVAILABLE
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+void x64_init(Assembler* as, uint32_t label_count) {
+  *as = (Assembler){0};
+  as->label_count = label_count;
+  as->labels = malloc((label_count + 1) * sizeof(uint32_t));
+  if (as->labels == NULL) {
+    as->failed = true;
+    return;
+  }
+  for (uint32_t i = 0; i < label_count; i++)
+    as->labels[i] = LABEL_UNBOUND;
+}
+
+void x64_free(Assembler* as) {
+  free(as->code);
+  free(as->jumps);
+  free(as->labels);
+  *as = (Assembler){0};
+}
+
+void x64_bind(Assembler* as, uint32_t label) {
+  if (as->failed)
+    return;
+  as->labels[label] = as->size;
+}
+
+bool x64_link(Assembler* as) {
+  if (as->failed)
+    return false;
+  for (uint32_t i = 0; i < as->jump_count; i++) {
+    X64Jump* jump = &as->jumps[i];
+    if (jump->label >= as->label_count ||
+        as->labels[jump->label] == LABEL_UNBOUND)
+      return false;
+
+    uint32_t rel = (uint32_t)(as->labels[jump->label] - (jump->pos + 4));
+    memcpy(&as->code[jump->pos], &rel, 4);
+  }
+  return true;
+}
+
+void* x64_install(Assembler* as) {
+  void* memory = mmap(NULL, as->size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED)
+    return NULL;
+  memcpy(memory, as->code, as->size);
+  if (mprotect(memory, as->size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(memory, as->size);
+    return NULL;
+  }
+  return memory;
+}
+
+void x64_uninstall(void* code, size_t size) {
+  munmap(code, size);
+}
+
+void x64_byte(Assembler* as, uint8_t byte) {
+  if (as->failed)
+    return;
+  if (as->size == as->capacity) {
+    size_t capacity = (as->capacity < 256) ? 256 : as->capacity * 2;
+    uint8_t* code = realloc(as->code, capacity);
+    if (code == NULL) {
+      as->failed = true;
+      return;
+    }
+    as->code = code;
+    as->capacity = capacity;
+  }
+  as->code[as->size++] = byte;
+}
+
+void x64_u32(Assembler* as, uint32_t value) {
+  for (int i = 0; i < 4; i++)
+    x64_byte(as, (value >> (8 * i)) & 0xff);
+}
+
+void x64_u64(Assembler* as, uint64_t value) {
+  for (int i = 0; i < 8; i++)
+    x64_byte(as, (value >> (8 * i)) & 0xff);
+}
+
+/* x64_rex: the REX prefix of an instruction with the register @reg in its
+ * ModRM.reg field and @base in ModRM.rm, if one is needed. */
+static void x64_rex(Assembler* as, bool wide, int reg, int base) {
+  uint8_t rex = 0x40 | (wide << 3) | ((reg >> 3) << 2) | (base >> 3);
+  if (rex != 0x40)
+    x64_byte(as, rex);
+}
+
+/* x64_mem_operand: the ModRM byte, plus SIB and displacement, of the
+ * operands @reg and [@base + @disp]. */
+static void x64_mem_operand(Assembler* as, int reg, int base, int32_t disp) {
+  uint8_t mod;
+  if (disp == 0 && (base & 7) != RBP)
+    mod = 0;
+  else if (disp >= INT8_MIN && disp <= INT8_MAX)
+    mod = 1;
+  else
+    mod = 2;
+
+  x64_byte(as, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == RSP)
+    x64_byte(as, 0x24);
+  if (mod == 1)
+    x64_byte(as, (uint8_t)disp);
+  else if (mod == 2)
+    x64_u32(as, (uint32_t)disp);
+}
+
+void x64_op_mem(Assembler* as,
+                uint8_t prefix,
+                bool wide,
+                uint16_t opcode,
+                int reg,
+                int base,
+                int32_t disp) {
+  if (prefix != 0)
+    x64_byte(as, prefix);
+  x64_rex(as, wide, reg, base);
+  if (opcode > 0xff)
+    x64_byte(as, opcode >> 8);
+  x64_byte(as, opcode & 0xff);
+  x64_mem_operand(as, reg, base, disp);
+}
+
+void x64_op_regs(Assembler* as,
+                 uint8_t prefix,
+                 bool wide,
+                 uint16_t opcode,
+                 int reg,
+                 int rm) {
+  if (prefix != 0)
+    x64_byte(as, prefix);
+  x64_rex(as, wide, reg, rm);
+  if (opcode > 0xff)
+    x64_byte(as, opcode >> 8);
+  x64_byte(as, opcode & 0xff);
+  x64_byte(as, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+void x64_op_reg(Assembler* as, uint8_t opcode, int reg, int rm) {
+  x64_op_regs(as, 0, true, opcode, reg, rm);
+}
+
+void x64_load(Assembler* as, int reg, int base, int32_t disp) {
+  x64_op_mem(as, 0, true, 0x8b, reg, base, disp);
+}
+
+void x64_store(Assembler* as, int base, int32_t disp, int reg) {
+  x64_op_mem(as, 0, true, 0x89, reg, base, disp);
+}
+
+void x64_lea(Assembler* as, int reg, int base, int32_t disp) {
+  x64_op_mem(as, 0, true, 0x8d, reg, base, disp);
+}
+
+void x64_mov(Assembler* as, int dst, int src) {
+  x64_op_reg(as, 0x89, src, dst);
+}
+
+void x64_mov_imm64(Assembler* as, int reg, uint64_t imm) {
+  x64_rex(as, true, 0, reg);
+  x64_byte(as, 0xb8 + (reg & 7));
+  x64_u64(as, imm);
+}
+
+void x64_mov_imm32(Assembler* as, int reg, uint32_t imm) {
+  x64_rex(as, false, 0, reg);
+  x64_byte(as, 0xb8 + (reg & 7));
+  x64_u32(as, imm);
+}
+
+void x64_cmp(Assembler* as, int left, int right) {
+  x64_op_reg(as, 0x39, right, left);
+}
+
+void x64_test(Assembler* as, int reg) {
+  x64_op_reg(as, 0x85, reg, reg);
+}
+
+void x64_call(Assembler* as, void* function) {
+  x64_mov_imm64(as, RAX, (uint64_t)(uintptr_t)function);
+  x64_byte(as, 0xff);  // call rax
+  x64_byte(as, 0xd0);
+}
+
+void x64_setcc(Assembler* as, uint8_t cc) {
+  x64_byte(as, 0x0f);  // setcc al
+  x64_byte(as, 0x90 + cc);
+  x64_byte(as, 0xc0);
+}
+
+static void x64_add_jump(Assembler* as, uint32_t label) {
+  if (as->failed)
+    return;
+  if (as->jump_count == as->jump_capacity) {
+    uint32_t capacity =
+        (as->jump_capacity < 32) ? 32 : as->jump_capacity * 2;
+    X64Jump* jumps = realloc(as->jumps, capacity * sizeof(X64Jump));
+    if (jumps == NULL) {
+      as->failed = true;
+      return;
+    }
+    as->jumps = jumps;
+    as->jump_capacity = capacity;
+  }
+  as->jumps[as->jump_count++] = (X64Jump){.pos = as->size, .label = label};
+  x64_u32(as, 0);
+}
+
+void x64_jmp(Assembler* as, uint32_t label) {
+  x64_byte(as, 0xe9);
+  x64_add_jump(as, label);
+}
+
+void x64_jcc(Assembler* as, uint8_t cc, uint32_t label) {
+  x64_byte(as, 0x0f);
+  x64_byte(as, 0x80 + cc);
+  x64_add_jump(as, label);
+}
+
+size_t x64_jcc_forward(Assembler* as, uint8_t cc) {
+  x64_byte(as, 0x0f);
+  x64_byte(as, 0x80 + cc);
+  x64_u32(as, 0);
+  return as->size - 4;
+}
+
+size_t x64_jmp_forward(Assembler* as) {
+  x64_byte(as, 0xe9);
+  x64_u32(as, 0);
+  return as->size - 4;
+}
+
+void x64_patch_here(Assembler* as, size_t pos) {
+  if (as->failed)
+    return;
+  uint32_t rel = (uint32_t)(as->size - (pos + 4));
+  memcpy(&as->code[pos], &rel, 4);
+}
+
+void x64_push_frame(Assembler* as, int32_t size) {
+  x64_byte(as, 0x55);  // push rbp
+  x64_byte(as, 0x53);  // push rbx
+  for (int reg = R12; reg <= R15; reg++) {
+    x64_byte(as, 0x41);  // push r12-r15
+    x64_byte(as, 0x50 + (reg & 7));
+  }
+  x64_byte(as, 0x48);  // sub rsp, size
+  x64_byte(as, 0x81);
+  x64_byte(as, 0xec);
+  x64_u32(as, (uint32_t)size);
+}
+
+void x64_pop_frame(Assembler* as, int32_t size) {
+  x64_byte(as, 0x48);  // add rsp, size
+  x64_byte(as, 0x81);
+  x64_byte(as, 0xc4);
+  x64_u32(as, (uint32_t)size);
+  for (int reg = R15; reg >= R12; reg--) {
+    x64_byte(as, 0x41);  // pop r15-r12
+    x64_byte(as, 0x58 + (reg & 7));
+  }
+  x64_byte(as, 0x5b);  // pop rbx
+  x64_byte(as, 0x5d);  // pop rbp
+  x64_byte(as, 0xc3);  // ret
+}
+
+void x64_copy_value(Assembler* as,
+                    int dst_base,
+                    int32_t dst_disp,
+                    int src_base,
+                    int32_t src_disp) {
+  for (int32_t word = 0; word < VALUE_SIZE; word += 8) {
+    x64_load(as, RDX, src_base, src_disp + word);
+    x64_store(as, dst_base, dst_disp + word, RDX);
+  }
+}
+
+void x64_store_value(Assembler* as, int base, int32_t disp, Value value) {
+  uint64_t words[sizeof(Value) / 8];
+  memcpy(words, &value, sizeof(Value));
+  for (int32_t word = 0; word < VALUE_SIZE; word += 8) {
+    x64_mov_imm64(as, RDX, words[word / 8]);
+    x64_store(as, base, disp + word, RDX);
+  }
+}
+
+/* x64_test_number: test the type of the value at [@base + @disp], and
+ * return the condition code that holds if it isn't a number. */
+static uint8_t x64_test_number(Assembler* as, int base, int32_t disp) {
+#ifdef NAN_BOXING
+  x64_load(as, RAX, base, disp);
+  x64_op_reg(as, 0x21, R14, RAX);  // and rax, r14
+  x64_cmp(as, RAX, R14);
+  return CC_E;
+#else
+  // cmp dword [base + disp], VAL_NUMBER
+  x64_op_mem(as, 0, false, 0x83, 7, base, disp + TYPE_OFFSET);
+  x64_byte(as, VAL_NUMBER);
+  return CC_NE;
+#endif
+}
+
+size_t x64_check_number(Assembler* as, int base, int32_t disp) {
+  return x64_jcc_forward(as, x64_test_number(as, base, disp));
+}
+
+void x64_guard_number(Assembler* as, int base, int32_t disp, uint32_t label) {
+  x64_jcc(as, x64_test_number(as, base, disp), label);
+}
+
+void x64_store_bool(Assembler* as, int base, int32_t disp) {
+  x64_byte(as, 0x0f);  // movzx eax, al
+  x64_byte(as, 0xb6);
+  x64_byte(as, 0xc0);
+#ifdef NAN_BOXING
+  x64_mov_imm64(as, RCX, BOOL_VAL(false));
+  x64_op_reg(as, 0x09, RCX, RAX);  // or rax, rcx
+  x64_store(as, base, disp, RAX);
+#else
+  x64_store_value(as, base, disp, BOOL_VAL(false));
+  x64_op_mem(as, 0, false, 0x88, RAX, base,  // mov byte [..], al
+             disp + (int32_t)offsetof(Value, as.boolean));
+#endif
+}
+
+void x64_store_number(Assembler* as, int base, int32_t disp, int xmm) {
+#ifndef NAN_BOXING
+  // mov dword [base + disp], VAL_NUMBER
+  x64_op_mem(as, 0, false, 0xc7, 0, base, disp + TYPE_OFFSET);
+  x64_u32(as, VAL_NUMBER);
+#endif
+  x64_movsd_store(as, base, disp, xmm);
+}
+
+void x64_movsd_load(Assembler* as, int xmm, int base, int32_t disp) {
+  x64_op_mem(as, 0xf2, false, 0x0f10, xmm, base, disp + NUMBER_OFFSET);
+}
+
+void x64_movsd_store(Assembler* as, int base, int32_t disp, int xmm) {
+  x64_op_mem(as, 0xf2, false, 0x0f11, xmm, base, disp + NUMBER_OFFSET);
+}
+
+void x64_ucomisd(Assembler* as, int xmm, int base, int32_t disp) {
+  x64_op_mem(as, 0x66, false, 0x0f2e, xmm, base, disp + NUMBER_OFFSET);
+}
+
+#endif
@@ -0,0 +1,36 @@
+#!/bin/bash
+
+# Build an optimized interpreter and time every program in test/bench/prog.
+#
+# Extra compiler flags are forwarded through EXT_FLAGS, e.g. to compare
+# against the portable switch dispatch:
+#   EXT_FLAGS="-DFORCE_SWITCH_DISPATCH" ./test/bench/bench.sh
+#
+# Each program runs REPEAT times (default 3) and the best wall time is
+# reported. Arguments given to this script are passed to the interpreter
+# before the program path.
+
+COMPILER="./bin/clox"
+REPEAT=${REPEAT:-3}
+
+BOLD='\033[1m'
+CYAN='\033[0;36m'
+NC='\033[0m' # No Color (Reset)
+
+make clean > /dev/null
+make clox EXT_FLAGS="-O2 -DNAN_BOXING $EXT_FLAGS" > /dev/null || exit 1
+
+echo -e "${BOLD}${CYAN}clox benchmarks${NC} (EXT_FLAGS=\"$EXT_FLAGS\")"
+
+TIMEFORMAT="%R"
+for source_file in test/bench/prog/*.clox; do
+    name=$(basename "$source_file" .clox)
+    best=""
+    for ((i = 0; i < REPEAT; i++)); do
+        elapsed=$( { time $COMPILER "$@" "$source_file" > /dev/null; } 2>&1 )
+        if [ -z "$best" ] || awk -v a="$elapsed" -v b="$best" 'BEGIN { exit !(a < b) }'; then
+            best=$elapsed
+        fi
+    done
+    printf "%-24s %8ss\n" "$name" "$best"
+done
@@ -0,0 +1,31 @@
+#!/bin/bash
+
+# Count the instructions dispatched by every program in test/bench/prog,
+# without and with the superinstructions of the peephole pass.
+
+COMPILER="./bin/clox"
+
+BOLD='\033[1m'
+CYAN='\033[0;36m'
+NC='\033[0m' # No Color (Reset)
+
+count_dispatches() {
+    make clean > /dev/null
+    make clox EXT_FLAGS="-O2 -DNAN_BOXING -DDBG_COUNT_DISPATCH $1" > /dev/null || exit 1
+    for source_file in test/bench/prog/*.clox; do
+        $COMPILER "$source_file" 2>&1 > /dev/null | awk '/^\[dispatch\]/ { print $2 }'
+    done
+}
+
+baseline=($(count_dispatches "-DDISABLE_PEEPHOLE"))
+fused=($(count_dispatches ""))
+
+echo -e "${BOLD}${CYAN}clox dispatch counts${NC}"
+printf "%-24s %16s %16s %8s\n" "program" "baseline" "peephole" "ratio"
+i=0
+for source_file in test/bench/prog/*.clox; do
+    name=$(basename "$source_file" .clox)
+    ratio=$(awk -v a="${fused[$i]}" -v b="${baseline[$i]}" 'BEGIN { printf "%.3f", a / b }')
+    printf "%-24s %16s %16s %8s\n" "$name" "${baseline[$i]}" "${fused[$i]}" "$ratio"
+    ((i++))
+done
@@ -0,0 +1,33 @@
+#!/bin/bash
+
+# Run test/bench/prog/latency.clox with the tables and the string set
+# rehashed all at once when they grow, and rehashed a few slots per write
+# (INCREMENTAL_REHASH). The program reports how many of its 1M interned
+# strings took under 10us, 100us, 1ms and over, then the worst one.
+#
+# Collections would show in the tail as well, so they are kept out of the
+# run: the nursery is built at 1G (GC_NURSERY_SIZE) and the first full
+# collection waits for 8G (CLOX_GC_INITIAL).
+
+COMPILER="./bin/clox"
+PROGRAM="test/bench/prog/latency.clox"
+
+BOLD='\033[1m'
+CYAN='\033[0;36m'
+NC='\033[0m' # No Color (Reset)
+
+run_program() {
+    make clean > /dev/null
+    make clox EXT_FLAGS="-O2 -DNAN_BOXING -DGC_NURSERY_SIZE='(1024*1024*1024)' $1" > /dev/null || exit 1
+    CLOX_GC_INITIAL=8G $COMPILER "$PROGRAM" | head -n 5
+}
+
+at_once=($(run_program ""))
+incremental=($(run_program "-DINCREMENTAL_REHASH"))
+
+echo -e "${BOLD}${CYAN}clox rehash latency${NC}"
+printf "%-12s %12s %12s\n" "interning" "at once" "incremental"
+labels=("< 10us" "< 100us" "< 1ms" ">= 1ms" "worst (s)")
+for i in "${!labels[@]}"; do
+    printf "%-12s %12s %12s\n" "${labels[$i]}" "${at_once[$i]}" "${incremental[$i]}"
+done
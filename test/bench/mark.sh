@@ -0,0 +1,34 @@
+#!/bin/bash
+
+# Time the marking of the full collections of test/bench/prog/heap.clox with
+# 1, 2, 4 and 8 marking threads (see GC_MARK_THREADS in memory.h).
+#
+# Each build runs the program REPEAT times (default 3) and the best marking
+# time is reported. The speedup is relative to a single thread, and is bounded
+# by the cores of the machine.
+
+COMPILER="./bin/clox"
+REPEAT=${REPEAT:-3}
+PROGRAM=${PROGRAM:-test/bench/prog/heap.clox}
+
+BOLD='\033[1m'
+CYAN='\033[0;36m'
+NC='\033[0m' # No Color (Reset)
+
+echo -e "${BOLD}${CYAN}clox parallel marking${NC} ($PROGRAM, $(nproc) cores)"
+printf "%-8s %12s %8s\n" "threads" "marking" "speedup"
+for threads in 1 2 4 8; do
+    make clean > /dev/null
+    make clox EXT_FLAGS="-O2 -DNAN_BOXING -DDBG_GC_STATS -DGC_MARK_THREADS=$threads" > /dev/null || exit 1
+    best=""
+    for ((i = 0; i < REPEAT; i++)); do
+        marking=$($COMPILER "$PROGRAM" 2>&1 > /dev/null |
+            awk '/^\[gc\]/ { for (i = 1; i < NF; i++) if ($(i + 1) == "ms" && $(i + 2) == "marking") print $i }')
+        if [ -z "$best" ] || awk -v a="$marking" -v b="$best" 'BEGIN { exit !(a < b) }'; then
+            best=$marking
+        fi
+    done
+    [ -z "$single" ] && single=$best
+    speedup=$(awk -v a="$single" -v b="$best" 'BEGIN { printf "%.2f", a / b }')
+    printf "%-8s %9s ms %8s\n" "$threads" "$best" "$speedup"
+done
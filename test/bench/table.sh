@@ -0,0 +1,45 @@
+#!/bin/bash
+
+# Time every program in test/bench/prog with the former Table, probed one
+# entry after the other (LINEAR_PROBE_TABLE), and with the current one,
+# probed a group of control bytes at a time (see Table in table.h).
+# methods.clox and classes.clox spend most of their time in the tables.
+#
+# Each program runs REPEAT times (default 3) and the best wall time is
+# reported.
+
+COMPILER="./bin/clox"
+REPEAT=${REPEAT:-3}
+
+BOLD='\033[1m'
+CYAN='\033[0;36m'
+NC='\033[0m' # No Color (Reset)
+
+time_programs() {
+    make clean > /dev/null
+    make clox EXT_FLAGS="-O2 -DNAN_BOXING $1" > /dev/null || exit 1
+    TIMEFORMAT="%R"
+    for source_file in test/bench/prog/*.clox; do
+        best=""
+        for ((i = 0; i < REPEAT; i++)); do
+            elapsed=$( { time $COMPILER "$source_file" > /dev/null; } 2>&1 )
+            if [ -z "$best" ] || awk -v a="$elapsed" -v b="$best" 'BEGIN { exit !(a < b) }'; then
+                best=$elapsed
+            fi
+        done
+        echo "$best"
+    done
+}
+
+linear=($(time_programs "-DLINEAR_PROBE_TABLE"))
+grouped=($(time_programs ""))
+
+echo -e "${BOLD}${CYAN}clox tables${NC}"
+printf "%-24s %10s %10s %8s\n" "program" "linear" "grouped" "ratio"
+i=0
+for source_file in test/bench/prog/*.clox; do
+    name=$(basename "$source_file" .clox)
+    ratio=$(awk -v a="${grouped[$i]}" -v b="${linear[$i]}" 'BEGIN { printf "%.3f", a / b }')
+    printf "%-24s %9ss %9ss %8s\n" "$name" "${linear[$i]}" "${grouped[$i]}" "$ratio"
+    ((i++))
+done
@@ -0,0 +1,12 @@
+print("// generated by 'test/scripts/globals_gen.py'")
+for i in range(0, 300):
+  print(f"var g{i} = {i};")
+print("fun bump() {")
+print("  g299 = g299 + g0 + 1;")
+print("  return g299;")
+print("}")
+print("print bump();")
+print("print bump();")
+print("var g299 = \"redefined\";")
+print("print g299;")
+print("print g256 + g255;")
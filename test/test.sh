@@ -1,5 +1,13 @@
 #!/bin/bash
 
+# Arguments given to this script are passed to the interpreter before the
+# program path, e.g. ./test/test.sh --register
+#
+# A test program may start with the lines
+#   // args: <options>    interpreter options for this test only
+#   // env: <VAR=value>... environment variables for this test only
+# and is expected to exit with 65 if named *.err_comp.clox, 70 if named
+# *.err_run.clox, 64 if named *.err_usage.clox, and 0 otherwise.
 COMPILER="./bin/clox"
 
 GREEN='\033[0;32m'
@@ -12,6 +20,7 @@ NC='\033[0m' # No Color (Reset)
 PASS_COUNT=0
 FAIL_COUNT=0
 
+EX_USAGE=64
 EX_DATAERR=65
 EX_SOFTWARE=70
 
@@ -29,14 +38,19 @@ for source_file in test/prog/*.clox; do
         expected_exit=$EX_DATAERR
     elif [[ "$name" == *"err_run"* ]]; then
         expected_exit=$EX_SOFTWARE
+    elif [[ "$name" == *"err_usage"* ]]; then
+        expected_exit=$EX_USAGE
     else
         expected_exit=0
     fi
 
     echo -n -e "Testing ${BOLD}$name${NC}... "
 
+    test_args=$(sed -n '1,2s|^// args: ||p' "$source_file")
+    test_env=$(sed -n '1,2s|^// env: ||p' "$source_file")
+
     # Force line-buffering for both stdout and stderr
-    actual_output=$(stdbuf -oL -eL $COMPILER "$source_file" 2>&1)
+    actual_output=$(env $test_env stdbuf -oL -eL $COMPILER "$@" $test_args "$source_file" 2>&1)
     actual_exit=$?
 
     output_diff=$(diff -u "$expected_file" <(echo "$actual_output"))